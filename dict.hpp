@@ -5,8 +5,10 @@
 #include <vector>
 #include <unordered_map>
 
-#ifndef _INC_WINDOWS
-    #include <windows.h>
+#ifdef _WIN32
+    #ifndef _INC_WINDOWS
+        #include <windows.h>
+    #endif
 #endif
 
 // The separators.
@@ -98,7 +100,8 @@ enum KatsuyouKei {
     SHUUSHI_KEI,    // 終止形
     RENTAI_KEI,     // 連体形
     KATEI_KEI,      // 仮定形
-    MEIREI_KEI      // 命令形
+    MEIREI_KEI,     // 命令形
+    NONE_KEI        // 活用形なし（接続を制限しない）
 };
 
 // 辞書の項目。
@@ -114,3 +117,276 @@ struct DictEntry {
         gyou = GYOU_NN;
     }
 };
+
+//////////////////////////////////////////////////////////////////////////////
+// 予測変換の索引。
+//
+// dict_compileは、レコード群を終えるNULの後に読みのトライ木を置く。
+// 各ノードには、その下にある単語のうち静的な単語コストが小さいものを
+// 最大DICT_PREDICT_TOPK個、あらかじめ並べておく。下にある単語がすべて
+// 並べられるノードより先は作らない（子のないノードの並びは完全）。
+// 数値はUTF-16の単位で、32ビットの値は下位、上位の順に二つの単位に分ける。
+// 索引はそれぞれ末尾を持ち、ファイルの最後の末尾から前の索引へたどれる
+// （DictFindIndexを参照）。
+//
+//   索引:    DICT_PREDICT_SIG0, DICT_PREDICT_SIG1, バージョン, TOPK,
+//            ノード数(32), ノード群, 番兵ノード, 上位候補群
+//   ノード:  文字, 最初の子の番号(32), 上位候補(32)
+//   上位候補: レコードの位置(32), 単語コスト
+//   末尾:    索引の位置(32), DICT_PREDICT_SIG0, DICT_PREDICT_SIG1
+//
+// ノードは幅優先の順に並び、兄弟は文字の順。根は0番で、文字は0。
+// 子の数は次のノードの「最初の子の番号」との差。ノードの上位候補は、
+// 並びの位置（下位28ビット）と数（上位4ビット）。位置はファイルの先頭（BOM）
+// からの単位数。
+
+#define DICT_PREDICT_SIG0       0x5A4D  // "MZ"
+#define DICT_PREDICT_SIG1       0x5250  // "PR"
+#define DICT_PREDICT_VERSION    1
+#define DICT_PREDICT_TOPK       8       // ノードごとの上位候補の最大数。
+#define DICT_PREDICT_HEADER     6       // 索引のヘッダーの単位数。
+#define DICT_PREDICT_NODE       5       // ノードの単位数。
+#define DICT_PREDICT_ENTRY      3       // 上位候補の単位数。
+#define DICT_PREDICT_TRAILER    4       // 末尾の単位数。
+#define DICT_PREDICT_POS_MASK   0x0FFFFFFF
+#define DICT_PREDICT_COUNT_SHIFT 28
+
+// 辞書の項目（語幹）から見出し語（終止形）を作る。
+// サ変動詞は「する」「ずる」の形だけを見出し語とし、それ以外はfalseを返す。
+inline bool DictEntryToWord(HinshiBunrui bunrui, Gyou gyou, std::wstring& pre, std::wstring& post)
+{
+    // 五段動詞の終止形の語尾。
+    static const wchar_t s_godan_endings[] = L"うくぐすずつづぬふぶぷむゆるうん";
+
+    switch (bunrui) {
+    case HB_IKEIYOUSHI:
+        pre += L'い';
+        post += L'い';
+        break;
+    case HB_ICHIDAN_DOUSHI:
+        pre += L'る';
+        post += L'る';
+        break;
+    case HB_GODAN_DOUSHI:
+        if (gyou >= GYOU_NN)
+            return false;
+        pre += s_godan_endings[gyou];
+        post += s_godan_endings[gyou];
+        break;
+    case HB_KAHEN_DOUSHI:
+        if (pre.size() < 2 || pre.compare(pre.size() - 2, 2, L"くる") != 0) {
+            pre += L"くる";
+            post += L"来る";
+        }
+        break;
+    case HB_SAHEN_DOUSHI:
+        if (pre.size() < 2)
+            return false;
+        if (pre.compare(pre.size() - 2, 2, L"する") != 0 &&
+            pre.compare(pre.size() - 2, 2, L"ずる") != 0)
+        {
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+    return !pre.empty();
+}
+
+// 見出し語の静的な単語コスト。LatticeNode::WordCostのうち、
+// 活用形とユーザーによる調整に関わらない部分と同じ。
+inline int DictEntryStaticCost(HinshiBunrui bunrui, const std::wstring& tags, size_t pre_len)
+{
+    int cost = 1000;
+    switch (bunrui) {
+    case HB_MEISHI:             cost += 100; break;
+    case HB_GODAN_DOUSHI: case HB_ICHIDAN_DOUSHI:
+    case HB_KAHEN_DOUSHI: case HB_SAHEN_DOUSHI:
+                                cost += 150; break;
+    case HB_IKEIYOUSHI: case HB_NAKEIYOUSHI:
+                                cost += 200; break;
+    case HB_JODOUSHI: case HB_MIZEN_JODOUSHI: case HB_RENYOU_JODOUSHI:
+    case HB_SHUUSHI_JODOUSHI: case HB_RENTAI_JODOUSHI: case HB_KATEI_JODOUSHI:
+    case HB_MEIREI_JODOUSHI:
+                                cost += 50; break;
+    case HB_KAKU_JOSHI: case HB_SETSUZOKU_JOSHI: case HB_FUKU_JOSHI:
+    case HB_SHUU_JOSHI:
+                                cost += 30; break;
+    case HB_FUKUSHI:            cost += 120; break;
+    case HB_RENTAISHI:          cost += 150; break;
+    case HB_SETSUZOKUSHI:       cost += 100; break;
+    case HB_KANDOUSHI:          cost += 180; break;
+    case HB_SETTOUJI:           cost += 200; break;
+    case HB_SETSUBIJI:          cost += 150; break;
+    case HB_KANGO:              cost += 400; break;
+    case HB_SYMBOL:             cost += 300; break;
+    case HB_PERIOD: case HB_COMMA:
+                                cost += 50; break;
+    case HB_UNKNOWN:            cost += 500; break;
+    default:                    cost += 150; break;
+    }
+
+    if (tags.find(L"[優先++]") != tags.npos) cost -= 300;
+    if (tags.find(L"[優先+]") != tags.npos) cost -= 150;
+    if (tags.find(L"[優先-]") != tags.npos) cost += 150;
+    if (tags.find(L"[優先--]") != tags.npos) cost += 300;
+    if (tags.find(L"[ユーザ辞書]") != tags.npos) cost -= 200;
+    if (tags.find(L"[人名]") != tags.npos) cost += 100;
+    if (tags.find(L"[地名]") != tags.npos) cost += 100;
+    if (tags.find(L"[駅名]") != tags.npos) cost += 100;
+    if (tags.find(L"[非標準]") != tags.npos) cost += 500;
+    if (tags.find(L"[不謹慎]") != tags.npos) cost += 400;
+    if (tags.find(L"[数単位]") != tags.npos) cost -= 20;
+    if (tags.find(L"[動植物]") != tags.npos) cost += 80;
+
+    if (pre_len >= 4) cost -= 50;
+    if (pre_len >= 6) cost -= 100;
+    if (pre_len >= 8) cost -= 150;
+
+    if (cost < 0)
+        cost = 0;
+    return cost;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 逆引きの索引。
+//
+// 変換後の文字列（表記）から読みを引くため、予測変換の索引の後に、
+// レコードの位置を表記の順（UTF-16の単位の順。同じ表記なら読みの順）に並べる。
+// 表記で二分探索できる。
+//
+//   索引:    DICT_PREDICT_SIG0, DICT_REVERSE_SIG1, バージョン, 0,
+//            レコード数(32), レコードの位置(32)の並び
+//   末尾:    索引の位置(32), DICT_PREDICT_SIG0, DICT_REVERSE_SIG1
+
+#define DICT_REVERSE_SIG1       0x5652  // "RV"
+#define DICT_REVERSE_VERSION    1
+#define DICT_REVERSE_HEADER     6       // 索引のヘッダーの単位数。
+#define DICT_REVERSE_ENTRY      2       // レコードの位置の単位数。
+
+//////////////////////////////////////////////////////////////////////////////
+// 読みの索引。
+//
+// 読み（pre）を1バイトのかなの符号にした鍵を、UTF-16の読みの代わりにレコードに置く。
+// U+3041～U+30FF（ひらがなとカタカナ）は1バイト、それ以外はエスケープに続けて
+// UTF-16の単位を6ビットずつ三つの桁（上位から。それぞれ1を足す）にして置く。
+// 符号のバイト列の順は単位の順と同じなので、レコードは鍵の順に並んでいる。
+// バイト列は二つずつ一つの単位に入れ（下位が先）、奇数なら最後の単位の上位を0にする。
+// 符号のバイトは0、0xFC、0xFDにならないので、単位はNULや区切りにならない。
+// 変換では入力を一度だけ同じ符号にして、入力の先頭の部分と一致する鍵を
+// バイトの比較で二分探索する。読みは必要なときにだけ文字列に戻す。
+//
+//   レコード: 符号にした読み, FIELD_SEP, post, FIELD_SEP, 品詞, FIELD_SEP, tags, RECORD_SEP
+//   索引:    DICT_PREDICT_SIG0, DICT_KEY_SIG1, バージョン, 0,
+//            レコードの数(32), バケット(32)×257
+//   末尾:    索引の位置(32), DICT_PREDICT_SIG0, DICT_KEY_SIG1
+//
+// バケットは最初のバイトごとの最初のレコードの位置で、最後はレコード群の終わり。
+// 索引がない辞書（版1以前）のレコードは、読みがUTF-16のまま。
+
+#define DICT_KEY_SIG1           0x594B  // "KY"
+#define DICT_KEY_VERSION        2       // 版2からレコードの読みが符号。
+#define DICT_KEY_HEADER         6       // 索引のヘッダーの単位数。
+#define DICT_KEY_BUCKETS        257     // バケットの数（番兵を含む）。
+#define DICT_KEY_KANA_FIRST     0x3041  // 1バイトになる最初の文字。
+#define DICT_KEY_KANA_LAST      0x30FF  // 1バイトになる最後の文字。
+#define DICT_KEY_KANA_BASE      0x02    // DICT_KEY_KANA_FIRSTの符号。
+#define DICT_KEY_ESCAPE_LOW     0x01    // DICT_KEY_KANA_FIRSTより前の文字。
+#define DICT_KEY_ESCAPE_HIGH    0xFF    // DICT_KEY_KANA_LASTより後の文字。
+#define DICT_KEY_DIGIT_BASE     0x01    // エスケープの後の桁の0の符号。
+
+// 文字chを読みの鍵の符号にしてkeyに加える。UTF-16の単位でなければfalse。
+inline bool DictKeyEncodeChar(std::string& key, wchar_t ch)
+{
+    if ((unsigned long)ch > 0xFFFF)
+        return false;
+    if (DICT_KEY_KANA_FIRST <= ch && ch <= DICT_KEY_KANA_LAST) {
+        key += (char)(DICT_KEY_KANA_BASE + (ch - DICT_KEY_KANA_FIRST));
+    } else {
+        key += (char)(ch < DICT_KEY_KANA_FIRST ? DICT_KEY_ESCAPE_LOW : DICT_KEY_ESCAPE_HIGH);
+        key += (char)(DICT_KEY_DIGIT_BASE + (ch >> 12));
+        key += (char)(DICT_KEY_DIGIT_BASE + ((ch >> 6) & 0x3F));
+        key += (char)(DICT_KEY_DIGIT_BASE + (ch & 0x3F));
+    }
+    return true;
+}
+
+// 単位に二つずつ入れた符号のib番目のバイト。
+inline unsigned char DictKeyByte(const wchar_t *pch, size_t ib)
+{
+    unsigned short w = (unsigned short)pch[ib >> 1];
+    return (unsigned char)((ib & 1) ? (w >> 8) : (w & 0xFF));
+}
+
+// 単位に入れた符号cch単位のバイト数。
+inline size_t DictKeyLength(const wchar_t *pch, size_t cch)
+{
+    if (cch == 0)
+        return 0;
+    return cch * 2 - ((((unsigned short)pch[cch - 1] >> 8) == 0) ? 1 : 0);
+}
+
+// 単位に入れた符号cch単位を、UTF-16の単位の並びに戻してpreに加える。
+// 不正な符号ならfalse。
+inline bool DictKeyDecode(std::wstring& pre, const wchar_t *pch, size_t cch)
+{
+    const size_t cb = DictKeyLength(pch, cch);
+    for (size_t ib = 0; ib < cb; ) {
+        unsigned char b = DictKeyByte(pch, ib++);
+        if (DICT_KEY_KANA_BASE <= b &&
+            b <= DICT_KEY_KANA_BASE + (DICT_KEY_KANA_LAST - DICT_KEY_KANA_FIRST))
+        {
+            pre += (wchar_t)(DICT_KEY_KANA_FIRST + (b - DICT_KEY_KANA_BASE));
+            continue;
+        }
+        if ((b != DICT_KEY_ESCAPE_LOW && b != DICT_KEY_ESCAPE_HIGH) || ib + 3 > cb)
+            return false;
+        unsigned int ch = 0;
+        for (int k = 0; k < 3; ++k) {
+            unsigned char digit = DictKeyByte(pch, ib++);
+            if (digit < DICT_KEY_DIGIT_BASE || digit > DICT_KEY_DIGIT_BASE + 0x3F)
+                return false;
+            ch = (ch << 6) | (digit - DICT_KEY_DIGIT_BASE);
+        }
+        pre += (wchar_t)ch;
+    }
+    return true;
+}
+
+// 辞書データの末尾から、二つ目の署名がsig1の索引を探し、その位置を返す。
+// 索引の末尾の直前には前の索引の末尾がある。見つからなければ0を返す。
+// dataはUTF-16の単位の並びで、cchはその数。
+inline size_t DictFindIndex(const wchar_t *data, size_t cch, unsigned short sig1)
+{
+    const size_t cTrailer = 4;  // DICT_PREDICT_TRAILER
+    size_t end = cch;
+    while (end > cTrailer) {
+        const wchar_t *trailer = data + end - cTrailer;
+        if ((unsigned short)trailer[2] != DICT_PREDICT_SIG0)
+            break;
+        size_t ibIndex = (unsigned short)trailer[0] | ((size_t)(unsigned short)trailer[1] << 16);
+        if (ibIndex >= end - cTrailer)
+            break;
+        if ((unsigned short)trailer[3] == sig1)
+            return ibIndex;
+        end = ibIndex;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 分割辞書。
+//
+// 分野別の辞書などは、dict_compile -sで読みの先頭の文字ごとに分けて、
+// いくつかの辞書ファイル（分割）とその目録にできる。分割はそれぞれ普通の
+// 辞書ファイルで、同じ先頭の文字の単語は一つの分割にまとめる。変換では、
+// ラティスの位置の文字を含む分割だけを読み込めばよい。
+// 目録はUTF-16LEのテキストで、ファイル名は目録のフォルダからの相対。
+//
+//   DICT_SHARD_SIGNATURE \t バージョン \n
+//   分割のファイル名 \t 先頭の文字の並び \n   （分割の数だけ）
+
+#define DICT_SHARD_SIGNATURE    L"MZSHARDS"
+#define DICT_SHARD_VERSION      1
+#define DICT_SHARD_TARGET_SIZE  (256 * 1024)    // 分割の大きさの目安（バイト）。
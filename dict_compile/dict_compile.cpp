@@ -3,12 +3,18 @@
 // (Japanese, UTF-8)
 
 #define _CRT_SECURE_NO_WARNINGS
+#include "../ime/platform.h"
 #include "../dict.hpp"
 #include "../str.hpp"
+#include "../kanji.hpp"
 #include <algorithm>
 #include <map>
 #include <cassert>
 
+#ifndef _countof
+    #define _countof(array)   (sizeof(array) / sizeof(array[0]))
+#endif
+
 static const wchar_t s_hiragana_table[][5] = {
     // DAN_A, DAN_I, DAN_U, DAN_E, DAN_O
     {L'あ', L'い', L'う', L'え', L'お'},   // GYOU_A
@@ -29,27 +35,40 @@ static const wchar_t s_hiragana_table[][5] = {
     {L'ん', 0, 0, 0, 0},                   // GYOU_NN
 };
 
-std::map<WCHAR,Dan>   g_hiragana_to_dan;   // 母音写像。
-std::map<WCHAR,Gyou>  g_hiragana_to_gyou;  // 子音写像。
+// 写像はひらがなの範囲の表にする。作った後は読むだけなので、スレッドから引ける。
+#define HIRAGANA_FIRST  0x3040
+#define HIRAGANA_COUNT  0x60
+static BYTE s_hiragana_to_dan[HIRAGANA_COUNT];  // 母音写像。
+static BYTE s_hiragana_to_gyou[HIRAGANA_COUNT]; // 子音写像。
 
 // 写像を準備する。
 void MakeLiteralMaps() {
-    if (g_hiragana_to_gyou.size()) {
-        return;
-    }
-    g_hiragana_to_gyou.clear();
-    g_hiragana_to_dan.clear();
     const size_t count = _countof(s_hiragana_table);
     for (size_t i = 0; i < count; ++i) {
         for (size_t k = 0; k < 5; ++k) {
-            g_hiragana_to_gyou[s_hiragana_table[i][k]] = (Gyou)i;
-        }
-        for (size_t k = 0; k < 5; ++k) {
-            g_hiragana_to_dan[s_hiragana_table[i][k]] = (Dan)k;
+            WCHAR ch = s_hiragana_table[i][k];
+            if (ch == 0)
+                continue;
+            s_hiragana_to_gyou[ch - HIRAGANA_FIRST] = (BYTE)i;
+            s_hiragana_to_dan[ch - HIRAGANA_FIRST] = (BYTE)k;
         }
     }
 } // MzIme::MakeLiteralMaps
 
+// ひらがなの母音。表にない文字はあ段。
+inline Dan HiraganaToDan(WCHAR ch) {
+    if (ch < HIRAGANA_FIRST || ch >= HIRAGANA_FIRST + HIRAGANA_COUNT)
+        return DAN_A;
+    return (Dan)s_hiragana_to_dan[ch - HIRAGANA_FIRST];
+}
+
+// ひらがなの子音。表にない文字はあ行。
+inline Gyou HiraganaToGyou(WCHAR ch) {
+    if (ch < HIRAGANA_FIRST || ch >= HIRAGANA_FIRST + HIRAGANA_COUNT)
+        return GYOU_A;
+    return (Gyou)s_hiragana_to_gyou[ch - HIRAGANA_FIRST];
+}
+
 // 全角カタカナか？
 inline BOOL is_fullwidth_katakana(WCHAR ch) {
     if (0x30A0 <= ch && ch <= 0x30FF) return TRUE;
@@ -62,15 +81,6 @@ inline BOOL is_fullwidth_katakana(WCHAR ch) {
     }
 }
 
-// 文字列の文字種を変換する。
-std::wstring lcmap(const std::wstring& str, DWORD dwFlags) {
-    WCHAR szBuf[1024];
-    const LCID langid = MAKELANGID(LANG_JAPANESE, SUBLANG_DEFAULT);
-    ::LCMapStringW(MAKELCID(langid, SORT_DEFAULT), dwFlags,
-                   str.c_str(), -1, szBuf, 1024);
-    return szBuf;
-}
-
 // タグをチェックする
 BOOL CheckTags(const std::wstring& tags) {
     if (tags.empty())
@@ -215,13 +225,13 @@ bool MakeDictFormat(DictEntry& entry, const std::wstring& strBunrui)
             // 終端の文字を取得する。
             WCHAR ch = entry.pre[entry.pre.size() - 1];
             // 終端の文字がウ段でなければ失敗。
-            if (g_hiragana_to_dan[ch] != DAN_U)
+            if (HiraganaToDan(ch) != DAN_U)
                 return false;
             // 終端の文字を削る。
             entry.pre.resize(entry.pre.size() - 1);
             entry.post.resize(entry.post.size() - 1);
             // 終端文字だったものの行を取得し、セットする。
-            entry.gyou = g_hiragana_to_gyou[ch];
+            entry.gyou = HiraganaToGyou(ch);
         }
         break;
     default:
@@ -237,140 +247,590 @@ dict_entry_compare_by_pre(const DictEntry& e1, const DictEntry& e2)
     return (e1.pre < e2.pre);
 }
 
+// サ変動詞の語尾。
+static const wchar_t *s_sa_endings[] = {
+    L"さ", L"し", L"せ", L"する", L"すれ", L"しろ", L"せよ", L"しよう"
+};
+static const wchar_t *s_za_endings[] = {
+    L"ざ", L"じ", L"ぜ", L"ずる", L"ずれ", L"じろ", L"ぜよ", L"じよう"
+};
+
+// UTF-8をUTF-16の単位に変換してstrの後ろに足す。WCHARが32ビットでも
+// サロゲートペアに分けるので、辞書の位置はOSによらず同じになる。
+// 不正なバイト列はU+FFFDにする。ASCIIの並びは8バイトずつ調べて写す。
+static void DecodeUtf8(std::wstring& str, const char *pch, size_t cb)
+{
+    const BYTE *pb = (const BYTE *)pch, *pbEnd = pb + cb;
+    while (pb < pbEnd) {
+        ULONGLONG qw;
+        if (pbEnd - pb >= 8 && (memcpy(&qw, pb, 8), (qw & 0x8080808080808080ULL) == 0)) {
+            for (INT i = 0; i < 8; ++i)
+                str += WCHAR(pb[i]);
+            pb += 8;
+            continue;
+        }
+
+        DWORD ch = *pb++;
+        if (ch < 0x80) {
+            str += WCHAR(ch);
+            continue;
+        }
+
+        INT cbTrail;
+        DWORD chMin;
+        if (0xC2 <= ch && ch <= 0xDF) {
+            ch &= 0x1F; cbTrail = 1; chMin = 0x80;
+        } else if (0xE0 <= ch && ch <= 0xEF) {
+            ch &= 0x0F; cbTrail = 2; chMin = 0x800;
+        } else if (0xF0 <= ch && ch <= 0xF4) {
+            ch &= 0x07; cbTrail = 3; chMin = 0x10000;
+        } else {
+            str += WCHAR(0xFFFD);
+            continue;
+        }
+        INT i;
+        for (i = 0; i < cbTrail && pb < pbEnd && (*pb & 0xC0) == 0x80; ++i)
+            ch = (ch << 6) | (*pb++ & 0x3F);
+        if (i < cbTrail || ch < chMin || ch > 0x10FFFF || (0xD800 <= ch && ch <= 0xDFFF)) {
+            str += WCHAR(0xFFFD);
+        } else if (ch >= 0x10000) {
+            ch -= 0x10000;
+            str += WCHAR(0xD800 + (ch >> 10));
+            str += WCHAR(0xDC00 + (ch & 0x3FF));
+        } else {
+            str += WCHAR(ch);
+        }
+    }
+}
+
+// 辞書データの一行を辞書形式にしてエントリ群に追加する。不正な行ならFALSEを返す。
+// 行の長さに制限はない。
+static BOOL AddDictDataLine(std::vector<DictEntry>& entries, const char *pch, size_t cb)
+{
+    if (cb == 0 || pch[0] == ';') return TRUE;  // comment
+
+    // convert to UTF-16
+    std::wstring str;
+    str.reserve(cb);
+    DecodeUtf8(str, pch, cb);
+
+    // split to fields
+    str_trim_right(str, L"\r\n");
+    WStrings fields;
+    str_split(fields, str, L"\t");
+
+    // is it an invalid line?
+    if (fields.empty() || fields[I_FIELD_PRE].empty())
+        return TRUE;
+
+    fields.resize(NUM_FIELDS);
+
+    // fields[I_FIELD_HINSHI]が空だったら「名詞」にする。
+    if (fields[I_FIELD_HINSHI].empty())
+        fields[I_FIELD_HINSHI] = L"名詞";
+
+    // fields[I_FIELD_POST]が空だったらfields[I_FIELD_PRE]をコピーする。
+    if (fields[I_FIELD_POST].empty())
+        fields[I_FIELD_POST] = fields[I_FIELD_PRE];
+
+    // fields[I_FIELD_PRE]を全角ひらがなにする。
+    fields[I_FIELD_PRE] = mz_lcmap(fields[I_FIELD_PRE], LCMAP_FULLWIDTH | LCMAP_HIRAGANA);
+
+    // 辞書にエントリーを追加する準備をする。
+    DictEntry entry;
+    entry.pre = fields[I_FIELD_PRE];
+    entry.gyou = GYOU_A;
+    entry.post = fields[I_FIELD_POST];
+    entry.tags = fields[I_FIELD_TAGS];
+
+    // 辞書形式にする。
+    if (!MakeDictFormat(entry, fields[I_FIELD_HINSHI]))
+        return FALSE;
+
+    if (fields[I_FIELD_HINSHI] != L"サ変動詞") {
+        // エントリーを追加する。
+        entries.push_back(entry);
+        return TRUE;
+    }
+
+    // サ変動詞は活用形ごとに追加する。
+    const wchar_t **endings = (entry.gyou == GYOU_ZA) ? s_za_endings : s_sa_endings;
+    std::wstring pre = entry.pre, post = entry.post;
+    for (size_t i = 0; i < _countof(s_sa_endings); ++i) {
+        entry.pre = pre + endings[i];
+        entry.post = post + endings[i];
+        entries.push_back(entry);
+    }
+    return TRUE;
+} // AddDictDataLine
+
+#define LOAD_MIN_CHUNK  (256 * 1024)    // スレッド一つに割り当てる最小のバイト数。
+#define LOAD_MAX_CHUNKS 64              // 塊の最大数。
+
+// 辞書データの塊。行の途中では切らない。
+struct LOAD_CHUNK {
+    const char *begin;              // 塊の先頭。
+    const char *end;                // 塊の終わり。
+    std::vector<DictEntry> entries; // 読みの順に並べたエントリ群。
+    std::vector<INT> bad_lines;     // 不正な行の、塊の中での行番号。
+    INT lines;                      // 塊の行数。
+    HANDLE hDone;                   // 読み終えたら合図するイベント。NULLならここで読む。
+};
+
+// 塊を読み込んで並べ替える。スレッドで動く。
+static DWORD WINAPI LoadChunkProc(LPVOID lpParam)
+{
+    LOAD_CHUNK *chunk = (LOAD_CHUNK *)lpParam;
+    const char *pch = chunk->begin;
+    chunk->lines = 0;
+    while (pch < chunk->end) {
+        const char *pchEnd = (const char *)memchr(pch, '\n', chunk->end - pch);
+        if (pchEnd == NULL)
+            pchEnd = chunk->end;
+        ++chunk->lines;
+        if (!AddDictDataLine(chunk->entries, pch, pchEnd - pch))
+            chunk->bad_lines.push_back(chunk->lines);
+        pch = pchEnd + 1;
+    }
+
+    // 同じ読みは元の順を保つ。
+    std::stable_sort(chunk->entries.begin(), chunk->entries.end(), dict_entry_compare_by_pre);
+    if (chunk->hDone)
+        mz_event_set(chunk->hDone);
+    return 0;
+}
+
 // 辞書データファイルを読み込む。
+// ファイルをメモリーに写して行の境目で塊に分け、塊ごとにスレッドで読み込んで並べ替え、
+// 最後に併合する。結果は塊の数によらない。
 BOOL LoadDictDataFile(const wchar_t *fname, std::vector<DictEntry>& entries)
 {
-    // ファイルを開く。
-    FILE *fp = _wfopen(fname, L"rb");
-    if (fp == NULL) {
-        return FALSE;
+    // ファイルをメモリーに写す。
+    DWORD cbFile;
+    const char *pbFile = (const char *)mz_map_file(fname, &cbFile);
+    if (pbFile == NULL) {
+        // 空のファイルは写せないが、エントリがないだけ。
+        FILE *fp = _wfopen(fname, L"rb");
+        if (!fp)
+            return FALSE;
+        fclose(fp);
+        return TRUE;
     }
 
-    // 一行ずつ処理する。
-    int lineno = 0;
-    char buf[256];
-    wchar_t wbuf[256];
-    while (fgets(buf, 256, fp) != NULL) {
-        ++lineno;
-        if (buf[0] == ';') continue;  // comment
+    const char *pch = pbFile, *pchEnd = pbFile + cbFile;
+    if (cbFile >= 3 && memcmp(pch, "\xEF\xBB\xBF", 3) == 0)
+        pch += 3;   // UTF-8 BOM
 
-        // convert to UTF-16
-        ::MultiByteToWideChar(CP_UTF8, 0, buf, -1, wbuf, 256);
-        std::wstring str = wbuf;
+    // 塊の数を決める。
+    size_t nChunks = (pchEnd - pch) / LOAD_MIN_CHUNK + 1;
+    if (nChunks > mz_get_processor_count())
+        nChunks = mz_get_processor_count();
+    if (nChunks > LOAD_MAX_CHUNKS)
+        nChunks = LOAD_MAX_CHUNKS;
+    if (nChunks < 1)
+        nChunks = 1;
 
-        // split to fields
-        str_trim_right(str, L"\r\n");
-        WStrings fields;
-        str_split(fields, str, L"\t");
+    // 行の境目で塊に分ける。
+    std::vector<LOAD_CHUNK> chunks(nChunks);
+    size_t cbChunk = (pchEnd - pch) / nChunks;
+    for (size_t i = 0; i < nChunks; ++i) {
+        chunks[i].begin = pch;
+        if (i + 1 == nChunks) {
+            pch = pchEnd;
+        } else {
+            pch += std::min(cbChunk, size_t(pchEnd - pch));
+            while (pch < pchEnd && pch[-1] != '\n')
+                ++pch;
+        }
+        chunks[i].end = pch;
+    }
 
-        // is it an invalid line?
-        if (fields.empty() || fields[I_FIELD_PRE].empty())
-            continue;
+    // 塊ごとにスレッドで読み込む。スレッドを作れなければここで読み込む。
+    for (size_t i = 0; i < nChunks; ++i) {
+        chunks[i].hDone = (i + 1 < nChunks) ? mz_event_create(TRUE) : NULL;
+        if (chunks[i].hDone && !mz_queue_work_item(LoadChunkProc, &chunks[i])) {
+            mz_event_close(chunks[i].hDone);
+            chunks[i].hDone = NULL;
+        }
+        if (!chunks[i].hDone)
+            LoadChunkProc(&chunks[i]);
+    }
+    for (size_t i = 0; i < nChunks; ++i) {
+        if (chunks[i].hDone) {
+            mz_event_wait(chunks[i].hDone, INFINITE);
+            mz_event_close(chunks[i].hDone);
+        }
+    }
 
-        fields.resize(NUM_FIELDS);
+    mz_unmap_file(pbFile, cbFile);
 
-        // fields[I_FIELD_HINSHI]が空だったら「名詞」にする。
-        if (fields[I_FIELD_HINSHI].empty())
-            fields[I_FIELD_HINSHI] = L"名詞";
+    // 不正な行を報告し、塊を順につなぐ。
+    size_t count = 0;
+    for (size_t i = 0; i < nChunks; ++i)
+        count += chunks[i].entries.size();
+    entries.reserve(entries.size() + count);
+    std::vector<size_t> runs;
+    INT lineno = 0;
+    for (size_t i = 0; i < nChunks; ++i) {
+        LOAD_CHUNK& chunk = chunks[i];
+        for (size_t k = 0; k < chunk.bad_lines.size(); ++k)
+            fprintf(stderr, "Line %d: Invalid format\n", lineno + chunk.bad_lines[k]);
+        lineno += chunk.lines;
+        runs.push_back(entries.size());
+        entries.insert(entries.end(), chunk.entries.begin(), chunk.entries.end());
+        std::vector<DictEntry>().swap(chunk.entries);
+    }
+    runs.push_back(entries.size());
 
-        // fields[I_FIELD_POST]が空だったらfields[I_FIELD_PRE]をコピーする。
-        if (fields[I_FIELD_POST].empty())
-            fields[I_FIELD_POST] = fields[I_FIELD_PRE];
+    // 並べ替えた塊を隣どうし併合する。安定なので、全体を安定に並べ替えたのと同じになる。
+    while (runs.size() > 2) {
+        std::vector<size_t> merged;
+        size_t k;
+        for (k = 0; k + 2 < runs.size(); k += 2) {
+            std::inplace_merge(entries.begin() + runs[k], entries.begin() + runs[k + 1],
+                               entries.begin() + runs[k + 2], dict_entry_compare_by_pre);
+            merged.push_back(runs[k]);
+        }
+        if (k + 1 < runs.size())
+            merged.push_back(runs[k]);
+        merged.push_back(runs.back());
+        runs.swap(merged);
+    }
+    return TRUE;  // success
+} // LoadDictDataFile
 
-        // fields[I_FIELD_PRE]を全角ひらがなにする。
-        fields[I_FIELD_PRE] = lcmap(fields[I_FIELD_PRE], LCMAP_FULLWIDTH | LCMAP_HIRAGANA);
+// 予測変換の索引の上位候補（作成用）。
+struct PREDICT_ITEM {
+    DWORD offset;   // レコードの位置。
+    WORD cost;      // 静的な単語コスト。
+    WORD len;       // 読みの長さ。
+};
 
-        // 辞書にエントリーを追加する準備をする。
-        DictEntry entry;
-        std::wstring pre = entry.pre = fields[I_FIELD_PRE];
-        entry.gyou = GYOU_A;
-        std::wstring post = entry.post = fields[I_FIELD_POST];
-        entry.tags = fields[I_FIELD_TAGS];
+static inline bool
+predict_item_equal(const PREDICT_ITEM& i1, const PREDICT_ITEM& i2)
+{
+    return i1.offset == i2.offset;
+}
+
+static inline bool
+predict_item_compare(const PREDICT_ITEM& i1, const PREDICT_ITEM& i2)
+{
+    if (i1.cost != i2.cost)
+        return i1.cost < i2.cost;
+    if (i1.len != i2.len)
+        return i1.len < i2.len;
+    return i1.offset < i2.offset;
+}
+
+// 予測変換の索引のノード（作成用）。
+struct PREDICT_NODE {
+    WCHAR ch;
+    std::map<WCHAR, size_t> children;   // 子ノード。
+    std::vector<PREDICT_ITEM> top;      // この読みの単語と上位候補。
+    size_t count;                       // この下にある単語の数。
+    DWORD top_pos;                      // 上位候補の位置。
+};
+
+// 32ビットの値を二つの単位で書く。
+static inline void PutDWord(std::vector<WORD>& units, DWORD value)
+{
+    units.push_back(LOWORD(value));
+    units.push_back(HIWORD(value));
+}
 
-        // 辞書形式にする。
-        if (!MakeDictFormat(entry, fields[I_FIELD_HINSHI])) {
-            fprintf(stderr, "Line %d: Invalid format\n", lineno);
+// 予測変換の索引を作る。offsetsは各レコードの位置、ibIndexは索引を置く位置。
+void CreatePredictIndex(std::vector<WORD>& index, const std::vector<DictEntry>& entries,
+                        const std::vector<DWORD>& offsets, DWORD ibIndex)
+{
+    // 見出し語の読みでトライ木を作る。同じ読みと変換後の単語は一つにまとめる。
+    std::vector<PREDICT_NODE> nodes(1);
+    nodes[0].ch = 0;
+    std::map<std::wstring, size_t> words;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const DictEntry& entry = entries[i];
+        std::wstring pre = entry.pre, post = entry.post;
+        if (!DictEntryToWord(entry.bunrui, entry.gyou, pre, post))
             continue;
-        }
 
-        if (fields[I_FIELD_HINSHI] == L"サ変動詞") {
-            pre = entry.pre;
-            post = entry.post;
-            if (entry.gyou == GYOU_ZA) {
-                entry.pre = pre + L"ざ";
-                entry.post = post + L"ざ";
-                entries.push_back(entry);
-                entry.pre = pre + L"じ";
-                entry.post = post + L"じ";
-                entries.push_back(entry);
-                entry.pre = pre + L"ぜ";
-                entry.post = post + L"ぜ";
-                entries.push_back(entry);
-                entry.pre = pre + L"ずる";
-                entry.post = post + L"ずる";
-                entries.push_back(entry);
-                entry.pre = pre + L"ずれ";
-                entry.post = post + L"ずれ";
-                entries.push_back(entry);
-                entry.pre = pre + L"じろ";
-                entry.post = post + L"じろ";
-                entries.push_back(entry);
-                entry.pre = pre + L"ぜよ";
-                entry.post = post + L"ぜよ";
-                entries.push_back(entry);
-                entry.pre = pre + L"じよう";
-                entry.post = post + L"じよう";
-                entries.push_back(entry);
+        size_t iNode = 0;
+        for (size_t k = 0; k < pre.size(); ++k) {
+            std::map<WCHAR, size_t>::iterator it = nodes[iNode].children.find(pre[k]);
+            if (it == nodes[iNode].children.end()) {
+                nodes[iNode].children[pre[k]] = nodes.size();
+                iNode = nodes.size();
+                nodes.resize(nodes.size() + 1);
+                nodes[iNode].ch = pre[k];
             } else {
-                entry.pre = pre + L"さ";
-                entry.post = post + L"さ";
-                entries.push_back(entry);
-                entry.pre = pre + L"し";
-                entry.post = post + L"し";
-                entries.push_back(entry);
-                entry.pre = pre + L"せ";
-                entry.post = post + L"せ";
-                entries.push_back(entry);
-                entry.pre = pre + L"する";
-                entry.post = post + L"する";
-                entries.push_back(entry);
-                entry.pre = pre + L"すれ";
-                entry.post = post + L"すれ";
-                entries.push_back(entry);
-                entry.pre = pre + L"しろ";
-                entry.post = post + L"しろ";
-                entries.push_back(entry);
-                entry.pre = pre + L"せよ";
-                entry.post = post + L"せよ";
-                entries.push_back(entry);
-                entry.pre = pre + L"しよう";
-                entry.post = post + L"しよう";
-                entries.push_back(entry);
+                iNode = it->second;
             }
-        } else {
-            // エントリーを追加する。
-            entries.push_back(entry);
+        }
+
+        PREDICT_ITEM item;
+        item.offset = offsets[i];
+        int cost = DictEntryStaticCost(entry.bunrui, entry.tags, pre.size());
+        item.cost = WORD(cost > 0xFFFF ? 0xFFFF : cost);
+        item.len = WORD(pre.size());
+
+        std::wstring key = pre + FIELD_SEP + post;
+        std::map<std::wstring, size_t>::iterator it = words.find(key);
+        if (it == words.end()) {
+            words[key] = nodes[iNode].top.size();
+            nodes[iNode].top.push_back(item);
+        } else if (item.cost < nodes[iNode].top[it->second].cost) {
+            nodes[iNode].top[it->second] = item;
         }
     }
 
-    // close the file
-    fclose(fp);
+    // 子は親より後に作られるので、後ろから上位候補を集める。
+    for (size_t i = nodes.size(); i-- > 0; ) {
+        PREDICT_NODE& node = nodes[i];
+        node.count = node.top.size();
+        std::map<WCHAR, size_t>::iterator it, end = node.children.end();
+        for (it = node.children.begin(); it != end; ++it) {
+            const PREDICT_NODE& child = nodes[it->second];
+            node.top.insert(node.top.end(), child.top.begin(), child.top.end());
+            node.count += child.count;
+        }
+        std::sort(node.top.begin(), node.top.end(), predict_item_compare);
+        if (node.top.size() > DICT_PREDICT_TOPK)
+            node.top.resize(DICT_PREDICT_TOPK);
+    }
 
-    // sort by preconversion string
-    std::sort(entries.begin(), entries.end(), dict_entry_compare_by_pre);
-    return TRUE;  // success
-} // LoadDictDataFile
+    // 幅優先の順に並べる。std::mapなので兄弟は文字の順になる。
+    // 下の単語がすべて上位候補に入るノードの子は並べない。
+    std::vector<size_t> order;
+    std::vector<DWORD> first_child(nodes.size());
+    order.reserve(nodes.size());
+    order.push_back(0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        PREDICT_NODE& node = nodes[order[i]];
+        first_child[order[i]] = DWORD(order.size());
+        if (node.count <= DICT_PREDICT_TOPK)
+            continue;
+        std::map<WCHAR, size_t>::iterator it, end = node.children.end();
+        for (it = node.children.begin(); it != end; ++it)
+            order.push_back(it->second);
+    }
+
+    // 上位候補を並べる。子が一つだけで上位候補も子と同じなら、子の並びを共有する。
+    DWORD ibTop = ibIndex + DICT_PREDICT_HEADER + DWORD(order.size() + 1) * DICT_PREDICT_NODE;
+    std::vector<WORD> tops;
+    for (size_t i = order.size(); i-- > 0; ) {
+        PREDICT_NODE& node = nodes[order[i]];
+        if (node.count > DICT_PREDICT_TOPK && node.children.size() == 1) {
+            const PREDICT_NODE& child = nodes[node.children.begin()->second];
+            if (child.top.size() == node.top.size() &&
+                std::equal(child.top.begin(), child.top.end(), node.top.begin(),
+                           predict_item_equal))
+            {
+                node.top_pos = child.top_pos;
+                continue;
+            }
+        }
+        node.top_pos = ibTop + DWORD(tops.size());
+        for (size_t k = 0; k < node.top.size(); ++k) {
+            PutDWord(tops, node.top[k].offset);
+            tops.push_back(node.top[k].cost);
+        }
+    }
+    assert(ibTop + tops.size() <= DICT_PREDICT_POS_MASK);
+
+    index.clear();
+    index.push_back(DICT_PREDICT_SIG0);
+    index.push_back(DICT_PREDICT_SIG1);
+    index.push_back(DICT_PREDICT_VERSION);
+    index.push_back(DICT_PREDICT_TOPK);
+    PutDWord(index, DWORD(order.size()));
+    for (size_t i = 0; i < order.size(); ++i) {
+        const PREDICT_NODE& node = nodes[order[i]];
+        index.push_back(WORD(node.ch));
+        PutDWord(index, first_child[order[i]]);
+        PutDWord(index, node.top_pos | (DWORD(node.top.size()) << DICT_PREDICT_COUNT_SHIFT));
+    }
+    // 番兵。最後のノードの子の数を求めるため。
+    index.push_back(0);
+    PutDWord(index, DWORD(order.size()));
+    PutDWord(index, 0);
+
+    index.insert(index.end(), tops.begin(), tops.end());
+    PutDWord(index, ibIndex);
+    index.push_back(DICT_PREDICT_SIG0);
+    index.push_back(DICT_PREDICT_SIG1);
+} // CreatePredictIndex
+
+// 逆引きの索引（作成用）。表記、読みの順に並べる。
+struct REVERSE_ITEM {
+    const DictEntry *entry;
+    DWORD offset;   // レコードの位置。
+};
+
+static inline bool
+reverse_item_compare(const REVERSE_ITEM& i1, const REVERSE_ITEM& i2)
+{
+    if (i1.entry->post != i2.entry->post)
+        return i1.entry->post < i2.entry->post;
+    if (i1.entry->pre != i2.entry->pre)
+        return i1.entry->pre < i2.entry->pre;
+    return i1.offset < i2.offset;
+}
+
+// 逆引きの索引を作る。offsetsは各レコードの位置、ibIndexは索引を置く位置。
+void CreateReverseIndex(std::vector<WORD>& index, const std::vector<DictEntry>& entries,
+                        const std::vector<DWORD>& offsets, DWORD ibIndex)
+{
+    std::vector<REVERSE_ITEM> items(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        items[i].entry = &entries[i];
+        items[i].offset = offsets[i];
+    }
+    std::sort(items.begin(), items.end(), reverse_item_compare);
+
+    index.clear();
+    index.push_back(DICT_PREDICT_SIG0);
+    index.push_back(DICT_REVERSE_SIG1);
+    index.push_back(DICT_REVERSE_VERSION);
+    index.push_back(0);
+    PutDWord(index, DWORD(items.size()));
+    for (size_t i = 0; i < items.size(); ++i)
+        PutDWord(index, items[i].offset);
+
+    PutDWord(index, ibIndex);
+    index.push_back(DICT_PREDICT_SIG0);
+    index.push_back(DICT_REVERSE_SIG1);
+} // CreateReverseIndex
+
+// 各エントリの読みを鍵の符号にする。読みは鍵と同じ順でなければならない。
+BOOL CreateKeys(std::vector<std::string>& keys, const std::vector<DictEntry>& entries)
+{
+    keys.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const std::wstring& pre = entries[i].pre;
+        bool ok = !pre.empty();
+        for (size_t ich = 0; ok && ich < pre.size(); ++ich)
+            ok = DictKeyEncodeChar(keys[i], pre[ich]);
+        if (!ok || (i > 0 && keys[i] < keys[i - 1])) {
+            printf("ERROR: bad reading at %d\n", (INT)i);
+            return FALSE;
+        }
+    }
+    return TRUE;
+} // CreateKeys
+
+// 読みの索引を作る。offsetsは各レコードの位置、ibEndはレコード群の終わり、
+// ibIndexは索引を置く位置。
+void CreateKeyIndex(std::vector<WORD>& index, const std::vector<std::string>& keys,
+                    const std::vector<DWORD>& offsets, DWORD ibEnd, DWORD ibIndex)
+{
+    // 最初のバイトごとのバケットを作る。std::stringの比較は符号なしのバイトの順。
+    std::vector<DWORD> buckets(DICT_KEY_BUCKETS, ibEnd);
+    for (size_t i = keys.size(); i-- > 0; )
+        buckets[(BYTE)keys[i][0]] = offsets[i];
+    for (size_t b = DICT_KEY_BUCKETS - 1; b-- > 0; ) {
+        if (buckets[b] > buckets[b + 1])
+            buckets[b] = buckets[b + 1];
+    }
+
+    index.clear();
+    index.push_back(DICT_PREDICT_SIG0);
+    index.push_back(DICT_KEY_SIG1);
+    index.push_back(DICT_KEY_VERSION);
+    index.push_back(0);
+    PutDWord(index, DWORD(keys.size()));
+    for (size_t b = 0; b < DICT_KEY_BUCKETS; ++b)
+        PutDWord(index, buckets[b]);
+
+    PutDWord(index, ibIndex);
+    index.push_back(DICT_PREDICT_SIG0);
+    index.push_back(DICT_KEY_SIG1);
+} // CreateKeyIndex
+
+#define DICT_WRITER_UNITS   (64 * 1024)     // 書き込みバッファの単位の数。
+
+// 辞書ファイルをUTF-16の単位でバッファに溜めて書く。
+class DictFileWriter {
+public:
+    DictFileWriter() : m_fp(NULL), m_count(0), m_bOK(TRUE) {
+        m_buf.reserve(DICT_WRITER_UNITS * 2);
+    }
+    ~DictFileWriter() {
+        Close();
+    }
+
+    BOOL Open(const wchar_t *fname) {
+        m_fp = _wfopen(fname, L"wb");
+        return m_fp != NULL;
+    }
+    // UTF-16LEの単位を書く。
+    void Put(WORD w) {
+        m_buf.push_back(LOBYTE(w));
+        m_buf.push_back(HIBYTE(w));
+        ++m_count;
+        if (m_buf.size() >= DICT_WRITER_UNITS * 2)
+            Flush();
+    }
+    void Put(const std::wstring& str) {
+        for (size_t i = 0; i < str.size(); ++i)
+            Put(WORD(str[i]));
+    }
+    void Put(const std::vector<WORD>& units) {
+        for (size_t i = 0; i < units.size(); ++i)
+            Put(units[i]);
+    }
+    // 鍵の符号を二つずつ一つの単位にして書く（下位が先）。
+    void PutKey(const std::string& key) {
+        for (size_t ib = 0; ib < key.size(); ib += 2) {
+            BYTE lo = (BYTE)key[ib];
+            BYTE hi = (ib + 1 < key.size()) ? (BYTE)key[ib + 1] : 0;
+            Put(MAKEWORD(lo, hi));
+        }
+    }
+    // 書いた単位の数。
+    size_t GetCount() const {
+        return m_count;
+    }
+    // 残りを書いてファイルを閉じる。すべて書けたらTRUEを返す。
+    BOOL Close() {
+        if (m_fp == NULL)
+            return FALSE;
+        Flush();
+        if (fclose(m_fp) != 0) // ファイルを閉じる。
+            m_bOK = FALSE;
+        m_fp = NULL;
+        return m_bOK;
+    }
+
+protected:
+    FILE *m_fp;
+    std::vector<BYTE> m_buf;
+    size_t m_count;
+    BOOL m_bOK;
+
+    void Flush() {
+        if (m_buf.empty())
+            return;
+        if (fwrite(&m_buf[0], 1, m_buf.size(), m_fp) != m_buf.size()) // 書き込む。
+            m_bOK = FALSE;
+        m_buf.clear();
+    }
+};
 
 // コンパイル済みの辞書ファイルを作成する。
 BOOL CreateDictFile(const wchar_t *fname, const std::vector<DictEntry>& entries)
 {
+    // レコードの読みは鍵の符号にする。
+    std::vector<std::string> keys;
+    if (!CreateKeys(keys, entries))
+        return FALSE;
+
     // calculate the total size
+    std::vector<DWORD> offsets(entries.size());
     size_t size = 0;
     size += 1;  // UTF-16 BOM
     size += 1;  // \n
     for (size_t i = 0; i < entries.size(); ++i) {
         const DictEntry& entry = entries[i];
-        size += entry.pre.size();
+        offsets[i] = DWORD(size);
+        size += (keys[i].size() + 1) / 2;
         //size += 3;  // \t hb \t
         size += entry.post.size();
         //size += 1;  // \t
@@ -378,64 +838,188 @@ BOOL CreateDictFile(const wchar_t *fname, const std::vector<DictEntry>& entries)
         //size += 1;  // \n
         size += 3 + 1 + 1;
     }
+    DWORD ibEnd = DWORD(size);
     size += 1;  // \0
-    size *= sizeof(WCHAR);
+
+    // 予測変換の索引をレコード群の後に置く。
+    std::vector<WORD> index;
+    CreatePredictIndex(index, entries, offsets, DWORD(size));
+    printf("index: %d\n", (INT)(index.size() * sizeof(WORD)));
+    size += index.size();
+
+    // 逆引きの索引をその後に置く。
+    std::vector<WORD> reverse;
+    CreateReverseIndex(reverse, entries, offsets, DWORD(size));
+    printf("reverse: %d\n", (INT)(reverse.size() * sizeof(WORD)));
+    size += reverse.size();
+    index.insert(index.end(), reverse.begin(), reverse.end());
+
+    // 読みの索引をその後に置く。
+    std::vector<WORD> key_index;
+    CreateKeyIndex(key_index, keys, offsets, ibEnd, DWORD(size));
+    printf("keys: %d\n", (INT)(key_index.size() * sizeof(WORD)));
+    size += key_index.size();
+    index.insert(index.end(), key_index.begin(), key_index.end());
+
+    size *= sizeof(WORD);
     printf("size: %d\n", (INT)size);
 
-    // メモリーブロックを確保する。
-    void *pv = calloc(1, size);
-    if (pv == NULL) {
+    // コンパイル済みの辞書ファイルを作成する。
+    DictFileWriter writer;
+    if (!writer.Open(fname))
         return FALSE;
-    }
 
-    WCHAR *pch = (WCHAR *)pv;
-    *pch++ = 0xFEFF; // UTF-16 BOM
-    *pch++ = RECORD_SEP;
+    writer.Put(0xFEFF); // UTF-16 BOM
+    writer.Put(RECORD_SEP);
     for (size_t i = 0; i < entries.size(); ++i) {
         // line format:
-        // pre FIELD_SEP MAKEWORD(bunrui, gyou) FIELD_SEP post FIELD_SEP tags RECORD_SEP
+        // key FIELD_SEP post FIELD_SEP MAKEWORD(bunrui, gyou) FIELD_SEP tags RECORD_SEP
         const DictEntry& entry = entries[i];
-        // pre \t
-        size_t cch = entry.pre.size();
-        memcpy(pch, entry.pre.c_str(), cch * sizeof(WCHAR));
-        pch += cch;
-        *pch++ = FIELD_SEP;
+        assert(writer.GetCount() == offsets[i]);
+        // key \t
+        writer.PutKey(keys[i]);
+        writer.Put(FIELD_SEP);
         // post \t
-        cch = entry.post.size();
-        memcpy(pch, entry.post.c_str(), cch * sizeof(WCHAR));
-        pch += cch;
-        *pch++ = FIELD_SEP;
+        writer.Put(entry.post);
+        writer.Put(FIELD_SEP);
         // MAKEWORD(bunrui, gyou) \t
-        *pch++ = MAKEWORD(entry.bunrui, entry.gyou);
-        *pch++ = FIELD_SEP;
+        writer.Put(MAKEWORD(entry.bunrui, entry.gyou));
+        writer.Put(FIELD_SEP);
         // tags
-        cch = entry.tags.size();
-        memcpy(pch, entry.tags.c_str(), cch * sizeof(WCHAR));
-        pch += cch;
+        writer.Put(entry.tags);
         // new line
-        *pch++ = RECORD_SEP;
+        writer.Put(RECORD_SEP);
     }
-    *pch++ = L'\0'; // NUL
-    assert(size / 2 == size_t(pch - reinterpret_cast<WCHAR *>(pv)));
+    writer.Put(L'\0'); // NUL
+    writer.Put(index);
+    assert(size / sizeof(WORD) == writer.GetCount());
 
-    BOOL ret = FALSE;
+    return writer.Close();
+} // CreateDictFile
 
-    // コンパイル済みの辞書ファイルを作成する。
-    HANDLE hFile = ::CreateFileW(fname, GENERIC_WRITE, FILE_SHARE_READ,
-        NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH,
-        NULL);
-    if (hFile != INVALID_HANDLE_VALUE) {
-        DWORD dwWritten;
-        ret = WriteFile(hFile, pv, DWORD(size), &dwWritten, NULL); // 書き込む。
-        CloseHandle(hFile); // ファイルを閉じる。
+// 読みの先頭の文字で分けた辞書ファイル（分割）群と、その目録を作成する。
+// 分割のファイル名は、目録のファイル名の拡張子を「.番号.dic」に替えたもの。
+BOOL CreateShardFiles(const wchar_t *fname, const std::vector<DictEntry>& entries)
+{
+    std::wstring base = fname, dir;
+    size_t ich = base.find_last_of(L"\\/");
+    if (ich != base.npos) {
+        dir = base.substr(0, ich + 1);
+        base = base.substr(ich + 1);
     }
+    ich = base.rfind(L'.');
+    if (ich != base.npos)
+        base.resize(ich);
 
-    free(pv);
-    return ret;
-} // CreateDictFile
+    WCHAR sz[64];
+    StringCchPrintfW(sz, _countof(sz), L"%c%s\t%d\n",
+                     0xFEFF, DICT_SHARD_SIGNATURE, DICT_SHARD_VERSION);
+    std::wstring manifest = sz;
+
+    // エントリ群は読みの順。同じ先頭の文字の単語は同じ分割に入れる。
+    size_t i = 0;
+    for (INT iShard = 0; i < entries.size(); ++iShard) {
+        std::vector<DictEntry> shard;
+        std::wstring chars;
+        size_t cb = 0;
+        while (i < entries.size() && cb < DICT_SHARD_TARGET_SIZE) {
+            WCHAR ch = entries[i].pre[0];
+            chars += ch;
+            for (; i < entries.size() && entries[i].pre[0] == ch; ++i) {
+                const DictEntry& entry = entries[i];
+                shard.push_back(entry);
+                cb += (entry.pre.size() + entry.post.size() + entry.tags.size() + 5) * sizeof(WORD);
+            }
+        }
+
+        StringCchPrintfW(sz, _countof(sz), L".%03d.dic", iShard);
+        std::wstring name = base + sz;
+        printf("shard %d: %d entries\n", iShard, (INT)shard.size());
+        if (!CreateDictFile((dir + name).c_str(), shard))
+            return FALSE;
+
+        manifest += name;
+        manifest += L'\t';
+        manifest += chars;
+        manifest += L'\n';
+    }
+
+    // 目録を作成する。
+    DictFileWriter writer;
+    if (!writer.Open(fname))
+        return FALSE;
+    writer.Put(manifest);
+    return writer.Close();
+} // CreateShardFiles
+
+// ImePadの漢字の索引を作成する。
+BOOL CreateKanjiIndexFile(const wchar_t *kanji_file, const wchar_t *radical_file,
+                          const wchar_t *fname)
+{
+    std::vector<std::wstring> lines;
+    std::vector<KANJI_ENTRY> kanji;
+    std::vector<RADICAL_ENTRY> radicals;
+
+    FILE *fp = _wfopen(kanji_file, L"rb");
+    if (!fp)
+        return FALSE;
+    KanjiIndexReadLines(fp, lines);
+    fclose(fp);
+    for (size_t i = 0; i < lines.size(); ++i) {
+        KANJI_ENTRY entry;
+        if (!KanjiIndexParseKanji(entry, lines[i])) {
+            fprintf(stderr, "%ls: Invalid format\n", kanji_file);
+            return FALSE;
+        }
+        kanji.push_back(entry);
+    }
+
+    lines.clear();
+    fp = _wfopen(radical_file, L"rb");
+    if (!fp)
+        return FALSE;
+    KanjiIndexReadLines(fp, lines);
+    fclose(fp);
+    for (size_t i = 0; i < lines.size(); ++i) {
+        RADICAL_ENTRY entry;
+        if (!KanjiIndexParseRadical(entry, lines[i])) {
+            fprintf(stderr, "%ls: Invalid format\n", radical_file);
+            return FALSE;
+        }
+        radicals.push_back(entry);
+    }
+
+    std::vector<WORD> units;
+    if (!KanjiIndexBuild(units, kanji, radicals))
+        return FALSE;
+    printf("kanji: %d, radicals: %d\n", (INT)kanji.size(), (INT)radicals.size());
+
+    DictFileWriter writer;
+    if (!writer.Open(fname))
+        return FALSE;
+    writer.Put(units);
+    return writer.Close();
+} // CreateKanjiIndexFile
 
 extern "C"
 int wmain(int argc, wchar_t **wargv) {
+    // -kなら、ImePadの漢字の索引を作る。
+    if (argc == 5 && lstrcmpW(wargv[1], L"-k") == 0) {
+        if (!CreateKanjiIndexFile(wargv[2], wargv[3], wargv[4])) {
+            printf("ERROR: cannot create\n");
+            return 3;
+        }
+        printf("success.\n");
+        return 0;
+    }
+
+    // -sなら、分割辞書とその目録を作る。
+    BOOL bShard = (argc == 4 && lstrcmpW(wargv[1], L"-s") == 0);
+    if (bShard) {
+        ++wargv;
+        --argc;
+    }
+
     // 引数の数を確認する。
     if (argc != 3) {
         printf("ERROR: missing parameters\n");
@@ -453,7 +1037,7 @@ int wmain(int argc, wchar_t **wargv) {
     }
 
     // バイナリ辞書を書き込む。
-    if (!CreateDictFile(wargv[2], entries)) {
+    if (bShard ? !CreateShardFiles(wargv[2], entries) : !CreateDictFile(wargv[2], entries)) {
         printf("ERROR: cannot create\n");
         return 3;
     }
@@ -462,3 +1046,18 @@ int wmain(int argc, wchar_t **wargv) {
 
     return 0;
 } // wmain
+
+#ifndef _WIN32
+int main(int argc, char **argv)
+{
+    std::vector<std::wstring> args(argc);
+    std::vector<wchar_t *> wargv(argc + 1);
+    for (int i = 0; i < argc; ++i) {
+        std::vector<WCHAR> buf(strlen(argv[i]) + 1);
+        int cch = MultiByteToWideChar(CP_UTF8, 0, argv[i], -1, &buf[0], (int)buf.size());
+        args[i].assign(&buf[0], (cch > 0) ? cch - 1 : 0);
+        wargv[i] = &args[i][0];
+    }
+    return wmain(argc, &wargv[0]);
+}
+#endif
@@ -2,11 +2,89 @@
 // 候補情報。
 //////////////////////////////////////////////////////////////////////////////
 
-#include "mzimeja.h"
+#ifdef _WIN32
+    #include "mzimeja.h"
+#else
+    #include "mzconv.h"
+    #include "input.h"
+#endif
+#include <algorithm>        // for std::find
 
-#define MAX_CANDLISTS   32 // 候補リストの最大数。
 #define CANDPAGE_SIZE   9  // 候補ページの最大数。
 
+//////////////////////////////////////////////////////////////////////////////
+// CandTable - 候補表。
+
+// 候補の文字列群を番号で引く表。入力コンテキストの候補情報には番号と、
+// 見えているページの周りの文字列だけを書くので、候補が多くても
+// キーを押すたびのコピーは増えない。番号は候補情報が参照している間は消さない。
+// CandInfo::Storeで参照を増やし、CandInfo::ReCreateで前の候補情報の参照を減らす。
+class CandTable {
+public:
+    CandTable() : m_dwNext(1) {
+        m_hLock = mz_mutex_open(NULL);
+    }
+    ~CandTable() {
+        mz_mutex_close(m_hLock);
+    }
+
+    DWORD Add(DWORD dwHandle, const CandStrsPtr& strs);
+    void Release(DWORD dwHandle);
+    CandStrsPtr Find(DWORD dwHandle);
+
+protected:
+    struct Entry {
+        CandStrsPtr strs;
+        LONG nRefs;         // 参照している候補情報の数。
+    };
+    HANDLE m_hLock;
+    DWORD m_dwNext;
+    std::map<DWORD, Entry> m_entries;
+};
+
+static CandTable s_cand_table;
+
+// 候補の文字列群を登録して参照を増やし、番号を返す。
+// dwHandleで同じ文字列群を登録済みなら使い回す。
+DWORD CandTable::Add(DWORD dwHandle, const CandStrsPtr& strs)
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<DWORD, Entry>::iterator it = m_entries.find(dwHandle);
+    if (it == m_entries.end() || it->second.strs != strs) {
+        do {
+            dwHandle = m_dwNext++;
+        } while (dwHandle == 0 || m_entries.count(dwHandle));
+        it = m_entries.insert(std::make_pair(dwHandle, Entry())).first;
+        it->second.strs = strs;
+        it->second.nRefs = 0;
+    }
+    ++it->second.nRefs;
+    mz_mutex_unlock(m_hLock);
+    return dwHandle;
+}
+
+// 参照を減らす。参照がなくなったら消す。
+void CandTable::Release(DWORD dwHandle)
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<DWORD, Entry>::iterator it = m_entries.find(dwHandle);
+    if (it != m_entries.end() && --it->second.nRefs <= 0)
+        m_entries.erase(it);
+    mz_mutex_unlock(m_hLock);
+}
+
+// 番号から候補の文字列群を探す。なければ空を返す。
+CandStrsPtr CandTable::Find(DWORD dwHandle)
+{
+    CandStrsPtr strs;
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<DWORD, Entry>::iterator it = m_entries.find(dwHandle);
+    if (it != m_entries.end())
+        strs = it->second.strs;
+    mz_mutex_unlock(m_hLock);
+    return strs;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // LogCandList - 候補リストの論理データ。
 
@@ -17,16 +95,47 @@ void LogCandList::clear()
     dwSelection = 0;
     dwPageStart = 0;
     dwPageSize = CANDPAGE_SIZE;
-    cand_strs.clear();
+    dwHandle = 0;
+    cand_strs.reset();
+    bLost = FALSE;
+}
+
+// 候補を追加する。
+void LogCandList::AddString(const std::wstring& str)
+{
+    if (!cand_strs) {
+        cand_strs = CandStrsPtr(new std::vector<std::wstring>());
+    }
+    cand_strs->push_back(str);
+}
+
+// 文節の候補群を追加する。
+void LogCandList::AddClause(const MzConvClause& clause)
+{
+    candidates_t::const_iterator it, end = clause.candidates.end();
+    for (it = clause.candidates.begin(); it != end; ++it) {
+        AddString(it->post);
+    }
+}
+
+// 物理データに文字列を書く候補の範囲。前後のページまで。
+void LogCandList::GetWindow(DWORD& iFirst, DWORD& iLast) const
+{
+    iFirst = (dwPageStart > dwPageSize) ? (dwPageStart - dwPageSize) : 0;
+    iLast = dwPageStart + 2 * dwPageSize;
+    if (iLast > GetCandCount()) iLast = GetCandCount();
+    if (iFirst > iLast) iFirst = iLast;
 }
 
 // 候補リストの物理データの合計サイズを計算。
 DWORD LogCandList::GetTotalSize() const
 {
+    DWORD iFirst, iLast;
+    GetWindow(iFirst, iLast);
     DWORD total = sizeof(CANDIDATELIST);
-    total += DWORD(cand_strs.size() * sizeof(DWORD));
-    for (size_t iCand = 0; iCand < cand_strs.size(); ++iCand) {
-        total += DWORD((cand_strs[iCand].size() + 1) * sizeof(WCHAR));
+    total += DWORD((iLast - iFirst) * sizeof(DWORD));
+    for (DWORD iCand = iFirst; iCand < iLast; ++iCand) {
+        total += DWORD(((*cand_strs)[iCand].size() + 1) * sizeof(WCHAR));
     }
     return total;
 }
@@ -34,7 +143,7 @@ DWORD LogCandList::GetTotalSize() const
 // 候補の個数。
 DWORD LogCandList::GetCandCount() const
 {
-    return (DWORD)cand_strs.size();
+    return cand_strs ? (DWORD)cand_strs->size() : 0;
 }
 
 // 次の候補リストへ。
@@ -97,7 +206,7 @@ void LogCandList::MoveEnd()
 // 候補の文字列を取得する。
 std::wstring LogCandList::GetString(DWORD iCand) const
 {
-    return cand_strs[iCand];
+    return (*cand_strs)[iCand];
 }
 
 // 候補の文字列を取得する。
@@ -139,6 +248,35 @@ BOOL LogCandInfo::SelectCand(UINT uCandIndex)
     return FALSE;
 }
 
+// 候補表から消えた候補リストを、変換し直した文節で作り直す。
+// 選んでいた候補は、見えていたページの中にあるので残っている。
+BOOL LogCandInfo::RebuildList(DWORD iList, const MzConvClause& clause)
+{
+    if (iList >= cand_lists.size())
+        return FALSE;
+
+    LogCandList& old_list = cand_lists[iList];
+    std::wstring selected;
+    if (old_list.dwSelection < old_list.GetCandCount())
+        selected = old_list.GetString();
+
+    LogCandList cand_list;
+    cand_list.AddClause(clause);
+    if (!selected.empty()) {
+        std::vector<std::wstring>::const_iterator it =
+            std::find(cand_list.cand_strs->begin(), cand_list.cand_strs->end(), selected);
+        if (it == cand_list.cand_strs->end()) {
+            cand_list.AddString(selected);
+            it = cand_list.cand_strs->end() - 1;
+        }
+        cand_list.dwSelection = DWORD(it - cand_list.cand_strs->begin());
+    }
+    cand_list.dwStyle = old_list.dwStyle;
+    cand_list.dwPageStart = cand_list.dwSelection / CANDPAGE_SIZE * CANDPAGE_SIZE;
+    old_list = cand_list;
+    return TRUE;
+}
+
 // 次の候補へ移動。
 void LogCandInfo::MoveNext()
 {
@@ -208,9 +346,10 @@ void LogCandInfo::Dump()
         DPRINTA("+ dwSelection: %08X\n", cand_lists[i].dwSelection);
         DPRINTA("+ dwPageStart: %08X\n", cand_lists[i].dwPageStart);
         DPRINTA("+ dwPageSize: %08X\n", cand_lists[i].dwPageSize);
+        DPRINTA("+ dwHandle: %u\n", cand_lists[i].dwHandle);
         DPRINTA("+ cand_strs: ");
-        for (size_t k = 0; k < cand_lists[i].cand_strs.size(); ++k) {
-            DPRINTA("%ls ", cand_lists[i].cand_strs[k].c_str());
+        for (DWORD k = 0; k < cand_lists[i].GetCandCount(); ++k) {
+            DPRINTA("%ls ", cand_lists[i].GetString(k).c_str());
         }
         DPRINTA("+ iClause: %u\n", iClause);
     }
@@ -227,27 +366,46 @@ DWORD CandList::GetPageEnd() const
     return dw;
 }
 
-// 物理データから論理データへ。
-void CandList::GetLog(LogCandList& log)
+// 物理データから論理データへ。文字列群はdwHandleで候補表から取り出す。
+// 物理データは論理データのdwFirst番目からの候補だけを持ち、論理データの候補はdwTotal個。
+void CandList::GetLog(LogCandList& log, DWORD dwHandle, DWORD dwFirst, DWORD dwTotal)
 {
     log.dwStyle = dwStyle;
+    log.dwPageSize = dwPageSize;
+    log.dwHandle = dwHandle;
+    log.bLost = FALSE;
+    log.cand_strs = s_cand_table.Find(dwHandle);
+    if (log.cand_strs && log.cand_strs->size() == dwTotal && dwFirst + dwCount <= dwTotal) {
+        log.dwSelection = dwFirst + dwSelection;
+        log.dwPageStart = dwFirst + dwPageStart;
+        return;
+    }
+
+    // 候補表になければ、書いてある範囲の候補だけを使う。範囲の外の候補が
+    // あったならbLostにする。呼び出し側で変換し直すこと。
     log.dwSelection = dwSelection;
     log.dwPageStart = dwPageStart;
-    log.dwPageSize = dwPageSize;
-    log.cand_strs.clear();
+    log.dwHandle = 0;
+    log.cand_strs.reset();
     for (DWORD iCand = 0; iCand < dwCount; ++iCand) {
-        log.cand_strs.push_back(GetCandString(iCand));
+        log.AddString(GetCandString(iCand));
     }
+    if (dwCount < dwTotal)
+        log.bLost = TRUE;
 }
 
-// 論理データから物理データへ。
+// 論理データから物理データへ。前後のページの候補だけを書き、dwCountはその数とする。
+// 選択とページの位置も、その範囲の中での値にする。
 DWORD CandList::Store(const LogCandList *log)
 {
+    DWORD iFirst, iLast;
+    log->GetWindow(iFirst, iLast);
+
     dwSize = log->GetTotalSize();
     dwStyle = log->dwStyle;
-    dwCount = DWORD(log->cand_strs.size());
-    dwSelection = log->dwSelection;
-    dwPageStart = log->dwPageStart;
+    dwCount = iLast - iFirst;
+    dwSelection = (iFirst <= log->dwSelection && log->dwSelection < iLast) ? (log->dwSelection - iFirst) : 0;
+    dwPageStart = (iFirst <= log->dwPageStart && log->dwPageStart < iLast) ? (log->dwPageStart - iFirst) : 0;
     dwPageSize = log->dwPageSize;
     if (dwCount < dwPageSize) dwPageSize = dwCount;
 
@@ -255,11 +413,11 @@ DWORD CandList::Store(const LogCandList *log)
     pb += sizeof(CANDIDATELIST);
     pb += dwCount * sizeof(DWORD);
 
-    for (DWORD iCand = 0; iCand < dwCount; ++iCand) {
-        dwOffset[iCand] = DWORD(pb - GetBytes());
-        const std::wstring& str = log->cand_strs[iCand];
+    for (DWORD iCand = iFirst; iCand < iLast; ++iCand) {
+        dwOffset[iCand - iFirst] = DWORD(pb - GetBytes());
+        const std::wstring& str = (*log->cand_strs)[iCand];
         DWORD cb = DWORD((str.size() + 1) * sizeof(WCHAR));
-        memcpy(pb, &str[0], cb);
+        memcpy(pb, str.c_str(), cb);
         pb += cb;
     }
 
@@ -282,14 +440,21 @@ void CandInfo::GetLog(LogCandInfo& log)
 {
     log.clear(); // 論理データをクリア。
 
+    CANDINFOEXTRA *extra = GetExtra(); // 余剰情報を取得。
+
     LogCandList cand; // 候補リストの論理データ。
     for (DWORD iList = 0; iList < dwCount; ++iList) {
         CandList *pList = GetList(iList);
-        pList->GetLog(cand); // 候補リストの論理データを取得。
+        DWORD dwHandle = 0, dwFirst = 0, dwTotal = pList->dwCount;
+        if (extra && iList < MAX_CANDLISTS) {
+            dwHandle = extra->dwHandles[iList];
+            dwFirst = extra->dwFirsts[iList];
+            dwTotal = extra->dwTotals[iList];
+        }
+        pList->GetLog(cand, dwHandle, dwFirst, dwTotal); // 候補リストの論理データを取得。
         log.cand_lists.push_back(cand); // 論理データに候補リストを追加。
     }
 
-    CANDINFOEXTRA *extra = GetExtra(); // 余剰情報を取得。
     if (extra && extra->dwSignature == 0xDEADFACE) {
         log.iClause = extra->iClause; // 現在の文節のインデックス。
     } else {
@@ -319,8 +484,19 @@ DWORD CandInfo::Store(const LogCandInfo *log)
     dwPrivateOffset = DWORD(pb - GetBytes());
 
     CANDINFOEXTRA *extra = (CANDINFOEXTRA *)pb;
+    ZeroMemory(extra, sizeof(*extra));
     extra->dwSignature = 0xDEADFACE;
     extra->iClause = log->iClause;
+    for (DWORD iList = 0; iList < dwCount; ++iList) {
+        const LogCandList& cand_list = log->cand_lists[iList];
+        if (cand_list.cand_strs) {
+            extra->dwHandles[iList] = s_cand_table.Add(cand_list.dwHandle, cand_list.cand_strs);
+        }
+        DWORD iFirst, iLast;
+        cand_list.GetWindow(iFirst, iLast);
+        extra->dwFirsts[iList] = iFirst;
+        extra->dwTotals[iList] = cand_list.GetCandCount();
+    }
     pb += sizeof(CANDINFOEXTRA);
 
     ASSERT(dwSize == DWORD(pb - GetBytes()));
@@ -351,6 +527,20 @@ CANDINFOEXTRA *CandInfo::GetExtra()
         log = &log_cand_info;
     }
 
+    // 前の候補情報が参照している候補表の番号。新しい候補情報を書いてから手放す。
+    std::vector<DWORD> old_handles;
+    if (hCandInfo && ::ImmGetIMCCSize(hCandInfo) >= sizeof(CANDIDATEINFO)) {
+        CandInfo *old_info = (CandInfo *)::ImmLockIMCC(hCandInfo);
+        if (old_info) {
+            CANDINFOEXTRA *extra = old_info->GetExtra();
+            for (DWORD iList = 0; extra && iList < old_info->dwCount && iList < MAX_CANDLISTS; ++iList) {
+                if (extra->dwHandles[iList])
+                    old_handles.push_back(extra->dwHandles[iList]);
+            }
+            ::ImmUnlockIMCC(hCandInfo);
+        }
+    }
+
     const DWORD total = log->GetTotalSize();
     HIMCC hNewCandInfo = ::ImmReSizeIMCC(hCandInfo, total);
     if (hNewCandInfo) {
@@ -361,6 +551,9 @@ CANDINFOEXTRA *CandInfo::GetExtra()
 
             ImmUnlockIMCC(hNewCandInfo);
             hCandInfo = hNewCandInfo;
+
+            for (size_t i = 0; i < old_handles.size(); ++i)
+                s_cand_table.Release(old_handles[i]);
         } else {
             ASSERT(0);
         }
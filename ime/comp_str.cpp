@@ -1,7 +1,122 @@
 ﻿// comp_str.cpp --- composition string of mzimeja
 //////////////////////////////////////////////////////////////////////////////
 
-#include "mzimeja.h"
+#ifdef _WIN32
+    #include "mzimeja.h"
+#else
+    #include "mzconv.h"
+    #include "input.h"
+#endif
+
+#define MAX_COMPSTR_MIRRORS 16  // 覚えておく論理データの写しの最大数。
+#define ROMAN_KEY_MAX       4   // ローマ字の表の一番長いキーの文字数。
+
+// 物理データの未確定文字列の各部の後ろに空けておく余白（バイト）。次の部分は4バイト境界から。
+// 入りきるあいだは、キーを押しても確保し直さずに書き換えられる。
+#define COMPSTR_SLACK(cb)   ((((((cb) * 3) / 2) + 32 + 3) & ~3) - (cb))
+
+static LONG s_nCompStrSerial = 0; // 物理データの通し番号。
+
+//////////////////////////////////////////////////////////////////////////////
+// CompStrMirrors - 未確定文字列の論理データの写し。
+
+// 入力コンテキストごとに、最後に書き込んだ論理データを取っておく。
+// 物理データの通し番号が同じなら、次のキーでは物理データを読み直さなくてよい。
+class CompStrMirrors {
+public:
+    CompStrMirrors() : m_dwTick(0) {
+        m_hLock = mz_mutex_open(NULL);
+    }
+    ~CompStrMirrors() {
+        mz_mutex_close(m_hLock);
+    }
+
+    void Put(HIMCC hCompStr, LogCompStr& log);
+    BOOL Take(HIMCC hCompStr, DWORD dwSerial, LogCompStr& log);
+
+protected:
+    struct Entry {
+        LogCompStr log;
+        DWORD dwUsed;       // 最後に使った順番。
+    };
+    HANDLE m_hLock;
+    DWORD m_dwTick;
+    std::map<HIMCC, Entry> m_entries;
+};
+
+static CompStrMirrors s_comp_mirrors;
+
+// 論理データを写しとして取っておく。中身は入れ替えるので、logは空になる。
+void CompStrMirrors::Put(HIMCC hCompStr, LogCompStr& log)
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<HIMCC, Entry>::iterator it = m_entries.find(hCompStr);
+    if (it == m_entries.end()) {
+        // いっぱいなら、一番長く使っていないものを捨てる。
+        if (m_entries.size() >= MAX_COMPSTR_MIRRORS) {
+            std::map<HIMCC, Entry>::iterator oldest = m_entries.begin();
+            for (it = m_entries.begin(); it != m_entries.end(); ++it) {
+                if (it->second.dwUsed < oldest->second.dwUsed)
+                    oldest = it;
+            }
+            m_entries.erase(oldest);
+        }
+        it = m_entries.insert(std::make_pair(hCompStr, Entry())).first;
+    }
+    it->second.log.swap(log);
+    it->second.dwUsed = ++m_dwTick;
+    mz_mutex_unlock(m_hLock);
+    log.clear();
+    log.dwSerial = 0;
+}
+
+// 通し番号が同じなら、写しを取り出す。表の項目は消さずに、logの空の
+// バッファと入れ替えて残す。次のPutでまた入れ替えるので、キーごとに
+// 項目やバッファを作り直さずに済む。
+BOOL CompStrMirrors::Take(HIMCC hCompStr, DWORD dwSerial, LogCompStr& log)
+{
+    BOOL ret = FALSE;
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<HIMCC, Entry>::iterator it = m_entries.find(hCompStr);
+    if (it != m_entries.end()) {
+        if (it->second.log.dwSerial == dwSerial) {
+            log.swap(it->second.log);
+            ret = TRUE;
+        }
+        it->second.log.dwSerial = 0; // 古い写しは二度と使わない。
+    }
+    mz_mutex_unlock(m_hLock);
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 入力モード。
+
+// IME変換モードから入力モードを返す。
+INPUT_MODE InputModeFromConversionMode(BOOL bOpen, DWORD dwConversion)
+{
+    if (bOpen) {
+        if (dwConversion & IME_CMODE_FULLSHAPE) {
+            if (dwConversion & IME_CMODE_JAPANESE) {
+                if (dwConversion & IME_CMODE_KATAKANA) {
+                    return IMODE_FULL_KATAKANA;
+                } else {
+                    return IMODE_FULL_HIRAGANA;
+                }
+            } else {
+                return IMODE_FULL_ASCII;
+            }
+        } else {
+            if (dwConversion & (IME_CMODE_JAPANESE | IME_CMODE_KATAKANA)) {
+                return IMODE_HALF_KANA;
+            } else {
+                return IMODE_HALF_ASCII;
+            }
+        }
+    } else {
+        return IMODE_HALF_ASCII;
+    }
+}
 
 //////////////////////////////////////////////////////////////////////////////
 // 未確定文字列の余剰情報の論理データ。
@@ -27,6 +142,15 @@ void LogCompStrExtra::clear()
     typing_clauses.clear();
 }
 
+// 余剰情報の論理データを入れ替える。
+void LogCompStrExtra::swap(LogCompStrExtra& other)
+{
+    std::swap(iClause, other.iClause);
+    hiragana_clauses.swap(other.hiragana_clauses);
+    typing_clauses.swap(other.typing_clauses);
+    comp_str_clauses.swap(other.comp_str_clauses);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // 未確定文字列の余剰情報の物理データ。
 
@@ -77,12 +201,12 @@ void COMPSTREXTRA::GetLog(LogCompStrExtra& log)
 // 未確定文字列の余剰情報の論理データから物理データへ。
 DWORD COMPSTREXTRA::Store(const LogCompStrExtra *log)
 {
-    ASSERT(this);
     ASSERT(log);
 
     BYTE *pb = GetBytes();
     dwSignature = 0xDEADFACE;
     iClause = log->iClause;
+    dwSerial = (DWORD)InterlockedIncrement(&s_nCompStrSerial);
     pb += sizeof(COMPSTREXTRA);
 
     DWORD size;
@@ -144,6 +268,25 @@ void LogCompStr::fix()
     }
 } // LogCompStr::fix
 
+// 未確定文字列の論理データを入れ替える。
+void LogCompStr::swap(LogCompStr& other)
+{
+    std::swap(dwCursorPos, other.dwCursorPos);
+    std::swap(dwDeltaStart, other.dwDeltaStart);
+    comp_read_attr.swap(other.comp_read_attr);
+    comp_read_clause.swap(other.comp_read_clause);
+    comp_read_str.swap(other.comp_read_str);
+    comp_attr.swap(other.comp_attr);
+    comp_clause.swap(other.comp_clause);
+    comp_str.swap(other.comp_str);
+    result_read_clause.swap(other.result_read_clause);
+    result_read_str.swap(other.result_read_str);
+    result_clause.swap(other.result_clause);
+    result_str.swap(other.result_str);
+    extra.swap(other.extra);
+    std::swap(dwSerial, other.dwSerial);
+}
+
 // 読みがなをクリア。
 void LogCompStr::clear_read()
 {
@@ -178,7 +321,7 @@ DWORD LogCompStr::GetClauseCount() const
     return (DWORD)(comp_clause.size() - 1);
 }
 
-// 未確定文字列の物理データの合計サイズを取得。
+// 未確定文字列の物理データの合計サイズを取得。余白を含む。
 DWORD LogCompStr::GetTotalSize() const
 {
     size_t total = sizeof(COMPOSITIONSTRING);
@@ -186,13 +329,17 @@ DWORD LogCompStr::GetTotalSize() const
     total += comp_read_clause.size() * sizeof(DWORD);
     total += comp_read_str.size() * sizeof(WCHAR);
     total += comp_attr.size() * sizeof(BYTE);
+    total += COMPSTR_SLACK(comp_attr.size() * sizeof(BYTE));
     total += comp_clause.size() * sizeof(DWORD);
+    total += COMPSTR_SLACK(comp_clause.size() * sizeof(DWORD));
     total += comp_str.size() * sizeof(WCHAR);
+    total += COMPSTR_SLACK(comp_str.size() * sizeof(WCHAR));
     total += result_read_clause.size() * sizeof(DWORD);
     total += result_read_str.size() * sizeof(WCHAR);
     total += result_clause.size() * sizeof(DWORD);
     total += result_str.size() * sizeof(WCHAR);
     total += extra.GetTotalSize();
+    total += COMPSTR_SLACK(extra.GetTotalSize());
     return (DWORD)total;
 }
 
@@ -372,6 +519,27 @@ void LogCompStr::UpdateCompStr()
     comp_clause[count] = (DWORD)ich;
 }
 
+// 文節の文字列のichFromから後ろだけを未確定文字列に反映する。
+void LogCompStr::UpdateClauseCompStr(DWORD iClause, DWORD ichFrom)
+{
+    if (comp_clause.size() != extra.comp_str_clauses.size() + 1 ||
+        iClause + 1 >= comp_clause.size() ||
+        comp_clause[iClause] + ichFrom > comp_clause[iClause + 1] ||
+        comp_clause[iClause + 1] > comp_str.size())
+    {
+        UpdateCompStr(); // 文節の区切りが合っていなければ作り直す。
+        return;
+    }
+    const std::wstring& str = extra.comp_str_clauses[iClause];
+    DWORD ich0 = comp_clause[iClause] + ichFrom;
+    DWORD ich1 = comp_clause[iClause + 1];
+    comp_str.replace(ich0, ich1 - ich0, str, ichFrom, str.npos);
+    DWORD ichEnd = comp_clause[iClause] + DWORD(str.size());
+    for (size_t i = iClause + 1; i < comp_clause.size(); ++i) {
+        comp_clause[i] = comp_clause[i] - ich1 + ichEnd;
+    }
+}
+
 // 余剰情報から未確定文字列を更新する。
 void LogCompStr::UpdateFromExtra(BOOL bRoman)
 {
@@ -447,7 +615,39 @@ void LogCompStr::MakeHanEisuu()
     dwCursorPos = ClauseToCompChar(extra.iClause + 1);
 }
 
-// 末尾に文字を追加する。
+typedef std::wstring (*ROMAN_FN)(std::wstring roman, size_t ichTarget);
+
+// 文字列の末尾に文字を足して、末尾のローマ字だけを変換する。
+// 変換済みの部分は読み直さない。変わり始めた位置を返す。
+static size_t
+AddRomanTail(std::wstring& str, WCHAR chTyped, ROMAN_FN fn, BOOL bTranslate)
+{
+    size_t ich = 0;
+    if (str.size() > ROMAN_KEY_MAX - 1)
+        ich = str.size() - (ROMAN_KEY_MAX - 1);
+    std::wstring tail = str.substr(ich);
+    std::wstring conv = tail + chTyped;
+    conv = mz_fullwidth_ascii_to_halfwidth(conv);
+    conv = (*fn)(conv, conv.size());
+    if (bTranslate)
+        conv = mz_translate_string(conv);
+    size_t i = 0;
+    while (i < tail.size() && i < conv.size() && tail[i] == conv[i])
+        ++i;
+    str.replace(ich + i, str.npos, conv, i, conv.npos);
+    return ich + i;
+}
+
+// 二つの文字列が違い始める位置。
+static size_t DiffStart(const std::wstring& str0, const std::wstring& str1)
+{
+    size_t i = 0;
+    while (i < str0.size() && i < str1.size() && str0[i] == str1[i])
+        ++i;
+    return i;
+}
+
+// 末尾に文字を追加する。ローマ字は末尾だけを変換する。
 void LogCompStr::AddCharToEnd(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
 {
     BOOL bRoman = (dwConv & IME_CMODE_ROMAN);
@@ -460,6 +660,7 @@ void LogCompStr::AddCharToEnd(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
         chTranslated = translated[0];
     }
     int len = 0;
+    size_t ichChanged = extra.comp_str_clauses[extra.iClause].size();
     INPUT_MODE imode = InputModeFromConversionMode(TRUE, dwConv);
     switch (imode) {
     case IMODE_FULL_HIRAGANA:
@@ -487,21 +688,13 @@ void LogCompStr::AddCharToEnd(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
             }
         } else {
             // set comp str and get delta length
-            str = extra.comp_str_clauses[extra.iClause];
-            len = (int)str.size();
-            str += chTyped;
-            str = mz_fullwidth_ascii_to_halfwidth(str);
-            str = mz_roman_to_hiragana(str, str.size());
-            str = mz_translate_string(str);
-            extra.comp_str_clauses[extra.iClause] = str;
-            len = (int)str.size() - len;
+            len = (int)extra.comp_str_clauses[extra.iClause].size();
+            ichChanged = AddRomanTail(extra.comp_str_clauses[extra.iClause], chTyped,
+                                      mz_roman_to_hiragana, TRUE);
+            len = (int)extra.comp_str_clauses[extra.iClause].size() - len;
             // set hiragana
-            str = extra.hiragana_clauses[extra.iClause];
-            str += chTyped;
-            str = mz_fullwidth_ascii_to_halfwidth(str);
-            str = mz_roman_to_hiragana(str, str.size());
-            str = mz_translate_string(str);
-            extra.hiragana_clauses[extra.iClause] = str;
+            AddRomanTail(extra.hiragana_clauses[extra.iClause], chTyped,
+                         mz_roman_to_hiragana, TRUE);
             // set typing
             chTyped = mz_translate_char(chTyped);
             extra.typing_clauses[extra.iClause] += chTyped;
@@ -531,21 +724,13 @@ void LogCompStr::AddCharToEnd(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
             }
         } else {
             // set comp str and get delta length
-            str = extra.comp_str_clauses[extra.iClause];
-            len = (int)str.size();
-            str += chTyped;
-            str = mz_fullwidth_ascii_to_halfwidth(str);
-            str = mz_roman_to_katakana(str, str.size());
-            str = mz_translate_string(str);
-            extra.comp_str_clauses[extra.iClause] = str;
-            len = (int)str.size() - len;
+            len = (int)extra.comp_str_clauses[extra.iClause].size();
+            ichChanged = AddRomanTail(extra.comp_str_clauses[extra.iClause], chTyped,
+                                      mz_roman_to_katakana, TRUE);
+            len = (int)extra.comp_str_clauses[extra.iClause].size() - len;
             // set hiragana
-            str = extra.hiragana_clauses[extra.iClause];
-            str += chTyped;
-            str = mz_fullwidth_ascii_to_halfwidth(str);
-            str = mz_roman_to_hiragana(str, str.size());
-            str = mz_translate_string(str);
-            extra.hiragana_clauses[extra.iClause] = str;
+            AddRomanTail(extra.hiragana_clauses[extra.iClause], chTyped,
+                         mz_roman_to_hiragana, TRUE);
             // set typing
             chTyped = mz_translate_char(chTyped);
             extra.typing_clauses[extra.iClause] += chTyped;
@@ -553,12 +738,9 @@ void LogCompStr::AddCharToEnd(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
         break;
     case IMODE_FULL_ASCII:
         // set comp str and get delta length
-        str = extra.comp_str_clauses[extra.iClause];
+        str = mz_lcmap(typed, LCMAP_FULLWIDTH);
+        extra.comp_str_clauses[extra.iClause] += str;
         len = (int)str.size();
-        str += chTyped;
-        str = mz_lcmap(str, LCMAP_FULLWIDTH);
-        extra.comp_str_clauses[extra.iClause] = str;
-        len = (int)str.size() - len;
         // set hiragana
         str = extra.hiragana_clauses[extra.iClause];
         str += chTyped;
@@ -591,19 +773,13 @@ void LogCompStr::AddCharToEnd(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
             }
         } else {
             // set comp str and get delta length
-            str = extra.comp_str_clauses[extra.iClause];
-            len = (int)str.size();
-            str += chTyped;
-            str = mz_fullwidth_ascii_to_halfwidth(str);
-            str = mz_roman_to_halfwidth_katakana(str, str.size());
-            extra.comp_str_clauses[extra.iClause] = str;
-            len = (int)str.size() - len;
+            len = (int)extra.comp_str_clauses[extra.iClause].size();
+            ichChanged = AddRomanTail(extra.comp_str_clauses[extra.iClause], chTyped,
+                                      mz_roman_to_halfwidth_katakana, FALSE);
+            len = (int)extra.comp_str_clauses[extra.iClause].size() - len;
             // set hiragana
-            str = extra.hiragana_clauses[extra.iClause];
-            str += chTyped;
-            str = mz_fullwidth_ascii_to_halfwidth(str);
-            str = mz_roman_to_hiragana(str, str.size());
-            extra.hiragana_clauses[extra.iClause] = str;
+            AddRomanTail(extra.hiragana_clauses[extra.iClause], chTyped,
+                         mz_roman_to_hiragana, FALSE);
             // set typing
             extra.typing_clauses[extra.iClause] += chTyped;
         }
@@ -613,7 +789,9 @@ void LogCompStr::AddCharToEnd(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
         break;
     }
     dwCursorPos += len;
-    UpdateCompStr();
+    UpdateClauseCompStr(extra.iClause, DWORD(ichChanged));
+    DWORD ich = ClauseToCompChar(extra.iClause) + DWORD(ichChanged);
+    if (ich < dwDeltaStart) dwDeltaStart = ich;
 } // LogCompStr::AddCharToEnd
 
 // 文字を挿入する。
@@ -682,6 +860,9 @@ void LogCompStr::InsertChar(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
     case IMODE_DISABLED:
         break;
     }
+    DWORD ich = ClauseToCompChar(extra.iClause) +
+                DWORD(DiffStart(extra.comp_str_clauses[extra.iClause], str));
+    if (ich < dwDeltaStart) dwDeltaStart = ich;
     extra.comp_str_clauses[extra.iClause] = str;
     dwCursorPos += len;
     UpdateCompStr();
@@ -695,13 +876,15 @@ LogCompStr::AddDakuonChar(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
     std::wstring str = extra.comp_str_clauses[extra.iClause];
     if (dwIndexInClause - 1 < str.size()) {
         str[dwIndexInClause - 1] = chTranslated;
+        DWORD ich = dwCursorPos - 1;
+        if (ich < dwDeltaStart) dwDeltaStart = ich;
     }
     extra.comp_str_clauses[extra.iClause] = str;
-    UpdateCompStr();
+    UpdateClauseCompStr(extra.iClause, 0);
     UpdateExtraClause(extra.iClause, dwConv);
 }
 
-// 文字を追加する。
+// 文字を追加する。dwDeltaStartは変わり始めた位置まで下げる。
 void LogCompStr::AddChar(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
 {
     size_t size0 = comp_str.size();
@@ -716,10 +899,12 @@ void LogCompStr::AddChar(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
     } else {
         InsertChar(chTyped, chTranslated, dwConv);
     }
+    // 変換していない文節の文字属性はみな同じなので、文節の末尾で増減する。
     size_t size1 = comp_str.size();
-    DWORD ich = ClauseToCompChar(extra.iClause);
+    DWORD ich = ClauseToCompChar(extra.iClause + 1);
     if (size0 < size1) {
         std::vector<BYTE> addition(size1 - size0);
+        ich -= DWORD(size1 - size0);
         comp_attr.insert(comp_attr.begin() + ich, addition.begin(), addition.end());
     } else if (size1 < size0) {
         comp_attr.erase(comp_attr.begin() + ich,
@@ -727,6 +912,7 @@ void LogCompStr::AddChar(WCHAR chTyped, WCHAR chTranslated, DWORD dwConv)
     }
 } // LogCompStr::AddChar
 
+// 文字を削除する。dwDeltaStartは変わり始めた位置まで下げる。
 void LogCompStr::DeleteChar(BOOL bBackSpace /* = FALSE*/, DWORD dwConv)
 {
     // is the current clause being converted?
@@ -737,6 +923,8 @@ void LogCompStr::DeleteChar(BOOL bBackSpace /* = FALSE*/, DWORD dwConv)
         UpdateCompStr();
         SetClauseAttr(extra.iClause, ATTR_INPUT);
         dwCursorPos = ClauseToCompChar(extra.iClause + 1);
+        DWORD ich = ClauseToCompChar(extra.iClause);
+        if (ich < dwDeltaStart) dwDeltaStart = ich;
     } else { // not being converted
         BOOL flag = FALSE;
         // is it back space?
@@ -758,9 +946,10 @@ void LogCompStr::DeleteChar(BOOL bBackSpace /* = FALSE*/, DWORD dwConv)
             // update extra clause
             UpdateExtraClause(extra.iClause, dwConv);
             // update composition string
-            UpdateCompStr();
+            UpdateClauseCompStr(extra.iClause, delta);
             // update comp_attr
-            comp_attr.erase(comp_attr.begin() + ich);
+            comp_attr.erase(comp_attr.begin() + dwCursorPos);
+            if (dwCursorPos < dwDeltaStart) dwDeltaStart = dwCursorPos;
         }
     }
 } // LogCompStr::DeleteChar
@@ -848,6 +1037,74 @@ void LogCompStr::MakeResult()
     fix();
 }
 
+// 変換結果を格納する。
+BOOL LogCompStr::StoreResult(const MzConvResult& result, LogCandInfo& cand)
+{
+    // 未確定文字列をクリア。
+    comp_str.clear();
+    extra.clear();
+
+    // 未確定文字列をセット。
+    comp_clause.resize(result.clauses.size() + 1);
+    for (size_t iClause = 0; iClause < result.clauses.size(); ++iClause) {
+        const MzConvClause& clause = result.clauses[iClause];
+        candidates_t::const_iterator it, end = clause.candidates.end();
+        for (it = clause.candidates.begin(); it != end; ++it) {
+            const MzConvCandidate& cand2 = *it;
+            comp_clause[iClause] = (DWORD)comp_str.size();
+            extra.hiragana_clauses.push_back(cand2.pre);
+            std::wstring typing = mz_hiragana_to_typing(cand2.pre);
+            extra.typing_clauses.push_back(typing);
+            comp_str += cand2.post;
+            break;
+        }
+    }
+    comp_clause[result.clauses.size()] = (DWORD)comp_str.size();
+    comp_attr.assign(comp_str.size(), ATTR_CONVERTED);
+    extra.iClause = 0;
+    SetClauseAttr(extra.iClause, ATTR_TARGET_CONVERTED);
+    dwCursorPos = (DWORD)comp_str.size();
+    dwDeltaStart = 0;
+
+    // 候補情報をセット。
+    cand.clear();
+    clauses_t::const_iterator it0, end0 = result.clauses.end();
+    for (it0 = result.clauses.begin(); it0 != end0; ++it0) {
+        const MzConvClause& clause = *it0;
+        LogCandList cand_list;
+        cand_list.AddClause(clause);
+        cand.cand_lists.push_back(cand_list);
+    }
+    cand.iClause = 0;
+
+    return TRUE;
+} // LogCompStr::StoreResult
+
+// 単一文節の変換結果を、現在の文節に格納する。
+BOOL LogCompStr::StoreClauseResult(const MzConvResult& result, LogCandInfo& cand, BOOL bRoman)
+{
+    if (result.clauses.empty() || result.clauses[0].candidates.empty())
+        return FALSE;
+
+    DWORD iClause = extra.iClause; // 現在の文節。
+
+    // 未確定文字列をセット。
+    const MzConvClause& clause = result.clauses[0];
+    std::wstring post = clause.candidates[0].post, pre = clause.candidates[0].pre;
+    SetClauseCompString(iClause, post);
+    SetClauseCompHiragana(iClause, pre, bRoman);
+
+    // 候補リストをセットする。
+    LogCandList cand_list;
+    cand_list.AddClause(clause);
+    ARRAY_AT(cand.cand_lists, iClause) = cand_list;
+
+    // 現在の文節をセットする。
+    cand.iClause = iClause;
+
+    return TRUE;
+} // LogCompStr::StoreClauseResult
+
 // 左に移動。
 BOOL LogCompStr::MoveLeft()
 {
@@ -1028,6 +1285,7 @@ void LogCompStr::SetClauseCompHiragana(
 //////////////////////////////////////////////////////////////////////////////
 
 // 未確定文字列の論理データから物理データを格納する。
+// 未確定文字列の各部と余剰情報の後ろには余白を空けておく。
 DWORD CompStr::Store(const LogCompStr *log)
 {
     const DWORD total = log->GetTotalSize();
@@ -1071,14 +1329,17 @@ DWORD CompStr::Store(const LogCompStr *log)
     dwCompAttrOffset = DWORD(pb - GetBytes());
     dwCompAttrLen = DWORD(log->comp_attr.size() * sizeof(BYTE));
     ADD_BYTES(comp_attr);
+    pb += COMPSTR_SLACK(dwCompAttrLen);
 
     dwCompClauseOffset = DWORD(pb - GetBytes());
     dwCompClauseLen = DWORD(log->comp_clause.size() * sizeof(DWORD));
     ADD_DWORDS(comp_clause);
+    pb += COMPSTR_SLACK(dwCompClauseLen);
 
     dwCompStrOffset = DWORD(pb - GetBytes());
     dwCompStrLen = DWORD(log->comp_str.size());
     ADD_STRING(comp_str);
+    pb += COMPSTR_SLACK(dwCompStrLen * sizeof(WCHAR));
 
     dwResultReadClauseOffset = DWORD(pb - GetBytes());
     dwResultReadClauseLen = DWORD(log->result_read_clause.size() * sizeof(DWORD));
@@ -1100,6 +1361,7 @@ DWORD CompStr::Store(const LogCompStr *log)
     dwPrivateSize = log->extra.GetTotalSize();
     dwPrivateOffset = DWORD(pb - GetBytes());
     pb += pExtra->Store(&log->extra);
+    pb += COMPSTR_SLACK(dwPrivateSize);
 
 #undef ADD_BYTES
 #undef ADD_DWORDS
@@ -1109,6 +1371,68 @@ DWORD CompStr::Store(const LogCompStr *log)
     return DWORD(pb - GetBytes());
 } // CompStr::Store
 
+// 論理データのdwDeltaStartから後ろだけを物理データに書き込む。
+// 読み込んだときから物理データが変わっていたり、余白に入りきらなければFALSEを返す。
+BOOL CompStr::Patch(const LogCompStr *log, DWORD cbCapacity)
+{
+    COMPSTREXTRA *pExtra = GetExtra();
+    if (!pExtra || !log->dwSerial || pExtra->dwSerial != log->dwSerial)
+        return FALSE;
+
+    // 読みと結果は書き換えない。
+    if (dwCompReadAttrLen != log->comp_read_attr.size() * sizeof(BYTE) ||
+        dwCompReadClauseLen != log->comp_read_clause.size() * sizeof(DWORD) ||
+        dwCompReadStrLen != log->comp_read_str.size() ||
+        dwResultReadClauseLen != log->result_read_clause.size() * sizeof(DWORD) ||
+        dwResultReadStrLen != log->result_read_str.size() ||
+        dwResultClauseLen != log->result_clause.size() * sizeof(DWORD) ||
+        dwResultStrLen != log->result_str.size())
+    {
+        return FALSE;
+    }
+
+    // 余白に入りきるか？
+    const DWORD cbAttr = DWORD(log->comp_attr.size() * sizeof(BYTE));
+    const DWORD cbClause = DWORD(log->comp_clause.size() * sizeof(DWORD));
+    const DWORD cchStr = DWORD(log->comp_str.size());
+    const DWORD cbExtra = log->extra.GetTotalSize();
+    if (dwCompAttrOffset + cbAttr > dwCompClauseOffset ||
+        dwCompClauseOffset + cbClause > dwCompStrOffset ||
+        dwCompStrOffset + cchStr * sizeof(WCHAR) > dwResultReadClauseOffset ||
+        dwPrivateOffset + cbExtra > cbCapacity)
+    {
+        return FALSE;
+    }
+
+    // 変わり始めた位置から後ろを書く。
+    DWORD ich = log->dwDeltaStart;
+    if (ich > dwCompStrLen) ich = dwCompStrLen;
+    if (ich > cchStr) ich = cchStr;
+    if (ich < cchStr) {
+        memcpy(GetCompStr() + ich, &log->comp_str[ich], (cchStr - ich) * sizeof(WCHAR));
+    }
+    dwCompStrLen = cchStr;
+
+    if (ich > dwCompAttrLen) ich = dwCompAttrLen;
+    if (ich > cbAttr) ich = cbAttr;
+    if (ich < cbAttr) {
+        memcpy(GetCompAttr() + ich, &log->comp_attr[ich], cbAttr - ich);
+    }
+    dwCompAttrLen = cbAttr;
+
+    if (cbClause) {
+        memcpy(GetCompClause(), &log->comp_clause[0], cbClause);
+    }
+    dwCompClauseLen = cbClause;
+
+    dwCursorPos = log->dwCursorPos;
+    dwDeltaStart = log->dwDeltaStart;
+    dwPrivateSize = pExtra->Store(&log->extra);
+    if (dwSize < dwPrivateOffset + dwPrivateSize)
+        dwSize = dwPrivateOffset + dwPrivateSize;
+    return TRUE;
+} // CompStr::Patch
+
 // 未確定文字列の論理データを取得する。
 void CompStr::GetLog(LogCompStr& log)
 {
@@ -1128,9 +1452,60 @@ void CompStr::GetLog(LogCompStr& log)
     if (extra && extra->dwSignature == 0xDEADFACE) {
         extra->GetLog(log.extra);
         log.fix();
+        log.dwSerial = extra->dwSerial;
+    } else {
+        log.dwSerial = 0;
     }
 }
 
+// 未確定文字列の論理データを取得する。
+// 最後に書き込んだときの写しが残っていれば、物理データを読まずにそれを取り出す。
+/*static*/ void CompStr::TakeLog(HIMCC hCompStr, LogCompStr& log)
+{
+    CompStr *lpCompStr = (CompStr *)::ImmLockIMCC(hCompStr);
+    if (lpCompStr) {
+        COMPSTREXTRA *extra = lpCompStr->GetExtra();
+        DWORD dwSerial = (extra ? extra->dwSerial : 0);
+        if (!dwSerial || !s_comp_mirrors.Take(hCompStr, dwSerial, log)) {
+            lpCompStr->GetLog(log);
+        }
+        ::ImmUnlockIMCC(hCompStr);
+    }
+}
+
+// 未確定文字列の物理データを書き換えて、論理データを写しとして取っておく。
+// logはdwDeltaStartより前と、読みと結果を変えていないこと。logは空になる。
+/*static*/ HIMCC CompStr::Update(HIMCC hCompStr, LogCompStr& log)
+{
+    BOOL bPatched = FALSE;
+    DWORD cbCapacity = ::ImmGetIMCCSize(hCompStr);
+    if (cbCapacity >= sizeof(COMPOSITIONSTRING)) {
+        CompStr *lpCompStr = (CompStr *)::ImmLockIMCC(hCompStr);
+        if (lpCompStr) {
+            bPatched = lpCompStr->Patch(&log, cbCapacity);
+            ::ImmUnlockIMCC(hCompStr);
+        }
+    }
+    if (!bPatched) {
+        hCompStr = ReCreate(hCompStr, &log);
+    }
+
+    // 書き込んだ物理データの通し番号を付けて、写しを取っておく。
+    log.dwSerial = 0;
+    CompStr *lpCompStr = (CompStr *)::ImmLockIMCC(hCompStr);
+    if (lpCompStr) {
+        COMPSTREXTRA *extra = lpCompStr->GetExtra();
+        if (extra) log.dwSerial = extra->dwSerial;
+        ::ImmUnlockIMCC(hCompStr);
+    }
+    if (log.dwSerial) {
+        s_comp_mirrors.Put(hCompStr, log);
+    } else {
+        log.clear();
+    }
+    return hCompStr;
+} // CompStr::Update
+
 // 論理データから未確定文字列を再作成する。
 /*static*/ HIMCC CompStr::ReCreate(HIMCC hCompStr, const LogCompStr *log) {
     LogCompStr log_comp_str;
@@ -1138,7 +1513,12 @@ void CompStr::GetLog(LogCompStr& log)
         log = &log_comp_str;
     }
     const DWORD total = log->GetTotalSize();
-    HIMCC hNewCompStr = ::ImmReSizeIMCC(hCompStr, total);
+    // 足りないか、大きすぎるときだけ確保し直す。
+    HIMCC hNewCompStr = hCompStr;
+    DWORD cbCapacity = ::ImmGetIMCCSize(hCompStr);
+    if (cbCapacity < total || cbCapacity > total * 2) {
+        hNewCompStr = ::ImmReSizeIMCC(hCompStr, total);
+    }
     if (hNewCompStr) {
         CompStr *lpCompStr = (CompStr *)::ImmLockIMCC(hNewCompStr);
         if (lpCompStr) {
@@ -15,20 +15,6 @@ extern "C" {
 
 //////////////////////////////////////////////////////////////////////////////
 
-// レジストリのアプリキーを開く。
-HKEY Config_OpenAppKey(VOID)
-{
-    HKEY hAppKey;
-    LSTATUS error = ::RegOpenKeyEx(HKEY_CURRENT_USER,
-                                   TEXT("SOFTWARE\\Katayama Hirofumi MZ\\mzimeja"),
-                                   0, KEY_READ, &hAppKey);
-    if (error) {
-        DPRINTA("0x%08lX\n", error);
-        return NULL;
-    }
-    return hAppKey;
-}
-
 // レジストリのアプリキーを作成する。
 HKEY Config_CreateAppKey(VOID)
 {
@@ -43,25 +29,6 @@ HKEY Config_CreateAppKey(VOID)
     return hAppKey;
 }
 
-// レジストリからDWORD値を読み込む。
-DWORD Config_GetDWORD(LPCTSTR name, DWORD dwDefault)
-{
-    HKEY hKey = Config_OpenAppKey();
-    if (!hKey)
-        return dwDefault;
-
-    DWORD dwValue = dwDefault;
-    DWORD cbValue = sizeof(dwValue);
-    LSTATUS error = ::RegQueryValueEx(hKey, name, NULL, NULL, (LPBYTE)&dwValue, &cbValue);
-    ::RegCloseKey(hKey);
-    if (error || cbValue != sizeof(DWORD)) {
-        DPRINTA("error: 0x%08lX\n", error);
-        return dwDefault;
-    }
-
-    return dwValue;
-}
-
 // レジストリにDWORD値を書き込む。
 BOOL Config_SetDWORD(LPCTSTR name, DWORD dwValue)
 {
@@ -114,85 +81,12 @@ BOOL Config_SetData(LPCTSTR name, DWORD dwType, LPCVOID pvData, DWORD cbData)
     return TRUE;
 }
 
-// レジストリから文字列値を読み込む。
-BOOL Config_GetSz(LPCTSTR name, std::wstring& str, LPCWSTR def_value)
-{
-    ASSERT(def_value);
-    str = def_value;
-
-    HKEY hKey = Config_OpenAppKey();
-    if (!hKey)
-        return FALSE;
-
-    TCHAR szText[MAX_PATH];
-    DWORD cbData = sizeof(szText);
-    LSTATUS error = ::RegQueryValueEx(hKey, name, NULL, NULL, (LPBYTE)szText, &cbData);
-    szText[_countof(szText) - 1] = 0;
-    ::RegCloseKey(hKey);
-    if (error) {
-        DPRINTA("error: 0x%08lX\n", error);
-        return FALSE;
-    }
-
-    str = szText;
-    return TRUE;
-}
-
 // レジストリに文字列値を書き込む。
 BOOL Config_SetSz(LPCTSTR name, LPCTSTR psz)
 {
     return Config_SetData(name, REG_SZ, psz, (lstrlen(psz) + 1) * sizeof(TCHAR));
 }
 
-// ローカルのファイルを探す。
-BOOL FindLocalFile(std::wstring& path, LPCWSTR filename) {
-    WCHAR szPath[MAX_PATH];
-    ::GetModuleFileNameW(NULL, szPath, MAX_PATH);
-    PathRemoveFileSpecW(szPath);
-
-    for (INT i = 0; i < 5; ++i) {
-        size_t ich = wcslen(szPath);
-        {
-            PathAppendW(szPath, filename);
-            if (PathFileExistsW(szPath)) {
-                path = szPath;
-                return TRUE;
-            }
-        }
-        szPath[ich] = 0;
-        {
-            PathAppendW(szPath, L"mzimeja");
-            PathAppendW(szPath, filename);
-            if (PathFileExistsW(szPath)) {
-                path = szPath;
-                return TRUE;
-            }
-        }
-        szPath[ich] = 0;
-        PathRemoveFileSpecW(szPath);
-    }
-
-    path.clear();
-    return FALSE;
-}
-
-// アプリフォルダのファイルを探す
-BOOL FindAppFile(std::wstring& path, LPCTSTR filename) {
-    LPITEMIDLIST pidl;
-    SHGetSpecialFolderLocation(NULL, CSIDL_PROGRAM_FILES, &pidl);
-    WCHAR szPath[MAX_PATH];
-    SHGetPathFromIDListW(pidl, szPath);
-    CoTaskMemFree(pidl);
-    PathAppendW(szPath, L"mzimeja");
-    PathAppendW(szPath, filename);
-    if (PathFileExistsW(szPath)) {
-        path = szPath;
-        return TRUE;
-    }
-    path.clear();
-    return FALSE;
-}
-
 // IDD_GENERAL - 全般設定プロパティシートページ。
 INT_PTR CALLBACK
 GeneralDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
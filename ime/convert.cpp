@@ -5,9 +5,10 @@
 // 参考文献1：『自然言語処理の基礎』2010年、コロナ社。
 // 参考文献2：『新編常用国語便覧』1995年、浜島書店。
 
-#include "mzimeja.h"
+#include "mzconv.h"
 #include "resource.h"
 #include <algorithm>        // for std::sort
+#include <new>              // for placement new
 
 // Vibrato engine integration
 #ifdef HAVE_VIBRATO
@@ -29,6 +30,7 @@ static const LPCWSTR s_months[] = {
 // 辞書。
 Dict g_basic_dict;
 Dict g_name_dict;
+MZ_SCAN_USER_DICT g_pfnScanUserDict = NULL;
 
 // ひらがな表。品詞の活用で使用される。
 static const WCHAR s_hiragana_table[][5] =
@@ -244,11 +246,562 @@ static ConnectionCostTable* GetConnectionCostTable() {
     return &table;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// 活用規則。
+//
+// 用言の語幹の後に続く文字列（語尾）を、品詞分類ごとの規則の表で表す。
+// 規則の表は最初に状態機械（トライ木）に変換され、変換時には語幹の後の
+// 文字列を一度だけ走査して、一致する規則をすべて求める。規則は表の順に
+// ノードになるので、表の順序がそのままラティスへの追加順になる。
+//
+// パターンの特殊文字：
+//   Ａ,Ｉ,Ｕ,Ｅ,Ｏ: 五段動詞の行の各段の文字（あ行の「Ａ」は「わ」）。
+//   Ｑ: 五段動詞の連用形の音便（「い」「っ」「ん」など）。
+//   Ｔ: 音便の後の「た」「だ」。Ｄ: 音便の後の「て」「で」。
+//   その他: s_katsuyou_classes の文字のいずれか。
+
+#define KRF_ELSE        0x0001  // 直前の一連の規則のどれかが一致したら試さない。
+#define KRF_ALSO        0x0002  // 直前の規則が一致したときのみ。
+#define KRF_DERIVE      0x0004  // ノードを作らず、語幹を伸ばして別の品詞として処理する。
+#define KRF_PEEK        0x0008  // 一致した部分を語幹に含めない（KRF_DERIVEと共に）。
+#define KRF_EOS         0x0010  // 語幹の後が空のときのみ。
+#define KRF_NONEMPTY    0x0020  // 語幹の後が空でないときのみ。
+#define KRF_GYOU        0x0040  // 行がgyouのときのみ。
+#define KRF_NOT_GYOU    0x0080  // 行がgyouでないときのみ。
+#define KRF_STEM_EQ     0x0100  // 語幹がstemと等しいときのみ。
+#define KRF_STEM_NE     0x0200  // 語幹がstemと等しくないときのみ。
+#define KRF_STEM_END    0x0400  // 語幹がstemで終わるときのみ。
+
+// 活用規則。
+struct KATSUYOU_RULE
+{
+    const WCHAR *suffix;    // 語幹の後に続く部分のパターン。
+    BYTE bunrui;            // 品詞分類。
+    BYTE katsuyou;          // 活用形。
+    SHORT cost;             // 追加のコスト。
+    const WCHAR *post;      // 変換後の語尾のパターン。NULLなら変換前と同じ。
+    WORD flags;             // KRF_*。
+    BYTE gyou;              // 行の条件。
+    const WCHAR *stem;      // 語幹の条件。
+};
+
+// 特殊文字が表す文字の集合。
+static const struct KATSUYOU_CLASS
+{
+    WCHAR meta;
+    const WCHAR *chars;
+} s_katsuyou_classes[] =
+{
+    { L'＊', L"よねなぞ" },
+    { L'＋', L"よや" },
+    { L'＆', L"よやなね" },
+    { L'％', L"よなね" },
+    { L'～', L"ーあぁえぇおぉ" },
+    { L'＄', L"。、，．.," },
+};
+
+// い形容詞の活用規則。
+static const KATSUYOU_RULE s_ikeiyoushi_rules[] =
+{
+    // 未然形。「痛い」→「痛かろ(う)」
+    { L"かろう",   HB_IKEIYOUSHI, MIZEN_KEI, 0, NULL, 0, 0, NULL },
+    // 連用形。「痛かっ(た)」「痛く(て)」「広う(て)」「美しゅう(て)」
+    // 「く」「う」の形は後続を制限しない（「痛く|ない」など）。
+    { L"かっ",     HB_IKEIYOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    { L"かった",   HB_IKEIYOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"く",       HB_IKEIYOUSHI, NONE_KEI, 0, NULL, 0, 0, NULL },
+    { L"くて",     HB_IKEIYOUSHI, NONE_KEI, 0, NULL, 0, 0, NULL },
+    { L"う",       HB_IKEIYOUSHI, NONE_KEI, 0, NULL, 0, 0, NULL },
+    { L"ゅう",     HB_IKEIYOUSHI, NONE_KEI, 0, NULL, 0, 0, NULL },
+    // 終止形。「かわいい」「かわいいよ」「かわいいね」「かわいいぞ」
+    { L"い",       HB_IKEIYOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"い＊",     HB_IKEIYOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 連体形。「痛い(とき)」「痛き(とき)」
+    { L"い",       HB_IKEIYOUSHI, RENTAI_KEI, 0, NULL, 0, 0, NULL },
+    { L"き",       HB_IKEIYOUSHI, RENTAI_KEI, 0, NULL, 0, 0, NULL },
+    // 仮定形。「痛けれ(ば)」
+    { L"けれ",     HB_IKEIYOUSHI, KATEI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ければ",   HB_IKEIYOUSHI, KATEI_KEI, 0, NULL, 0, 0, NULL },
+    // 名詞形。「痛さ」「痛み」「痛げ」「痛め」「痛目」
+    { L"さ",       HB_MEISHI, RENTAI_KEI, 0, NULL, 0, 0, NULL },
+    { L"み",       HB_MEISHI, RENTAI_KEI, 0, NULL, KRF_STEM_NE, 0, L"な" },
+    { L"げ",       HB_MEISHI, RENTAI_KEI, 0, NULL, KRF_STEM_NE, 0, L"な" },
+    { L"め",       HB_MEISHI, RENTAI_KEI, 0, NULL, KRF_STEM_NE, 0, L"な" },
+    { L"め",       HB_MEISHI, RENTAI_KEI, 0, L"目", KRF_STEM_NE, 0, L"な" },
+    // 「痛そうな(な形容詞)」「痛すぎる(一段動詞)」
+    { L"そう",     HB_NAKEIYOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"すぎ",     HB_ICHIDAN_DOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"すぎ",     HB_ICHIDAN_DOUSHI, 0, 0, L"過ぎ", KRF_DERIVE, 0, NULL },
+    // 「痛。」「寒。」など
+    { L"",         HB_MEISHI, 0, 100, NULL, KRF_DERIVE | KRF_PEEK | KRF_EOS, 0, NULL },
+    { L"＄",       HB_MEISHI, 0, 100, NULL, KRF_DERIVE | KRF_PEEK, 0, NULL },
+};
+
+// な形容詞の活用規則。
+static const KATSUYOU_RULE s_nakeiyoushi_rules[] =
+{
+    // 未然形。「巨大だろ(う)」「巨大だろうに」
+    { L"だろう",   HB_NAKEIYOUSHI, MIZEN_KEI, 0, NULL, 0, 0, NULL },
+    { L"だろうに", HB_FUKUSHI, MIZEN_KEI, 0, NULL, 0, 0, NULL },
+    // 「破壊的すぎる(一段動詞)」
+    { L"すぎ",     HB_ICHIDAN_DOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"すぎ",     HB_ICHIDAN_DOUSHI, 0, 0, L"過ぎ", KRF_DERIVE, 0, NULL },
+    // 連用形。「巨大だっ(た)」「巨大で」「巨大に」
+    { L"だっ",     HB_NAKEIYOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    { L"だった",   HB_NAKEIYOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"で",       HB_NAKEIYOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    { L"に",       HB_NAKEIYOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    // 終止形。「巨大だ」「巨大だね」「巨大だぞ」
+    { L"だ",       HB_NAKEIYOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"だ＊",     HB_NAKEIYOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 連体形。「巨大な(とき)」
+    { L"な",       HB_NAKEIYOUSHI, RENTAI_KEI, 0, NULL, 0, 0, NULL },
+    // 「穏健な」→「穏健に(副詞)」
+    { L"に",       HB_FUKUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    // 仮定形。「巨大なら」「巨大ならば」
+    { L"なら",     HB_NAKEIYOUSHI, KATEI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ならば",   HB_NAKEIYOUSHI, KATEI_KEI, 0, NULL, 0, 0, NULL },
+    // 名詞形。「きれいさ」「巨大さ」
+    { L"さ",       HB_MEISHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    // 「きれい。」「静か。」「巨大。」など
+    { L"",         HB_MEISHI, 0, 0, NULL, KRF_DERIVE | KRF_PEEK | KRF_EOS, 0, NULL },
+    { L"＄",       HB_MEISHI, 0, 0, NULL, KRF_DERIVE | KRF_PEEK, 0, NULL },
+};
+
+// 五段動詞の活用規則。
+static const KATSUYOU_RULE s_godan_rules[] =
+{
+    // 未然形。「咲か(ない)」「食わ(ない)」「咲かせ(られる)」「とまん(ない)」
+    { L"Ａ",       HB_GODAN_DOUSHI, MIZEN_KEI, 0, NULL, 0, 0, NULL },
+    { L"Ａせ",     HB_GODAN_DOUSHI, MIZEN_KEI, 0, NULL, 0, 0, NULL },
+    { L"ん",       HB_GODAN_DOUSHI, MIZEN_KEI, 0, NULL, KRF_GYOU, GYOU_RA, NULL },
+    // 連用形。「咲き(ます)」「食い(ます)」
+    { L"Ｉ",       HB_GODAN_DOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    // 連用形の音便。「書いても」「書いて」「書いたり」「書いた」
+    { L"ＱＤも",   HB_GODAN_DOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    { L"ＱＤ",     HB_GODAN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"ＱＴり",   HB_GODAN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"ＱＴ",     HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"ＱＴ",     HB_GODAN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_ALSO, 0, NULL },
+    // 「～ちゃった」「～ちまった」「～じゃった」「～じまった」
+    { L"Ｑちゃった", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑちまった", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじゃった", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじまった", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    // 「～ちゃう」「～ちまう」「～じゃう」「～じまう」
+    { L"Ｑちゃう", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑちまう", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじゃう", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじまう", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    // 命令形「～ちゃえ」「～ちまえ」「～じゃえ」「～じまえ」
+    { L"Ｑちゃえ", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑちまえ", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじゃえ", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじまえ", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    // 命令形「～ちゃい」「～ちまい」「～じゃい」「～じまい」
+    { L"Ｑちゃい", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑちまい", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじゃい", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    { L"Ｑじまい", HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_ELSE, 0, NULL },
+    // 終止形・連体形。「動く」「動く(とき)」「動くよ」「動くね」「動くな」「動くぞ」
+    { L"Ｕ",       HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"Ｕ",       HB_GODAN_DOUSHI, RENTAI_KEI, 0, NULL, 0, 0, NULL },
+    { L"Ｕ＊",     HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 仮定形・命令形。「動け(ば)」「動け」「動けよ」
+    { L"Ｅ",       HB_GODAN_DOUSHI, KATEI_KEI, 0, NULL, 0, 0, NULL },
+    { L"Ｅ",       HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"Ｅ＋",     HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    // 「くだされ」→「ください」、「なされ」→「なさい」
+    { L"い",       HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_RA, L"さ" },
+    // 「動こう」「動こうよ」
+    { L"Ｏう",     HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"Ｏう＆",   HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    // 名詞形。「動き」「動き方」
+    { L"Ｉ",       HB_MEISHI, RENYOU_KEI, 40, NULL, 0, 0, NULL },
+    { L"Ｉかた",   HB_MEISHI, RENYOU_KEI, 0, L"Ｉ方", 0, 0, NULL },
+    // 「動きやすい」「動きにくい」「動きづらい」
+    { L"Ｉやす",   HB_IKEIYOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"Ｉやす",   HB_IKEIYOUSHI, 0, 10, L"Ｉ易い", KRF_DERIVE, 0, NULL },
+    { L"Ｉにく",   HB_IKEIYOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"Ｉにく",   HB_IKEIYOUSHI, 0, 10, L"Ｉ難", KRF_DERIVE, 0, NULL },
+    { L"Ｉづら",   HB_IKEIYOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"Ｉづら",   HB_IKEIYOUSHI, 0, 10, L"Ｉ辛", KRF_DERIVE, 0, NULL },
+    // 「動ける(一段)」「聞ける(一段)」
+    { L"Ｅ",       HB_ICHIDAN_DOUSHI, 0, 30, NULL, KRF_DERIVE, 0, NULL },
+};
+
+// 一段動詞の活用規則。
+static const KATSUYOU_RULE s_ichidan_rules[] =
+{
+    // 未然形・連用形。「寄せ(ない)」「寄せ(ます)」「見(ない)」「見(ます)」
+    { L"",         HB_ICHIDAN_DOUSHI, MIZEN_KEI, 0, NULL, 0, 0, NULL },
+    { L"",         HB_ICHIDAN_DOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    // 「見て」「見ていた」「見ていたよ」「見ていたよぉ」
+    { L"て",       HB_ICHIDAN_DOUSHI, RENYOU_KEI, 0, NULL, 0, 0, NULL },
+    { L"ていた",   HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ていた％", HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ていた％～", HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 「見てた」「見てたよ」「見てたよぉ」
+    { L"てた",     HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"てた％",   HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"てた％～", HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 「見ない」
+    { L"ない",     HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 「見ちゃう」「見ちゃえ」「見ちゃい」「見ちゃった」など
+    { L"ちゃう",   HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ちまう",   HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ちゃえ",   HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ちまえ",   HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ちゃい",   HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ちまい",   HB_GODAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ちゃった", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ちまった", HB_GODAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 「寄せやすい」「寄せにくい」「寄せづらい」
+    { L"やす",     HB_IKEIYOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"やす",     HB_IKEIYOUSHI, 0, 10, L"易", KRF_DERIVE, 0, NULL },
+    { L"にく",     HB_IKEIYOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"にく",     HB_IKEIYOUSHI, 0, 10, L"難", KRF_DERIVE, 0, NULL },
+    { L"づら",     HB_IKEIYOUSHI, 0, 0, NULL, KRF_DERIVE, 0, NULL },
+    { L"づら",     HB_IKEIYOUSHI, 0, 10, L"辛い", KRF_DERIVE, 0, NULL },
+    // 終止形・連体形。「寄せる」「寄せる(とき)」「見るよ」「見るね」「見るな」「見るぞ」
+    { L"る",       HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    { L"る",       HB_ICHIDAN_DOUSHI, RENTAI_KEI, 0, NULL, 0, 0, NULL },
+    { L"る＊",     HB_ICHIDAN_DOUSHI, SHUUSHI_KEI, 0, NULL, 0, 0, NULL },
+    // 仮定形。「寄せれ(ば)」「見れ(ば)」
+    { L"れ",       HB_ICHIDAN_DOUSHI, KATEI_KEI, 0, NULL, 0, 0, NULL },
+    // 命令形。「寄せろ」「寄せろよ」「寄せよ」
+    { L"ろ",       HB_ICHIDAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"ろ＋",     HB_ICHIDAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"よ",       HB_ICHIDAN_DOUSHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    // 名詞形。「寄せ」「寄せ方」「見」「見方」
+    { L"",         HB_MEISHI, MEIREI_KEI, 0, NULL, 0, 0, NULL },
+    { L"かた",     HB_MEISHI, MEIREI_KEI, 0, L"方", 0, 0, NULL },
+};
+
+// カ変動詞の活用規則。
+// 「くる」「こ(ない)」「き(ます)」などと、語幹が一致しないので、
+// 実際の辞書では「来い」を登録するなど回避策を施している。
+static const KATSUYOU_RULE s_kahen_rules[] =
+{
+    // 終止形・連体形。「～来る」「～来るよ」
+    { L"くる",     HB_KAHEN_DOUSHI, SHUUSHI_KEI, 0, L"来る", 0, 0, NULL },
+    { L"くる",     HB_KAHEN_DOUSHI, RENTAI_KEI, 0, L"来る", 0, 0, NULL },
+    { L"くる＊",   HB_KAHEN_DOUSHI, SHUUSHI_KEI, 0, L"来る＊", 0, 0, NULL },
+    { L"",         HB_KAHEN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_STEM_EQ, 0, L"くる" },
+    { L"",         HB_KAHEN_DOUSHI, RENTAI_KEI, 0, NULL, KRF_STEM_EQ, 0, L"くる" },
+    { L"＊",       HB_KAHEN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_STEM_EQ, 0, L"くる" },
+    // 命令形。「～こい」「～こいよ」「～こいや」
+    { L"こい",     HB_KAHEN_DOUSHI, MEIREI_KEI, 0, L"来い", 0, 0, NULL },
+    { L"こい＋",   HB_KAHEN_DOUSHI, MEIREI_KEI, 0, L"来い＋", 0, 0, NULL },
+    { L"",         HB_KAHEN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_STEM_EQ, 0, L"こい" },
+    { L"＋",       HB_KAHEN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_STEM_EQ, 0, L"こい" },
+    // 仮定形。「～来れ」
+    { L"くれ",     HB_KAHEN_DOUSHI, KATEI_KEI, 0, L"来れ", 0, 0, NULL },
+    { L"",         HB_KAHEN_DOUSHI, KATEI_KEI, 0, NULL, KRF_STEM_EQ, 0, L"くれ" },
+    // 未然形。「～来」（こ）「～来させ」
+    { L"こ",       HB_KAHEN_DOUSHI, MIZEN_KEI, 0, L"来", 0, 0, NULL },
+    { L"こさせ",   HB_KAHEN_DOUSHI, MIZEN_KEI, 0, L"来させ", 0, 0, NULL },
+    { L"",         HB_KAHEN_DOUSHI, MIZEN_KEI, 0, NULL, KRF_STEM_EQ, 0, L"こ" },
+    { L"させ",     HB_KAHEN_DOUSHI, MIZEN_KEI, 0, NULL, KRF_STEM_EQ, 0, L"こ" },
+    // 連用形。「～来」（き）
+    { L"き",       HB_KAHEN_DOUSHI, RENYOU_KEI, 0, L"来", 0, 0, NULL },
+    { L"",         HB_KAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_STEM_EQ, 0, L"き" },
+};
+
+// サ変動詞の活用規則。
+// カ変動詞と同様に、サ変動詞は語幹が変化するので、「回避策」が必要になる。
+// 回避策として、辞書にそれぞれ異なる語幹を登録している。
+static const KATSUYOU_RULE s_sahen_rules[] =
+{
+    // 未然形「～さ」「～し」「～せ」「～ざ」「～じ」「～ぜ」
+    { L"", HB_SAHEN_DOUSHI, MIZEN_KEI, 50, NULL, KRF_NONEMPTY | KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ざ" },
+    { L"", HB_SAHEN_DOUSHI, MIZEN_KEI, 50, NULL, KRF_NONEMPTY | KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"じ" },
+    { L"", HB_SAHEN_DOUSHI, MIZEN_KEI, 50, NULL, KRF_NONEMPTY | KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ぜ" },
+    { L"", HB_SAHEN_DOUSHI, MIZEN_KEI, 50, NULL, KRF_NONEMPTY | KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"さ" },
+    { L"", HB_SAHEN_DOUSHI, MIZEN_KEI, 50, NULL, KRF_NONEMPTY | KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"し" },
+    { L"", HB_SAHEN_DOUSHI, MIZEN_KEI, 50, NULL, KRF_NONEMPTY | KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"せ" },
+    // 連用形「～し」「～じ」
+    { L"", HB_SAHEN_DOUSHI, RENYOU_KEI, 50, NULL, KRF_NONEMPTY | KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"じ" },
+    { L"", HB_SAHEN_DOUSHI, RENYOU_KEI, 50, NULL, KRF_NONEMPTY | KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"し" },
+    // 終止形「～ずる」、連用形「～ずる(とき)」「～ずるな」「～ずるよ」「～ずるなよ」
+    { L"",     HB_SAHEN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ずる" },
+    { L"",     HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ずる" },
+    { L"な",   HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ずる" },
+    { L"よ",   HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ずる" },
+    { L"なよ", HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ずる" },
+    // 終止形「～する」、連用形「～する(とき)」「～するな」「～するよ」「～するなよ」
+    { L"",     HB_SAHEN_DOUSHI, SHUUSHI_KEI, 0, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"する" },
+    { L"",     HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"する" },
+    { L"な",   HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"する" },
+    { L"よ",   HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"する" },
+    { L"なよ", HB_SAHEN_DOUSHI, RENYOU_KEI, 0, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"する" },
+    // 仮定形「～すれ(ば)」「～ずれ(ば)」
+    { L"", HB_SAHEN_DOUSHI, KATEI_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ずれ" },
+    { L"", HB_SAHEN_DOUSHI, KATEI_KEI, 0, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"すれ" },
+    // 命令形「～しろ」「～じろ」「せよ」「ぜよ」「せい」「ぜい」
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 200, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"じろ" },
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 200, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ぜよ" },
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 200, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"ぜい" },
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 200, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"しろ" },
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 200, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"せよ" },
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 200, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"せい" },
+    // 「～しよう」「～じよう」
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_GYOU | KRF_STEM_END, GYOU_ZA, L"じよう" },
+    { L"", HB_SAHEN_DOUSHI, MEIREI_KEI, 0, NULL, KRF_NOT_GYOU | KRF_STEM_END, GYOU_ZA, L"しよう" },
+};
+
+// 一つの表の規則の最大数（一致をビット集合で表すため）。
+#define KATSUYOU_MAX_RULES 64
+
+// 活用規則の表。
+struct KATSUYOU_TABLE
+{
+    const KATSUYOU_RULE *rules; // 規則の配列。
+    size_t count;               // 規則の個数。
+    BOOL by_gyou;               // 行ごとに状態機械を作るか？
+    WORD root[GYOU_NN + 1];     // 状態機械の根。
+};
+
+static KATSUYOU_TABLE s_ikeiyoushi_table = { s_ikeiyoushi_rules, _countof(s_ikeiyoushi_rules), FALSE, { 0 } };
+static KATSUYOU_TABLE s_nakeiyoushi_table = { s_nakeiyoushi_rules, _countof(s_nakeiyoushi_rules), FALSE, { 0 } };
+static KATSUYOU_TABLE s_godan_table = { s_godan_rules, _countof(s_godan_rules), TRUE, { 0 } };
+static KATSUYOU_TABLE s_ichidan_table = { s_ichidan_rules, _countof(s_ichidan_rules), FALSE, { 0 } };
+static KATSUYOU_TABLE s_kahen_table = { s_kahen_rules, _countof(s_kahen_rules), FALSE, { 0 } };
+static KATSUYOU_TABLE s_sahen_table = { s_sahen_rules, _countof(s_sahen_rules), FALSE, { 0 } };
+
+// 状態機械の状態。
+struct KATSUYOU_STATE
+{
+    WCHAR ch;           // この状態に入る文字。
+    WORD child;         // 最初の子（0ならなし）。
+    WORD sibling;       // 次の兄弟（0ならなし）。
+    ULONGLONG accept;   // この状態で一致する規則のビット集合。
+};
+
+// 状態の置き場。0番は使わない。
+static KATSUYOU_STATE s_katsuyou_states[2048];
+static size_t s_katsuyou_state_count = 1;
+
+// 特殊文字に対応する文字集合を取得する。
+static const WCHAR *mz_katsuyou_class(WCHAR ch)
+{
+    for (size_t i = 0; i < _countof(s_katsuyou_classes); ++i) {
+        if (s_katsuyou_classes[i].meta == ch)
+            return s_katsuyou_classes[i].chars;
+    }
+    return NULL;
+}
+
+// 五段動詞の行に応じて特殊文字を解決する。その行にない文字なら0を返す。
+static WCHAR mz_katsuyou_char(WCHAR ch, Gyou gyou)
+{
+    switch (ch) {
+    case L'Ａ':
+        if (gyou == GYOU_A)
+            return L'わ';
+        return ARRAY_AT_AT(s_hiragana_table, gyou, DAN_A);
+    case L'Ｉ': return ARRAY_AT_AT(s_hiragana_table, gyou, DAN_I);
+    case L'Ｕ': return ARRAY_AT_AT(s_hiragana_table, gyou, DAN_U);
+    case L'Ｅ': return ARRAY_AT_AT(s_hiragana_table, gyou, DAN_E);
+    case L'Ｏ': return ARRAY_AT_AT(s_hiragana_table, gyou, DAN_O);
+    case L'Ｑ':
+        switch (gyou) {
+        case GYOU_NA: case GYOU_MA: case GYOU_BA:
+            return L'ん'; // 「よんだ」「のんだ」
+        case GYOU_A: case GYOU_TA: case GYOU_RA:
+            return L'っ'; // 「かった」「もった」「とった」
+        case GYOU_KA: case GYOU_GA:
+            return L'い'; // 「かいた」「かいだ」
+        default:
+            return ARRAY_AT_AT(s_hiragana_table, gyou, DAN_I);
+        }
+    case L'Ｔ':
+    case L'Ｄ':
+        switch (gyou) {
+        case GYOU_NA: case GYOU_MA: case GYOU_BA: case GYOU_GA:
+            return (ch == L'Ｔ') ? L'だ' : L'で';
+        default:
+            return (ch == L'Ｔ') ? L'た' : L'て';
+        }
+    default:
+        return ch;
+    }
+}
+
+// 子の状態を探す。bCreateがTRUEなら、なければ作る。
+static WORD mz_katsuyou_child(WORD state, WCHAR ch, BOOL bCreate)
+{
+    WORD child = s_katsuyou_states[state].child;
+    for (; child; child = s_katsuyou_states[child].sibling) {
+        if (s_katsuyou_states[child].ch == ch)
+            return child;
+    }
+    if (!bCreate)
+        return 0;
+    ASSERT(s_katsuyou_state_count < _countof(s_katsuyou_states));
+    if (s_katsuyou_state_count >= _countof(s_katsuyou_states))
+        return 0;
+    child = (WORD)s_katsuyou_state_count++;
+    KATSUYOU_STATE& s = s_katsuyou_states[child];
+    s.ch = ch;
+    s.child = 0;
+    s.sibling = s_katsuyou_states[state].child;
+    s.accept = 0;
+    s_katsuyou_states[state].child = child;
+    return child;
+}
+
+// パターンを状態機械に追加する。
+static void mz_katsuyou_add(WORD state, const WCHAR *pattern, Gyou gyou, ULONGLONG bit)
+{
+    if (!state)
+        return;
+    if (*pattern == 0) {
+        s_katsuyou_states[state].accept |= bit;
+        return;
+    }
+    if (const WCHAR *chars = mz_katsuyou_class(*pattern)) {
+        for (; *chars; ++chars) {
+            mz_katsuyou_add(mz_katsuyou_child(state, *chars, TRUE), pattern + 1, gyou, bit);
+        }
+        return;
+    }
+    WCHAR ch = mz_katsuyou_char(*pattern, gyou);
+    if (ch == 0)
+        return; // この行にはない。
+    mz_katsuyou_add(mz_katsuyou_child(state, ch, TRUE), pattern + 1, gyou, bit);
+}
+
+// 活用規則の表から状態機械を作る。
+static void mz_make_katsuyou_table(KATSUYOU_TABLE& table)
+{
+    ASSERT(table.count <= KATSUYOU_MAX_RULES);
+    const size_t num_roots = (table.by_gyou ? _countof(table.root) : 1);
+    for (size_t iGyou = 0; iGyou < num_roots; ++iGyou) {
+        WORD root = (WORD)s_katsuyou_state_count++;
+        ZeroMemory(&s_katsuyou_states[root], sizeof(KATSUYOU_STATE));
+        for (size_t i = 0; i < table.count; ++i) {
+            mz_katsuyou_add(root, table.rules[i].suffix, (Gyou)iGyou, 1ULL << i);
+        }
+        table.root[iGyou] = root;
+    }
+    for (size_t iGyou = num_roots; iGyou < _countof(table.root); ++iGyou) {
+        table.root[iGyou] = table.root[0];
+    }
+}
+
+// 活用規則の状態機械を作成する。
+static void mz_make_katsuyou_automata()
+{
+    if (s_katsuyou_state_count > 1)
+        return;
+    mz_make_katsuyou_table(s_ikeiyoushi_table);
+    mz_make_katsuyou_table(s_nakeiyoushi_table);
+    mz_make_katsuyou_table(s_godan_table);
+    mz_make_katsuyou_table(s_ichidan_table);
+    mz_make_katsuyou_table(s_kahen_table);
+    mz_make_katsuyou_table(s_sahen_table);
+    DPRINTW(L"katsuyou states: %d\n", (INT)s_katsuyou_state_count);
+}
+
+// 活用規則の一致。
+struct KATSUYOU_MATCH
+{
+    const KATSUYOU_RULE *rule;  // 規則。
+    size_t length;              // 語幹の後の一致した長さ。
+};
+
+// 語幹の後の文字列を一度だけ走査して、一致する規則を表の順に求める。
+// メモリーの確保はしない。matchesにはKATSUYOU_MAX_RULES個の領域が必要。
+static size_t
+mz_katsuyou_match(const KATSUYOU_TABLE& table, Gyou gyou, const std::wstring& stem,
+                  const WCHAR *tail, size_t tail_len, KATSUYOU_MATCH *matches)
+{
+    if ((size_t)gyou >= _countof(table.root))
+        return 0;
+
+    // 状態機械を走査する。
+    WORD state = table.root[gyou];
+    ULONGLONG bits = s_katsuyou_states[state].accept;
+    for (size_t i = 0; i < tail_len; ++i) {
+        state = mz_katsuyou_child(state, tail[i], FALSE);
+        if (!state)
+            break;
+        bits |= s_katsuyou_states[state].accept;
+    }
+
+    // 規則の順に条件を確かめる。
+    size_t count = 0;
+    BOOL chain = FALSE, prev = FALSE;
+    for (size_t i = 0; i < table.count; ++i) {
+        const KATSUYOU_RULE& rule = table.rules[i];
+        const WORD flags = rule.flags;
+        BOOL hit = (BOOL)((bits >> i) & 1);
+        if (hit && (flags & KRF_EOS) && tail_len != 0)
+            hit = FALSE;
+        if (hit && (flags & KRF_NONEMPTY) && tail_len == 0)
+            hit = FALSE;
+        if (hit && (flags & KRF_GYOU) && gyou != rule.gyou)
+            hit = FALSE;
+        if (hit && (flags & KRF_NOT_GYOU) && gyou == rule.gyou)
+            hit = FALSE;
+        if (hit && (flags & (KRF_STEM_EQ | KRF_STEM_NE | KRF_STEM_END))) {
+            const size_t len = lstrlenW(rule.stem);
+            if (flags & KRF_STEM_EQ)
+                hit = (stem.size() == len && stem.compare(0, len, rule.stem) == 0);
+            else if (flags & KRF_STEM_NE)
+                hit = !(stem.size() == len && stem.compare(0, len, rule.stem) == 0);
+            else
+                hit = (stem.size() >= len && stem.compare(stem.size() - len, len, rule.stem) == 0);
+        }
+        if (flags & KRF_ALSO) {
+            hit = hit && prev;
+        } else if (flags & KRF_ELSE) {
+            if (chain)
+                hit = FALSE;
+            chain = chain || hit;
+        } else {
+            chain = hit;
+        }
+        prev = hit;
+        if (!hit)
+            continue;
+        matches[count].rule = &rule;
+        matches[count].length = ((flags & KRF_PEEK) ? 0 : lstrlenW(rule.suffix));
+        ++count;
+    }
+    return count;
+}
+
+// 変換後の語尾を追加する。
+static void
+mz_katsuyou_post(std::wstring& str, const KATSUYOU_RULE& rule, const WCHAR *tail,
+                 size_t length, Gyou gyou)
+{
+    if (!rule.post) {
+        str.append(tail, length);
+        return;
+    }
+    for (size_t i = 0; rule.post[i]; ++i) {
+        WCHAR ch = rule.post[i];
+        if (mz_katsuyou_class(ch)) {
+            // 文字集合ならば、一致した文字をそのまま使う。
+            ASSERT(i < length);
+            ch = tail[i];
+        } else {
+            ch = mz_katsuyou_char(ch, gyou);
+        }
+        str += ch;
+    }
+}
+
 // 子音の写像と母音の写像を作成する。
 void mz_make_literal_maps()
 {
     if (g_hiragana_to_gyou.size())
         return;
+    // 活用規則の状態機械を作成する。
+    mz_make_katsuyou_automata();
     g_hiragana_to_gyou.clear();
     g_hiragana_to_dan.clear();
     const size_t count = _countof(s_hiragana_table);
@@ -266,7 +819,11 @@ void mz_make_literal_maps()
 LPCTSTR mz_hinshi_to_string(HinshiBunrui hinshi)
 {
     if (HB_MEISHI <= hinshi && hinshi <= HB_MAX)
-        return TheIME.LoadSTR(IDS_HINSHI_00 + (hinshi - HB_MEISHI));
+    {
+        static std::wstring s_str;
+        mz_load_string(IDS_HINSHI_00 + (hinshi - HB_MEISHI), s_str);
+        return s_str.c_str();
+    }
     return TEXT("");
 }
 
@@ -326,10 +883,104 @@ LPCWSTR mz_bunrui_to_string(HinshiBunrui bunrui)
     return s_array[index];
 } // mz_bunrui_to_string
 
+// タグの名前。
+static const struct MZ_TAG_NAME
+{
+    DWORD tag;
+    const WCHAR *name;
+} s_tag_names[] =
+{
+    { MZ_TAG_JINMEI, L"[人名]" },
+    { MZ_TAG_CHIMEI, L"[地名]" },
+    { MZ_TAG_EKIMEI, L"[駅名]" },
+    { MZ_TAG_HIHYOUJUN, L"[非標準]" },
+    { MZ_TAG_SUUTANI, L"[数単位]" },
+    { MZ_TAG_DOUSHOKUBUTSU, L"[動植物]" },
+    { MZ_TAG_SUUSHI, L"[数詞]" },
+    { MZ_TAG_YUUSEN_PP, L"[優先++]" },
+    { MZ_TAG_YUUSEN_P, L"[優先+]" },
+    { MZ_TAG_YUUSEN_M, L"[優先-]" },
+    { MZ_TAG_YUUSEN_MM, L"[優先--]" },
+    { MZ_TAG_KAIHISAKU, L"[回避策]" },
+    { MZ_TAG_MIZEN_RENKETSU, L"[未然形に連結]" },
+    { MZ_TAG_RENYOU_RENKETSU, L"[連用形に連結]" },
+    { MZ_TAG_SHUUSHI_RENKETSU, L"[終止形に連結]" },
+    { MZ_TAG_KANYOUKU, L"[慣用句]" },
+    { MZ_TAG_FUKINSHIN, L"[不謹慎]" },
+    { MZ_TAG_USER_DICT, L"[ユーザ辞書]" },
+    { MZ_TAG_SHUJU_NO_GO, L"[種々の語]" },
+    { MZ_TAG_SUUJI, L"[数字]" },
+};
+
+// タグ文字列をビットに変換する。知らないタグは無視する。
+DWORD mz_tags_from_string(const std::wstring& tags)
+{
+    DWORD ret = 0;
+    size_t i = 0;
+    while ((i = tags.find(L'[', i)) != tags.npos) {
+        size_t k = tags.find(L']', i);
+        if (k == tags.npos)
+            break;
+        ++k;
+        for (size_t n = 0; n < _countof(s_tag_names); ++n) {
+            const WCHAR *name = s_tag_names[n].name;
+            if (tags.compare(i, k - i, name) == 0) {
+                ret |= s_tag_names[n].tag;
+                break;
+            }
+        }
+        i = k;
+    }
+    return ret;
+}
+
+// タグのビットを文字列に変換する。
+std::wstring mz_tags_to_string(DWORD tags)
+{
+    std::wstring ret;
+    for (size_t n = 0; n < _countof(s_tag_names); ++n) {
+        if (tags & s_tag_names[n].tag)
+            ret += s_tag_names[n].name;
+    }
+    return ret;
+}
+
+#define MZ_STRING_POOL_BLOCK 4096 // 文字列プールのブロックの文字数。
+
+// 文字列をプールに追加する。NUL終端はしない。
+const WCHAR *MzStringPool::add(const WCHAR *str, size_t len)
+{
+    if (len > MZ_STRING_POOL_BLOCK / 4) {
+        // 長い文字列は専用のブロックに置く。最後のブロックは変えない。
+        WCHAR *block = new WCHAR[len];
+        memcpy(block, str, len * sizeof(WCHAR));
+        m_blocks.insert(m_blocks.begin(), block);
+        return block;
+    }
+    if (m_blocks.empty() || m_used + len > MZ_STRING_POOL_BLOCK) {
+        m_blocks.push_back(new WCHAR[MZ_STRING_POOL_BLOCK]);
+        m_used = 0;
+    }
+    WCHAR *ptr = m_blocks.back() + m_used;
+    memcpy(ptr, str, len * sizeof(WCHAR));
+    m_used += len;
+    return ptr;
+}
+
+// 文字列プールを空にする。
+void MzStringPool::clear()
+{
+    for (size_t i = 0; i < m_blocks.size(); ++i) {
+        delete[] m_blocks[i];
+    }
+    m_blocks.clear();
+    m_used = 0;
+}
+
 // 品詞の連結可能性を計算する関数。
 BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
 {
-    HinshiBunrui h0 = bunrui, h1 = other.bunrui;
+    HinshiBunrui h0 = (HinshiBunrui)bunrui, h1 = (HinshiBunrui)other.bunrui;
 
     if (h0 == HB_HEAD && (h1 == HB_SETSUBIJI || h1 == HB_SHUU_JOSHI))
         return FALSE;
@@ -357,8 +1008,8 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         switch (katsuyou) {
         case MIZEN_KEI:
             if (h1 == HB_JODOUSHI) {
-                if (other.HasTag(L"[未然形に連結]")) {
-                    if (other.pre[0] == L'な' || other.pre == L"う") {
+                if (other.HasTag(MZ_TAG_MIZEN_RENKETSU)) {
+                    if ((other.pre_len && other.pre[0] == L'な') || other.PreIs(L"う")) {
                         return TRUE;
                     }
                 }
@@ -367,7 +1018,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         case RENYOU_KEI:
             switch (h1) {
             case HB_JODOUSHI:
-                if (other.HasTag(L"[連用形に連結]")) {
+                if (other.HasTag(MZ_TAG_RENYOU_RENKETSU)) {
                     return TRUE;
                 }
                 return FALSE;
@@ -382,10 +1033,10 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
             break;
         case SHUUSHI_KEI:
             if (h1 == HB_JODOUSHI) {
-                if (other.HasTag(L"[終止形に連結]")) {
+                if (other.HasTag(MZ_TAG_SHUUSHI_RENKETSU)) {
                     return TRUE;
                 }
-                if (other.HasTag(L"[種々の語]")) {
+                if (other.HasTag(MZ_TAG_SHUJU_NO_GO)) {
                     return TRUE;
                 }
             }
@@ -403,7 +1054,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         case KATEI_KEI:
             switch (h1) {
             case HB_SETSUZOKU_JOSHI:
-                if (other.pre == L"ば" || other.pre == L"ども" || other.pre == L"ど") {
+                if (other.PreIs(L"ば") || other.PreIs(L"ども") || other.PreIs(L"ど")) {
                     return TRUE;
                 }
             default:
@@ -478,7 +1129,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         switch (katsuyou) {
         case MIZEN_KEI:
             if (h1 == HB_JODOUSHI) {
-                if (other.HasTag(L"[未然形に連結]")) {
+                if (other.HasTag(MZ_TAG_MIZEN_RENKETSU)) {
                     return TRUE;
                 }
             }
@@ -486,7 +1137,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         case RENYOU_KEI:
             switch (h1) {
             case HB_JODOUSHI:
-                if (other.HasTag(L"[連用形に連結]")) {
+                if (other.HasTag(MZ_TAG_RENYOU_RENKETSU)) {
                     return TRUE;
                 }
                 return FALSE;
@@ -501,10 +1152,10 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
             break;
         case SHUUSHI_KEI:
             if (h1 == HB_JODOUSHI) {
-                if (other.HasTag(L"[終止形に連結]")) {
+                if (other.HasTag(MZ_TAG_SHUUSHI_RENKETSU)) {
                     return TRUE;
                 }
-                if (other.HasTag(L"[種々の語]")) {
+                if (other.HasTag(MZ_TAG_SHUJU_NO_GO)) {
                     return TRUE;
                 }
             }
@@ -522,7 +1173,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         case KATEI_KEI:
             switch (h1) {
             case HB_SETSUZOKU_JOSHI:
-                if (other.pre == L"ば" || other.pre == L"ども" || other.pre == L"ど") {
+                if (other.PreIs(L"ば") || other.PreIs(L"ども") || other.PreIs(L"ど")) {
                     return TRUE;
                 }
                 break;
@@ -550,7 +1201,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         switch (katsuyou) {
         case MIZEN_KEI:
             if (h1 == HB_JODOUSHI) {
-                if (other.HasTag(L"[未然形に連結]")) {
+                if (other.HasTag(MZ_TAG_MIZEN_RENKETSU)) {
                     return TRUE;
                 }
             }
@@ -558,7 +1209,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         case RENYOU_KEI:
             switch (h1) {
             case HB_JODOUSHI:
-                if (other.HasTag(L"[連用形に連結]")) {
+                if (other.HasTag(MZ_TAG_RENYOU_RENKETSU)) {
                     return TRUE;
                 }
                 return FALSE;
@@ -573,10 +1224,10 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
             break;
         case SHUUSHI_KEI:
             if (h1 == HB_JODOUSHI) {
-                if (other.HasTag(L"[終止形に連結]")) {
+                if (other.HasTag(MZ_TAG_SHUUSHI_RENKETSU)) {
                     return TRUE;
                 }
-                if (other.HasTag(L"[種々の語]")) {
+                if (other.HasTag(MZ_TAG_SHUJU_NO_GO)) {
                     return TRUE;
                 }
             }
@@ -595,7 +1246,7 @@ BOOL LatticeNode::CanConnectTo(const LatticeNode& other) const
         case KATEI_KEI:
             switch (h1) {
             case HB_SETSUZOKU_JOSHI:
-                if (other.pre == L"ば" || other.pre == L"ども" || other.pre == L"ど") {
+                if (other.PreIs(L"ば") || other.PreIs(L"ども") || other.PreIs(L"ど")) {
                     return TRUE;
                 }
             default:
@@ -645,7 +1296,7 @@ INT LatticeNode::WordCost() const
     INT cost = 1000;
 
     // 品詞による基本コスト（使用頻度を考慮）
-    HinshiBunrui h = bunrui;
+    HinshiBunrui h = (HinshiBunrui)bunrui;
     switch (h) {
         case HB_HEAD:
         case HB_TAIL:
@@ -736,26 +1387,26 @@ INT LatticeNode::WordCost() const
     }
 
     // タグによる調整（優先度を反映）
-    if (HasTag(L"[優先++]")) cost -= 300;  // 最優先
-    if (HasTag(L"[優先+]")) cost -= 150;   // 優先
-    if (HasTag(L"[優先-]")) cost += 150;   // 劣後
-    if (HasTag(L"[優先--]")) cost += 300;  // 最劣後
+    if (HasTag(MZ_TAG_YUUSEN_PP)) cost -= 300;  // 最優先
+    if (HasTag(MZ_TAG_YUUSEN_P)) cost -= 150;   // 優先
+    if (HasTag(MZ_TAG_YUUSEN_M)) cost += 150;   // 劣後
+    if (HasTag(MZ_TAG_YUUSEN_MM)) cost += 300;  // 最劣後
 
-    if (HasTag(L"[ユーザ辞書]")) cost -= 200;  // ユーザ辞書を優先
+    if (HasTag(MZ_TAG_USER_DICT)) cost -= 200;  // ユーザ辞書を優先
 
-    if (HasTag(L"[人名]")) cost += 100;  // 固有名詞はやや重い
-    if (HasTag(L"[地名]")) cost += 100;
-    if (HasTag(L"[駅名]")) cost += 100;
+    if (HasTag(MZ_TAG_JINMEI)) cost += 100;  // 固有名詞はやや重い
+    if (HasTag(MZ_TAG_CHIMEI)) cost += 100;
+    if (HasTag(MZ_TAG_EKIMEI)) cost += 100;
 
-    if (HasTag(L"[非標準]")) cost += 500;  // 非標準語は重い
-    if (HasTag(L"[不謹慎]")) cost += 400;  // 不謹慎な単語は重い
-    if (HasTag(L"[数単位]")) cost -= 20;   // 数値単位は優先
-    if (HasTag(L"[動植物]")) cost += 80;  // 動植物は重い
+    if (HasTag(MZ_TAG_HIHYOUJUN)) cost += 500;  // 非標準語は重い
+    if (HasTag(MZ_TAG_FUKINSHIN)) cost += 400;  // 不謹慎な単語は重い
+    if (HasTag(MZ_TAG_SUUTANI)) cost -= 20;   // 数値単位は優先
+    if (HasTag(MZ_TAG_DOUSHOKUBUTSU)) cost += 80;  // 動植物は重い
 
     // 長さによる調整（長い単語を優先）
-    if (pre.size() >= 4) cost -= 50;
-    if (pre.size() >= 6) cost -= 100;
-    if (pre.size() >= 8) cost -= 150;
+    if (pre_len >= 4) cost -= 50;
+    if (pre_len >= 6) cost -= 100;
+    if (pre_len >= 8) cost -= 150;
 
     // deltaCostを加算（ユーザーによる動的な調整）
     cost += deltaCost;
@@ -769,7 +1420,7 @@ INT LatticeNode::WordCost() const
 // 連結コストの計算（テーブルベース）。
 INT LatticeNode::ConnectCost(const LatticeNode& other) const
 {
-    HinshiBunrui h0 = bunrui, h1 = other.bunrui;
+    HinshiBunrui h0 = (HinshiBunrui)bunrui, h1 = (HinshiBunrui)other.bunrui;
 
     // 特殊なケース（HEAD, TAIL, 未知の品詞）
     if (h0 == HB_HEAD || h1 == HB_TAIL)
@@ -799,20 +1450,24 @@ INT LatticeNode::ConnectCost(const LatticeNode& other) const
     }
 
     // 名詞→サ変動詞の特別な処理（「回転する」「到達する」など）
-    if (h0 == HB_MEISHI && h1 == HB_SAHEN_DOUSHI && other.pre.size() <= 2) {
+    if (h0 == HB_MEISHI && h1 == HB_SAHEN_DOUSHI && other.pre_len <= 2) {
         cost -= 50;  // 漢語名詞→「する」は自然
     }
 
     // 特定の語形による調整
     // 「し」+「ます」のような自然な接続
-    if (post == L"し" && other.post == L"ます") {
+    if (PostIs(L"し") && other.PostIs(L"ます")) {
         cost -= 100;
     }
     // 「でき」「出来」+「ます」
-    if ((post == L"でき" || post == L"出来") && other.post == L"ます") {
+    if ((PostIs(L"でき") || PostIs(L"出来")) && other.PostIs(L"ます")) {
         cost -= 100;
     }
 
+    // ユーザーが確定した連結を優先
+    if (learning && other.learning)
+        cost += learning->PairCost(*this, other);
+
     return cost;
 } // LatticeNode::ConnectCost
 
@@ -827,25 +1482,21 @@ BOOL Lattice::OptimizeMarking(LatticeNode *ptr0)
     BOOL reach = (ptr0->bunrui == HB_TAIL);
     INT min_cost = MAXLONG;
     LatticeNode *min_node = NULL;
-    branches_t::iterator it, end = ptr0->branches.end();
-    for (it = ptr0->branches.begin(); it != end; ++it) {
-        LatticeNodePtr ptr1 = *it;
-        if (OptimizeMarking(ptr1.get())) {
+    for (size_t i = 0; i < ptr0->branch_count; ++i) {
+        LatticeNodePtr ptr1 = Branch(ptr0, i);
+        if (OptimizeMarking(ptr1)) {
             reach = TRUE;
             if (ptr1->subtotal_cost < min_cost) {
                 min_cost = ptr1->subtotal_cost;
-                min_node = ptr1.get();
+                min_node = ptr1;
             }
         }
     }
 
-    {
-        branches_t::iterator it, end = ptr0->branches.end();
-        for (it = ptr0->branches.begin(); it != end; ++it) {
-            LatticeNodePtr& ptr1 = *it;
-            if (ptr1.get() != min_node) {
-                ptr1->marked = 0;
-            }
+    for (size_t i = 0; i < ptr0->branch_count; ++i) {
+        LatticeNodePtr ptr1 = Branch(ptr0, i);
+        if (ptr1 != min_node) {
+            ptr1->marked = 0;
         }
     }
 
@@ -858,7 +1509,7 @@ BOOL Lattice::OptimizeMarking(LatticeNode *ptr0)
 } // Lattice::OptimizeMarking
 
 // 基本辞書データをスキャンする。
-static size_t ScanBasicDict(WStrings& records, const WCHAR *dict_data, WCHAR ch)
+size_t ScanBasicDict(WStrings& records, const WCHAR *dict_data, WCHAR ch)
 {
     DPRINTW(L"%c\n", ch);
 
@@ -890,7 +1541,7 @@ static size_t ScanBasicDict(WStrings& records, const WCHAR *dict_data, WCHAR ch)
 
     // 最初に発見したレコード区切りから最後のレコード区切りまでの文字列を取得する。
     std::wstring str;
-    str.assign(pch1 + 1, pch3);
+    mz_assign_utf16(str, pch1 + 1, pch3);
 
     // レコード区切りで分割してレコードを取得する。
     sz[0] = RECORD_SEP;
@@ -900,217 +1551,147 @@ static size_t ScanBasicDict(WStrings& records, const WCHAR *dict_data, WCHAR ch)
     return records.size();
 } // ScanBasicDict
 
-static WStrings s_UserDictRecords;
+// 読みの索引の位置を探す。なければ0を返す。
+size_t FindKeyIndex(const WCHAR *dict_data, size_t cch)
+{
+    size_t ichIndex = DictFindIndex(dict_data, cch, DICT_KEY_SIG1);
+    if (!ichIndex || (WORD)dict_data[ichIndex + 2] != DICT_KEY_VERSION ||
+        ichIndex + DICT_KEY_HEADER + DICT_KEY_BUCKETS * 2 > cch)
+    {
+        return 0;
+    }
+    return ichIndex;
+}
+
+// 辞書データの位置ichのレコードを、レコード区切りの前まで得る。
+// bPackedなら読みは鍵の符号なので（読みの索引の版2）、文字列に戻す。
+BOOL GetDictRecord(std::wstring& record, const WCHAR *dict_data, size_t cch, size_t ich,
+                   BOOL bPacked)
+{
+    record.clear();
+    if (ich >= cch)
+        return FALSE;
+    const WCHAR *pch1 = dict_data + ich, *pch2 = pch1;
+    while (*pch2 && *pch2 != RECORD_SEP)
+        ++pch2;
+    if (!bPacked) {
+        mz_assign_utf16(record, pch1, pch2);
+        return TRUE;
+    }
+
+    const WCHAR *pchSep = pch1;
+    while (pchSep < pch2 && *pchSep != FIELD_SEP)
+        ++pchSep;
+    std::wstring units;
+    if (!DictKeyDecode(units, pch1, pchSep - pch1))
+        return FALSE;
+    units.append(pchSep, pch2);
+    mz_assign_utf16(record, units.c_str(), units.c_str() + units.size());
+    return TRUE;
+}
+
+// 二つの単位から32ビットの値を読む。
+static inline DWORD mz_key_dword(const WCHAR *pch)
+{
+    return (WORD)pch[0] | ((DWORD)(WORD)pch[1] << 16);
+}
+
+// 位置ichのレコードの符号にした読みの先頭cbバイトと、key[ib...ib+cb)を比べる。
+// 読みがcbバイトより短くて一致する部分の後で終わるなら、小さいとする。
+static int mz_key_compare(const WCHAR *dict_data, size_t ich, const std::string& key,
+                          size_t ib, size_t cb)
+{
+    const WCHAR *pch = dict_data + ich;
+    for (size_t i = 0; i < cb; ++i) {
+        if ((WORD)pch[i >> 1] == FIELD_SEP)
+            return -1;
+        BYTE b = DictKeyByte(pch, i);
+        if (b == 0)
+            return -1;
+        if (b != (BYTE)key[ib + i])
+            return (b < (BYTE)key[ib + i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+// 位置ichのレコードの符号にした読みのバイト数。
+static size_t mz_key_length(const WCHAR *dict_data, size_t ich)
+{
+    const WCHAR *pch = dict_data + ich, *pchSep = pch;
+    while (*pchSep && *pchSep != FIELD_SEP)
+        ++pchSep;
+    return DictKeyLength(pch, pchSep - pch);
+}
+
+// 位置ichのレコードの次のレコードの位置。
+static size_t mz_key_next(const WCHAR *dict_data, size_t ich)
+{
+    while (dict_data[ich] && dict_data[ich] != RECORD_SEP)
+        ++ich;
+    return ich + 1;
+}
 
-static INT CALLBACK UserDictProc(LPCTSTR lpRead, DWORD dwStyle, LPCTSTR lpStr, LPVOID lpData)
+// 読みの索引をスキャンして、読みが鍵key[ib...]の先頭の部分と一致する単語の
+// レコードを、レコードの順に得る。ichIndexはFindKeyIndexで得た索引の位置。
+size_t ScanKeyIndex(WStrings& records, const WCHAR *dict_data, size_t ichIndex,
+                    const std::string& key, size_t ib)
 {
-    ASSERT(lpStr && lpStr[0]);
-    ASSERT(lpRead && lpRead[0]);
-    Lattice *pThis = (Lattice *)lpData;
-    ASSERT(pThis != NULL);
-
-    // データの初期化。
-    std::wstring pre = lpRead;
-    std::wstring post = lpStr;
-    Gyou gyou = GYOU_A;
-    HinshiBunrui bunrui = StyleToHinshi(dwStyle);
-
-    if (pre.size() <= 1)
+    records.clear();
+    if (ib >= key.size())
         return 0;
 
-    // データを辞書形式に変換する。
-    WCHAR ch;
-    size_t i;
-    switch (bunrui) {
-    case HB_NAKEIYOUSHI: // な形容詞
-        // 終端の「な」を削る。
-        i = pre.size() - 1;
-        if (pre[i] == L'な')
-            pre.resize(i);
-        i = post.size() - 1;
-        if (post[i] == L'な')
-            post.resize(i);
-        break;
-    case HB_IKEIYOUSHI: // い形容詞
-        // 終端の「い」を削る。
-        i = pre.size() - 1;
-        if (pre[i] == L'い')
-            pre.resize(i);
-        i = post.size() - 1;
-        if (post[i] == L'い')
-            post.resize(i);
-        break;
-    case HB_ICHIDAN_DOUSHI: // 一段動詞
-        // 終端の「る」を削る。
-        if (pre[pre.size() - 1] == L'る')
-            pre.resize(pre.size() - 1);
-        if (post[post.size() - 1] == L'る')
-            post.resize(post.size() - 1);
-        break;
-    case HB_KAHEN_DOUSHI: // カ変動詞
-        // 読みが３文字以上で「来る」「くる」で終わるとき、「来る」を削る。
-        if (pre.size() >= 3) {
-            if (pre.substr(pre.size() - 2, 2) == L"くる" &&
-                post.substr(post.size() - 2, 2) == L"来る")
-            {
-                pre = pre.substr(0, pre.size() - 2);
-                post = post.substr(0, post.size() - 2);
-            }
+    // レコード群は読みの鍵の順なので、最初のバイトのバケットから始めて、
+    // 一致するバイトを一つずつ伸ばしながら二分探索する。長さがdepthの鍵は、
+    // 先頭のdepthバイトが同じ鍵のうち最初にある。
+    const WCHAR *buckets = dict_data + ichIndex + DICT_KEY_HEADER;
+    BYTE b = (BYTE)key[ib];
+    size_t lo = mz_key_dword(buckets + b * 2), hi = mz_key_dword(buckets + (b + 1) * 2);
+    if (hi > ichIndex)
+        return 0;
+    std::vector<size_t> offsets;
+    for (size_t depth = 1; ib + depth <= key.size() && lo < hi; ++depth) {
+        // 先頭のdepthバイトがkeyより小さくない最初のレコード。
+        // 二分探索の中ほどの位置は、そのレコードの先頭まで戻す。
+        size_t lo2 = lo, hi2 = hi;
+        while (lo2 < hi2) {
+            size_t mid = lo2 + (hi2 - lo2) / 2;
+            while (mid > lo2 && dict_data[mid - 1] != RECORD_SEP)
+                --mid;
+            if (mz_key_compare(dict_data, mid, key, ib, depth) < 0)
+                lo2 = mz_key_next(dict_data, mid);
+            else
+                hi2 = mid;
         }
-        break;
-    case HB_SAHEN_DOUSHI: // サ変動詞
-        gyou = GYOU_SA;
-        if (pre.size() >= 2 && post.size() >= 2) { // 三文字以上のとき。
-            // 「する」「ずる」ならば「する」「ずる」を削る。
-            if (pre.substr(pre.size() - 2) == L"する" &&
-                post.substr(post.size() - 2) == L"する")
-            {
-                gyou = GYOU_ZA;
-                pre.resize(pre.size() - 2);
-                post.resize(post.size() - 2);
-            }
-            else if (pre.substr(pre.size() - 2) == L"ずる" &&
-                     post.substr(post.size() - 2) == L"ずる")
+        lo = lo2;
+
+        // 読みがちょうどdepthバイトのレコード。
+        for (; lo < hi; lo = mz_key_next(dict_data, lo)) {
+            if (mz_key_compare(dict_data, lo, key, ib, depth) != 0 ||
+                mz_key_length(dict_data, lo) != depth)
             {
-                gyou = GYOU_SA;
-                pre.resize(pre.size() - 2);
-                post.resize(post.size() - 2);
+                break;
             }
+            offsets.push_back(lo);
         }
-        break;
-    case HB_GODAN_DOUSHI: // 五段動詞
-        // 写像を準備する。
-        mz_make_literal_maps();
-        // 終端がウ段の文字でなければ失敗。
-        if (pre.empty())
-            return TRUE;
-        ch = pre[pre.size() - 1];
-        if (g_hiragana_to_dan[ch] != DAN_U)
-            return TRUE;
-        if (ch != post[post.size() - 1])
-            return TRUE;
-        // 終端の文字を削る。
-        pre.resize(pre.size() - 1);
-        post.resize(post.size() - 1);
-        // 終端の文字だったものの行を取得する。
-        gyou = g_hiragana_to_gyou[ch];
-        break;
-    default:
-        break;
+        if (lo >= hi || mz_key_compare(dict_data, lo, key, ib, depth) != 0)
+            break;
     }
 
-    WStrings fields(NUM_FIELDS);
-    fields[I_FIELD_PRE] = pre;
-    fields[I_FIELD_HINSHI].resize(1);
-    fields[I_FIELD_HINSHI][0] = MAKEWORD(bunrui, gyou);
-    fields[I_FIELD_POST] = post;
-    fields[I_FIELD_TAGS] = L"[ユーザ辞書]";
-
-    std::wstring record;
-    std::wstring sep;
-    sep.resize(1);
-    sep[0] = FIELD_SEP;
-    if (bunrui == HB_SAHEN_DOUSHI) {
-        if (gyou == GYOU_ZA) {
-            fields[I_FIELD_PRE] = pre + L"ざ";
-            fields[I_FIELD_POST] = post + L"ざ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"じ";
-            fields[I_FIELD_POST] = post + L"じ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"ぜ";
-            fields[I_FIELD_POST] = post + L"ぜ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"ずる";
-            fields[I_FIELD_POST] = post + L"ずる";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"ずれ";
-            fields[I_FIELD_POST] = post + L"ずれ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"じろ";
-            fields[I_FIELD_POST] = post + L"じろ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"ぜよ";
-            fields[I_FIELD_POST] = post + L"ぜよ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"じよう";
-            fields[I_FIELD_POST] = post + L"じよう";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-        } else {
-            fields[I_FIELD_PRE] = pre + L"さ";
-            fields[I_FIELD_POST] = post + L"さ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"し";
-            fields[I_FIELD_POST] = post + L"し";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"せ";
-            fields[I_FIELD_POST] = post + L"せ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"する";
-            fields[I_FIELD_POST] = post + L"する";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"すれ";
-            fields[I_FIELD_POST] = post + L"すれ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"しろ";
-            fields[I_FIELD_POST] = post + L"しろ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"せよ";
-            fields[I_FIELD_POST] = post + L"せよ";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-
-            fields[I_FIELD_PRE] = pre + L"しよう";
-            fields[I_FIELD_POST] = post + L"しよう";
-            record = str_join(fields, sep);
-            s_UserDictRecords.push_back(record);
-        }
-    } else {
-        record = str_join(fields, sep);
-        s_UserDictRecords.push_back(record);
+    // 同じ読みの単語はレコードの順。短い読みが先なので、全体もレコードの順になる。
+    std::wstring str;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (GetDictRecord(str, dict_data, ichIndex, offsets[i], TRUE))
+            records.push_back(str);
     }
-
-    return TRUE;
-}
+    return records.size();
+} // ScanKeyIndex
 
 // ユーザー辞書データをスキャンする。
 static size_t ScanUserDict(WStrings& records, WCHAR ch, Lattice *pThis)
 {
-    DPRINTW(L"%c\n", ch);
-    s_UserDictRecords.clear();
-    ImeEnumRegisterWord(UserDictProc, NULL, 0, NULL, pThis);
-
-    records.insert(records.end(), s_UserDictRecords.begin(), s_UserDictRecords.end());
-    s_UserDictRecords.clear();
-
-    return records.size();
+    if (!g_pfnScanUserDict)
+        return records.size();
+    return g_pfnScanUserDict(records, ch, pThis);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1121,6 +1702,7 @@ Dict::Dict()
 {
     m_hMutex = NULL;
     m_hFileMapping = NULL;
+    m_cbData = 0;
 }
 
 // 辞書データのデストラクタ。
@@ -1132,13 +1714,7 @@ Dict::~Dict()
 // 辞書データファイルのサイズを取得する。
 DWORD Dict::GetSize() const
 {
-    WIN32_FIND_DATAW find;
-    HANDLE hFind = ::FindFirstFileW(m_strFileName.c_str(), &find);
-    if (hFind != INVALID_HANDLE_VALUE) {
-        ::FindClose(hFind);
-        return find.nFileSizeLow;
-    }
-    return 0;
+    return mz_get_file_size(m_strFileName.c_str());
 }
 
 // 辞書を読み込む。
@@ -1153,56 +1729,45 @@ BOOL Dict::Load(const WCHAR *file_name, const WCHAR *object_name)
     if (file_name == NULL)
         return FALSE;
 
-    SECURITY_ATTRIBUTES *psa = CreateSecurityAttributes(); // セキュリティ属性を作成。
-    ASSERT(psa);
-
     // ミューテックス (排他制御を行うオブジェクト) を作成。
     if (m_hMutex == NULL) {
-        m_hMutex = ::CreateMutexW(psa, FALSE, m_strObjectName.c_str());
+        m_hMutex = mz_mutex_open(m_strObjectName.c_str());
     }
     if (m_hMutex == NULL) {
-        // free sa
-        FreeSecurityAttributes(psa);
         return FALSE;
     }
 
-    // ファイルサイズを取得。
+    // ファイルサイズを取得。ファイルはUTF-16だが、WCHARの大きさはOSによる。
     DWORD cbSize = GetSize();
     if (cbSize == 0)
         return FALSE;
+    m_cbData = (cbSize / 2) * sizeof(WCHAR);
 
     BOOL ret = FALSE;
-    DWORD wait = ::WaitForSingleObject(m_hMutex, c_dwMilliseconds); // 排他制御を待つ。
-    if (wait == WAIT_OBJECT_0) {
+    if (mz_mutex_lock(m_hMutex, c_dwMilliseconds)) { // 排他制御を待つ。
         // ファイルマッピングを作成する。
-        m_hFileMapping = ::CreateFileMappingW(
-                INVALID_HANDLE_VALUE, psa, PAGE_READWRITE,
-                0, cbSize, (m_strObjectName + L"FileMapping").c_str());
+        BOOL bCreated = FALSE;
+        m_hFileMapping = mz_shmem_open((m_strObjectName + L"FileMapping").c_str(),
+                                       m_cbData, &bCreated);
         if (m_hFileMapping) {
             // ファイルマッピングが作成された。
-            if (::GetLastError() == ERROR_ALREADY_EXISTS) {
+            if (!bCreated) {
                 // ファイルマッピングがすでに存在する。
                 ret = TRUE;
             } else {
                 // 新しく作成された。ファイルを読み込む。
-                FILE *fp = _wfopen(m_strFileName.c_str(), L"rb");
-                if (fp) {
-                    WCHAR *pch = Lock();
-                    if (pch) {
-                        ret = (BOOL)fread(pch, cbSize, 1, fp);
-                        Unlock(pch);
-                    }
-                    fclose(fp);
+                WCHAR *pch = Lock();
+                if (pch) {
+                    size_t cch = m_cbData / sizeof(WCHAR);
+                    ret = (mz_read_utf16_file(m_strFileName.c_str(), pch, cch) == cch);
+                    Unlock(pch);
                 }
             }
         }
         // 排他制御を解放。
-        ::ReleaseMutex(m_hMutex);
+        mz_mutex_unlock(m_hMutex);
     }
 
-    // free sa
-    FreeSecurityAttributes(psa);
-
     return ret;
 } // Dict::Load
 
@@ -1211,19 +1776,18 @@ void Dict::Unload()
 {
     if (m_hMutex) {
         if (m_hFileMapping) {
-            DWORD wait = ::WaitForSingleObject(m_hMutex, c_dwMilliseconds); // 排他制御を待つ。
-            if (wait == WAIT_OBJECT_0) {
+            if (mz_mutex_lock(m_hMutex, c_dwMilliseconds)) { // 排他制御を待つ。
                 // ファイルマッピングを閉じる。
                 if (m_hFileMapping) {
-                    ::CloseHandle(m_hFileMapping);
+                    mz_shmem_close(m_hFileMapping);
                     m_hFileMapping = NULL;
                 }
                 // 排他制御を解放。
-                ::ReleaseMutex(m_hMutex);
+                mz_mutex_unlock(m_hMutex);
             }
         }
         // ミューテックスを閉じる。
-        ::CloseHandle(m_hMutex);
+        mz_mutex_close(m_hMutex);
         m_hMutex = NULL;
     }
 }
@@ -1233,15 +1797,14 @@ WCHAR *Dict::Lock()
 {
     if (m_hFileMapping == NULL)
         return NULL;
-    DWORD cbSize = GetSize();
-    void *pv = ::MapViewOfFile(m_hFileMapping, FILE_MAP_ALL_ACCESS, 0, 0, cbSize);
+    void *pv = mz_shmem_map(m_hFileMapping, m_cbData);
     return reinterpret_cast<WCHAR *>(pv);
 }
 
 // 辞書のロックを解除して、情報の取得を終了。
 void Dict::Unlock(WCHAR *data)
 {
-    ::UnmapViewOfFile(data);
+    mz_shmem_unmap(data, m_cbData);
 }
 
 // 辞書は読み込まれたか？
@@ -1259,28 +1822,28 @@ void MzConvClause::add(const LatticeNode *node)
     candidates_t::iterator it, end = candidates.end();
     for (it = candidates.begin(); it != end; ++it) {
         MzConvCandidate& cand = *it;
-        if (cand.post == node->post) {
+        if (cand.post.compare(0, cand.post.size(), node->post, node->post_len) == 0) {
             if (node->subtotal_cost < cand.cost) {
                 cand.cost = node->subtotal_cost;
-                cand.bunrui = node->bunrui;
-                cand.katsuyou = node->katsuyou;
+                cand.bunrui = (HinshiBunrui)node->bunrui;
+                cand.katsuyou = (KatsuyouKei)node->katsuyou;
             }
             if (node->WordCost() < cand.word_cost) {
                 cand.word_cost = node->WordCost();
             }
-            cand.bunruis.insert(node->bunrui);
-            cand.tags += node->tags;
+            cand.bunruis.insert((HinshiBunrui)node->bunrui);
+            cand.tags |= node->tags;
             return;
         }
     }
     MzConvCandidate cand;
-    cand.pre = node->pre;
-    cand.post = mz_translate_string_2(node->post);
+    cand.pre = node->GetPre();
+    cand.post = mz_translate_string_2(node->GetPost());
     cand.cost = node->subtotal_cost;
     cand.word_cost = node->WordCost();
-    cand.bunruis.insert(node->bunrui);
-    cand.bunrui = node->bunrui;
-    cand.katsuyou = node->katsuyou;
+    cand.bunruis.insert((HinshiBunrui)node->bunrui);
+    cand.bunrui = (HinshiBunrui)node->bunrui;
+    cand.katsuyou = (KatsuyouKei)node->katsuyou;
     cand.tags = node->tags;
     candidates.push_back(cand);
 }
@@ -1303,9 +1866,58 @@ compare_candidate_by_post(const MzConvCandidate& cand1, const MzConvCandidate& c
     return cand1.post == cand2.post;
 }
 
+// 数字の並びのほかの表記を一つ足す。同じ表記の候補があれば、安い方のコストにする。
+static void
+add_numeric_variant(candidates_t& candidates, const MzConvCandidate& cand,
+                    const std::wstring& post, INT delta)
+{
+    candidates_t::iterator it, end = candidates.end();
+    for (it = candidates.begin(); it != end; ++it) {
+        if (it->post == post) {
+            if (cand.cost + delta < it->cost)
+                it->cost = cand.cost + delta;
+            if (cand.word_cost + delta < it->word_cost)
+                it->word_cost = cand.word_cost + delta;
+            return;
+        }
+    }
+    MzConvCandidate variant = cand;
+    variant.post = post;
+    variant.cost += delta;
+    variant.word_cost += delta;
+    variant.tags &= ~MZ_TAG_SUUJI;
+    candidates.push_back(variant);
+}
+
+// 数字の並び（[数字]）の候補に、全角、漢数字、大字、丸数字の表記を足す。
+// ラティスには数字の並びのノードを一つだけ置き、ほかの表記は結果を作るときに作る。
+void MzConvClause::expand_numeric()
+{
+    const size_t count = candidates.size();
+    for (size_t i = 0; i < count; ++i) {
+        if (!(candidates[i].tags & MZ_TAG_SUUJI))
+            continue;
+        MzConvCandidate cand = candidates[i];
+        std::wstring halfwidth = mz_fullwidth_ascii_to_halfwidth(cand.post);
+        if (halfwidth.empty() || !mz_are_all_chars_numeric(halfwidth))
+            continue;
+
+        if (!Config_GetDWORD(L"bNoFullwidthAscii", FALSE)) // 全角ASCIIを使う？
+            add_numeric_variant(candidates, cand, mz_halfwidth_ascii_to_fullwidth(halfwidth), +10);
+        add_numeric_variant(candidates, cand, mz_convert_to_kansuuji(halfwidth), +50);
+        add_numeric_variant(candidates, cand, mz_convert_to_kansuuji_brief(halfwidth), +50);
+        add_numeric_variant(candidates, cand, mz_convert_to_kansuuji_formal(halfwidth), +60);
+        add_numeric_variant(candidates, cand, mz_convert_to_kansuuji_brief_formal(halfwidth), +60);
+        add_numeric_variant(candidates, cand, mz_convert_to_maru_suuji(halfwidth), +70);
+    }
+}
+
 // コストで候補をソートする。
 void MzConvClause::sort()
 {
+    // 数字の並びなら、ほかの表記を足す。
+    expand_numeric();
+
     // 全角カタカナを優先するか？
     if (Config_GetDWORD(TEXT("bFullwidthKatakanaYuusen"), FALSE))
     {
@@ -1672,9 +2284,10 @@ void Lattice::SetUser() {
     }
 }
 
-void Lattice::SetParens() {
+// タブで区切った語を候補にする。
+void Lattice::SetWords(const std::wstring& words) {
     WStrings items;
-    str_split(items, TheIME.LoadSTR(IDS_PAREN), std::wstring(L"\t"));
+    str_split(items, words, std::wstring(L"\t"));
 
     WStrings fields(NUM_FIELDS);
     fields[I_FIELD_PRE] = m_pre;
@@ -1687,179 +2300,93 @@ void Lattice::SetParens() {
     }
 }
 
-void Lattice::SetSymbols() {
-    static const WCHAR *s_words[] = {
-        L"きごう",      // IDS_SYMBOLS
-        L"けいせん",    // IDS_KEISEN
-        L"けいさん",    // IDS_MATH
-        L"さんかく",    // IDS_SANKAKU
-        L"しかく",      // IDS_SHIKAKU
-        L"ずけい",      // IDS_ZUKEI
-        L"まる",        // IDS_MARU
-        L"ほし",        // IDS_STARS
-        L"ひし",        // IDS_HISHI
-        L"てん",        // IDS_POINTS
-        L"たんい",      // IDS_UNITS
-        L"ふとうごう",  // IDS_FUTOUGOU
-        L"たて",        // IDS_TATE
-        L"たてひだり",  // IDS_TATE_HIDARI
-        L"たてみぎ",    // IDS_TATE_MIGI
-        L"ひだりうえ",  // IDS_HIDARI_UE
-        L"ひだりした",  // IDS_HIDARI_SHITA
-        L"ふとわく",    // IDS_FUTO_WAKU
-        L"ほそわく",    // IDS_HOSO_WAKU
-        L"まんなか",    // IDS_MANNAKA
-        L"みぎうえ",    // IDS_MIGI_UE
-        L"みぎした",    // IDS_MIGI_SHITA
-        L"よこ",        // IDS_YOKO
-        L"よこうえ",    // IDS_YOKO_UE
-        L"よこした",    // IDS_YOKO_SHITA
-        L"おなじ",      // IDS_SAME
-        L"やじるし",    // IDS_ARROWS
-        L"ぎりしゃ",    // IDS_GREEK
-        L"うえ",        // IDS_UP
-        L"した",        // IDS_DOWN
-        L"ひだり",      // IDS_LEFT
-        L"みぎ",        // IDS_RIGHT
-        L"や",          // IDS_ARROWS2
-    };
-    for (size_t i = 0; i < _countof(s_words); ++i) {
-        if (m_pre == s_words[i]) {
-            WStrings items;
-            WCHAR *pch = TheIME.LoadSTR(IDS_SYMBOLS + INT(i));
-            WStrings fields(NUM_FIELDS);
-            fields[I_FIELD_PRE] = m_pre;
-            fields[I_FIELD_HINSHI].resize(1);
-            fields[I_FIELD_HINSHI][0] = MAKEWORD(HB_SYMBOL, 0);
-            int cost = 300;
-            while (*pch) {
-                fields[I_FIELD_POST].assign(1, *pch++);
-                DoFields(0, fields, cost);
-                ++cost;
-            }
-            return;
-        }
+// 一文字ずつ記号の候補にする。
+void Lattice::SetSymbols(const std::wstring& symbols) {
+    WStrings fields(NUM_FIELDS);
+    fields[I_FIELD_PRE] = m_pre;
+    fields[I_FIELD_HINSHI].resize(1);
+    fields[I_FIELD_HINSHI][0] = MAKEWORD(HB_SYMBOL, 0);
+    int cost = 300;
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        fields[I_FIELD_POST].assign(1, symbols[i]);
+        DoFields(0, fields, cost);
+        ++cost;
     }
 }
 
-// 追加情報。
+// 追加情報。読みをg_special_convsで引き、種類ごとの生成器を呼ぶ。
 void Lattice::AddExtraNodes()
 {
     FOOTMARK();
 
-    // 現在の日時を取得する。
-    SYSTEMTIME st;
-    ::GetLocalTime(&st);
-
-    // 今日
-    if (m_pre == L"きょう") {
-        SetDay(L"今日", st, 0);
+    MzSpecialConv entry;
+    if (!g_special_convs.Find(m_pre, entry))
         return;
-    }
 
     static const LONGLONG ONE_DAY_FT = 24LL * 60 * 60 * 10000000; // 864000000000
     static const LONGLONG ONE_MONTH_FT = ONE_DAY_FT * 30;
 
-    // 昨日
-    if (m_pre == L"きのう" || m_pre == L"さくじつ") {
-        SetDay(L"昨日", st, -ONE_DAY_FT);
-        return;
-    }
+    // 現在の日時を取得する。
+    SYSTEMTIME st;
+    ::GetLocalTime(&st);
 
-    // 明日
-    if (m_pre == L"あす" || m_pre == L"あした") {
-        SetDay(L"明日", st, +ONE_DAY_FT);
-        return;
+    switch (entry.kind) {
+    case MZSC_DAY:
+        SetDay(entry.text.c_str(), st, entry.value * ONE_DAY_FT);
+        break;
+    case MZSC_MONTH:
+        SetMonth(entry.text.c_str(), st, entry.value * ONE_MONTH_FT);
+        break;
+    case MZSC_YEAR:
+        SetYear(entry.text.c_str(), WORD(st.wYear + entry.value));
+        break;
+    case MZSC_TIME:
+        SetTime(entry.text.c_str(), st);
+        break;
+    case MZSC_DATETIME:
+        SetDateTime(entry.text.c_str(), st);
+        break;
+    case MZSC_USER:
+        SetUser();
+        break;
+    case MZSC_WORDS:
+        SetWords(entry.text);
+        break;
+    case MZSC_SYMBOLS:
+        SetSymbols(entry.text);
+        break;
     }
+} // Lattice::AddExtraNodes
 
-    // 明後日
-    if (m_pre == L"あさって") {
-        SetDay(L"明後日", st, +2 * ONE_DAY_FT);
-        return;
-    }
-
-    // 一昨日
-    if (m_pre == L"おととい") {
-        SetDay(L"一昨日", st, -2 * ONE_DAY_FT);
-        return;
-    }
-
-    // 今年
-    if (m_pre == L"ことし") {
-        SetYear(L"今年", st.wYear);
-        return;
-    }
-
-    // 去年
-    if (m_pre == L"きょねん") {
-        SetYear(L"去年", st.wYear - 1);
-        return;
-    }
-    // 昨年
-    if (m_pre == L"さくねん") {
-        SetYear(L"昨年", st.wYear - 1);
-        return;
-    }
-    // 来年
-    if (m_pre == L"らいねん") {
-        SetYear(L"来年", st.wYear + 1);
-        return;
-    }
-    // 再来年
-    if (m_pre == L"さらいねん") {
-        SetYear(L"再来年", st.wYear + 2);
-        return;
-    }
-
-    // 今月
-    if (m_pre == L"こんげつ") {
-        SetMonth(L"今月", st, 0);
-        return;
-    }
-
-    // 先月
-    if (m_pre == L"せんげつ") {
-        SetMonth(L"先月", st, -ONE_MONTH_FT);
-        return;
-    }
-
-    // 来月
-    if (m_pre == L"らいげつ") {
-        SetMonth(L"来月", st, +ONE_MONTH_FT);
-        return;
-    }
-
-    // 現在の時刻
-    if (m_pre == L"じこく") {
-        SetTime(L"時刻", st);
-        return;
-    } else if (m_pre == L"ただいま") {
-        SetTime(L"ただ今", st);
-        return;
-    }
-
-    if (m_pre == L"にちじ") { // date and time
-        SetDateTime(L"日時", st);
-        return;
-    }
-
-    if (m_pre == L"じぶん") { // myself
-        SetUser();
-        return;
-    }
-
-    // カッコ (parens, brackets, braces, ...)
-    if (m_pre == L"かっこ") {
-        SetParens();
-        return;
-    }
+// 変換前の文字列を設定し、読みの鍵の符号にしておく。
+void Lattice::SetPre(const std::wstring& pre)
+{
+    m_pre = pre;
+    m_chunks.resize(pre.size() + 1);
 
-    // 記号（symbols）
-    SetSymbols();
-} // Lattice::AddExtraNodes
+    // 符号にできない文字は0にする。辞書の鍵の文字は0で始まらないので、
+    // その文字を含む読みとは一致しない。
+    m_key.clear();
+    m_key_pos.resize(pre.size() + 1);
+    for (size_t index = 0; index < pre.size(); ++index) {
+        m_key_pos[index] = m_key.size();
+        if (!DictKeyEncodeChar(m_key, pre[index]))
+            m_key += '\0';
+    }
+    m_key_pos[pre.size()] = m_key.size();
+} // Lattice::SetPre
+
+// 辞書データから、位置indexの文字で始まる単語のレコードを得る。
+// 読みの索引があれば、その位置からの文字列の先頭と一致する単語だけを得る。
+size_t Lattice::ScanDict(WStrings& records, const WCHAR *dict_data, size_t ichKeys, size_t index)
+{
+    if (ichKeys)
+        return ScanKeyIndex(records, dict_data, ichKeys, m_key, m_key_pos[index]);
+    return ScanBasicDict(records, dict_data, m_pre[index]);
+}
 
-// 辞書からノード群を追加する。
-BOOL Lattice::AddNodesFromDict(size_t index, const WCHAR *dict_data)
+// 辞書からノード群を追加する。ichKeysは読みの索引の位置（なければ0）。
+BOOL Lattice::AddNodesFromDict(size_t index, const WCHAR *dict_data, size_t ichKeys)
 {
     FOOTMARK();
     const size_t length = m_pre.size();
@@ -2012,25 +2539,20 @@ BOOL Lattice::AddNodesFromDict(size_t index, const WCHAR *dict_data)
 
             std::wstring halfwidth = mz_fullwidth_ascii_to_halfwidth(fields[I_FIELD_PRE]);
             fields[I_FIELD_POST] = halfwidth;
-            DoMeishi(saved, fields);
-
-            if (!Config_GetDWORD(L"bNoFullwidthAscii", FALSE)) { // 全角ASCIIを使う？
-                fields[I_FIELD_POST] = mz_halfwidth_ascii_to_fullwidth(halfwidth);
-                DoMeishi(saved, fields, +10);
-            }
 
-            // 全部が数字なら特殊な変換を行う。
             if (mz_are_all_chars_numeric(halfwidth)) {
-                fields[I_FIELD_POST] = mz_convert_to_kansuuji(halfwidth);
-                DoMeishi(saved, fields, +50);
-                fields[I_FIELD_POST] = mz_convert_to_kansuuji_brief(halfwidth);
-                DoMeishi(saved, fields, +50);
-                fields[I_FIELD_POST] = mz_convert_to_kansuuji_formal(halfwidth);
-                DoMeishi(saved, fields, +60);
-                fields[I_FIELD_POST] = mz_convert_to_kansuuji_brief_formal(halfwidth);
-                DoMeishi(saved, fields, +60);
-                fields[I_FIELD_POST] = mz_convert_to_maru_suuji(halfwidth);
-                DoMeishi(saved, fields, +70);
+                // 全部が数字なら、ノードは一つだけ。全角や漢数字などの表記は
+                // 結果を作るときにMzConvClause::expand_numericで作る。
+                fields[I_FIELD_TAGS] = L"[数字]";
+                DoMeishi(saved, fields);
+                fields[I_FIELD_TAGS].clear();
+            } else {
+                DoMeishi(saved, fields);
+
+                if (!Config_GetDWORD(L"bNoFullwidthAscii", FALSE)) { // 全角ASCIIを使う？
+                    fields[I_FIELD_POST] = mz_halfwidth_ascii_to_fullwidth(halfwidth);
+                    DoMeishi(saved, fields, +10);
+                }
             }
 
             // 郵便番号変換。
@@ -2048,8 +2570,8 @@ BOOL Lattice::AddNodesFromDict(size_t index, const WCHAR *dict_data)
         }
 
         // 基本辞書をスキャンする。
-        size_t count = ScanBasicDict(records, dict_data, m_pre[index]);
-        DPRINTW(L"ScanBasicDict(%c) count: %d\n", m_pre[index], count);
+        size_t count = ScanDict(records, dict_data, ichKeys, index);
+        DPRINTW(L"ScanDict(%c) count: %d\n", m_pre[index], count);
 
         // ユーザー辞書をスキャンする。
         count = ScanUserDict(records, m_pre[index], this);
@@ -2074,12 +2596,12 @@ struct lattice_compare
     }
 
     bool operator()(const LatticeNodePtr& n) const {
-        return n->pre.size() != m_pre.size();
+        return n->pre_len != m_pre.size();
     }
 };
 
 // 単一文節変換用のノード群を追加する。
-BOOL Lattice::AddNodesFromDict(const WCHAR *dict_data)
+BOOL Lattice::AddNodesFromDict(const WCHAR *dict_data, size_t ichKeys)
 {
     // 区切りを準備。
     std::wstring sep;
@@ -2088,8 +2610,8 @@ BOOL Lattice::AddNodesFromDict(const WCHAR *dict_data)
 
     // 基本辞書をスキャンする。
     WStrings fields, records;
-    size_t count = ScanBasicDict(records, dict_data, m_pre[0]);
-    DPRINTW(L"ScanBasicDict(%c) count: %d\n", m_pre[0], count);
+    size_t count = ScanDict(records, dict_data, ichKeys, 0);
+    DPRINTW(L"ScanDict(%c) count: %d\n", m_pre[0], count);
 
     // ユーザー辞書をスキャンする。
     count = ScanUserDict(records, m_pre[0], this);
@@ -2114,6 +2636,39 @@ BOOL Lattice::AddNodesFromDict(const WCHAR *dict_data)
     return !ARRAY_AT(m_chunks, 0).empty();
 }
 
+// 分割辞書からノード群を追加する。各位置の文字の分割だけが読み込まれる。
+// 単一文節変換なら先頭の位置だけを見て、入力全体の長さのノードだけを残す。
+BOOL Lattice::AddNodesFromShards(MzShardedDict& dict, BOOL bSingle)
+{
+    // 区切りを準備。
+    std::wstring sep;
+    sep.resize(1);
+    sep[0] = FIELD_SEP;
+
+    WStrings fields, records;
+    size_t count = bSingle ? 1 : m_pre.size();
+    for (size_t index = 0; index < count; ++index) {
+        records.clear();
+        if (!dict.Scan(records, m_pre[index], m_key, m_key_pos[index]))
+            continue;
+        DPRINTW(L"MzShardedDict::Scan(%c) count: %d\n", m_pre[index], (INT)records.size());
+
+        // 各レコードをフィールドに分割し、処理する。
+        for (size_t i = 0; i < records.size(); ++i) {
+            str_split(fields, records[i], sep);
+            DoFields(index, fields);
+        }
+    }
+
+    if (!bSingle)
+        return TRUE;
+
+    // 異なるサイズのノードを削除する。
+    LatticeChunk& chunk = ARRAY_AT(m_chunks, 0);
+    chunk.erase(std::remove_if(chunk.begin(), chunk.end(), lattice_compare(m_pre)), chunk.end());
+    return !chunk.empty();
+} // Lattice::AddNodesFromShards
+
 // 部分最小コストを計算する（改良版ビタビアルゴリズム）。
 INT Lattice::CalcSubTotalCosts(LatticeNode *ptr1)
 {
@@ -2127,13 +2682,12 @@ INT Lattice::CalcSubTotalCosts(LatticeNode *ptr1)
     LatticeNode *min_node = NULL;
 
     // 逆向き枝がない場合（開始ノード）はコスト0
-    if (ptr1->reverse_branches.empty())
+    if (ptr1->reverse_count == 0)
         min_cost = 0;
 
     // 各逆向き枝について最小コストを探索
-    reverse_branches_t::iterator it, end = ptr1->reverse_branches.end();
-    for (it = ptr1->reverse_branches.begin(); it != end; ++it) {
-        LatticeNode *ptr0 = *it;
+    for (size_t i = 0; i < ptr1->reverse_count; ++i) {
+        LatticeNode *ptr0 = ReverseBranch(ptr1, i);
 
         // 再帰的に前のノードのコストを計算
         INT prev_cost = CalcSubTotalCosts(ptr0);
@@ -2184,30 +2738,37 @@ void Lattice::UpdateLinksAndBranches()
     // リンク数とブランチ群をリセットする。
     ResetLatticeInfo();
 
+    // 古いテイルを捨てて、ノードを位置の順に詰め直す。ヘッドとテイルの分も空けておく。
+    ARRAY_AT(m_chunks, m_pre.size()).clear();
+    PackNodes(2);
+
     // ヘッド（頭）を追加する。リンク数は１。
     {
         LatticeNode node;
+        node.clear();
         node.bunrui = HB_HEAD;
         node.linked = 1;
+        node.branch_begin = (DWORD)m_branches.size();
         // 現在位置のノードを先頭ブランチに追加する。
         LatticeChunk& chunk1 = ARRAY_AT(m_chunks, 0);
         LatticeChunk::iterator it, end = chunk1.end();
         for (it = chunk1.begin(); it != end; ++it) {
             LatticeNodePtr& ptr1 = *it;
-            if (node.CanConnectTo(*ptr1)) {
+            if (node.CanConnectTo(*ptr1) && node.branch_count < MAXWORD) {
                 ptr1->linked = 1;
-                node.branches.push_back(ptr1);
+                m_branches.push_back(ptr1);
+                node.branch_count++;
             }
         }
-        m_head = unboost::make_shared<LatticeNode>(node);
+        m_head = NewNode(node);
     }
 
     // 尻尾（テイル）を追加する。
     {
         LatticeNode node;
+        node.clear();
         node.bunrui = HB_TAIL;
-        m_tail = unboost::make_shared<LatticeNode>(node);
-        ARRAY_AT(m_chunks, m_pre.size()).clear();
+        m_tail = NewNode(node);
         ARRAY_AT(m_chunks, m_pre.size()).push_back(m_tail);
     }
 
@@ -2223,17 +2784,19 @@ void Lattice::UpdateLinksAndBranches()
             if (!ptr1->linked)
                 continue;
             // 区間チェック。
-            ASSERT(index + ptr1->pre.size() <= m_pre.size());
-            if (!(index + ptr1->pre.size() <= m_pre.size()))
+            ASSERT(index + ptr1->pre_len <= m_pre.size());
+            if (!(index + ptr1->pre_len <= m_pre.size()))
                 continue;
             // 連結可能であれば、リンク先をブランチに追加し、リンク先のリンク数を増やす。
-            LatticeChunk& chunk2 = ARRAY_AT(m_chunks, index + ptr1->pre.size());
+            LatticeChunk& chunk2 = ARRAY_AT(m_chunks, index + ptr1->pre_len);
+            ptr1->branch_begin = (DWORD)m_branches.size();
             {
                 LatticeChunk::iterator it, end = chunk2.end();
                 for (it = chunk2.begin(); it != end; ++it) {
                     LatticeNodePtr& ptr2 = *it;
-                    if (ptr1->CanConnectTo(*ptr2.get())) {
-                        ptr1->branches.push_back(ptr2);
+                    if (ptr1->CanConnectTo(*ptr2) && ptr1->branch_count < MAXWORD) {
+                        m_branches.push_back(ptr2);
+                        ptr1->branch_count++;
                         ptr2->linked++;
                     }
                 }
@@ -2251,10 +2814,12 @@ void Lattice::ResetLatticeInfo()
         for (it = chunk1.begin(); it != end; ++it) {
             LatticeNodePtr& ptr1 = *it;
             ptr1->linked = 0;
-            ptr1->branches.clear();
-            ptr1->reverse_branches.clear();
+            ptr1->branch_begin = ptr1->branch_count = 0;
+            ptr1->reverse_begin = ptr1->reverse_count = 0;
         }
     }
+    m_branches.clear();
+    m_reverse_branches.clear();
 } // Lattice::ResetLatticeInfo
 
 // 変換失敗時に未定義の単語を追加する。
@@ -2266,13 +2831,15 @@ void Lattice::AddComplement()
     if (ARRAY_AT(m_chunks, lastIndex).empty())
         return;
 
-    lastIndex += ARRAY_AT_AT(m_chunks, lastIndex, 0)->pre.size();
+    lastIndex += ARRAY_AT_AT(m_chunks, lastIndex, 0)->pre_len;
 
     LatticeNode node;
+    node.clear();
     node.bunrui = HB_UNKNOWN;
     node.deltaCost = 0;
-    node.pre = node.post = m_pre.substr(lastIndex);
-    ARRAY_AT(m_chunks, lastIndex).push_back(unboost::make_shared<LatticeNode>(node));
+    node.pre_len = node.post_len = (WORD)(m_pre.size() - lastIndex);
+    node.post = m_pre.c_str() + lastIndex;
+    AddNode(lastIndex, node);
     UpdateLinksAndBranches();
 } // Lattice::AddComplement
 
@@ -2306,6 +2873,120 @@ void Lattice::CutUnlinkedNodes()
     }
 } // Lattice::CutUnlinkedNodes
 
+static inline bool beam_compare_by_cost(const LatticeNode *node0, const LatticeNode *node1) {
+    return node0->subtotal_cost < node1->subtotal_cost;
+}
+
+// 同じ位置で終わるノード群を、コストの小さい上位beam_width個と、最良のコストから
+// threshold以内のものに絞り込む。落としたノードはリンク数をゼロにする。
+static void PruneBeamNodes(std::vector<LatticeNode *>& nodes, size_t beam_width, INT threshold)
+{
+    if (nodes.empty())
+        return;
+
+    std::stable_sort(nodes.begin(), nodes.end(), beam_compare_by_cost);
+
+    INT limit = nodes[0]->subtotal_cost;
+    if (threshold <= 0 || !SafeAddCost(limit, threshold))
+        limit = MAXLONG;
+
+    size_t keep = 0;
+    while (keep < nodes.size() && keep < beam_width && nodes[keep]->subtotal_cost <= limit)
+        ++keep;
+
+    for (size_t i = keep; i < nodes.size(); ++i) {
+        nodes[i]->linked = 0;
+    }
+    nodes.resize(keep);
+}
+
+// ビーム探索でノードを枝刈りする（UpdateLinksAndBranchesの前に呼ぶ）。
+// 前から順に各ノードへの最小コストを求め、終了位置ごとに絞り込んでから
+// 次の位置に進む。枝を作る前にノード数が抑えられるので、長い入力でも
+// 時間とメモリが入力長にほぼ比例する。
+void Lattice::PruneByBeam(size_t beam_width, INT threshold)
+{
+    ASSERT(m_pre.size() + 1 == m_chunks.size());
+    if (beam_width == 0)
+        return;
+
+    const size_t length = m_pre.size();
+
+    LatticeNode head;
+    head.clear();
+    head.bunrui = HB_HEAD;
+
+    // 終了位置ごとの、生き残ったノード群。
+    std::vector<std::vector<LatticeNode *> > ends(length + 1);
+
+    for (size_t index = 0; index < length; ++index) {
+        // この位置で終わるノード群を絞り込む。
+        std::vector<LatticeNode *>& prev = ends[index];
+        PruneBeamNodes(prev, beam_width, threshold);
+
+        LatticeChunk& chunk1 = ARRAY_AT(m_chunks, index);
+        LatticeChunk::iterator it, end = chunk1.end();
+        for (it = chunk1.begin(); it != end; ++it) {
+            LatticeNode *ptr1 = *it;
+            ptr1->linked = 0;
+            ptr1->subtotal_cost = MAXLONG;
+
+            size_t end_index = index + ptr1->pre_len;
+            if (end_index > length)
+                continue;
+
+            INT word_cost = ptr1->WordCost();
+            INT min_cost = MAXLONG;
+            if (index == 0) {
+                // 先頭から連結する。
+                if (head.CanConnectTo(*ptr1)) {
+                    INT cost = word_cost;
+                    if (SafeAddCost(cost, head.ConnectCost(*ptr1)))
+                        min_cost = cost;
+                }
+            } else {
+                // 生き残った前のノードから連結する。
+                std::vector<LatticeNode *>::iterator it0, end0 = prev.end();
+                for (it0 = prev.begin(); it0 != end0; ++it0) {
+                    LatticeNode *ptr0 = *it0;
+                    if (!ptr0->CanConnectTo(*ptr1))
+                        continue;
+                    INT cost = ptr0->subtotal_cost;
+                    if (!SafeAddCost(cost, word_cost))
+                        continue;
+                    if (!SafeAddCost(cost, ptr0->ConnectCost(*ptr1)))
+                        continue;
+                    if (cost < min_cost)
+                        min_cost = cost;
+                }
+            }
+
+            // 到達できないノードは捨てる。
+            if (min_cost == MAXLONG)
+                continue;
+
+            ptr1->subtotal_cost = min_cost;
+            ptr1->linked = 1;
+            ends[end_index].push_back(ptr1);
+        }
+    }
+
+    // 末尾で終わるノード群も絞り込む。
+    PruneBeamNodes(ends[length], beam_width, threshold);
+
+    // 落としたノードを削除する。
+    CutUnlinkedNodes();
+
+    // 部分合計コストは後でCalcSubTotalCostsが計算し直す。
+    for (size_t index = 0; index < length; ++index) {
+        LatticeChunk& chunk1 = ARRAY_AT(m_chunks, index);
+        LatticeChunk::iterator it, end = chunk1.end();
+        for (it = chunk1.begin(); it != end; ++it) {
+            (*it)->subtotal_cost = MAXLONG;
+        }
+    }
+} // Lattice::PruneByBeam
+
 // 最後にリンクされたインデックスを取得する。
 size_t Lattice::GetLastLinkedIndex() const
 {
@@ -2320,7 +3001,7 @@ size_t Lattice::GetLastLinkedIndex() const
         const LatticeChunk& chunk = ARRAY_AT(m_chunks, index);
         LatticeChunk::const_iterator it, end = chunk.end();
         for (it = chunk.begin(); it != end; ++it) {
-            unboost::shared_ptr<LatticeNode> ptr = *it;
+            LatticeNodePtr ptr = *it;
             if (ptr->linked) {
                 return index; // リンクされたノードが見つかった。
             }
@@ -2329,1309 +3010,224 @@ size_t Lattice::GetLastLinkedIndex() const
     return 0; // not found
 } // Lattice::GetLastLinkedIndex
 
-// ノードを一つ追加する。
-void Lattice::AddNode(size_t index, const LatticeNode& node)
+#define LATTICE_NODE_BLOCK 256 // ノードのブロックの大きさ。
+
+// ラティスを破棄する。
+Lattice::~Lattice()
 {
-    // ノードを追加するとき、必ずこの関数を通る。
-    // ここで条件付きでブレークさせて、呼び出し履歴を取得すれば、
-    // どのようにノードが追加されているのかが観測できる。
-    ASSERT(index + node.pre.size() <= m_pre.size());
-    ARRAY_AT(m_chunks, index).push_back(unboost::make_shared<LatticeNode>(node));
+    // ノードはPODなので、ブロックを解放するだけでよい。
+    for (size_t i = 0; i < m_node_blocks.size(); ++i) {
+        ::operator delete(m_node_blocks[i]);
+    }
+    MzLearning::Release(m_learning);
 }
 
-// イ形容詞を変換する。
-void Lattice::DoIkeiyoushi(size_t index, const WStrings& fields, INT deltaCost)
+// ノードをブロックから確保する。ノードはラティスと共に破棄される。
+LatticeNodePtr Lattice::NewNode(const LatticeNode& node)
 {
-    FOOTMARK();
-    ASSERT(fields.size() == NUM_FIELDS);
-    ASSERT(fields[I_FIELD_PRE].size());
-    size_t length = fields[I_FIELD_PRE].size();
+    if (m_node_blocks.empty() || m_nodes_used == m_nodes_capacity) {
+        m_node_blocks.push_back(::operator new(LATTICE_NODE_BLOCK * sizeof(LatticeNode)));
+        m_nodes_used = 0;
+        m_nodes_capacity = LATTICE_NODE_BLOCK;
+    }
+    LatticeNode *nodes = reinterpret_cast<LatticeNode *>(m_node_blocks.back());
+    nodes[m_nodes_used] = node;
+    nodes[m_nodes_used].serial = m_nodes_added++;
+    return &nodes[m_nodes_used++];
+}
 
-    // 区間チェック。
-    if (index + length > m_pre.size()) {
-        return;
-    }
-    // 対象のテキストが語幹と一致するか確かめる。
-    if (m_pre.substr(index, length) != fields[I_FIELD_PRE]) {
-        return;
+// チャンクのノードを、チャンクの順に一つのブロックに詰め直す。
+// チャンクにないノードは捨てられるので、ノードへのポインタを持ち越してはいけない。
+// extraは、後から追加するノードのために空けておく数。
+void Lattice::PackNodes(size_t extra)
+{
+    size_t count = 0;
+    for (size_t index = 0; index < m_chunks.size(); ++index) {
+        count += m_chunks[index].size();
+    }
+
+    LatticeNode *nodes =
+        reinterpret_cast<LatticeNode *>(::operator new((count + extra) * sizeof(LatticeNode)));
+    size_t k = 0;
+    for (size_t index = 0; index < m_chunks.size(); ++index) {
+        LatticeChunk& chunk1 = m_chunks[index];
+        for (size_t i = 0; i < chunk1.size(); ++i) {
+            nodes[k] = *chunk1[i];
+            chunk1[i] = &nodes[k++];
+        }
     }
-    // 語幹の後の部分文字列。
-    std::wstring tail = m_pre.substr(index + length);
-
-    // ラティスノードの準備。
-    LatticeNode node;
-    node.bunrui = HB_IKEIYOUSHI;
-    node.tags = fields[I_FIELD_TAGS];
-    node.deltaCost = deltaCost;
-
-    // い形容詞の未然形。
-    // 「痛い」→「痛かろ(う)」
-    do {
-        if (tail.empty() || tail.substr(0, 3) != L"かろう") break;
-        node.katsuyou = MIZEN_KEI;
-        node.pre = fields[I_FIELD_PRE] + L"かろう";
-        node.post = fields[I_FIELD_POST] + L"かろう";
-        AddNode(index, node);
-    } while (0);
-
-    mz_make_literal_maps();
-
-    // い形容詞の連用形。
-    // 「痛い」→「痛かっ(た)」
-    do {
-        if (tail.empty() || tail.substr(0, 2) != L"かっ") break;
-        node.pre = fields[I_FIELD_PRE] + L"かっ";
-        node.post = fields[I_FIELD_POST] + L"かっ";
-        node.katsuyou = RENYOU_KEI;
-        AddNode(index, node);
-
-        if (tail.size() < 3 || tail[2] != L'た') break;
-        node.pre += L'た';
-        node.post += L'た';
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-    } while (0);
-    // 「痛い」→「痛く(て)」、「広い」→「広く(て)」
-    do {
-        if (tail.empty() || tail[0] != L'く') break;
-        node.pre = fields[I_FIELD_PRE] + L'く';
-        node.post = fields[I_FIELD_POST] + L'く';
-        AddNode(index, node);
-
-        if (tail.size() < 2 || tail[1] != L'て') break;
-        node.pre += tail[1];
-        node.post += tail[1];
-        AddNode(index, node);
-    } while (0);
-    // 「広い」→「広う(て)」
-    do {
-        if (tail.empty() || tail[0] != L'う') break;
-        node.pre = fields[I_FIELD_PRE] + L'う';
-        node.post = fields[I_FIELD_POST] + L'う';
-        AddNode(index, node);
-    } while (0);
-    // 「美しい」→「美しゅう(て)」
-    do {
-        if (tail.empty() || tail[0] != L'ゅ' || tail[1] != L'う') break;
-        node.pre = fields[I_FIELD_PRE] + L"ゅう";
-        node.post = fields[I_FIELD_POST] + L"ゅう";
-        AddNode(index, node);
-    } while (0);
-    // TODO: 「危ない」→「危のう(て)」
-    // TODO: 「暖かい」→「暖こう(て)」
 
-    // い形容詞の終止形。「かわいい」「かわいいよ」「かわいいね」「かわいいぞ」
-    node.katsuyou = SHUUSHI_KEI;
-    do {
-        if (tail.empty() || tail[0] != L'い') break;
-        node.pre = fields[I_FIELD_PRE] + L'い';
-        node.post = fields[I_FIELD_POST] + L'い';
-        AddNode(index, node);
-        if (tail.size() < 1 ||
-            (tail[1] != L'よ' && tail[1] != L'ね' && tail[1] != L'な' && tail[1] != L'ぞ'))
-                break;
-        node.pre += tail[1];
-        node.post += tail[1];
-        AddNode(index, node);
-    } while (0);
+    for (size_t i = 0; i < m_node_blocks.size(); ++i) {
+        ::operator delete(m_node_blocks[i]);
+    }
+    m_node_blocks.assign(1, nodes);
+    m_nodes_used = count;
+    m_nodes_capacity = count + extra;
+    m_head = m_tail = NULL;
+} // Lattice::PackNodes
 
-    // い形容詞の連体形。
-    // 「痛い」→「痛い(とき)」
-    node.katsuyou = RENTAI_KEI;
-    do {
-        if (tail.empty() || tail[0] != L'い') break;
-        node.pre = fields[I_FIELD_PRE] + L'い';
-        node.post = fields[I_FIELD_POST] + L'い';
-        AddNode(index, node);
-    } while (0);
-    // 「痛い」→「痛き(とき)」
-    do {
-        if (tail.empty() || tail[0] != L'き') break;
-        node.pre = fields[I_FIELD_PRE] + L'き';
-        node.post = fields[I_FIELD_POST] + L'き';
-        AddNode(index, node);
-    } while (0);
+// ノードを一つ追加する。
+void Lattice::AddNode(size_t index, const LatticeNode& node)
+{
+    // ノードを追加するとき、必ずこの関数を通る。
+    // ここで条件付きでブレークさせて、呼び出し履歴を取得すれば、
+    // どのようにノードが追加されているのかが観測できる。
+    ASSERT(index + node.pre_len <= m_pre.size());
+    LatticeNodePtr ptr = NewNode(node);
+
+    // 変換前は入力文字列を指す。
+    ptr->pre = m_pre.c_str() + index;
+    // 変換後は、変換前と同じなら入力文字列を、そうでなければプールの文字列を指す。
+    if (node.post_len == node.pre_len &&
+        memcmp(node.post, ptr->pre, node.post_len * sizeof(WCHAR)) == 0) {
+        ptr->post = ptr->pre;
+    } else {
+        ptr->post = m_strings.add(node.post, node.post_len);
+    }
 
-    // い形容詞の仮定形。
-    // 「痛い」→「痛けれ(ば)」
-    do {
-        if (tail.empty() || tail.substr(0, 2) != L"けれ") break;
-        node.katsuyou = KATEI_KEI;
-        node.pre = fields[I_FIELD_PRE] + L"けれ";
-        node.post = fields[I_FIELD_POST] + L"けれ";
-        AddNode(index, node);
-        if (tail.empty() || tail.substr(0, 3) != L"ければ") break;
-        node.katsuyou = KATEI_KEI;
-        node.pre = fields[I_FIELD_PRE] + L"ければ";
-        node.post = fields[I_FIELD_POST] + L"ければ";
-        AddNode(index, node);
-    } while (0);
+    // 学習を反映する。表は最初のノードのときに取得し、ラティスを破棄するまで使う。
+    if (!m_bLearning) {
+        m_learning = g_learning.Acquire();
+        m_bLearning = TRUE;
+    }
+    if (m_learning)
+        m_learning->Apply(*ptr);
 
-    // い形容詞の名詞形。
-    // 「痛い(い形容詞)」→「痛さ(名詞)」、
-    // 「痛い(い形容詞)」→「痛み(名詞)」、
-    // 「痛い(い形容詞)」→「痛め(名詞)」「痛目(名詞)」など。
-    node.bunrui = HB_MEISHI;
-    do {
-        if (tail.empty() || tail[0] != L'さ') break;
-        node.pre = fields[I_FIELD_PRE] + L'さ';
-        node.post = fields[I_FIELD_POST] + L'さ';
-        AddNode(index, node);
-    } while (0);
-    do {
-        if (tail.empty() || tail[0] != L'み') break;
-        node.pre = fields[I_FIELD_PRE] + L'み';
-        if (node.pre != L"なみ") {
-            node.post = fields[I_FIELD_POST] + L'み';
-            AddNode(index, node);
-        }
-    } while (0);
-    do {
-        if (tail.empty() || tail[0] != L'げ') break;
-        node.pre = fields[I_FIELD_PRE] + L'げ';
-        if (node.pre != L"なげ") {
-            node.post = fields[I_FIELD_POST] + L'げ';
-            AddNode(index, node);
-        }
-    } while (0);
-    do {
-        if (tail.empty() || tail[0] != L'め') break;
-        node.pre = fields[I_FIELD_PRE] + L'め';
-        if (node.pre != L"なめ") {
-            node.post = fields[I_FIELD_POST] + L'め';
-            AddNode(index, node);
-
-            node.post = fields[I_FIELD_POST] + L'目';
-            AddNode(index, node);
-        }
-    } while (0);
+    ARRAY_AT(m_chunks, index).push_back(ptr);
+}
 
-    // 「痛い(い形容詞)」→「痛そうな(な形容詞)」など。
-    if (tail.size() >= 2 && tail[0] == L'そ' && tail[1] == L'う') {
-        WStrings new_fields = fields;
-        new_fields[I_FIELD_PRE] = fields[I_FIELD_PRE] + L"そう";
-        new_fields[I_FIELD_POST] = fields[I_FIELD_POST] + L"そう";
-        DoNakeiyoushi(index, new_fields, deltaCost);
-    }
+// 外部のエンジンがAddNodeで追加したノード群から、変換結果を作れるラティスにする。
+void Lattice::Fix(const std::wstring& pre)
+{
+    ASSERT(m_pre == pre);
+    UpdateLinksAndBranches();
+    CutUnlinkedNodes();
+    AddComplement();
+    MakeReverseBranches(m_head);
 
-    // 「痛い(い形容詞)」→「痛すぎる(一段動詞)」
-    if (tail.size() >= 2 && tail[0] == L'す' && tail[1] == L'ぎ') {
-        WStrings new_fields = fields;
-        new_fields[I_FIELD_PRE] = fields[I_FIELD_PRE] + L"すぎ";
-        new_fields[I_FIELD_POST] = fields[I_FIELD_POST] + L"すぎ";
-        DoIchidanDoushi(index, new_fields, deltaCost);
-        new_fields[I_FIELD_POST] = fields[I_FIELD_POST] + L"過ぎ";
-        DoIchidanDoushi(index, new_fields, deltaCost);
-    }
+    m_tail->marked = 1;
+    CalcSubTotalCosts(m_tail);
 
-    // 「痛。」「寒。」など
-    if (tail.empty()) {
-        DoMeishi(index, fields, deltaCost + 100);
-    } else {
-        switch (tail[0]) {
-        case L'。': case L'、': case L'，': case L'．': case L'.': case L',':
-            DoMeishi(index, fields, deltaCost + 100);
-            break;
-        }
-    }
-} // Lattice::DoIkeiyoushi
+    m_head->marked = 1;
+    OptimizeMarking(m_head);
+} // Lattice::Fix
 
-// ナ形容詞を変換する。
-void Lattice::DoNakeiyoushi(size_t index, const WStrings& fields, INT deltaCost)
+// 活用規則の表に従って用言を変換する。
+void Lattice::DoKatsuyou(size_t index, const WStrings& fields, INT deltaCost,
+                         const KATSUYOU_TABLE& table)
 {
-    FOOTMARK();
     ASSERT(fields.size() == NUM_FIELDS);
     ASSERT(fields[I_FIELD_PRE].size());
-    size_t length = fields[I_FIELD_PRE].size();
+    const std::wstring& stem = fields[I_FIELD_PRE];
+    size_t length = stem.size();
+
     // 区間チェック。
     if (index + length > m_pre.size()) {
         return;
     }
     // 対象のテキストが語幹と一致するか確かめる。
-    if (m_pre.substr(index, length) != fields[I_FIELD_PRE]) {
+    if (m_pre.compare(index, length, stem) != 0) {
         return;
     }
-    // 語幹の後の部分文字列。
-    std::wstring tail = m_pre.substr(index + length);
-
-    // ラティスノードの準備。
-    LatticeNode node;
-    node.bunrui = HB_NAKEIYOUSHI;
-    node.tags = fields[I_FIELD_TAGS];
-    node.deltaCost = deltaCost;
-
-    // な形容詞の未然形。
-    // 「巨大な」→「巨大だろ(う)」
-    do {
-        if (tail.empty() || tail.substr(0, 3) != L"だろう") break;
-        node.katsuyou = MIZEN_KEI;
-        node.pre = fields[I_FIELD_PRE] + L"だろう";
-        node.post = fields[I_FIELD_POST] + L"だろう";
-        AddNode(index, node);
-        if (tail.empty() || tail.substr(0, 4) != L"だろうに") break;
-        node.pre = fields[I_FIELD_PRE] + L"だろうに";
-        node.post = fields[I_FIELD_POST] + L"だろうに";
-        node.bunrui = HB_FUKUSHI;
-        AddNode(index, node);
-        node.bunrui = HB_NAKEIYOUSHI;
-    } while (0);
-
-    // 「破壊的な(な形容詞)」→「破壊的すぎる(一段動詞)」
-    if (tail.size() >= 2 && tail[0] == L'す' && tail[1] == L'ぎ') {
-        WStrings new_fields = fields;
-        new_fields[I_FIELD_PRE] = fields[I_FIELD_PRE] + L"すぎ";
-        new_fields[I_FIELD_POST] = fields[I_FIELD_POST] + L"すぎ";
-        DoIchidanDoushi(index, new_fields, deltaCost);
-        new_fields[I_FIELD_POST] = fields[I_FIELD_POST] + L"過ぎ";
-        DoIchidanDoushi(index, new_fields, deltaCost);
-    }
-
-    // な形容詞の連用形。
-    // 「巨大な」→「巨大だっ(た)」
-    do {
-        if (tail.empty() || tail.substr(0, 2) != L"だっ") break;
-        node.pre = fields[I_FIELD_PRE] + L"だっ";
-        node.post = fields[I_FIELD_POST] + L"だっ";
-        node.katsuyou = RENYOU_KEI;
-        AddNode(index, node);
-
-        if (tail.size() < 3 || tail[2] != L'た') break;
-        node.pre += L'た';
-        node.post += L'た';
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-    } while (0);
-    node.katsuyou = RENYOU_KEI;
-    do {
-        if (tail.empty() || tail[0] != L'で') break;
-        node.pre = fields[I_FIELD_PRE] + L'で';
-        node.post = fields[I_FIELD_POST] + L'で';
-        AddNode(index, node);
-    } while (0);
-    do {
-        if (tail.empty() || tail[0] != L'に') break;
-        node.pre = fields[I_FIELD_PRE] + L'に';
-        node.post = fields[I_FIELD_POST] + L'に';
-        AddNode(index, node);
-    } while (0);
-
-    // な形容詞の終止形。
-    // 「巨大な」→「巨大だ」「巨大だね」「巨大だぞ」
-    do {
-        if (tail.empty() || tail[0] != L'だ') break;
-        node.katsuyou = SHUUSHI_KEI;
-        node.pre = fields[I_FIELD_PRE] + L'だ';
-        node.post = fields[I_FIELD_POST] + L'だ';
-        AddNode(index, node);
-
-        if (tail.size() < 1 ||
-            (tail[1] != L'よ' && tail[1] != L'ね' && tail[1] != L'な' && tail[1] != L'ぞ'))
-            break;
-        node.pre += tail[1];
-        node.post += tail[1];
-        AddNode(index, node);
-    } while (0);
-
-    // な形容詞の連体形。
-    // 「巨大な」→「巨大な(とき)」
-    do {
-        if (tail.empty() || tail[0] != L'な') break;
-        node.katsuyou = RENTAI_KEI;
-        node.pre = fields[I_FIELD_PRE] + L'な';
-        node.post = fields[I_FIELD_POST] + L'な';
-        AddNode(index, node);
-    } while (0);
-
-    // な形容詞の連用形。
-    // 「穏健な」→「穏健に」
-    do {
-        if (tail.empty() || tail[0] != L'に') break;
-        node.katsuyou = RENYOU_KEI;
-        node.pre = fields[I_FIELD_PRE] + L'に';
-        node.post = fields[I_FIELD_POST] + L'に';
-        node.bunrui = HB_FUKUSHI;
-        AddNode(index, node);
-        node.bunrui = HB_NAKEIYOUSHI;
-    } while (0);
-
-    // な形容詞の仮定形。
-    // 「巨大な」→「巨大なら」
-    do {
-        if (tail.empty() || tail.substr(0, 2) != L"なら") break;
-        node.katsuyou = KATEI_KEI;
-        node.pre = fields[I_FIELD_PRE] + L"なら";
-        node.post = fields[I_FIELD_POST] + L"なら";
-        AddNode(index, node);
-        if (tail.empty() || tail.substr(0, 3) != L"ならば") break;
-        node.katsuyou = KATEI_KEI;
-        node.pre = fields[I_FIELD_PRE] + L"ならば";
-        node.post = fields[I_FIELD_POST] + L"ならば";
-        AddNode(index, node);
-    } while (0);
-
-    // な形容詞の名詞形。
-    // 「きれいな(な形容詞)」→「きれいさ(名詞)」、
-    // 「巨大な」→「巨大さ」。
-    node.bunrui = HB_MEISHI;
-    do {
-        if (tail.empty() || tail[0] != L'さ') break;
-        node.pre = fields[I_FIELD_PRE] + L'さ';
-        node.post = fields[I_FIELD_POST] + L'さ';
-        AddNode(index, node);
-    } while (0);
-
-    // 「きれい。」「静か。」「巨大。」など
-    if (tail.empty()) {
-        DoMeishi(index, fields, deltaCost);
-    } else {
-        switch (tail[0]) {
-        case L'。': case L'、': case L'，': case L'．': case L',': case L'.':
-            DoMeishi(index, fields, deltaCost);
-            break;
-        }
-    }
-} // Lattice::DoNakeiyoushi
-
-// 五段動詞を変換する。
-void Lattice::DoGodanDoushi(size_t index, const WStrings& fields, INT deltaCost)
-{
-    FOOTMARK();
-    ASSERT(fields.size() == NUM_FIELDS);
-    ASSERT(fields[I_FIELD_PRE].size());
-    size_t length = fields[I_FIELD_PRE].size();
-    // 区間チェック。
-    if (index + length > m_pre.size()) {
-        return;
-    }
-    // 対象のテキストが語幹と一致するか確かめる。
-    if (m_pre.substr(index, length) != fields[I_FIELD_PRE]) {
-        return;
-    }
-    // 語幹の後の部分文字列。
-    std::wstring tail = m_pre.substr(index + length);
-    DPRINTW(L"DoGodanDoushi: %s, %s\n", fields[I_FIELD_PRE].c_str(), tail.c_str());
-
-    // ラティスノードの準備。
-    LatticeNode node;
-    node.bunrui = HB_GODAN_DOUSHI;
-    node.tags = fields[I_FIELD_TAGS];
-    node.deltaCost = deltaCost;
-    node.gyou = (Gyou)HIBYTE(fields[I_FIELD_HINSHI][0]);
-
-    // 五段動詞の未然形。
-    // 「咲く(五段)」→「咲か(ない)」、「食う(五段)」→「食わ(ない)」
-    do {
-        node.katsuyou = MIZEN_KEI;
-        WCHAR ch;
-        if (node.gyou == GYOU_A) {
-            ch = L'わ';
-        } else {
-            ch = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_A);
-        }
-        if (tail.empty() || tail[0] != ch)
-            break;
-        node.pre = fields[I_FIELD_PRE] + ch;
-        node.post = fields[I_FIELD_POST] + ch;
-        AddNode(index, node);
-
-        // 「咲かせ」「食わせ」～られる
-        if (tail.size() >= 2 && tail[1] == L'せ') {
-            node.pre = fields[I_FIELD_PRE] + ch + tail[1];
-            node.post = fields[I_FIELD_POST] + ch + tail[1];
-            AddNode(index, node);
-        }
-    } while (0);
-    // 「とまら(ない)」→「とまん(ない)」
-    // 「さわら(ない)」→「さわん(ない)」
-    do {
-        WCHAR ch = L'ん';
-        if (tail.empty() || tail[0] != ch || node.gyou != GYOU_RA) {
-            break;
-        }
-        node.katsuyou = MIZEN_KEI;
-        node.pre = fields[I_FIELD_PRE] + ch;
-        node.post = fields[I_FIELD_POST] + ch;
-        AddNode(index, node);
-    } while (0);
-
-    // 五段動詞の連用形。
-    // 「咲く(五段)」→「咲き(ます)」、「食う(五段)」→「食い(ます)」
-    node.katsuyou = RENYOU_KEI;
-    WCHAR ch = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_I);
-    if (tail.size() >= 1 && tail[0] == ch) {
-        node.pre = fields[I_FIELD_PRE] + ch;
-        node.post = fields[I_FIELD_POST] + ch;
-        AddNode(index, node);
-    }
-
-    // 五段動詞の連用形の音便の分類。
-    WCHAR ch2 = 0, ch3 = 0, ch4 = 0;
-    switch (node.gyou) {
-    case GYOU_NA:
-    case GYOU_MA:
-    case GYOU_BA:
-        // あそんだ、あんだ、うんだ、かんだ、くんだ、こんだ、しんだ、すんだ、
-        // つんだ、とんだ、のんだ、ふんだ、もんだ、やんだ、よんだ
-        ch2 = L'ん';
-        ch3 = L'だ';
-        ch4 = L'で';
-        break;
-
-    case GYOU_A:
-    case GYOU_TA:
-    case GYOU_RA:
-        // あった、うった、うつった、おった、かった、きった、くった、
-        // けった、さった、しった、すった、そった、たった、ちった、
-        // つった、とった、なった、ぬった、のった、はった、ふった、
-        // へった、ほった、まった、もった、やった、ゆった、よった、
-        // わった、わらった
-        ch2 = L'っ';
-        ch3 = L'た';
-        ch4 = L'て';
-        break;
-
-    case GYOU_KA:
-        // ういた、えがいた、かいた、きいた、さいた、しいた、たいた、
-        // だいた、ついた、といた、どいた、ないた、ぬいた、のいた、
-        // はいた、ひいた、ふいた、ふぶいた、やいた、わいた
-        ch2 = L'い';
-        ch3 = L'た';
-        ch4 = L'て';
-        break;
-
-    case GYOU_GA:
-        // かいだ、さわいだ、そいだ、みついだ
-        ch2 = L'い';
-        ch3 = L'だ';
-        ch4 = L'で';
-        break;
-
-    default:
-        // よくわからない
-        ch2 = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_I);
-        ch3 = L'た';
-        ch4 = L'て';
-        break;
-    }
-
-    // 上記の分類に基づいて、五段動詞の連用形の音便を処理する。
-    if (ch2 != 0 && tail.size() >= 1 && tail[0] == ch2) {
-        if (tail.size() >= 3 && tail[1] == ch4 && tail[2] == L'も') {
-            // 連用形「ても」「でも」
-            node.katsuyou = RENYOU_KEI;
-            node.pre = fields[I_FIELD_PRE] + ch2 + tail[1] + tail[2];
-            node.post = fields[I_FIELD_POST] + ch2 + tail[1] + tail[2];
-            AddNode(index, node);
-        } else if (tail.size() >= 2 && tail[1] == ch4) {
-            // 連用形「て」「で」
-            node.katsuyou = RENYOU_KEI;
-            node.pre = fields[I_FIELD_PRE] + ch2 + tail[1];
-            node.post = fields[I_FIELD_POST] + ch2 + tail[1];
-            AddNode(index, node);
-        } else if (tail.size() >= 3 && tail[1] == ch3 && tail[2] == L'り') {
-            // 連用形「たり」「だり」
-            node.katsuyou = RENYOU_KEI;
-            node.pre = fields[I_FIELD_PRE] + ch2 + tail[1] + tail[2];
-            node.post = fields[I_FIELD_POST] + ch2 + tail[1] + tail[2];
-            AddNode(index, node);
-        } else if (tail.size() >= 2 && tail[1] == ch3) {
-            // 終止形「た」「だ」
-            node.katsuyou = SHUUSHI_KEI;
-            node.pre = fields[I_FIELD_PRE] + ch2 + tail[1];
-            node.post = fields[I_FIELD_POST] + ch2 + tail[1];
-            AddNode(index, node);
-            // 連用形「た」「だ」
-            node.katsuyou = RENYOU_KEI;
-            node.pre = fields[I_FIELD_PRE] + ch2 + tail[1];
-            node.post = fields[I_FIELD_POST] + ch2 + tail[1];
-            AddNode(index, node);
-        } else {
-            if (tail.size() >= 5 && (tail.substr(1, 4) == L"ちゃった" || tail.substr(1, 4) == L"ちまった")) {
-                // 終止形「～ちゃった」「～ちまった」
-                node.katsuyou = SHUUSHI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            } else if (tail.size() >= 5 && (tail.substr(1, 4) == L"じゃった" || tail.substr(1, 4) == L"じまった")) {
-                // 終止形「～じゃった」「～じまった」
-                node.katsuyou = SHUUSHI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            } else if (tail.size() >= 4 && (tail.substr(1, 3) == L"ちゃう" || tail.substr(1, 3) == L"ちまう")) {
-                // 終止形「～ちゃう」「～ちまう」
-                node.katsuyou = SHUUSHI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            } else if (tail.size() >= 4 && (tail.substr(1, 3) == L"じゃう" || tail.substr(1, 3) == L"じまう")) {
-                // 終止形「～じゃう」「～じまう」
-                node.katsuyou = SHUUSHI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            } else if (tail.size() >= 4 && (tail.substr(1, 3) == L"ちゃえ" || tail.substr(1, 3) == L"ちまえ")) {
-                // 命令形「～ちゃえ」「～ちまえ」
-                node.katsuyou = MEIREI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            } else if (tail.size() >= 4 && (tail.substr(1, 3) == L"じゃえ" || tail.substr(1, 3) == L"じまえ")) {
-                // 命令形「～じゃえ」「～じまえ」
-                node.katsuyou = MEIREI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            } else if (tail.size() >= 4 && (tail.substr(1, 3) == L"ちゃい" || tail.substr(1, 3) == L"ちまい")) {
-                // 命令形「～ちゃい」「～ちまい」
-                node.katsuyou = MEIREI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            } else if (tail.size() >= 4 && (tail.substr(1, 3) == L"じゃい" || tail.substr(1, 3) == L"じまい")) {
-                // 命令形「～じゃい」「～じまい」
-                node.katsuyou = MEIREI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch2 + tail.substr(1, 4);
-                node.post = fields[I_FIELD_POST] + ch2 + tail.substr(1, 4);
-                AddNode(index, node);
-            }
-        }
-    }
-
-    // 五段動詞の終止形。「動く」「聞き取る」
-    // 五段動詞の連体形。「動く(とき)」「聞き取る(とき)」
-    do {
-        WCHAR ch = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_U);
-        if (tail.size() <= 0 || tail[0] != ch)
-            break;
-
-        node.katsuyou = SHUUSHI_KEI;
-        node.pre = fields[I_FIELD_PRE] + ch;
-        node.post = fields[I_FIELD_POST] + ch;
-        AddNode(index, node);
-
-        node.katsuyou = RENTAI_KEI;
-        AddNode(index, node);
-
-        // 「動くよ」「動くね」「動くな」「動くぞ」
-        if (tail.size() < 2 ||
-            (tail[1] != L'よ' && tail[1] != L'ね' && tail[1] != L'な' && tail[1] != L'ぞ'))
-                break;
-        node.pre += tail[1];
-        node.post += tail[1];
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-    } while (0);
-
-    // 五段動詞の仮定形。「動く」→「動け(ば)」、「聞き取る」→「聞き取れ(ば)」
-    // 五段動詞の命令形。
-    // 「動く」→「動け」「動けよ」、「聞き取る」→「聞き取れ」「聞き取れよ」
-    do {
-        WCHAR ch = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_E);
-        if (tail.size() >= 1) {
-            if (tail[0] == ch) {
-                node.katsuyou = KATEI_KEI;
-                node.pre = fields[I_FIELD_PRE] + ch;
-                node.post = fields[I_FIELD_POST] + ch;
-                AddNode(index, node);
-
-                node.katsuyou = MEIREI_KEI;
-                AddNode(index, node);
-
-                if (tail.size() >= 2 && (tail[1] == L'よ' || tail[1] == L'や')) {
-                    node.pre += tail[1];
-                    node.post += tail[1];
-                    AddNode(index, node);
-                }
-            }
-            // 「くだされ」→「ください」
-            // 「なされ」→「なさい」
-            std::wstring pre = fields[I_FIELD_PRE];
-            if (pre[pre.size() - 1] == L'さ' && ch == L'れ') {
-                ch = L'い';
-                if (tail[0] == ch) {
-                    node.katsuyou = MEIREI_KEI;
-                    node.pre = fields[I_FIELD_PRE] + ch;
-                    node.post = fields[I_FIELD_POST] + ch;
-                    AddNode(index, node);
-                }
-            }
-        }
-    } while (0);
-
-    // 五段動詞の命令形。「動く」→「動こう」「動こうよ」、「聞き取る」→「聞き取ろう」「聞き取ろうよ」
-    do {
-        WCHAR ch = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_O);
-        if (tail.size() < 2 || tail[0] != ch || tail[1] != L'う')
-            break;
-        node.katsuyou = MEIREI_KEI;
-        node.pre = fields[I_FIELD_PRE] + ch + L'う';
-        node.post = fields[I_FIELD_POST] + ch + L'う';
-        AddNode(index, node);
-
-        if (tail.size() < 3 ||
-            (tail[2] != L'よ' && tail[2] != L'や' && tail[2] != L'な' && tail[2] != L'ね'))
-            break;
-        node.pre += tail[2];
-        node.post += tail[2];
-        AddNode(index, node);
-    } while (0);
-
-    // 五段動詞の名詞形。
-    // 「動く(五段)」→「動き(名詞)」「動き方(名詞)」、
-    // 「聞き取る(五段)」→「聞き取り(名詞)」「聞き取り方(名詞)」など。
-    node.bunrui = HB_MEISHI;
-    WCHAR ch1 = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_I);
-    do {
-        if (tail.empty() || tail[0] != ch1)
-            break;
-        node.pre = fields[I_FIELD_PRE] + ch1;
-        node.post = fields[I_FIELD_POST] + ch1;
-        node.deltaCost = deltaCost + 40;
-        AddNode(index, node);
-
-        if (tail[1] != L'か' || tail[2] != L'た')
-            break;
-        node.pre += L"かた";
-        node.post += L"方";
-        node.deltaCost = deltaCost;
-        AddNode(index, node);
-    } while (0);
-
-    do {
-        if (tail.empty() || tail[0] != ch1)
-            break;
-        // 「動きやすい」「聞き取りやすい」
-        if (tail.size() >= 3 && tail.substr(1, 2) == L"やす") {
-            WStrings new_fields = fields;
-            new_fields[I_FIELD_PRE] += ch;
-            new_fields[I_FIELD_POST] += ch;
-            new_fields[I_FIELD_PRE] += L"やす";
-            new_fields[I_FIELD_POST] += L"やす";
-            DoIkeiyoushi(index, new_fields, deltaCost);
-
-            new_fields = fields;
-            new_fields[I_FIELD_PRE] += ch;
-            new_fields[I_FIELD_POST] += ch;
-            new_fields[I_FIELD_PRE] += L"やす";
-            new_fields[I_FIELD_POST] += L"易い";
-            DoIkeiyoushi(index, new_fields, deltaCost + 10);
-        }
-
-        // 「動きにくい」「聞き取りにくい」
-        if (tail.size() >= 3 && tail.substr(1, 2) == L"にく") {
-            WStrings new_fields = fields;
-            new_fields[I_FIELD_PRE] += ch;
-            new_fields[I_FIELD_POST] += ch;
-            new_fields[I_FIELD_PRE] += L"にく";
-            new_fields[I_FIELD_POST] += L"にく";
-            DoIkeiyoushi(index, new_fields, deltaCost);
-
-            new_fields = fields;
-            new_fields[I_FIELD_PRE] += ch;
-            new_fields[I_FIELD_POST] += ch;
-            new_fields[I_FIELD_PRE] += L"にく";
-            new_fields[I_FIELD_POST] += L"難";
-            DoIkeiyoushi(index, new_fields, deltaCost + 10);
-        }
-
-        // 「動きづらい」「聞き取りづらい」
-        // 「動きにくい」「聞き取りにくい」
-        if (tail.size() >= 3 && tail.substr(1, 2) == L"づら") {
-            WStrings new_fields = fields;
-            new_fields[I_FIELD_PRE] += ch;
-            new_fields[I_FIELD_POST] += ch;
-            new_fields[I_FIELD_PRE] += L"づら";
-            new_fields[I_FIELD_POST] += L"づら";
-            DoIkeiyoushi(index, new_fields, deltaCost);
-
-            new_fields = fields;
-            new_fields[I_FIELD_PRE] += ch;
-            new_fields[I_FIELD_POST] += ch;
-            new_fields[I_FIELD_PRE] += L"づら";
-            new_fields[I_FIELD_POST] += L"辛";
-            DoIkeiyoushi(index, new_fields, deltaCost + 10);
-        }
-    } while (0);
-
-    // 「動く(五段)」→「動ける(一段)」、
-    // 「聞く(五段)」→「聞ける(一段)」など。
-    do {
-        WCHAR ch = ARRAY_AT_AT(s_hiragana_table, node.gyou, DAN_E);
-        if (tail.empty() || tail[0] != ch)
-            break;
-        WStrings new_fields = fields;
-        new_fields[I_FIELD_PRE] += ch;
-        new_fields[I_FIELD_POST] += ch;
-        DoIchidanDoushi(index, new_fields, deltaCost + 30);
-    } while (0);
-} // Lattice::DoGodanDoushi
-
-// 一段動詞を変換する。
-void Lattice::DoIchidanDoushi(size_t index, const WStrings& fields, INT deltaCost)
-{
-    FOOTMARK();
-    ASSERT(fields.size() == NUM_FIELDS);
-    ASSERT(fields[I_FIELD_PRE].size());
-    size_t length = fields[I_FIELD_PRE].size();
-    // 区間チェック。
-    if (index + length > m_pre.size()) {
-        return;
-    }
-    // 対象のテキストが語幹と一致するか確かめる。
-    if (m_pre.substr(index, length) != fields[I_FIELD_PRE]) {
-        return;
-    }
-    // 語幹の後の部分文字列。
-    std::wstring tail = m_pre.substr(index + length);
-
-    // ラティスノードの準備。
-    LatticeNode node;
-    node.bunrui = HB_ICHIDAN_DOUSHI;
-    node.tags = fields[I_FIELD_TAGS];
-    node.deltaCost = deltaCost;
-
-    // 一段動詞の未然形。「寄せる」→「寄せ(ない/よう)」、「見る」→「見(ない/よう)」
-    // 一段動詞の連用形。「寄せる」→「寄せ(ます/た/て)」、「見る」→「見(ます/た/て)」
-    // 一段動詞＋「ちゃう」。「寄せる」→「寄せ(ちゃう/ちゃっ)」
-    do {
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
-        node.katsuyou = MIZEN_KEI;
-        AddNode(index, node);
-
-        node.katsuyou = RENYOU_KEI;
-        AddNode(index, node);
-
-        // 「見て」
-        if (tail.size() >= 1 && tail[0] == L'て') {
-            node.pre += tail[0];
-            node.post += tail[0];
-            AddNode(index, node);
-            // 「見ていた」
-            if (tail.size() >= 3 && tail[1] == L'い' && tail[2] == L'た') {
-                node.pre += L"いた";
-                node.post += L"いた";
-                node.katsuyou = SHUUSHI_KEI;
-                AddNode(index, node);
-                // 「見ていたよ」「見ていたな」「見ていたね」
-                if (tail.size() >= 4 && (tail[3] == L'よ' || tail[3] == L'な' || tail[3] == L'ね')) {
-                    node.pre += tail[3];
-                    node.post += tail[3];
-                    node.katsuyou = SHUUSHI_KEI;
-                    AddNode(index, node);
-                    // 「見ていたよぉ」「見ていたなー」「見ていたねえ」
-                    if (tail.size() >= 5 &&
-                        (tail[4] == L'ー' ||
-                         tail[4] == L'あ' || tail[4] == L'ぁ' ||
-                         tail[4] == L'え' || tail[4] == L'ぇ' ||
-                         tail[4] == L'お' || tail[4] == L'ぉ'))
-                    {
-                        node.pre += tail[4];
-                        node.post += tail[4];
-                        node.katsuyou = SHUUSHI_KEI;
-                        AddNode(index, node);
-                    }
-                }
-            }
-            // 「見てた」
-            if (tail.size() >= 2 && tail[1] == L'た') {
-                node.pre = fields[I_FIELD_PRE] + L"てた";
-                node.post = fields[I_FIELD_POST] + L"てた";
-                node.katsuyou = SHUUSHI_KEI;
-                AddNode(index, node);
-                // 「見てたよ」「見てたな」「見てたね」
-                if (tail.size() >= 3 && (tail[2] == L'よ' || tail[2] == L'な' || tail[2] == L'ね')) {
-                    node.pre += tail[2];
-                    node.post += tail[2];
-                    node.katsuyou = SHUUSHI_KEI;
-                    AddNode(index, node);
-                    // 「見てたよぉ」「見てたなー」「見てたねえ」
-                    if (tail.size() >= 4 &&
-                        (tail[3] == L'ー' ||
-                         tail[3] == L'あ' || tail[3] == L'ぁ' ||
-                         tail[3] == L'え' || tail[3] == L'ぇ' ||
-                         tail[3] == L'お' || tail[3] == L'ぉ'))
-                    {
-                        node.pre += tail[3];
-                        node.post += tail[3];
-                        node.katsuyou = SHUUSHI_KEI;
-                        AddNode(index, node);
-                    }
-                }
-            }
-        }
-        // 終止形「見ない」
-        if (tail.size() >= 2 && tail.substr(0, 2) == L"ない") {
-            node.pre = fields[I_FIELD_PRE] + L"ない";
-            node.post = fields[I_FIELD_POST] + L"ない";
-            node.katsuyou = SHUUSHI_KEI;
-            AddNode(index, node);
-        }
-        // 終止形「見ちゃう」「見ちまえ」
-        if (tail.size() >= 3 && (tail.substr(0, 3) == L"ちゃう" || tail.substr(0, 3) == L"ちまう")) {
-            HinshiBunrui old_bunrui = node.bunrui; // 保存
-            node.bunrui = HB_GODAN_DOUSHI;
-            node.pre = fields[I_FIELD_PRE] + tail.substr(0, 3);
-            node.post = fields[I_FIELD_POST] + tail.substr(0, 3);
-            node.katsuyou = SHUUSHI_KEI;
-            AddNode(index, node);
-            node.bunrui = old_bunrui; // 元に戻す
-        }
-        // 命令形「見ちゃえ」「見ちまえ」
-        if (tail.size() >= 3 && (tail.substr(0, 3) == L"ちゃえ" || tail.substr(0, 3) == L"ちまえ")) {
-            HinshiBunrui old_bunrui = node.bunrui; // 保存
-            node.bunrui = HB_GODAN_DOUSHI;
-            node.pre = fields[I_FIELD_PRE] + tail.substr(0, 3);
-            node.post = fields[I_FIELD_POST] + tail.substr(0, 3);
-            node.katsuyou = MEIREI_KEI;
-            AddNode(index, node);
-            node.bunrui = old_bunrui; // 元に戻す
-        }
-        // 命令形「見ちゃい」「見ちまい」
-        if (tail.size() >= 3 && (tail.substr(0, 3) == L"ちゃい" || tail.substr(0, 3) == L"ちまい")) {
-            HinshiBunrui old_bunrui = node.bunrui; // 保存
-            node.bunrui = HB_GODAN_DOUSHI;
-            node.pre = fields[I_FIELD_PRE] + tail.substr(0, 3);
-            node.post = fields[I_FIELD_POST] + tail.substr(0, 3);
-            node.katsuyou = MEIREI_KEI;
-            AddNode(index, node);
-            node.bunrui = old_bunrui; // 元に戻す
-        }
-        // 終止形「見ちゃった」「見ちまった」
-        if (tail.size() >= 4 && (tail.substr(0, 4) == L"ちゃった" || tail.substr(0, 4) == L"ちまった")) {
-            HinshiBunrui old_bunrui = node.bunrui; // 保存
-            node.bunrui = HB_GODAN_DOUSHI;
-            node.pre = fields[I_FIELD_PRE] + tail.substr(0, 4);
-            node.post = fields[I_FIELD_POST] + tail.substr(0, 4);
-            node.katsuyou = SHUUSHI_KEI;
-            AddNode(index, node);
-            node.bunrui = old_bunrui; // 元に戻す
-         }
-    } while (0);
-
-    // 「～やすい」「～にくい」「～づらい」で、い形容詞の形。
-    if (tail.size() >= 2) {
-        // 「寄せやすい」
-        if (tail.substr(0, 2) == L"やす") {
-            WStrings new_fields = fields;
-            new_fields[I_FIELD_PRE] += L"やす";
-            new_fields[I_FIELD_POST] += L"やす";
-            DoIkeiyoushi(index, new_fields, deltaCost);
-
-            new_fields = fields;
-            new_fields[I_FIELD_PRE] += L"やす";
-            new_fields[I_FIELD_POST] += L"易";
-            DoIkeiyoushi(index, new_fields, deltaCost + 10);
-        }
-        // 「寄せにくい」
-        if (tail.substr(0, 2) == L"にく") {
-            WStrings new_fields = fields;
-            new_fields[I_FIELD_PRE] += L"にく";
-            new_fields[I_FIELD_POST] += L"にく";
-            DoIkeiyoushi(index, new_fields, deltaCost);
-
-            new_fields = fields;
-            new_fields[I_FIELD_PRE] += L"にく";
-            new_fields[I_FIELD_POST] += L"難";
-            DoIkeiyoushi(index, new_fields, deltaCost + 10);
-        }
-        // 「寄せづらい」
-        if (tail.substr(0, 2) == L"づら") {
-            WStrings new_fields = fields;
-            new_fields[I_FIELD_PRE] += L"づら";
-            new_fields[I_FIELD_POST] += L"づら";
-            DoIkeiyoushi(index, new_fields, deltaCost);
-
-            new_fields = fields;
-            new_fields[I_FIELD_PRE] += L"づら";
-            new_fields[I_FIELD_POST] += L"辛い";
-            DoIkeiyoushi(index, new_fields, deltaCost + 10);
-        }
-    }
-
-    // 一段動詞の終止形。「寄せる」「見る」
-    // 一段動詞の連体形。「寄せる(とき)」「見る(とき)」
-    do {
-        if (tail.empty() || tail[0] != L'る') break;
-        node.pre = fields[I_FIELD_PRE] + L'る';
-        node.post = fields[I_FIELD_POST] + L'る';
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-
-        node.katsuyou = RENTAI_KEI;
-        AddNode(index, node);
-
-        // 「見るよ」「見るね」「見るな」「見るぞ」
-        if (tail.size() < 2 ||
-            (tail[1] != L'よ' && tail[1] != L'ね' && tail[1] != L'な' && tail[1] != L'ぞ'))
-                break;
-        node.pre += tail[1];
-        node.post += tail[1];
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-    } while (0);
-
-    // 一段動詞の仮定形。「寄せる」→「寄せれ(ば)」、「見る」→「見れ(ば)」
-    do {
-        if (tail.empty() || tail[0] != L'れ') break;
-        node.katsuyou = KATEI_KEI;
-        node.pre = fields[I_FIELD_PRE] + L'れ';
-        node.post = fields[I_FIELD_POST] + L'れ';
-        AddNode(index, node);
-    } while (0);
-
-    // 一段動詞の命令形。
-    // 「寄せる」→「寄せろ」「寄せろよ」、「見る」→「見ろ」「見ろよ」
-    node.katsuyou = MEIREI_KEI;
-    do {
-        if (tail.empty() || tail[0] != L'ろ') break;
-        node.pre = fields[I_FIELD_PRE] + L'ろ';
-        node.post = fields[I_FIELD_POST] + L'ろ';
-        AddNode(index, node);
-
-        if (tail.size() < 2 || (tail[1] != L'よ' && tail[1] != L'や')) break;
-        node.pre += tail[1];
-        node.post += tail[1];
-        AddNode(index, node);
-    } while (0);
-    // 「寄せる」→「寄せよ」、「見る」→「見よ」
-    do {
-        if (tail.empty() || tail[0] != L'よ') break;
-        node.pre = fields[I_FIELD_PRE] + L'よ';
-        node.post = fields[I_FIELD_POST] + L'よ';
-        AddNode(index, node);
-    } while (0);
-
-    // 一段動詞の名詞形。
-    // 「寄せる」→「寄せ」「寄せ方」、「見る」→「見」「見方」
-    node.bunrui = HB_MEISHI;
-    do {
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
-        AddNode(index, node);
-
-        if (tail.empty() || tail[0] != L'か' || tail[1] != L'た') break;
-        node.pre += L"かた";
-        node.post += L"方";
-        AddNode(index, node);
-    } while (0);
-} // Lattice::DoIchidanDoushi
-
-// カ変動詞を変換する。
-void Lattice::DoKahenDoushi(size_t index, const WStrings& fields, INT deltaCost)
-{
-    FOOTMARK();
-    ASSERT(fields.size() == NUM_FIELDS);
-    ASSERT(fields[I_FIELD_PRE].size());
-    size_t length = fields[I_FIELD_PRE].size();
-    // 区間チェック。
-    if (index + length > m_pre.size()) {
-        return;
-    }
-    // 対象のテキストが語幹と一致するか確かめる。
-    if (m_pre.substr(index, length) != fields[I_FIELD_PRE]) {
-        return;
-    }
-    // 語幹の後の部分文字列。
-    std::wstring tail = m_pre.substr(index + length);
-
-    // ラティスノードの準備。
-    LatticeNode node;
-    node.bunrui = HB_KAHEN_DOUSHI;
-    node.tags = fields[I_FIELD_TAGS];
-    node.deltaCost = deltaCost;
-
-    // 「くる」「こ(ない)」「き(ます)」などと、語幹が一致しないので、
-    // 実際の辞書では「来い」を登録するなど回避策を施している。
-
-    // 終止形と連用形「～来る」
-    do {
-        if (tail.size() < 2 || tail[0] != L'く' || tail[1] != L'る') break;
-        node.pre = fields[I_FIELD_PRE] + L"くる";
-        node.post = fields[I_FIELD_POST] + L"来る";
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-
-        node.katsuyou = RENTAI_KEI;
-        AddNode(index, node);
-
-        // 「来るよ」「来るね」「来るな」「来るぞ」
-        if (tail.size() < 3 ||
-            (tail[2] != L'よ' && tail[2] != L'ね' && tail[2] != L'な' && tail[2] != L'ぞ'))
-                break;
-        node.pre += tail[2];
-        node.post += tail[2];
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-    } while (0);
-    do {
-        if (fields[I_FIELD_PRE] != L"くる") break;
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-
-        node.katsuyou = RENTAI_KEI;
-        AddNode(index, node);
-
-        // 「来るよ」「来るね」「来るな」「来るぞ」
-        if (tail.size() < 1 ||
-            (tail[0] != L'よ' && tail[0] != L'ね' && tail[0] != L'な' && tail[0] != L'ぞ'))
-                break;
-        node.pre += tail[0];
-        node.post += tail[0];
-        node.katsuyou = SHUUSHI_KEI;
-        AddNode(index, node);
-    } while (0);
-
-    // 命令形「～こい」「～こいよ」「～こいや」
-    do {
-        if (tail.size() < 2 || tail[0] != L'こ' || tail[1] != L'い') break;
-        node.pre = fields[I_FIELD_PRE] + L"こい";
-        node.post = fields[I_FIELD_POST] + L"来い";
-        node.katsuyou = MEIREI_KEI;
-        AddNode(index, node);
-
-        if (tail.size() < 3 || (tail[2] != L'よ' && tail[2] != L'や')) break;
-        node.pre += tail[2];
-        node.post += tail[2];
-        AddNode(index, node);
-    } while (0);
-    do {
-        if (fields[I_FIELD_PRE] != L"こい") break;
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
-        node.katsuyou = MEIREI_KEI;
-        AddNode(index, node);
-
-        if (tail.size() < 1 || (tail[0] != L'よ' && tail[0] != L'や')) break;
-        node.pre += tail[0];
-        node.post += tail[0];
-        AddNode(index, node);
-    } while (0);
-
-    // 仮定形「～来れ」
-    do {
-        if (tail.size() < 2 || tail[0] != L'く' || tail[1] != L'れ') break;
-        node.pre = fields[I_FIELD_PRE] + L"くれ";
-        node.post = fields[I_FIELD_POST] + L"来れ";
-        node.katsuyou = KATEI_KEI;
-        AddNode(index, node);
-    } while (0);
-    do {
-        if (fields[I_FIELD_PRE] != L"くれ") break;
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
-        node.katsuyou = KATEI_KEI;
-        AddNode(index, node);
-    } while (0);
-
-    // 未然形「～来」（こ）
-    do {
-        if (tail.size() < 1 || tail[0] != L'こ') break;
-        node.pre = fields[I_FIELD_PRE] + L"こ";
-        node.post = fields[I_FIELD_POST] + L"来";
-        node.katsuyou = MIZEN_KEI;
-        AddNode(index, node);
-        if (tail.substr(0, 3) != L"こさせ") break;
-        node.pre = fields[I_FIELD_PRE] + L"こさせ";
-        node.post = fields[I_FIELD_POST] + L"来させ";
-        AddNode(index, node);
-    } while (0);
-    do {
-        if (fields[I_FIELD_PRE] != L"こ") break;
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
-        node.katsuyou = MIZEN_KEI;
-        AddNode(index, node);
-        if (tail.substr(0, 3) != L"させ") break;
-        node.pre = fields[I_FIELD_PRE] + L"させ";
-        node.post = fields[I_FIELD_POST] + L"させ";
-        AddNode(index, node);
-    } while (0);
-
-    // 連用形「～来」（き）
-    do {
-        if (tail.size() < 1 || tail[0] != L'き') break;
-        node.pre = fields[I_FIELD_PRE] + L"き";
-        node.post = fields[I_FIELD_POST] + L"来";
-        node.katsuyou = RENYOU_KEI;
-        AddNode(index, node);
-    } while (0);
-    do {
-        if (fields[I_FIELD_PRE] != L"き") break;
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
-        node.katsuyou = RENYOU_KEI;
-        AddNode(index, node);
-    } while (0);
-} // Lattice::DoKahenDoushi
-
-// サ変動詞を変換する。
-void Lattice::DoSahenDoushi(size_t index, const WStrings& fields, INT deltaCost)
-{
-    FOOTMARK();
-    ASSERT(fields.size() == NUM_FIELDS);
-    ASSERT(fields[I_FIELD_PRE].size());
-    size_t length = fields[I_FIELD_PRE].size();
-    // 区間チェック。
-    if (index + length > m_pre.size()) {
-        return;
-    }
-    // 対象のテキストが語幹と一致するか確かめる。
-    if (m_pre.substr(index, length) != fields[I_FIELD_PRE]) {
-        return;
-    }
-    // 変換前の語幹。
-    std::wstring pre = fields[I_FIELD_PRE];
-    // 変換後の語幹。
-    std::wstring post = fields[I_FIELD_POST];
-    // 語幹の後の部分文字列。
-    std::wstring tail = m_pre.substr(index + length);
-
-    // ラティスノードの準備。
-    LatticeNode node;
-    node.bunrui = HB_SAHEN_DOUSHI;
-    node.tags = fields[I_FIELD_TAGS];
-    node.pre = pre;
-    node.post = post;
-    node.deltaCost = deltaCost;
-
-    // カ変動詞と同様に、サ変動詞は語幹が変化するので、「回避策」が必要になる。
-    // 回避策として、辞書にそれぞれ異なる語幹を登録している。
-
-    WCHAR lastChar = pre[pre.size() - 1];
-
-    // 未然形「～さ」「～ざ」
-    // 未然形「～し」「～じ」
-    // 未然形「～せ」「～ぜ」
-    node.katsuyou = MIZEN_KEI;
-    if (tail.size() >= 1) {
-        node.deltaCost += 50;
-        if (node.gyou == GYOU_ZA) {
-            if (lastChar == L'ざ' || lastChar == L'じ' || lastChar == L'ぜ')
-                AddNode(index, node);
-        } else {
-            if (lastChar == L'さ' || lastChar == L'し' || lastChar == L'せ')
-                AddNode(index, node);
-        }
-        node.deltaCost -= 50;
-    }
+    // 語幹の後の部分文字列。コピーはしない。
+    const WCHAR *tail = m_pre.c_str() + index + length;
+    size_t tail_len = m_pre.size() - (index + length);
 
-    // 連用形「～し」「～じ」
-    node.katsuyou = RENYOU_KEI;
-    if (tail.size() >= 1) {
-        node.deltaCost += 50;
-        if (node.gyou == GYOU_ZA) {
-            if (lastChar == L'じ')
-                AddNode(index, node);
-        } else {
-            if (lastChar == L'し')
-                AddNode(index, node);
-        }
-        node.deltaCost -= 50;
-    }
-
-    if (pre.size() >= 2) {
-        std::wstring lastTwoChars = pre.substr(pre.size() - 2);
-        // 終止形「～する」「～ずる」
-        // 連用形「～する(とき)」「～ずる(とき)」
-        if (node.gyou == GYOU_ZA) {
-            if (lastTwoChars == L"ずる") {
-                node.katsuyou = SHUUSHI_KEI;
-                AddNode(index, node);
-
-                node.katsuyou = RENYOU_KEI;
-                AddNode(index, node);
-
-                // 「ずるな」「ずるよ」
-                if (tail.size() && (tail[0] == L'な' || tail[0] == L'よ')) {
-                    node.pre = pre + tail[0];
-                    node.post = post + tail[0];
-                    AddNode(index, node);
-                }
-                // 「ずるなよ」
-                if (tail.size() >= 2 && tail.substr(0, 2) == L"なよ") {
-                    node.pre = pre + L"なよ";
-                    node.post = post + L"なよ";
-                    AddNode(index, node);
-                }
-            }
-        } else {
-            if (lastTwoChars == L"する") {
-                node.katsuyou = SHUUSHI_KEI;
-                AddNode(index, node);
-
-                node.katsuyou = RENYOU_KEI;
-                AddNode(index, node);
-
-                // 「するな」「するよ」
-                if (tail.size() && (tail[0] == L'な' || tail[0] == L'よ')) {
-                    node.pre = pre + tail[0];
-                    node.post = post + tail[0];
-                    AddNode(index, node);
-                }
-                // 「するなよ」
-                if (tail.size() >= 2 && tail.substr(0, 2) == L"なよ") {
-                    node.pre = pre + L"なよ";
-                    node.post = post + L"なよ";
-                    AddNode(index, node);
-                }
-            }
-        }
+    // 状態機械で一致する規則を求める。
+    mz_make_literal_maps();
+    Gyou gyou = (Gyou)HIBYTE(fields[I_FIELD_HINSHI][0]);
+    KATSUYOU_MATCH matches[KATSUYOU_MAX_RULES];
+    size_t count = mz_katsuyou_match(table, gyou, stem, tail, tail_len, matches);
+    if (!count)
+        return;
 
-        // 仮定形「～すれ(ば)」「～ずれ(ば)」
-        node.katsuyou = KATEI_KEI;
-        if (node.gyou == GYOU_ZA) {
-            if (lastTwoChars == L"ずれ") {
-                node.pre = pre;
-                node.post = post;
-                AddNode(index, node);
-            }
-        } else {
-            if (lastTwoChars == L"すれ") {
-                node.pre = pre;
-                node.post = post;
-                AddNode(index, node);
-            }
-        }
+    // ラティスノードの準備。
+    LatticeNode node;
+    node.clear();
+    node.tags = mz_tags_from_string(fields[I_FIELD_TAGS]);
+    node.gyou = gyou;
+    std::wstring post;
 
-        // 命令形「～しろ」「～じろ」「せよ」「ぜよ」「せい」「ぜい」
-        node.katsuyou = MEIREI_KEI;
-        node.deltaCost += 200;
-        if (node.gyou == GYOU_ZA) {
-            if (lastTwoChars == L"じろ" || lastTwoChars == L"ぜよ" || lastTwoChars == L"ぜい") {
-                node.pre = pre;
-                node.post = post;
-                AddNode(index, node);
+    for (size_t i = 0; i < count; ++i) {
+        const KATSUYOU_RULE& rule = *matches[i].rule;
+        const size_t len = matches[i].length;
+        if (rule.flags & KRF_DERIVE) {
+            // 語幹を伸ばして、別の品詞として処理する。
+            WStrings new_fields = fields;
+            if (!(rule.flags & KRF_PEEK)) {
+                new_fields[I_FIELD_PRE].append(tail, len);
+                mz_katsuyou_post(new_fields[I_FIELD_POST], rule, tail, len, gyou);
             }
-        } else {
-            if (lastTwoChars == L"しろ" || lastTwoChars == L"せよ" || lastTwoChars == L"せい") {
-                node.pre = pre;
-                node.post = post;
-                AddNode(index, node);
+            switch (rule.bunrui) {
+            case HB_MEISHI:
+                DoMeishi(index, new_fields, deltaCost + rule.cost);
+                break;
+            case HB_IKEIYOUSHI:
+                DoIkeiyoushi(index, new_fields, deltaCost + rule.cost);
+                break;
+            case HB_NAKEIYOUSHI:
+                DoNakeiyoushi(index, new_fields, deltaCost + rule.cost);
+                break;
+            case HB_ICHIDAN_DOUSHI:
+                DoIchidanDoushi(index, new_fields, deltaCost + rule.cost);
+                break;
+            default:
+                ASSERT(0);
+                break;
             }
+            continue;
         }
-        node.deltaCost -= 200;
+        node.bunrui = (HinshiBunrui)rule.bunrui;
+        node.katsuyou = (KatsuyouKei)rule.katsuyou;
+        node.deltaCost = deltaCost + rule.cost;
+        node.pre_len = (WORD)(length + len);
+        post = fields[I_FIELD_POST];
+        mz_katsuyou_post(post, rule, tail, len, gyou);
+        node.SetPost(post);
+        AddNode(index, node);
     }
+} // Lattice::DoKatsuyou
 
-    if (pre.size() >= 3) {
-        std::wstring lastTriChars = pre.substr(pre.size() - 3);
-        if (node.gyou == GYOU_ZA) {
-            if (lastTriChars == L"じよう") {
-                node.pre = pre;
-                node.post = post;
-                AddNode(index, node);
-            }
-        } else {
-            if (lastTriChars == L"しよう") {
-                node.pre = pre;
-                node.post = post;
-                AddNode(index, node);
-            }
-        }
-    }
+// イ形容詞を変換する。
+void Lattice::DoIkeiyoushi(size_t index, const WStrings& fields, INT deltaCost)
+{
+    FOOTMARK();
+    DoKatsuyou(index, fields, deltaCost, s_ikeiyoushi_table);
+} // Lattice::DoIkeiyoushi
+
+// ナ形容詞を変換する。
+void Lattice::DoNakeiyoushi(size_t index, const WStrings& fields, INT deltaCost)
+{
+    FOOTMARK();
+    DoKatsuyou(index, fields, deltaCost, s_nakeiyoushi_table);
+} // Lattice::DoNakeiyoushi
+
+// 五段動詞を変換する。
+void Lattice::DoGodanDoushi(size_t index, const WStrings& fields, INT deltaCost)
+{
+    FOOTMARK();
+    DoKatsuyou(index, fields, deltaCost, s_godan_table);
+} // Lattice::DoGodanDoushi
+
+// 一段動詞を変換する。
+void Lattice::DoIchidanDoushi(size_t index, const WStrings& fields, INT deltaCost)
+{
+    FOOTMARK();
+    DoKatsuyou(index, fields, deltaCost, s_ichidan_table);
+} // Lattice::DoIchidanDoushi
+
+// カ変動詞を変換する。
+void Lattice::DoKahenDoushi(size_t index, const WStrings& fields, INT deltaCost)
+{
+    FOOTMARK();
+    DoKatsuyou(index, fields, deltaCost, s_kahen_table);
+} // Lattice::DoKahenDoushi
+
+// サ変動詞を変換する。
+void Lattice::DoSahenDoushi(size_t index, const WStrings& fields, INT deltaCost)
+{
+    FOOTMARK();
+    DoKatsuyou(index, fields, deltaCost, s_sahen_table);
 } // Lattice::DoSahenDoushi
 
 void Lattice::DoMeishi(size_t index, const WStrings& fields, INT deltaCost)
@@ -3654,24 +3250,25 @@ void Lattice::DoMeishi(size_t index, const WStrings& fields, INT deltaCost)
 
     // ラティスノードの準備。
     LatticeNode node;
+    node.clear();
     node.bunrui = HB_MEISHI;
-    node.tags = fields[I_FIELD_TAGS];
+    node.tags = mz_tags_from_string(fields[I_FIELD_TAGS]);
     node.deltaCost = deltaCost;
 
     // 名詞は活用なし。
-    if (node.HasTag(L"[動植物]")) {
+    if (node.HasTag(MZ_TAG_DOUSHOKUBUTSU)) {
         // 動植物名は、カタカナでもよい。
-        node.pre = fields[I_FIELD_PRE];
-        node.post = mz_lcmap(fields[I_FIELD_PRE], LCMAP_KATAKANA | LCMAP_FULLWIDTH);
+        std::wstring katakana = mz_lcmap(fields[I_FIELD_PRE], LCMAP_KATAKANA | LCMAP_FULLWIDTH);
+        node.SetPre(fields[I_FIELD_PRE]);
+        node.SetPost(katakana);
         AddNode(index, node);
 
         node.deltaCost += 30;
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
+        node.SetPost(fields[I_FIELD_POST]);
         AddNode(index, node);
     } else {
-        node.pre = fields[I_FIELD_PRE];
-        node.post = fields[I_FIELD_POST];
+        node.SetPre(fields[I_FIELD_PRE]);
+        node.SetPost(fields[I_FIELD_POST]);
         AddNode(index, node);
     }
 
@@ -3774,20 +3371,22 @@ void Lattice::DoFukushi(size_t index, const WStrings& fields, INT deltaCost)
 
     // ラティスノードの準備。
     LatticeNode node;
+    node.clear();
     node.bunrui = HB_FUKUSHI;
-    node.tags = fields[I_FIELD_TAGS];
+    node.tags = mz_tags_from_string(fields[I_FIELD_TAGS]);
     node.deltaCost = deltaCost;
 
     // 副詞。活用はない。
-    node.pre = fields[I_FIELD_PRE];
-    node.post = fields[I_FIELD_POST];
+    node.SetPre(fields[I_FIELD_PRE]);
+    node.SetPost(fields[I_FIELD_POST]);
     AddNode(index, node);
 
     // 副詞なら最後に「っと」「って」を付けてもいい。
     do {
         if (tail.size() < 2 || tail[0] != L'っ' || (tail[1] != L'と' && tail[1] != L'て')) break;
-        node.pre = fields[I_FIELD_PRE] + tail[0] + tail[1];
-        node.post = fields[I_FIELD_POST] + tail[0] + tail[1];
+        std::wstring post = fields[I_FIELD_POST] + tail[0] + tail[1];
+        node.pre_len += 2;
+        node.SetPost(post);
         AddNode(index, node);
     } while (0);
 }
@@ -3812,12 +3411,13 @@ void Lattice::DoFields(size_t index, const WStrings& fields, INT deltaCost)
 
     // ラティスノードの準備。
     LatticeNode node;
-    node.pre = fields[I_FIELD_PRE];
-    node.post = fields[I_FIELD_POST];
+    node.clear();
+    node.SetPre(fields[I_FIELD_PRE]);
+    node.SetPost(fields[I_FIELD_POST]);
     WORD w = fields[I_FIELD_HINSHI][0];
-    node.bunrui = (HinshiBunrui)LOBYTE(w);
-    node.gyou = (Gyou)HIBYTE(w);
-    node.tags = fields[I_FIELD_TAGS];
+    node.bunrui = LOBYTE(w);
+    node.gyou = HIBYTE(w);
+    node.tags = mz_tags_from_string(fields[I_FIELD_TAGS]);
     node.deltaCost = deltaCost;
 
     // 品詞分類で場合分けする。
@@ -3898,8 +3498,8 @@ void Lattice::Dump(int num)
     for (size_t i = 0; i < length; ++i) {
         DPRINTW(L"Lattice chunk #%d:", int(i));
         for (size_t k = 0; k < ARRAY_AT(m_chunks, i).size(); ++k) {
-            DPRINTW(L" %s(%s)", ARRAY_AT_AT(m_chunks, i, k)->post.c_str(),
-                        mz_bunrui_to_string(ARRAY_AT_AT(m_chunks, i, k)->bunrui));
+            DPRINTW(L" %s(%s)", ARRAY_AT_AT(m_chunks, i, k)->GetPost().c_str(),
+                        mz_bunrui_to_string((HinshiBunrui)ARRAY_AT_AT(m_chunks, i, k)->bunrui));
         }
         DPRINTW(L"\n");
     }
@@ -3907,26 +3507,76 @@ void Lattice::Dump(int num)
 
 //////////////////////////////////////////////////////////////////////////////
 
-// 逆向きブランチ群を追加する。
+static inline bool lattice_compare_by_serial(const LatticeNode *node0, const LatticeNode *node1) {
+    return node0->serial < node1->serial;
+}
+
+// 逆向きブランチ群を追加する。ptr0から辿れるノードだけが対象になる。
+// 枝は必ず後ろの位置へ向かうので、位置の順に一度ずつ見ればよい。
 void Lattice::MakeReverseBranches(LatticeNode *ptr0)
 {
     ASSERT(ptr0);
 
-    if (!ptr0->linked || ptr0->bunrui == HB_TAIL)
-        return;
+    for (size_t index = 0; index < m_chunks.size(); ++index) {
+        LatticeChunk& chunk1 = ARRAY_AT(m_chunks, index);
+        for (size_t i = 0; i < chunk1.size(); ++i) {
+            chunk1[i]->reverse_begin = chunk1[i]->reverse_count = 0;
+        }
+    }
 
-    size_t i = 0;
-    branches_t::iterator it, end = ptr0->branches.end();
-    for (it = ptr0->branches.begin(); it != end; ++it) {
-        LatticeNodePtr& ptr1 = *it;
-        if (ptr1->reverse_branches.count(ptr0) == 0) {
-            ptr1->reverse_branches.insert(ptr0);
-            MakeReverseBranches(ptr1.get());
+    // 辿れるノードから、逆向きブランチの数を数える。
+    // 始点以外では、逆向きブランチがあることが辿れることを意味する。
+    MakeReverseBranchesPass(ptr0, NULL);
+
+    // 数の累計から各ノードの範囲を決める。
+    size_t total = 0;
+    for (size_t index = 0; index < m_chunks.size(); ++index) {
+        LatticeChunk& chunk1 = ARRAY_AT(m_chunks, index);
+        for (size_t i = 0; i < chunk1.size(); ++i) {
+            chunk1[i]->reverse_begin = (DWORD)total;
+            total += chunk1[i]->reverse_count;
+        }
+    }
+    m_reverse_branches.assign(total, NULL);
+
+    // 前のノードを詰めて、追加した順に並べる。コストが同じなら先に追加したものが選ばれる。
+    std::vector<WORD> filled(m_nodes_added + 1);
+    MakeReverseBranchesPass(ptr0, &filled[0]);
+    for (size_t index = 0; index < m_chunks.size(); ++index) {
+        LatticeChunk& chunk1 = ARRAY_AT(m_chunks, index);
+        for (size_t i = 0; i < chunk1.size(); ++i) {
+            branches_t::iterator it = m_reverse_branches.begin() + chunk1[i]->reverse_begin;
+            std::sort(it, it + chunk1[i]->reverse_count, lattice_compare_by_serial);
         }
-        ++i;
     }
 } // Lattice::MakeReverseBranches
 
+// MakeReverseBranchesの下請け。filledがNULLなら数を数え、そうでなければ範囲に詰める。
+// filledは追加した順番ごとの、詰めた数。
+void Lattice::MakeReverseBranchesPass(LatticeNode *ptr0, WORD *filled)
+{
+    for (size_t index = 0; index <= m_chunks.size(); ++index) {
+        size_t count = (index == 0) ? 1 : m_chunks[index - 1].size();
+        for (size_t i = 0; i < count; ++i) {
+            LatticeNode *ptr1 = (index == 0) ? ptr0 : m_chunks[index - 1][i];
+            if (ptr1 != ptr0 && !ptr1->reverse_count)
+                continue;
+            if (!ptr1->linked || ptr1->bunrui == HB_TAIL)
+                continue;
+            for (size_t k = 0; k < ptr1->branch_count; ++k) {
+                LatticeNode *ptr2 = Branch(ptr1, k);
+                if (filled) {
+                    WORD& n = filled[ptr2->serial];
+                    if (n < ptr2->reverse_count)
+                        m_reverse_branches[ptr2->reverse_begin + n++] = ptr1;
+                } else if (ptr2->reverse_count < MAXWORD) {
+                    ptr2->reverse_count++;
+                }
+            }
+        }
+    }
+} // Lattice::MakeReverseBranchesPass
+
 // 文節境界スコアの計算（改良版）。
 // 位置posが文節の境界となる適切さを評価する。
 // スコアが低いほど境界になりやすい。
@@ -3947,10 +3597,9 @@ INT Lattice::CalculateClauseBoundaryScore(size_t pos) const
 
     // この位置で終わるノードがあるか確認
     bool has_ending_jiritsugo = false;  // 自立語で終わるか
-    bool has_fuzokugo = false;           // 付属語があるか
 
     for (size_t i = 0; i < chunk.size(); ++i) {
-        const LatticeNode* node = chunk[i].get();
+        const LatticeNode* node = chunk[i];
         if (!node->linked) continue;
 
         // 自立語（名詞、動詞、形容詞など）で終わる場合は境界候補
@@ -3969,7 +3618,6 @@ INT Lattice::CalculateClauseBoundaryScore(size_t pos) const
 
         // 付属語（助詞、助動詞）がある場合
         if (node->IsJoshi() || node->IsJodoushi()) {
-            has_fuzokugo = true;
             score += 200;  // 付属語の途中なら境界にしにくい
         }
 
@@ -3985,7 +3633,7 @@ INT Lattice::CalculateClauseBoundaryScore(size_t pos) const
         bool next_starts_with_fuzokugo = false;
 
         for (size_t i = 0; i < next_chunk.size(); ++i) {
-            const LatticeNode* next_node = next_chunk[i].get();
+            const LatticeNode* next_node = next_chunk[i];
             if (next_node->IsJoshi() || next_node->IsJodoushi()) {
                 next_starts_with_fuzokugo = true;
                 break;
@@ -4007,13 +3655,12 @@ BOOL Lattice::AddNodesForMulti(const std::wstring& pre)
 
     // ラティスを初期化。
     ASSERT(pre.size() != 0);
-    m_pre = pre; // 変換前の文字列。
-    m_chunks.resize(pre.size() + 1);
+    SetPre(pre); // 変換前の文字列。
 
     WCHAR *dict_data1 = g_basic_dict.Lock(); // 基本辞書をロック。
     if (dict_data1) {
         // ノード群を追加。
-        AddNodesFromDict(0, dict_data1);
+        AddNodesFromDict(0, dict_data1, FindKeyIndex(dict_data1, g_basic_dict.GetLength()));
 
         g_basic_dict.Unlock(dict_data1); // 基本辞書のロックを解除。
     }
@@ -4021,11 +3668,15 @@ BOOL Lattice::AddNodesForMulti(const std::wstring& pre)
     WCHAR *dict_data2 = g_name_dict.Lock(); // 人名・地名辞書をロック。
     if (dict_data2) {
         // ノード群を追加。
-        AddNodesFromDict(0, dict_data2);
+        AddNodesFromDict(0, dict_data2, FindKeyIndex(dict_data2, g_name_dict.GetLength()));
 
         g_name_dict.Unlock(dict_data2); // 人名・地名辞書のロックを解除。
     }
 
+    // 分割辞書からノード群を追加。
+    if (g_domain_dict.IsLoaded())
+        AddNodesFromShards(g_domain_dict, FALSE);
+
     return TRUE;
 } // Lattice::AddNodesForMulti
 
@@ -4036,15 +3687,18 @@ BOOL Lattice::AddNodesForSingle(const std::wstring& pre)
 
     // ラティスを初期化。
     ASSERT(pre.size() != 0);
-    m_pre = pre;
-    m_chunks.resize(pre.size() + 1);
+    SetPre(pre);
 
     BOOL bOK = TRUE;
 
+    // 分割辞書からノード群を追加。先に追加すれば、見つかったときに補完しない。
+    if (g_domain_dict.IsLoaded())
+        AddNodesFromShards(g_domain_dict, TRUE);
+
     WCHAR *dict_data1 = g_basic_dict.Lock(); // 基本辞書をロックする。
     if (dict_data1) {
         // ノード群を追加。
-        if (!AddNodesFromDict(dict_data1)) {
+        if (!AddNodesFromDict(dict_data1, FindKeyIndex(dict_data1, g_basic_dict.GetLength()))) {
             AddComplement(0, pre.size(), pre.size());
         }
 
@@ -4056,7 +3710,7 @@ BOOL Lattice::AddNodesForSingle(const std::wstring& pre)
     WCHAR *dict_data2 = g_name_dict.Lock(); // 人名・地名辞書をロックする。
     if (dict_data2) {
         // ノード群を追加。
-        if (!AddNodesFromDict(dict_data2)) {
+        if (!AddNodesFromDict(dict_data2, FindKeyIndex(dict_data2, g_name_dict.GetLength()))) {
             AddComplement(0, pre.size(), pre.size());
         }
 
@@ -4074,20 +3728,19 @@ BOOL Lattice::AddNodesForSingle(const std::wstring& pre)
 } // Lattice::AddNodesForSingle
 
 // 複数文節変換において、変換結果を生成する。
-void MzIme::MakeResultForMulti(MzConvResult& result, Lattice& lattice)
+void MzConverter::MakeResultForMulti(MzConvResult& result, Lattice& lattice)
 {
     DPRINTW(L"%s\n", lattice.m_pre.c_str());
     result.clear(); // 結果をクリア。
 
-    LatticeNode* ptr0 = lattice.m_head.get();
-    while (ptr0 && ptr0 != lattice.m_tail.get()) {
+    LatticeNode* ptr0 = lattice.m_head;
+    while (ptr0 && ptr0 != lattice.m_tail) {
         LatticeNode* target = NULL;
         {
-            branches_t::iterator it, end = ptr0->branches.end();
-            for (it = ptr0->branches.begin(); it != end; ++it) {
-                LatticeNodePtr& ptr1 = *it;
-                if (lattice.OptimizeMarking(ptr1.get())) {
-                    target = ptr1.get();
+            for (size_t i = 0; i < ptr0->branch_count; ++i) {
+                LatticeNodePtr ptr1 = lattice.Branch(ptr0, i);
+                if (lattice.OptimizeMarking(ptr1)) {
+                    target = ptr1;
                     break;
                 }
             }
@@ -4097,10 +3750,9 @@ void MzIme::MakeResultForMulti(MzConvResult& result, Lattice& lattice)
             break;
 
         {
-            branches_t::iterator it, end = ptr0->branches.end();
-            for (it = ptr0->branches.begin(); it != end; ++it) {
-                LatticeNodePtr& ptr1 = *it;
-                if (ptr1.get() != target) {
+            for (size_t i = 0; i < ptr0->branch_count; ++i) {
+                LatticeNodePtr ptr1 = lattice.Branch(ptr0, i);
+                if (ptr1 != target) {
                     ptr1->marked = FALSE;
                 }
             }
@@ -4110,47 +3762,58 @@ void MzIme::MakeResultForMulti(MzConvResult& result, Lattice& lattice)
         clause.add(target);
 
         {
-            branches_t::iterator it, end = ptr0->branches.end();
-            for (it = ptr0->branches.begin(); it != end; ++it) {
-                LatticeNodePtr& ptr1 = *it;
-                if (target->pre.size() == ptr1->pre.size()) {
-                    if (target != ptr1.get()) {
-                        clause.add(ptr1.get());
+            for (size_t i = 0; i < ptr0->branch_count; ++i) {
+                LatticeNodePtr ptr1 = lattice.Branch(ptr0, i);
+                if (target->pre_len == ptr1->pre_len) {
+                    if (target != ptr1) {
+                        clause.add(ptr1);
                     }
                 }
             }
         }
 
         LatticeNode node;
+        node.clear();
         node.bunrui = HB_UNKNOWN;
         node.deltaCost = 3000;
-        node.pre = mz_lcmap(target->pre, LCMAP_HIRAGANA | LCMAP_FULLWIDTH);
+        std::wstring pre = mz_lcmap(target->GetPre(), LCMAP_HIRAGANA | LCMAP_FULLWIDTH);
+        std::wstring post;
+        node.SetPre(pre);
 
-        node.post = mz_lcmap(node.pre, LCMAP_HIRAGANA | LCMAP_FULLWIDTH);
+        post = mz_lcmap(pre, LCMAP_HIRAGANA | LCMAP_FULLWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = mz_lcmap(node.pre, LCMAP_KATAKANA | LCMAP_FULLWIDTH);
+        post = mz_lcmap(pre, LCMAP_KATAKANA | LCMAP_FULLWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = mz_lcmap(node.pre, LCMAP_KATAKANA | LCMAP_HALFWIDTH);
+        post = mz_lcmap(pre, LCMAP_KATAKANA | LCMAP_HALFWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = mz_lcmap(node.pre, LCMAP_LOWERCASE | LCMAP_FULLWIDTH);
+        post = mz_lcmap(pre, LCMAP_LOWERCASE | LCMAP_FULLWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = mz_lcmap(node.pre, LCMAP_UPPERCASE | LCMAP_FULLWIDTH);
+        post = mz_lcmap(pre, LCMAP_UPPERCASE | LCMAP_FULLWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = node.post[0] + mz_lcmap(node.pre.substr(1), LCMAP_LOWERCASE | LCMAP_FULLWIDTH);
+        post = post[0] + mz_lcmap(pre.substr(1), LCMAP_LOWERCASE | LCMAP_FULLWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = mz_lcmap(node.pre, LCMAP_LOWERCASE | LCMAP_HALFWIDTH);
+        post = mz_lcmap(pre, LCMAP_LOWERCASE | LCMAP_HALFWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = mz_lcmap(node.pre, LCMAP_UPPERCASE | LCMAP_HALFWIDTH);
+        post = mz_lcmap(pre, LCMAP_UPPERCASE | LCMAP_HALFWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
-        node.post = node.post[0] + mz_lcmap(node.pre.substr(1), LCMAP_LOWERCASE | LCMAP_HALFWIDTH);
+        post = post[0] + mz_lcmap(pre.substr(1), LCMAP_LOWERCASE | LCMAP_HALFWIDTH);
+        node.SetPost(post);
         clause.add(&node);
 
         result.clauses.push_back(clause);
@@ -4159,10 +3822,10 @@ void MzIme::MakeResultForMulti(MzConvResult& result, Lattice& lattice)
 
     // コストによりソートする。
     result.sort();
-} // MzIme::MakeResultForMulti
+} // MzConverter::MakeResultForMulti
 
 // 変換に失敗したときの結果を作成する。
-void MzIme::MakeResultOnFailure(MzConvResult& result, const std::wstring& pre)
+void MzConverter::MakeResultOnFailure(MzConvResult& result, const std::wstring& pre)
 {
     DPRINTW(L"%s\n", pre.c_str());
     MzConvClause clause; // 文節。
@@ -4170,36 +3833,43 @@ void MzIme::MakeResultOnFailure(MzConvResult& result, const std::wstring& pre)
 
     // ノードを初期化。
     LatticeNode node;
-    node.pre = pre; // 変換前の文字列。
+    node.clear();
+    node.SetPre(pre); // 変換前の文字列。
+    std::wstring post; // 変換後の文字列。
     node.deltaCost = 40; // コストは人名・地名よりも高くする。
     node.bunrui = HB_MEISHI; // 名詞。
 
     // 文節に無変換文字列を追加。
-    node.post = pre; // 変換後の文字列。
+    post = pre; // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節にひらがなを追加。
-    node.post = mz_lcmap(pre, LCMAP_HIRAGANA); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_HIRAGANA); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節にカタカナを追加。
-    node.post = mz_lcmap(pre, LCMAP_KATAKANA); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_KATAKANA); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節に全角を追加。
-    node.post = mz_lcmap(pre, LCMAP_FULLWIDTH); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_FULLWIDTH); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節に半角を追加。
-    node.post = mz_lcmap(pre, LCMAP_HALFWIDTH | LCMAP_KATAKANA); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_HALFWIDTH | LCMAP_KATAKANA); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 結果に文節を追加。
     result.clauses.push_back(clause);
-} // MzIme::MakeResultOnFailure
+} // MzConverter::MakeResultOnFailure
 
 // 単一文節変換の結果を作成する。
-void MzIme::MakeResultForSingle(MzConvResult& result, Lattice& lattice)
+void MzConverter::MakeResultForSingle(MzConvResult& result, Lattice& lattice)
 {
     DPRINTW(L"%s\n", lattice.m_pre.c_str());
     result.clear(); // 結果をクリア。
@@ -4210,37 +3880,44 @@ void MzIme::MakeResultForSingle(MzConvResult& result, Lattice& lattice)
     ASSERT(lattice.m_chunks.size());
     const LatticeChunk& chunk = ARRAY_AT(lattice.m_chunks, 0);
     for (size_t i = 0; i < chunk.size(); ++i) {
-        if (ARRAY_AT(chunk, i)->pre.size() == length) {
+        if (ARRAY_AT(chunk, i)->pre_len == length) {
             // add a candidate of same size
-            clause.add(ARRAY_AT(chunk, i).get());
+            clause.add(ARRAY_AT(chunk, i));
         }
     }
 
     // ノードを初期化する。
     std::wstring pre = lattice.m_pre; // 変換前の文字列。
     LatticeNode node;
-    node.pre = pre;
+    node.clear();
+    node.SetPre(pre);
+    std::wstring post; // 変換後の文字列。
     node.bunrui = HB_UNKNOWN;
     node.deltaCost = 40; // コストは人名・地名よりも高くする。
 
     // 文節に無変換文字列を追加。
-    node.post = pre; // 変換後の文字列。
+    post = pre; // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節にひらがなを追加。
-    node.post = mz_lcmap(pre, LCMAP_HIRAGANA); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_HIRAGANA); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節にカタカナを追加。
-    node.post = mz_lcmap(pre, LCMAP_KATAKANA); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_KATAKANA); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節に全角を追加。
-    node.post = mz_lcmap(pre, LCMAP_FULLWIDTH); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_FULLWIDTH); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 文節に半角を追加。
-    node.post = mz_lcmap(pre, LCMAP_HALFWIDTH | LCMAP_KATAKANA); // 変換後の文字列。
+    post = mz_lcmap(pre, LCMAP_HALFWIDTH | LCMAP_KATAKANA); // 変換後の文字列。
+    node.SetPost(post);
     clause.add(&node);
 
     // 結果に文節を追加。
@@ -4250,116 +3927,180 @@ void MzIme::MakeResultForSingle(MzConvResult& result, Lattice& lattice)
     // コストによりソートする。
     result.sort();
     ASSERT(ARRAY_AT(result.clauses, 0).candidates.size());
-} // MzIme::MakeResultForSingle
+} // MzConverter::MakeResultForSingle
 
-// 複数文節を変換する。
-BOOL MzIme::ConvertMultiClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+// 文の区切りか？
+static inline BOOL mz_is_sentence_break(WCHAR ch)
 {
-    MzConvResult result;
-    std::wstring str = ARRAY_AT(comp.extra.hiragana_clauses, comp.extra.iClause);
-    if (!ConvertMultiClause(str, result)) {
-        return FALSE;
+    return ch == L'。' || ch == L'．' || ch == L'！' || ch == L'？' ||
+           ch == L'\n' || ch == L'\r';
+}
+
+// 文の区切り（「。」「！」「？」や改行）で文字列を分割する。
+// 区切りの文字は前の文に含める。
+static size_t mz_split_sentences(WStrings& sentences, const std::wstring& pre)
+{
+    sentences.clear();
+
+    size_t start = 0;
+    for (size_t i = 0; i < pre.size(); ) {
+        if (!mz_is_sentence_break(pre[i])) {
+            ++i;
+            continue;
+        }
+        // 連続する区切りはまとめる。
+        while (i < pre.size() && mz_is_sentence_break(pre[i]))
+            ++i;
+        sentences.push_back(pre.substr(start, i - start));
+        start = i;
     }
-    return StoreResult(result, comp, cand);
-} // MzIme::ConvertMultiClause
+    if (start < pre.size())
+        sentences.push_back(pre.substr(start));
+
+    return sentences.size();
+}
+
+#ifdef HAVE_VIBRATO
+#define MZ_HEDGE_DEADLINE   50  // 優先するエンジンを待つ既定の時間（ミリ秒）。
+#define MZ_HEDGE_POLL       10  // 呼び出し元の取り消しを確かめる間隔（ミリ秒）。
+
+enum { HEDGE_VIBRATO, HEDGE_LEGACY, HEDGE_ENGINES };
+
+volatile LONG g_nHedgeVibratoWins = 0;
+volatile LONG g_nHedgeLegacyWins = 0;
+
+// 両エンジンの競争の作業データ。最後に手放した者が消す。
+struct MzHedgeJob {
+    MzConverter *pConverter;
+    std::wstring pre;
+    MzConvResult results[HEDGE_ENGINES];
+    BOOL bOK[HEDGE_ENGINES];                // 変換できたか？
+    volatile LONG bDone[HEDGE_ENGINES];     // 終わったか？
+    volatile LONG bCancel[HEDGE_ENGINES];   // 途中でやめさせる。
+    volatile LONG refs;                     // 参照数。
+    HANDLE hDone;                           // どちらかが終わるたびにシグナル状態になる。
+};
 
-// Graphvizの候補テキストを取得する。
-std::string GetGraphvizCandText(const MzConvCandidate* cand, BOOL bFirst)
+static void ReleaseHedgeJob(MzHedgeJob *job)
 {
-    if (!cand) {
-        if (bFirst)
-            return "HEAD";
-        else
-            return "TAIL";
-    }
-    static CHAR sz[MAX_PATH];
-    ::WideCharToMultiByte(CP_UTF8, 0, cand->post.c_str(), -1, sz, _countof(sz), NULL, NULL);
-    sz[_countof(sz) - 1] = 0;
-    return sz;
+    if (InterlockedDecrement(&job->refs) == 0) {
+        mz_event_close(job->hDone);
+        delete job;
+    }
 }
 
-// Graphvizのエッジを出力する。
-void OutputGraphvizEdge(FILE* fout, const MzConvCandidate *cand0, const MzConvCandidate *cand1)
+// 一つのエンジンで変換し、終わったことを知らせる。
+static void DoHedgeJob(MzHedgeJob *job, INT iEngine)
 {
-    std::string str1 = GetGraphvizCandText(cand0, TRUE);
-    std::string str2 = GetGraphvizCandText(cand1, FALSE);
-    if (!cand0)
-        cand0 = (MzConvCandidate*)0xDEAD;
-    if (!cand1)
-        cand1 = (MzConvCandidate*)0xFACE;
-    fprintf(fout, "L%p [label=\"%s\"];\n", cand0, str1.c_str());
-    fprintf(fout, "L%p [label=\"%s\"];\n", cand1, str2.c_str());
-    fprintf(fout, "L%p -> L%p;\n", cand0, cand1);
+    BOOL bOK;
+    if (iEngine == HEDGE_VIBRATO)
+        bOK = g_vibrato_engine.ConvertMultiClause(job->pre, job->results[iEngine], &job->bCancel[iEngine]);
+    else
+        bOK = job->pConverter->ConvertLegacy(job->pre, job->results[iEngine], &job->bCancel[iEngine]);
+    job->bOK[iEngine] = bOK && !job->bCancel[iEngine];
+    InterlockedExchange(&job->bDone[iEngine], TRUE);
+    mz_event_set(job->hDone);
+    ReleaseHedgeJob(job);
 }
 
-// Graphvizでグラフ構造を表示する。
-void ShowGraphviz(const MzConvResult& result)
+static DWORD WINAPI HedgeVibratoProc(LPVOID lpParam)
 {
-    if (!mz_find_graphviz()[0])
-        return;
+    DoHedgeJob((MzHedgeJob *)lpParam, HEDGE_VIBRATO);
+    return 0;
+}
 
-    TCHAR path0[MAX_PATH], path1[MAX_PATH];
-    ExpandEnvironmentStrings(TEXT("%TEMP%\\graph.dot"), path0, _countof(path0));
-    ExpandEnvironmentStrings(TEXT("%TEMP%\\graph.png"), path1, _countof(path1));
-    ::DeleteFile(path1);
+static DWORD WINAPI HedgeLegacyProc(LPVOID lpParam)
+{
+    DoHedgeJob((MzHedgeJob *)lpParam, HEDGE_LEGACY);
+    return 0;
+}
 
-    if (FILE *fout = _tfopen(path0, _T("wb"))) {
-        fprintf(fout, "digraph test {\n");
-        fprintf(fout, "  graph [fontname=\"MS UI Gothic\"];\n");
-        fprintf(fout, "  node [fontname=\"MS UI Gothic\"];\n");
-        fprintf(fout, "  edge [fontname=\"MS UI Gothic\"];\n");
+// 両エンジンをスレッドプールで同時に動かす。優先するエンジンが締め切りまでに
+// 終われば、その結果を使う。間に合わなければ、先に終わった方を使う。
+// 負けた方は取り消し、終わるのを待たずに戻る。
+// Vibratoの経路は既存エンジンの辞書引きも含むので、普段は既存エンジンより先には
+// 終わらない。Vibratoの辞書の読み込み中や、形態素解析が遅れたときの待ち時間を
+// 締め切りで抑えるためのものである。
+static BOOL ConvertHedged(MzConverter *pConverter, const std::wstring& pre,
+                          MzConvResult& result, volatile LONG *pbCancel)
+{
+    // 活用規則とかなの表はグローバル変数に遅れて作るので、ワーカーより先に作っておく。
+    mz_make_literal_maps();
 
-        size_t i = 0;
-        {
-            clauses_t::const_iterator it0, end0 = result.clauses.end();
-            for (it0 = result.clauses.begin(); it0 != end0; ++it0) {
-                const MzConvClause& clause = *it0;
-
-                candidates_t::const_iterator it1, end1 = clause.candidates.end();
-                for (it1 = clause.candidates.begin(); it1 != end1; ++it1) {
-                    const MzConvCandidate& cand1 = *it1;
-                    if (i == 0) {
-                        OutputGraphvizEdge(fout, NULL, &cand1);
-                    } else {
-                        candidates_t::const_iterator it2, end2 = result.clauses[i - 1].candidates.end();
-                        for (it2 = result.clauses[i - 1].candidates.begin(); it2 != end2; ++it2) {
-                            const MzConvCandidate& cand0 = *it2;
-                            OutputGraphvizEdge(fout, &cand0, &cand1);
-                        }
-                    }
-                }
-                ++i;
-            }
+    const INT iPrefer = Config_GetDWORD(L"HedgePreferLegacy", FALSE) ? HEDGE_LEGACY : HEDGE_VIBRATO;
+    const INT iOther = HEDGE_ENGINES - 1 - iPrefer;
+    const DWORD dwDeadline = Config_GetDWORD(L"HedgeDeadline", MZ_HEDGE_DEADLINE);
+
+    MzHedgeJob *job = new MzHedgeJob;
+    job->pConverter = pConverter;
+    job->pre = pre;
+    job->refs = 1; // 呼び出し元の分。
+    job->hDone = mz_event_create(FALSE);
+    for (INT i = 0; i < HEDGE_ENGINES; ++i) {
+        job->bOK[i] = FALSE;
+        job->bDone[i] = job->bCancel[i] = FALSE;
+    }
+
+    // 始められなかったエンジンは、変換できずに終わったことにする。
+    static const LPTHREAD_START_ROUTINE s_procs[HEDGE_ENGINES] = { HedgeVibratoProc, HedgeLegacyProc };
+    for (INT i = 0; i < HEDGE_ENGINES; ++i) {
+        InterlockedIncrement(&job->refs);
+        if (!job->hDone || !mz_queue_work_item(s_procs[i], job)) {
+            InterlockedDecrement(&job->refs);
+            job->bDone[i] = TRUE;
         }
+    }
 
-        {
-            candidates_t::const_iterator it, end = result.clauses[i - 1].candidates.end();
-            for (it = result.clauses[i - 1].candidates.begin(); it != end; ++it) {
-                const MzConvCandidate& cand = *it;
-                OutputGraphvizEdge(fout, &cand, NULL);
-            }
+    // 勝者を待つ。
+    const DWORD dwStart = ::GetTickCount();
+    INT iWinner = -1;
+    for (;;) {
+        BOOL bLate = (::GetTickCount() - dwStart) >= dwDeadline;
+        if (job->bDone[iPrefer] && job->bOK[iPrefer]) {
+            iWinner = iPrefer;
+            break;
         }
+        if ((bLate || job->bDone[iPrefer]) && job->bDone[iOther] && job->bOK[iOther]) {
+            iWinner = iOther;
+            break;
+        }
+        if (job->bDone[iPrefer] && job->bDone[iOther])
+            break; // どちらも変換できなかった。
+        if (MZ_CANCELLED(pbCancel))
+            break;
+
+        DWORD dwWait = INFINITE;
+        if (!bLate)
+            dwWait = dwDeadline - (::GetTickCount() - dwStart);
+        if (pbCancel && dwWait > MZ_HEDGE_POLL)
+            dwWait = MZ_HEDGE_POLL;
+        mz_event_wait(job->hDone, dwWait);
+    }
 
-        fprintf(fout, "}\n");
-        fclose(fout);
+    // 負けた方をやめさせる。
+    for (INT i = 0; i < HEDGE_ENGINES; ++i)
+        InterlockedExchange(&job->bCancel[i], TRUE);
 
-        TCHAR cmdline[MAX_PATH * 2];
-        StringCchPrintf(cmdline, _countof(cmdline), TEXT("-Tpng \"%s\" -o \"%s\""), path0, path1);
-        ::ShellExecute(NULL, NULL, mz_find_graphviz(), cmdline, NULL, SW_SHOWNORMAL);
-        for (INT i = 0; i < 20; ++i) {
-            ::Sleep(100);
-            if (PathFileExists(path1))
-                break;
-        }
-        ::Sleep(100);
-        ::ShellExecute(NULL, NULL, path1, NULL, NULL, SW_SHOWNORMAL);
+    if (iWinner >= 0) {
+        result.clauses.swap(job->results[iWinner].clauses);
+        InterlockedIncrement(iWinner == HEDGE_VIBRATO ? &g_nHedgeVibratoWins : &g_nHedgeLegacyWins);
     }
+    ReleaseHedgeJob(job);
+    if (iWinner >= 0)
+        return TRUE;
+    if (MZ_CANCELLED(pbCancel))
+        return FALSE;
 
-    ::DeleteFile(path0);
-}
+    // どちらも変換できなかった（スレッドを使えなかった）ら、順番に変換する。
+    if (g_vibrato_engine.ConvertMultiClause(pre, result, pbCancel))
+        return TRUE;
+    return !MZ_CANCELLED(pbCancel) && pConverter->ConvertLegacy(pre, result, pbCancel);
+} // ConvertHedged
+#endif  // def HAVE_VIBRATO
 
 // 複数文節を変換する。
-BOOL MzIme::ConvertMultiClause(const std::wstring& str, MzConvResult& result, BOOL show_graphviz)
+BOOL MzConverter::ConvertMultiClause(const std::wstring& str, MzConvResult& result,
+                                     volatile LONG *pbCancel)
 {
     DPRINTW(L"%s\n", str.c_str());
 
@@ -4369,80 +4110,175 @@ BOOL MzIme::ConvertMultiClause(const std::wstring& str, MzConvResult& result, BO
 #ifdef HAVE_VIBRATO
     // Vibratoエンジンを優先使用
     if (g_vibrato_engine.IsInitialized()) {
-        if (g_vibrato_engine.ConvertMultiClause(pre, result)) {
-            if (show_graphviz)
-                ShowGraphviz(result);
+        // 両エンジンを同時に動かして、締め切りまでに間に合った方を使う？
+        if (Config_GetDWORD(L"HedgedConversion", FALSE))
+            return ConvertHedged(this, pre, result, pbCancel);
+
+        // そうでなければVibratoを使い、失敗したときだけ既存エンジンを使う。
+        if (g_vibrato_engine.ConvertMultiClause(pre, result, pbCancel))
             return TRUE;
-        }
+        if (MZ_CANCELLED(pbCancel))
+            return FALSE;
         DPRINTW(L"Vibrato conversion failed, fallback to legacy engine\n");
     }
 #endif
 
+    return ConvertLegacy(pre, result, pbCancel);
+} // MzConverter::ConvertMultiClause
+
+// 既存エンジンで複数文節を変換する。preはひらがな全角。
+BOOL MzConverter::ConvertLegacy(const std::wstring& pre, MzConvResult& result,
+                                volatile LONG *pbCancel)
+{
+    // 文の区切りで分割して並列に変換する？
+    if (Config_GetDWORD(L"ParallelConversion", FALSE)) {
+        WStrings sentences;
+        if (mz_split_sentences(sentences, pre) >= 2) {
+            ConvertSentencesInParallel(sentences, result);
+            return TRUE;
+        }
+    }
+
+    // 既存エンジンで変換する。
+    ConvertSentence(pre, result, pbCancel);
+    return !MZ_CANCELLED(pbCancel);
+} // MzConverter::ConvertLegacy
+
+// 一つの文を既存エンジンで変換する。
+// 共有データを書き換えないので、複数のスレッドから同時に呼んでもよい。
+void MzConverter::ConvertSentence(const std::wstring& pre, MzConvResult& result,
+                                  volatile LONG *pbCancel)
+{
+    // ビーム幅が設定されていれば、枝を作る前に枝刈りする。
+    DWORD dwBeamWidth = Config_GetDWORD(L"BeamWidth", 0);
+    INT threshold = (INT)Config_GetDWORD(L"BeamThreshold", 2000);
+    ConvertWithBeam(pre, result, dwBeamWidth, threshold, pbCancel);
+} // MzConverter::ConvertSentence
+
+// ビーム幅を指定して一つの文を変換する。beam_widthが0なら枝刈りしない。
+void MzConverter::ConvertWithBeam(const std::wstring& pre, MzConvResult& result,
+                                  size_t beam_width, INT threshold,
+                                  volatile LONG *pbCancel)
+{
+    result.clear();
+
     // ラティスを作成し、結果を作成する。（既存エンジン）
     Lattice lattice;
     lattice.AddNodesForMulti(pre);
     lattice.AddExtraNodes();
+    if (MZ_CANCELLED(pbCancel))
+        return;
+
+    if (beam_width)
+        lattice.PruneByBeam(beam_width, threshold);
+
     lattice.UpdateLinksAndBranches();
+    if (MZ_CANCELLED(pbCancel))
+        return;
     lattice.CutUnlinkedNodes();
     lattice.AddComplement();
-    lattice.MakeReverseBranches(lattice.m_head.get());
+    lattice.MakeReverseBranches(lattice.m_head);
 
     lattice.m_tail->marked = 1;
-    lattice.CalcSubTotalCosts(lattice.m_tail.get());
+    lattice.CalcSubTotalCosts(lattice.m_tail);
+    if (MZ_CANCELLED(pbCancel))
+        return;
 
     lattice.m_head->marked = 1;
-    lattice.OptimizeMarking(lattice.m_head.get());
+    lattice.OptimizeMarking(lattice.m_head);
 
     MakeResultForMulti(result, lattice);
 
     if (result.clauses.empty()) {
         MakeResultOnFailure(result, pre);
     }
+} // MzConverter::ConvertWithBeam
 
-    if (show_graphviz)
-        ShowGraphviz(result);
+#define MAX_SENTENCE_WORKERS 4 // 並列変換のワーカーの最大数。
 
-    return TRUE;
-} // MzIme::ConvertMultiClause
+// 並列変換の作業データ。
+struct MzSentenceJob {
+    MzConverter *pConverter;
+    const WStrings *sentences;
+    std::vector<MzConvResult> *results;
+    volatile LONG next;     // 次に変換する文の番号。
+    volatile LONG pending;  // 作業中のスレッドの数。
+    HANDLE hDone;           // 全部終わったらシグナル状態になる。
+};
 
-// 単一文節を変換する。
-BOOL MzIme::ConvertSingleClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+// 残っている文を一つずつ取り出して変換する。
+static void DoSentenceJob(MzSentenceJob *job)
 {
-    DWORD iClause = comp.extra.iClause; // 現在の文節。
-
-    // 変換する。
-    MzConvResult result;
-    std::wstring str = ARRAY_AT(comp.extra.hiragana_clauses, iClause);
-    if (!ConvertSingleClause(str, result)) {
-        return FALSE;
+    const LONG count = (LONG)job->sentences->size();
+    for (;;) {
+        LONG i = InterlockedIncrement(&job->next) - 1;
+        if (i >= count)
+            break;
+        job->pConverter->ConvertSentence((*job->sentences)[i], (*job->results)[i]);
     }
+}
+
+// スレッドプールで実行される関数。
+static DWORD WINAPI SentenceWorkerProc(LPVOID lpParam)
+{
+    MzSentenceJob *job = (MzSentenceJob *)lpParam;
+    DoSentenceJob(job);
+    if (InterlockedDecrement(&job->pending) == 0)
+        mz_event_set(job->hDone);
+    return 0;
+}
 
-    // 未確定文字列をセット。
-    result.clauses.resize(1);
-    MzConvClause& clause = ARRAY_AT(result.clauses, 0);
-    comp.SetClauseCompString(iClause, ARRAY_AT(clause.candidates, 0).post);
-    comp.SetClauseCompHiragana(iClause, ARRAY_AT(clause.candidates, 0).pre, bRoman);
+// 複数の文をスレッドプールで並列に変換し、文節を順番どおりにつなげる。
+void MzConverter::ConvertSentencesInParallel(const WStrings& sentences, MzConvResult& result)
+{
+    // 活用規則とかなの表はグローバル変数に遅れて作るので、ワーカーより先に作っておく。
+    // 関数内の静的変数（連結コストの表など）の初期化はC++11からスレッドセーフである。
+    mz_make_literal_maps();
 
-    // 候補リストをセットする。
-    LogCandList cand_list;
-    {
-        candidates_t::iterator it, end = clause.candidates.end();
-        for (it = clause.candidates.begin(); it != end; ++it) {
-            MzConvCandidate& cand2 = *it;
-            cand_list.cand_strs.push_back(cand2.post);
+    std::vector<MzConvResult> results(sentences.size());
+
+    MzSentenceJob job;
+    job.pConverter = this;
+    job.sentences = &sentences;
+    job.results = &results;
+    job.next = 0;
+    job.pending = 1; // 呼び出し元のスレッドの分。
+    job.hDone = mz_event_create(TRUE);
+
+    // 呼び出し元のスレッドも変換するので、ワーカーは一つ少なくてよい。
+    size_t workers = mz_get_processor_count();
+    if (workers > MAX_SENTENCE_WORKERS)
+        workers = MAX_SENTENCE_WORKERS;
+    if (workers > sentences.size())
+        workers = sentences.size();
+    if (job.hDone) {
+        for (size_t i = 1; i < workers; ++i) {
+            InterlockedIncrement(&job.pending);
+            if (!mz_queue_work_item(SentenceWorkerProc, &job)) {
+                InterlockedDecrement(&job.pending);
+                break;
+            }
         }
     }
-    ARRAY_AT(cand.cand_lists, iClause) = cand_list;
 
-    // 現在の文節をセットする。
-    cand.iClause = iClause;
-    comp.extra.iClause = iClause;
+    DoSentenceJob(&job);
 
-    return TRUE;
-} // MzIme::ConvertSingleClause
+    // ワーカーの終了を待つ。
+    if (InterlockedDecrement(&job.pending) != 0)
+        mz_event_wait(job.hDone, INFINITE);
+    if (job.hDone)
+        mz_event_close(job.hDone);
+
+    // 文節をつなげる。
+    result.clear();
+    for (size_t i = 0; i < results.size(); ++i) {
+        clauses_t& clauses = results[i].clauses;
+        result.clauses.insert(result.clauses.end(), clauses.begin(), clauses.end());
+    }
+} // MzConverter::ConvertSentencesInParallel
 
 // 単一文節を変換する。
-BOOL MzIme::ConvertSingleClause(const std::wstring& str, MzConvResult& result)
+BOOL MzConverter::ConvertSingleClause(const std::wstring& str, MzConvResult& result)
 {
     DPRINTW(L"%s\n", str.c_str());
     result.clear(); // 結果をクリア。
@@ -4459,191 +4295,7 @@ BOOL MzIme::ConvertSingleClause(const std::wstring& str, MzConvResult& result)
     MakeResultForSingle(result, lattice);
 
     return TRUE;
-} // MzIme::ConvertSingleClause
-
-// 文節を左に伸縮する。
-BOOL MzIme::StretchClauseLeft(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
-{
-    DWORD iClause = comp.extra.iClause; // 現在の文節の位置。
-
-    // 現在の文節を取得する。
-    std::wstring str1 = comp.extra.hiragana_clauses[iClause];
-    // 一文字以下の長さなら左に拡張できない。
-    if (str1.size() <= 1)
-        return FALSE;
-
-    // この文節の最後の文字。
-    WCHAR ch = str1[str1.size() - 1];
-    // この文節を１文字縮小する。
-    str1.resize(str1.size() - 1);
-
-    // その文字を次の文節の先頭に追加する。
-    std::wstring str2;
-    BOOL bSplitted = FALSE; // 分離したか？
-    if (iClause + 1 < comp.GetClauseCount()) {
-        str2 = ch + comp.extra.hiragana_clauses[iClause + 1];
-    } else {
-        str2 += ch;
-        bSplitted = TRUE; // 分離した。
-    }
-
-    // ２つの文節を単一文節変換する。
-    MzConvResult result1, result2;
-    if (!ConvertSingleClause(str1, result1)) {
-        return FALSE;
-    }
-    if (!ConvertSingleClause(str2, result2)) {
-        return FALSE;
-    }
-
-    // 文節が分離したら、新しい文節を挿入する。
-    if (bSplitted) {
-        std::wstring str;
-        comp.extra.hiragana_clauses.insert(comp.extra.hiragana_clauses.begin() + iClause + 1, str);
-        comp.extra.comp_str_clauses.insert(comp.extra.comp_str_clauses.begin() + iClause + 1, str);
-    }
-
-    // 未確定文字列をセット。
-    MzConvClause& clause1 = result1.clauses[0];
-    MzConvClause& clause2 = result2.clauses[0];
-    comp.extra.hiragana_clauses[iClause] = str1;
-    comp.extra.comp_str_clauses[iClause] = clause1.candidates[0].post;
-    comp.extra.hiragana_clauses[iClause + 1] = str2;
-    comp.extra.comp_str_clauses[iClause + 1] = clause2.candidates[0].post;
-
-    // 余剰情報から未確定文字列を更新する。
-    comp.UpdateFromExtra(bRoman);
-
-    // 候補リストをセットする。
-    {
-        LogCandList cand_list;
-        candidates_t::iterator it, end = clause1.candidates.end();
-        for (it = clause1.candidates.begin(); it != end; ++it) {
-            MzConvCandidate& cand1 = *it;
-            cand_list.cand_strs.push_back(cand1.post);
-        }
-        cand.cand_lists[iClause] = cand_list;
-    }
-    {
-        LogCandList cand_list;
-        {
-            candidates_t::iterator it, end = clause2.candidates.end();
-            for (it = clause2.candidates.begin(); it != end; ++it) {
-                MzConvCandidate& cand2 = *it;
-                cand_list.cand_strs.push_back(cand2.post);
-            }
-        }
-        if (bSplitted) {
-            cand.cand_lists.push_back(cand_list);
-        } else {
-            cand.cand_lists[iClause + 1] = cand_list;
-        }
-    }
-
-    // 現在の文節をセットする。
-    cand.iClause = iClause;
-    comp.extra.iClause = iClause;
-
-    // 文節属性をセットする。
-    comp.SetClauseAttr(iClause, ATTR_TARGET_CONVERTED);
-
-    return TRUE;
-} // MzIme::StretchClauseLeft
-
-// 文節を右に伸縮する。
-BOOL MzIme::StretchClauseRight(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
-{
-    DWORD iClause = comp.extra.iClause; // 現在の文節の位置。
-
-    // 現在の文節を取得する。
-    std::wstring str1 = comp.extra.hiragana_clauses[iClause];
-
-    // 右端であれば右には拡張できない。
-    if (iClause == comp.GetClauseCount() - 1)
-        return FALSE;
-
-    // 次の文節を取得する。
-    std::wstring str2 = comp.extra.hiragana_clauses[iClause + 1];
-    // 次の文節が空ならば、右には拡張できない。
-    if (str2.empty())
-        return FALSE;
-
-    // str2の最初の文字。
-    WCHAR ch = str2[0];
-
-    // それをstr1の末尾に引っ越しする。
-    str1 += ch;
-    if (str2.size() == 1) {
-        str2.clear();
-    } else {
-        str2 = str2.substr(1);
-    }
-
-    // 関係する文節を単一文節変換。
-    MzConvResult result1, result2;
-    if (!ConvertSingleClause(str1, result1)) {
-        return FALSE;
-    }
-    if (str2.size() && !ConvertSingleClause(str2, result2)) {
-        return FALSE;
-    }
-
-    // 現在の文節。
-    MzConvClause& clause1 = result1.clauses[0];
-
-    if (str2.empty()) { // 次の文節が空になったか？
-        // 次の文節を削除する。
-        comp.extra.hiragana_clauses.erase(comp.extra.hiragana_clauses.begin() + iClause + 1);
-        comp.extra.comp_str_clauses.erase(comp.extra.comp_str_clauses.begin() + iClause + 1);
-        comp.extra.hiragana_clauses[iClause] = str1;
-        comp.extra.comp_str_clauses[iClause] = clause1.candidates[0].post;
-
-        // 候補リストも削除する
-        if (iClause + 1 < cand.cand_lists.size()) {
-            cand.cand_lists.erase(cand.cand_lists.begin() + (iClause + 1));
-        }
-    } else {
-        // ２つの文節情報をセットする。
-        MzConvClause& clause2 = result2.clauses[0];
-        comp.extra.hiragana_clauses[iClause] = str1;
-        comp.extra.comp_str_clauses[iClause] = clause1.candidates[0].post;
-        comp.extra.hiragana_clauses[iClause + 1] = str2;
-        comp.extra.comp_str_clauses[iClause + 1] = clause2.candidates[0].post;
-    }
-
-    // 余剰情報から未確定文字列を更新する。
-    comp.UpdateFromExtra(bRoman);
-
-    // 候補リストをセットする。
-    {
-        LogCandList cand_list;
-        candidates_t::iterator it, end = clause1.candidates.end();
-        for (it = clause1.candidates.begin(); it != end; ++it) {
-            MzConvCandidate& cand1 = *it;
-            cand_list.cand_strs.push_back(cand1.post);
-        }
-        cand.cand_lists[iClause] = cand_list;
-    }
-    if (str2.size()) {
-        MzConvClause& clause2 = result2.clauses[0];
-        LogCandList cand_list;
-        candidates_t::iterator it, end = clause2.candidates.end();
-        for (it = clause2.candidates.begin(); it != end; ++it) {
-            MzConvCandidate& cand2 = *it;
-            cand_list.cand_strs.push_back(cand2.post);
-        }
-        cand.cand_lists[iClause + 1] = cand_list;
-    }
-
-    // 現在の文節をセットする。
-    cand.iClause = iClause;
-    comp.extra.iClause = iClause;
-
-    // 文節属性をセットする。
-    comp.SetClauseAttr(iClause, ATTR_TARGET_CONVERTED);
-
-    return TRUE;
-} // MzIme::StretchClauseRight
+} // MzConverter::ConvertSingleClause
 
 // Shift_JISのマルチバイト文字の1バイト目か？
 inline bool is_sjis_lead(BYTE ch)
@@ -4726,11 +4378,12 @@ inline WORD kuten_to_jis(const std::wstring& str)
 }
 
 // コード変換。
-BOOL MzIme::ConvertCode(const std::wstring& strTyping, MzConvResult& result)
+BOOL MzConverter::ConvertCode(const std::wstring& strTyping, MzConvResult& result)
 {
     // ノードを初期化。
     LatticeNode node;
-    node.pre = strTyping;
+    node.clear();
+    node.SetPre(strTyping);
     node.bunrui = HB_UNKNOWN;
 
     // 16進を読み込み。
@@ -4743,7 +4396,7 @@ BOOL MzIme::ConvertCode(const std::wstring& strTyping, MzConvResult& result)
     WCHAR szUnicode[2];
     szUnicode[0] = WCHAR(hex_code);
     szUnicode[1] = 0;
-    node.post = szUnicode; // 変換後の文字列。
+    node.SetPost(szUnicode); // 変換後の文字列。
     clause.add(&node);
     node.deltaCost++; // コストを１つ加算。
 
@@ -4755,7 +4408,7 @@ BOOL MzIme::ConvertCode(const std::wstring& strTyping, MzConvResult& result)
         szSJIS[1] = LOBYTE(wSJIS);
         szSJIS[2] = 0;
         ::MultiByteToWideChar(CODEPAGE_SJIS_932, 0, szSJIS, -1, szUnicode, 2);
-        node.post = szUnicode; // 変換後の文字列。
+        node.SetPost(szUnicode); // 変換後の文字列。
         node.deltaCost++; // コストを１つ加算。
         clause.add(&node);
     }
@@ -4768,7 +4421,7 @@ BOOL MzIme::ConvertCode(const std::wstring& strTyping, MzConvResult& result)
             szSJIS[1] = LOBYTE(wSJIS);
             szSJIS[2] = 0;
             ::MultiByteToWideChar(CODEPAGE_SJIS_932, 0, szSJIS, -1, szUnicode, 2);
-            node.post = szUnicode; // 変換後の文字列。
+            node.SetPost(szUnicode); // 変換後の文字列。
             node.deltaCost++; // コストを１つ加算。
             clause.add(&node);
         }
@@ -4783,14 +4436,14 @@ BOOL MzIme::ConvertCode(const std::wstring& strTyping, MzConvResult& result)
             szSJIS[1] = LOBYTE(wSJIS);
             szSJIS[2] = 0;
             ::MultiByteToWideChar(CODEPAGE_SJIS_932, 0, szSJIS, -1, szUnicode, 2);
-            node.post = szUnicode; // 変換後の文字列。
+            node.SetPost(szUnicode); // 変換後の文字列。
             node.deltaCost++; // コストを１つ加算。
             clause.add(&node);
         }
     }
 
     // 元の入力文字列のノードを文節に追加。
-    node.post = strTyping; // 変換後の文字列。
+    node.SetPost(strTyping); // 変換後の文字列。
     node.deltaCost++; // コストを１つ加算。
     clause.add(&node);
 
@@ -4799,65 +4452,7 @@ BOOL MzIme::ConvertCode(const std::wstring& strTyping, MzConvResult& result)
     result.clauses.push_back(clause);
 
     return TRUE;
-} // MzIme::ConvertCode
-
-// コード変換。
-BOOL MzIme::ConvertCode(LogCompStr& comp, LogCandInfo& cand)
-{
-    MzConvResult result;
-    std::wstring strTyping = comp.extra.typing_clauses[comp.extra.iClause];
-    if (!ConvertCode(strTyping, result)) {
-        return FALSE;
-    }
-    return StoreResult(result, comp, cand);
-} // MzIme::ConvertCode
-
-// 結果を格納する。
-BOOL MzIme::StoreResult(const MzConvResult& result, LogCompStr& comp, LogCandInfo& cand)
-{
-    // 未確定文字列をクリア。
-    comp.comp_str.clear();
-    comp.extra.clear();
-
-    // 未確定文字列をセット。
-    comp.comp_clause.resize(result.clauses.size() + 1);
-    for (size_t iClause = 0; iClause < result.clauses.size(); ++iClause) {
-        const MzConvClause& clause = result.clauses[iClause];
-        candidates_t::const_iterator it, end = clause.candidates.end();
-        for (it = clause.candidates.begin(); it != end; ++it) {
-            const MzConvCandidate& cand2 = *it;
-            comp.comp_clause[iClause] = (DWORD)comp.comp_str.size();
-            comp.extra.hiragana_clauses.push_back(cand2.pre);
-            std::wstring typing = mz_hiragana_to_typing(cand2.pre);
-            comp.extra.typing_clauses.push_back(typing);
-            comp.comp_str += cand2.post;
-            break;
-        }
-    }
-    comp.comp_clause[result.clauses.size()] = (DWORD)comp.comp_str.size();
-    comp.comp_attr.assign(comp.comp_str.size(), ATTR_CONVERTED);
-    comp.extra.iClause = 0;
-    comp.SetClauseAttr(comp.extra.iClause, ATTR_TARGET_CONVERTED);
-    comp.dwCursorPos = (DWORD)comp.comp_str.size();
-    comp.dwDeltaStart = 0;
-
-    // 候補情報をセット。
-    cand.clear();
-    clauses_t::const_iterator it0, end0 = result.clauses.end();
-    for (it0 = result.clauses.begin(); it0 != end0; ++it0) {
-        const MzConvClause& clause = *it0;
-        LogCandList cand_list;
-        candidates_t::const_iterator it1, end1 = clause.candidates.end();
-        for (it1 = clause.candidates.begin(); it1 != end1; ++it1) {
-            const MzConvCandidate& cand2 = *it1;
-            cand_list.cand_strs.push_back(cand2.post);
-        }
-        cand.cand_lists.push_back(cand_list);
-    }
-    cand.iClause = 0;
-
-    return TRUE;
-} // MzIme::StoreResult
+} // MzConverter::ConvertCode
 
 LPCTSTR KatsuyouToString(KatsuyouKei kk) {
     static const LPCWSTR s_array[] =
@@ -4868,6 +4463,7 @@ LPCTSTR KatsuyouToString(KatsuyouKei kk) {
         L"連体形", // RENTAI_KEI
         L"仮定形", // KATEI_KEI
         L"命令形", // MEIREI_KEI
+        L"活用形なし", // NONE_KEI
     };
     ASSERT(kk < _countof(s_array));
     return s_array[kk];
@@ -0,0 +1,646 @@
+﻿// convert_ime.cpp --- mzimeja kana kanji conversion (IME side)
+// (Japanese, UTF-8)
+// かな漢字変換のうち、未確定文字列や候補情報、ユーザー辞書などIMEに関わる部分。
+// 変換そのものはMzConverter（convert.cpp）が行う。
+
+#include "mzimeja.h"
+#include "resource.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// ユーザー辞書。
+
+// ユーザー辞書のスキャンに使うデータ。複数のスレッドから同時に変換できるよう、
+// 呼び出しごとに用意する。
+struct USER_DICT_SCAN {
+    Lattice *pThis;
+    WStrings records;
+};
+
+static INT CALLBACK UserDictProc(LPCTSTR lpRead, DWORD dwStyle, LPCTSTR lpStr, LPVOID lpData)
+{
+    ASSERT(lpStr && lpStr[0]);
+    ASSERT(lpRead && lpRead[0]);
+    USER_DICT_SCAN *pScan = (USER_DICT_SCAN *)lpData;
+    ASSERT(pScan != NULL);
+    WStrings& s_UserDictRecords = pScan->records;
+
+    // データの初期化。
+    std::wstring pre = lpRead;
+    std::wstring post = lpStr;
+    Gyou gyou = GYOU_A;
+    HinshiBunrui bunrui = StyleToHinshi(dwStyle);
+
+    if (pre.size() <= 1)
+        return 0;
+
+    // データを辞書形式に変換する。
+    WCHAR ch;
+    size_t i;
+    switch (bunrui) {
+    case HB_NAKEIYOUSHI: // な形容詞
+        // 終端の「な」を削る。
+        i = pre.size() - 1;
+        if (pre[i] == L'な')
+            pre.resize(i);
+        i = post.size() - 1;
+        if (post[i] == L'な')
+            post.resize(i);
+        break;
+    case HB_IKEIYOUSHI: // い形容詞
+        // 終端の「い」を削る。
+        i = pre.size() - 1;
+        if (pre[i] == L'い')
+            pre.resize(i);
+        i = post.size() - 1;
+        if (post[i] == L'い')
+            post.resize(i);
+        break;
+    case HB_ICHIDAN_DOUSHI: // 一段動詞
+        // 終端の「る」を削る。
+        if (pre[pre.size() - 1] == L'る')
+            pre.resize(pre.size() - 1);
+        if (post[post.size() - 1] == L'る')
+            post.resize(post.size() - 1);
+        break;
+    case HB_KAHEN_DOUSHI: // カ変動詞
+        // 読みが３文字以上で「来る」「くる」で終わるとき、「来る」を削る。
+        if (pre.size() >= 3) {
+            if (pre.substr(pre.size() - 2, 2) == L"くる" &&
+                post.substr(post.size() - 2, 2) == L"来る")
+            {
+                pre = pre.substr(0, pre.size() - 2);
+                post = post.substr(0, post.size() - 2);
+            }
+        }
+        break;
+    case HB_SAHEN_DOUSHI: // サ変動詞
+        gyou = GYOU_SA;
+        if (pre.size() >= 2 && post.size() >= 2) { // 三文字以上のとき。
+            // 「する」「ずる」ならば「する」「ずる」を削る。
+            if (pre.substr(pre.size() - 2) == L"する" &&
+                post.substr(post.size() - 2) == L"する")
+            {
+                gyou = GYOU_ZA;
+                pre.resize(pre.size() - 2);
+                post.resize(post.size() - 2);
+            }
+            else if (pre.substr(pre.size() - 2) == L"ずる" &&
+                     post.substr(post.size() - 2) == L"ずる")
+            {
+                gyou = GYOU_SA;
+                pre.resize(pre.size() - 2);
+                post.resize(post.size() - 2);
+            }
+        }
+        break;
+    case HB_GODAN_DOUSHI: // 五段動詞
+        // 写像を準備する。
+        mz_make_literal_maps();
+        // 終端がウ段の文字でなければ失敗。
+        if (pre.empty())
+            return TRUE;
+        ch = pre[pre.size() - 1];
+        {
+            // 写像に要素を追加しないよう、operator[]は使わない。
+            std::map<WCHAR,Dan>::const_iterator it = g_hiragana_to_dan.find(ch);
+            if (it == g_hiragana_to_dan.end() || it->second != DAN_U)
+                return TRUE;
+        }
+        if (ch != post[post.size() - 1])
+            return TRUE;
+        // 終端の文字を削る。
+        pre.resize(pre.size() - 1);
+        post.resize(post.size() - 1);
+        // 終端の文字だったものの行を取得する。
+        gyou = g_hiragana_to_gyou.find(ch)->second;
+        break;
+    default:
+        break;
+    }
+
+    WStrings fields(NUM_FIELDS);
+    fields[I_FIELD_PRE] = pre;
+    fields[I_FIELD_HINSHI].resize(1);
+    fields[I_FIELD_HINSHI][0] = MAKEWORD(bunrui, gyou);
+    fields[I_FIELD_POST] = post;
+    fields[I_FIELD_TAGS] = L"[ユーザ辞書]";
+
+    std::wstring record;
+    std::wstring sep;
+    sep.resize(1);
+    sep[0] = FIELD_SEP;
+    if (bunrui == HB_SAHEN_DOUSHI) {
+        if (gyou == GYOU_ZA) {
+            fields[I_FIELD_PRE] = pre + L"ざ";
+            fields[I_FIELD_POST] = post + L"ざ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"じ";
+            fields[I_FIELD_POST] = post + L"じ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"ぜ";
+            fields[I_FIELD_POST] = post + L"ぜ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"ずる";
+            fields[I_FIELD_POST] = post + L"ずる";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"ずれ";
+            fields[I_FIELD_POST] = post + L"ずれ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"じろ";
+            fields[I_FIELD_POST] = post + L"じろ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"ぜよ";
+            fields[I_FIELD_POST] = post + L"ぜよ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"じよう";
+            fields[I_FIELD_POST] = post + L"じよう";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+        } else {
+            fields[I_FIELD_PRE] = pre + L"さ";
+            fields[I_FIELD_POST] = post + L"さ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"し";
+            fields[I_FIELD_POST] = post + L"し";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"せ";
+            fields[I_FIELD_POST] = post + L"せ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"する";
+            fields[I_FIELD_POST] = post + L"する";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"すれ";
+            fields[I_FIELD_POST] = post + L"すれ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"しろ";
+            fields[I_FIELD_POST] = post + L"しろ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"せよ";
+            fields[I_FIELD_POST] = post + L"せよ";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+
+            fields[I_FIELD_PRE] = pre + L"しよう";
+            fields[I_FIELD_POST] = post + L"しよう";
+            record = str_join(fields, sep);
+            s_UserDictRecords.push_back(record);
+        }
+    } else {
+        record = str_join(fields, sep);
+        s_UserDictRecords.push_back(record);
+    }
+
+    return TRUE;
+}
+
+// ユーザー辞書データをスキャンする。g_pfnScanUserDictに設定して使う。
+size_t ImeScanUserDict(WStrings& records, WCHAR ch, Lattice *pThis)
+{
+    DPRINTW(L"%c\n", ch);
+    USER_DICT_SCAN scan;
+    scan.pThis = pThis;
+    ImeEnumRegisterWord(UserDictProc, NULL, 0, NULL, &scan);
+
+    records.insert(records.end(), scan.records.begin(), scan.records.end());
+
+    return records.size();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Graphviz
+
+// Graphvizの候補テキストを取得する。
+std::string GetGraphvizCandText(const MzConvCandidate* cand, BOOL bFirst)
+{
+    if (!cand) {
+        if (bFirst)
+            return "HEAD";
+        else
+            return "TAIL";
+    }
+    static CHAR sz[MAX_PATH];
+    ::WideCharToMultiByte(CP_UTF8, 0, cand->post.c_str(), -1, sz, _countof(sz), NULL, NULL);
+    sz[_countof(sz) - 1] = 0;
+    return sz;
+}
+
+// Graphvizのエッジを出力する。
+void OutputGraphvizEdge(FILE* fout, const MzConvCandidate *cand0, const MzConvCandidate *cand1)
+{
+    std::string str1 = GetGraphvizCandText(cand0, TRUE);
+    std::string str2 = GetGraphvizCandText(cand1, FALSE);
+    if (!cand0)
+        cand0 = (MzConvCandidate*)0xDEAD;
+    if (!cand1)
+        cand1 = (MzConvCandidate*)0xFACE;
+    fprintf(fout, "L%p [label=\"%s\"];\n", cand0, str1.c_str());
+    fprintf(fout, "L%p [label=\"%s\"];\n", cand1, str2.c_str());
+    fprintf(fout, "L%p -> L%p;\n", cand0, cand1);
+}
+
+// Graphvizでグラフ構造を表示する。
+void ShowGraphviz(const MzConvResult& result)
+{
+    if (!mz_find_graphviz()[0])
+        return;
+
+    TCHAR path0[MAX_PATH], path1[MAX_PATH];
+    ExpandEnvironmentStrings(TEXT("%TEMP%\\graph.dot"), path0, _countof(path0));
+    ExpandEnvironmentStrings(TEXT("%TEMP%\\graph.png"), path1, _countof(path1));
+    ::DeleteFile(path1);
+
+    if (FILE *fout = _tfopen(path0, _T("wb"))) {
+        fprintf(fout, "digraph test {\n");
+        fprintf(fout, "  graph [fontname=\"MS UI Gothic\"];\n");
+        fprintf(fout, "  node [fontname=\"MS UI Gothic\"];\n");
+        fprintf(fout, "  edge [fontname=\"MS UI Gothic\"];\n");
+
+        size_t i = 0;
+        {
+            clauses_t::const_iterator it0, end0 = result.clauses.end();
+            for (it0 = result.clauses.begin(); it0 != end0; ++it0) {
+                const MzConvClause& clause = *it0;
+
+                candidates_t::const_iterator it1, end1 = clause.candidates.end();
+                for (it1 = clause.candidates.begin(); it1 != end1; ++it1) {
+                    const MzConvCandidate& cand1 = *it1;
+                    if (i == 0) {
+                        OutputGraphvizEdge(fout, NULL, &cand1);
+                    } else {
+                        candidates_t::const_iterator it2, end2 = result.clauses[i - 1].candidates.end();
+                        for (it2 = result.clauses[i - 1].candidates.begin(); it2 != end2; ++it2) {
+                            const MzConvCandidate& cand0 = *it2;
+                            OutputGraphvizEdge(fout, &cand0, &cand1);
+                        }
+                    }
+                }
+                ++i;
+            }
+        }
+
+        {
+            candidates_t::const_iterator it, end = result.clauses[i - 1].candidates.end();
+            for (it = result.clauses[i - 1].candidates.begin(); it != end; ++it) {
+                const MzConvCandidate& cand = *it;
+                OutputGraphvizEdge(fout, &cand, NULL);
+            }
+        }
+
+        fprintf(fout, "}\n");
+        fclose(fout);
+
+        TCHAR cmdline[MAX_PATH * 2];
+        StringCchPrintf(cmdline, _countof(cmdline), TEXT("-Tpng \"%s\" -o \"%s\""), path0, path1);
+        ::ShellExecute(NULL, NULL, mz_find_graphviz(), cmdline, NULL, SW_SHOWNORMAL);
+        for (INT i = 0; i < 20; ++i) {
+            ::Sleep(100);
+            if (PathFileExists(path1))
+                break;
+        }
+        ::Sleep(100);
+        ::ShellExecute(NULL, NULL, path1, NULL, NULL, SW_SHOWNORMAL);
+    }
+
+    ::DeleteFile(path0);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzIme - 変換。
+
+// 変換中の先読み変換を待つ時間の既定値（ミリ秒）。設定SpeculativeWaitで変えられる。
+#define MZ_SPECULATE_WAIT 200
+
+// 複数文節を変換する。
+BOOL MzIme::ConvertMultiClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    MzConvResult result;
+    std::wstring str = ARRAY_AT(comp.extra.hiragana_clauses, comp.extra.iClause);
+    // 先読み変換が済んでいれば、その結果を使う。
+    DWORD dwWait = Config_GetDWORD(L"SpeculativeWait", MZ_SPECULATE_WAIT);
+    if (!m_speculator.Take(m_hIMC, str, result, dwWait) &&
+        !ConvertMultiClause(str, result))
+    {
+        return FALSE;
+    }
+    return comp.StoreResult(result, cand);
+} // MzIme::ConvertMultiClause
+
+// 先読み変換を予約する。設定SpeculativeConversionが0なら何もしない。
+void MzIme::Speculate(const LogCompStr& comp)
+{
+    if (!m_hIMC || !Config_GetDWORD(L"SpeculativeConversion", TRUE))
+        return;
+    // 変換サーバーを使うときや、辞書の読み込み中は先読みしない。
+    if (Config_GetDWORD(L"UseConvServer", FALSE) || !WaitForDict(0))
+        return;
+    if (comp.extra.iClause >= comp.extra.hiragana_clauses.size())
+        return;
+    m_speculator.Schedule(m_hIMC, ARRAY_AT(comp.extra.hiragana_clauses, comp.extra.iClause));
+} // MzIme::Speculate
+
+// 先読み変換を取り消す。
+void MzIme::CancelSpeculation(HIMC hIMC)
+{
+    m_speculator.Cancel(hIMC);
+} // MzIme::CancelSpeculation
+
+// 変換した文節を学習する。書き込みは学習のスレッドが行う。
+void MzIme::LearnResult(const LogCompStr& comp)
+{
+    if (!g_learning.IsOpen())
+        return;
+
+    std::wstring prev_post;
+    const DWORD count = comp.GetClauseCount();
+    for (DWORD iClause = 0; iClause < count; ++iClause) {
+        if (!comp.IsClauseConverted(iClause) || iClause >= comp.extra.hiragana_clauses.size()) {
+            prev_post.clear();
+            continue;
+        }
+        std::wstring post = comp.GetClauseCompString(iClause);
+        g_learning.Learn(comp.extra.hiragana_clauses[iClause], post, prev_post);
+        prev_post = post;
+    }
+} // MzIme::LearnResult
+
+// 辞書の読み込みを待つ時間の既定値（ミリ秒）。設定DictWaitTimeoutで変えられる。
+#define MZ_DICT_WAIT_TIMEOUT 500
+
+// 複数文節を変換する。
+BOOL MzIme::ConvertMultiClause(const std::wstring& str, MzConvResult& result, BOOL show_graphviz)
+{
+    if (!ConvertByServer(MZCONV_MULTI, str, result)) {
+        if (!WaitForDict(Config_GetDWORD(L"DictWaitTimeout", MZ_DICT_WAIT_TIMEOUT))) {
+            // 辞書がまだ使えないので、変換しない候補を返す。
+            MakeResultOnFailure(result, str);
+        } else if (!MzConverter::ConvertMultiClause(str, result)) {
+            return FALSE;
+        }
+    }
+
+    if (show_graphviz)
+        ShowGraphviz(result);
+
+    return TRUE;
+} // MzIme::ConvertMultiClause
+
+// 単一文節を変換する。
+BOOL MzIme::ConvertSingleClause(const std::wstring& str, MzConvResult& result)
+{
+    if (ConvertByServer(MZCONV_SINGLE, str, result))
+        return TRUE;
+    if (!WaitForDict(Config_GetDWORD(L"DictWaitTimeout", MZ_DICT_WAIT_TIMEOUT))) {
+        // 辞書がまだ使えないので、変換しない候補を返す。
+        MakeResultOnFailure(result, str);
+        return TRUE;
+    }
+    return MzConverter::ConvertSingleClause(str, result);
+} // MzIme::ConvertSingleClause
+
+// 変換サーバーで変換する。使えなければFALSEを返し、呼び出し側がこのプロセスで変換する。
+// サーバーはユーザー辞書を読まないので、既定では使わない。
+BOOL MzIme::ConvertByServer(WORD wType, const std::wstring& str, MzConvResult& result)
+{
+    if (!m_hConvLock || !Config_GetDWORD(L"UseConvServer", FALSE))
+        return FALSE;
+
+    BOOL ret = FALSE;
+    mz_mutex_lock(m_hConvLock, INFINITE);
+    if (m_conv_client.IsConnected() || m_conv_client.Connect()) {
+        if (wType == MZCONV_SINGLE)
+            ret = m_conv_client.ConvertSingleClause(str, result);
+        else
+            ret = m_conv_client.ConvertMultiClause(str, result);
+    }
+    mz_mutex_unlock(m_hConvLock);
+    return ret;
+} // MzIme::ConvertByServer
+
+// 単一文節を変換する。
+BOOL MzIme::ConvertSingleClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    DWORD iClause = comp.extra.iClause; // 現在の文節。
+
+    // 変換する。
+    MzConvResult result;
+    std::wstring str = ARRAY_AT(comp.extra.hiragana_clauses, iClause);
+    if (!ConvertSingleClause(str, result)) {
+        return FALSE;
+    }
+    return comp.StoreClauseResult(result, cand, bRoman);
+} // MzIme::ConvertSingleClause
+
+// 候補表から消えた候補リストを、文節を変換し直して作り直す。
+BOOL MzIme::RebuildCandList(const LogCompStr& comp, LogCandInfo& cand, DWORD iClause)
+{
+    if (iClause >= comp.extra.hiragana_clauses.size())
+        return FALSE;
+
+    MzConvResult result;
+    if (!ConvertSingleClause(comp.extra.hiragana_clauses[iClause], result) || result.clauses.empty())
+        return FALSE;
+    return cand.RebuildList(iClause, result.clauses[0]);
+} // MzIme::RebuildCandList
+
+// 文節を左に伸縮する。
+BOOL MzIme::StretchClauseLeft(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    DWORD iClause = comp.extra.iClause; // 現在の文節の位置。
+
+    // 現在の文節を取得する。
+    std::wstring str1 = comp.extra.hiragana_clauses[iClause];
+    // 一文字以下の長さなら左に拡張できない。
+    if (str1.size() <= 1)
+        return FALSE;
+
+    // この文節の最後の文字。
+    WCHAR ch = str1[str1.size() - 1];
+    // この文節を１文字縮小する。
+    str1.resize(str1.size() - 1);
+
+    // その文字を次の文節の先頭に追加する。
+    std::wstring str2;
+    BOOL bSplitted = FALSE; // 分離したか？
+    if (iClause + 1 < comp.GetClauseCount()) {
+        str2 = ch + comp.extra.hiragana_clauses[iClause + 1];
+    } else {
+        str2 += ch;
+        bSplitted = TRUE; // 分離した。
+    }
+
+    // ２つの文節を単一文節変換する。
+    MzConvResult result1, result2;
+    if (!ConvertSingleClause(str1, result1)) {
+        return FALSE;
+    }
+    if (!ConvertSingleClause(str2, result2)) {
+        return FALSE;
+    }
+
+    // 文節が分離したら、新しい文節を挿入する。
+    if (bSplitted) {
+        std::wstring str;
+        comp.extra.hiragana_clauses.insert(comp.extra.hiragana_clauses.begin() + iClause + 1, str);
+        comp.extra.comp_str_clauses.insert(comp.extra.comp_str_clauses.begin() + iClause + 1, str);
+    }
+
+    // 未確定文字列をセット。
+    MzConvClause& clause1 = result1.clauses[0];
+    MzConvClause& clause2 = result2.clauses[0];
+    comp.extra.hiragana_clauses[iClause] = str1;
+    comp.extra.comp_str_clauses[iClause] = clause1.candidates[0].post;
+    comp.extra.hiragana_clauses[iClause + 1] = str2;
+    comp.extra.comp_str_clauses[iClause + 1] = clause2.candidates[0].post;
+
+    // 余剰情報から未確定文字列を更新する。
+    comp.UpdateFromExtra(bRoman);
+
+    // 候補リストをセットする。
+    {
+        LogCandList cand_list;
+        cand_list.AddClause(clause1);
+        cand.cand_lists[iClause] = cand_list;
+    }
+    {
+        LogCandList cand_list;
+        cand_list.AddClause(clause2);
+        if (bSplitted) {
+            cand.cand_lists.push_back(cand_list);
+        } else {
+            cand.cand_lists[iClause + 1] = cand_list;
+        }
+    }
+
+    // 現在の文節をセットする。
+    cand.iClause = iClause;
+    comp.extra.iClause = iClause;
+
+    // 文節属性をセットする。
+    comp.SetClauseAttr(iClause, ATTR_TARGET_CONVERTED);
+
+    return TRUE;
+} // MzIme::StretchClauseLeft
+
+// 文節を右に伸縮する。
+BOOL MzIme::StretchClauseRight(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    DWORD iClause = comp.extra.iClause; // 現在の文節の位置。
+
+    // 現在の文節を取得する。
+    std::wstring str1 = comp.extra.hiragana_clauses[iClause];
+
+    // 右端であれば右には拡張できない。
+    if (iClause == comp.GetClauseCount() - 1)
+        return FALSE;
+
+    // 次の文節を取得する。
+    std::wstring str2 = comp.extra.hiragana_clauses[iClause + 1];
+    // 次の文節が空ならば、右には拡張できない。
+    if (str2.empty())
+        return FALSE;
+
+    // str2の最初の文字。
+    WCHAR ch = str2[0];
+
+    // それをstr1の末尾に引っ越しする。
+    str1 += ch;
+    if (str2.size() == 1) {
+        str2.clear();
+    } else {
+        str2 = str2.substr(1);
+    }
+
+    // 関係する文節を単一文節変換。
+    MzConvResult result1, result2;
+    if (!ConvertSingleClause(str1, result1)) {
+        return FALSE;
+    }
+    if (str2.size() && !ConvertSingleClause(str2, result2)) {
+        return FALSE;
+    }
+
+    // 現在の文節。
+    MzConvClause& clause1 = result1.clauses[0];
+
+    if (str2.empty()) { // 次の文節が空になったか？
+        // 次の文節を削除する。
+        comp.extra.hiragana_clauses.erase(comp.extra.hiragana_clauses.begin() + iClause + 1);
+        comp.extra.comp_str_clauses.erase(comp.extra.comp_str_clauses.begin() + iClause + 1);
+        comp.extra.hiragana_clauses[iClause] = str1;
+        comp.extra.comp_str_clauses[iClause] = clause1.candidates[0].post;
+
+        // 候補リストも削除する
+        if (iClause + 1 < cand.cand_lists.size()) {
+            cand.cand_lists.erase(cand.cand_lists.begin() + (iClause + 1));
+        }
+    } else {
+        // ２つの文節情報をセットする。
+        MzConvClause& clause2 = result2.clauses[0];
+        comp.extra.hiragana_clauses[iClause] = str1;
+        comp.extra.comp_str_clauses[iClause] = clause1.candidates[0].post;
+        comp.extra.hiragana_clauses[iClause + 1] = str2;
+        comp.extra.comp_str_clauses[iClause + 1] = clause2.candidates[0].post;
+    }
+
+    // 余剰情報から未確定文字列を更新する。
+    comp.UpdateFromExtra(bRoman);
+
+    // 候補リストをセットする。
+    {
+        LogCandList cand_list;
+        cand_list.AddClause(clause1);
+        cand.cand_lists[iClause] = cand_list;
+    }
+    if (str2.size()) {
+        MzConvClause& clause2 = result2.clauses[0];
+        LogCandList cand_list;
+        cand_list.AddClause(clause2);
+        cand.cand_lists[iClause + 1] = cand_list;
+    }
+
+    // 現在の文節をセットする。
+    cand.iClause = iClause;
+    comp.extra.iClause = iClause;
+
+    // 文節属性をセットする。
+    comp.SetClauseAttr(iClause, ATTR_TARGET_CONVERTED);
+
+    return TRUE;
+} // MzIme::StretchClauseRight
+
+// コード変換。
+BOOL MzIme::ConvertCode(LogCompStr& comp, LogCandInfo& cand)
+{
+    MzConvResult result;
+    std::wstring strTyping = comp.extra.typing_clauses[comp.extra.iClause];
+    if (!ConvertCode(strTyping, result)) {
+        return FALSE;
+    }
+    return comp.StoreResult(result, cand);
+} // MzIme::ConvertCode
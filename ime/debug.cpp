@@ -1,11 +1,8 @@
 ﻿// debug.cpp --- MZ-IME Japanese Input (mzimeja)
 //////////////////////////////////////////////////////////////////////////////
 
-#include "mzimeja.h"
-#include <shlobj.h>
-#include <strsafe.h>
+#include "mzconv.h"
 #include <stdio.h>
-#include "resource.h"
 
 extern "C"
 {
@@ -13,6 +10,181 @@ extern "C"
 //#define USE_LOGFILE
 #undef USE_LOGFILE
 
+//////////////////////////////////////////////////////////////////////////////
+// ログのリングバッファ。
+// 書き込み側はロックを取らずにスロットを確保して書式化し、出力は専用スレッドが
+// まとめて行う。変換処理のスレッドがOutputDebugStringやファイル出力で待たされない。
+// スロットごとの通し番号で書き込み完了を判定する(有界MPMCキューと同じ方式)。
+
+#define LOG_RING_SIZE   256     // 2の累乗であること。
+#define LOG_MSG_LEN     512     // 1件あたりの最大文字数。
+#define LOG_IDLE_TIMEOUT 2000   // この時間(ミリ秒)何もなければ出力スレッドを終了する。
+
+struct LOG_SLOT {
+    volatile LONG nSeq;     // 通し番号。
+    BOOL bWide;             // szMsgWが有効か？
+    union {
+        char szMsgA[LOG_MSG_LEN];
+        WCHAR szMsgW[LOG_MSG_LEN];
+    };
+};
+
+static LOG_SLOT s_log_ring[LOG_RING_SIZE];
+static volatile LONG s_nLogInit = 0;        // 通し番号を初期化したか？
+static volatile LONG s_nLogWrite = 0;       // 次に書き込む位置。
+static LONG s_nLogRead = 0;                 // 次に読み込む位置(出力側のみが使う)。
+static volatile LONG s_nLogDropped = 0;     // あふれて捨てた件数。
+static volatile LONG s_nLogDraining = 0;    // 出力中か？
+static volatile LONG s_nLogFlusher = 0;     // 出力スレッドが動いているか？
+static HANDLE s_hLogEvent = NULL;           // 出力スレッドを起こすイベント。
+
+// リングバッファを初期化する。
+static void LogRing_Init(void)
+{
+    if (s_nLogInit == 2)
+        return;
+    if (InterlockedCompareExchange(&s_nLogInit, 1, 0) == 0) {
+        for (LONG i = 0; i < LOG_RING_SIZE; ++i)
+            s_log_ring[i].nSeq = i;
+        s_hLogEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+        InterlockedExchange(&s_nLogInit, 2);
+    } else {
+        while (s_nLogInit != 2)
+            Sleep(0);
+    }
+}
+
+// 書き込み用のスロットを確保する。あふれたらNULLを返す。
+static LOG_SLOT *LogRing_Acquire(LONG& nPos)
+{
+    for (;;) {
+        LONG pos = s_nLogWrite;
+        LOG_SLOT *slot = &s_log_ring[pos & (LOG_RING_SIZE - 1)];
+        LONG dif = slot->nSeq - pos;
+        if (dif == 0) {
+            if (InterlockedCompareExchange(&s_nLogWrite, pos + 1, pos) == pos) {
+                nPos = pos;
+                return slot;
+            }
+        } else if (dif < 0) {
+            InterlockedIncrement(&s_nLogDropped);
+            return NULL;
+        }
+    }
+}
+
+// 1件を出力する。
+static void LogRing_Output(const LOG_SLOT *slot)
+{
+#ifdef USE_LOGFILE
+    FILE *fout = fopen("C:\\mzimeja.log", "a");
+    if (fout) {
+        if (slot->bWide)
+            fprintf(fout, "%ls", slot->szMsgW);
+        else
+            fprintf(fout, "%s", slot->szMsgA);
+        fclose(fout);
+    }
+#else
+    if (slot->bWide)
+        OutputDebugStringW(slot->szMsgW);
+    else
+        OutputDebugStringA(slot->szMsgA);
+#endif
+}
+
+// たまっているログをすべて出力する。
+static void LogRing_Drain(void)
+{
+    if (InterlockedCompareExchange(&s_nLogDraining, 1, 0) != 0)
+        return; // 他のスレッドが出力中。
+
+    for (;;) {
+        LOG_SLOT *slot = &s_log_ring[s_nLogRead & (LOG_RING_SIZE - 1)];
+        if (slot->nSeq != s_nLogRead + 1)
+            break;
+        LogRing_Output(slot);
+        InterlockedExchange(&slot->nSeq, s_nLogRead + LOG_RING_SIZE);
+        ++s_nLogRead;
+    }
+
+    LONG nDropped = InterlockedExchange(&s_nLogDropped, 0);
+    if (nDropped) {
+        char szMsgA[64];
+        StringCchPrintfA(szMsgA, _countof(szMsgA), "(%ld log messages dropped)\n", nDropped);
+        OutputDebugStringA(szMsgA);
+    }
+
+    InterlockedExchange(&s_nLogDraining, 0);
+}
+
+// ログが残っているか？
+static BOOL LogRing_HasData(void)
+{
+    const LOG_SLOT *slot = &s_log_ring[s_nLogRead & (LOG_RING_SIZE - 1)];
+    return slot->nSeq == s_nLogRead + 1;
+}
+
+// このソースを含むモジュールのハンドルを取得する。
+static HMODULE LogRing_GetModule(void)
+{
+    MEMORY_BASIC_INFORMATION mbi;
+    if (!VirtualQuery((LPCVOID)&LogRing_GetModule, &mbi, sizeof(mbi)))
+        return NULL;
+    return (HMODULE)mbi.AllocationBase;
+}
+
+// 出力スレッド。しばらく暇になったら自分で終了する。
+// 動いている間はモジュールの参照カウントを上げておき、DLLがアンロードされない
+// ようにする。
+static DWORD WINAPI LogRing_ThreadProc(LPVOID)
+{
+    HMODULE hMod = NULL;
+    WCHAR szPath[MAX_PATH];
+    if (GetModuleFileNameW(LogRing_GetModule(), szPath, _countof(szPath)))
+        hMod = LoadLibraryW(szPath);
+
+    for (;;) {
+        DWORD dwWait = WaitForSingleObject(s_hLogEvent, LOG_IDLE_TIMEOUT);
+        LogRing_Drain();
+        if (dwWait != WAIT_TIMEOUT)
+            continue;
+
+        // 終了する。直前に書き込まれたものがあれば、続行を試みる。
+        InterlockedExchange(&s_nLogFlusher, 0);
+        if (!LogRing_HasData() ||
+            InterlockedCompareExchange(&s_nLogFlusher, 1, 0) != 0)
+        {
+            break;
+        }
+    }
+
+    if (hMod)
+        FreeLibraryAndExitThread(hMod, 0);
+    return 0;
+}
+
+// 書き込みが終わったスロットを公開して、出力スレッドを起こす。
+static void LogRing_Commit(LOG_SLOT *slot, LONG nPos)
+{
+    InterlockedExchange(&slot->nSeq, nPos + 1);
+
+    if (InterlockedCompareExchange(&s_nLogFlusher, 1, 0) == 0) {
+        HANDLE hThread = NULL;
+        if (s_hLogEvent)
+            hThread = CreateThread(NULL, 0, LogRing_ThreadProc, NULL, 0, NULL);
+        if (hThread) {
+            CloseHandle(hThread);
+        } else {
+            // スレッドを作れなければその場で出力する。
+            InterlockedExchange(&s_nLogFlusher, 0);
+            LogRing_Drain();
+        }
+    } else {
+        SetEvent(s_hLogEvent);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // デバッグ用。
 
@@ -21,45 +193,52 @@ BOOL g_bTrace = TRUE;   // この変数がFALSEのときはデバッグ出力し
 // printf関数と同じ文法でデバッグ出力を行う関数。
 void DebugPrintA(const char *lpszFormat, ...)
 {
-    char szMsgA[1024];
-
     if (!g_bTrace)
         return;
 
+    LogRing_Init();
+
+    LONG nPos;
+    LOG_SLOT *slot = LogRing_Acquire(nPos);
+    if (!slot)
+        return;
+
     va_list marker;
     va_start(marker, lpszFormat);
-    StringCchVPrintfA(szMsgA, _countof(szMsgA), lpszFormat, marker);
+    StringCchVPrintfA(slot->szMsgA, _countof(slot->szMsgA), lpszFormat, marker);
     va_end(marker);
+    slot->bWide = FALSE;
 
-#ifdef USE_LOGFILE
-    FILE *fout = fopen("C:\\mzimeja.log", "a");
-    fprintf(fout, "%s", szMsgA);
-    fclose(fout);
-#else
-    OutputDebugStringA(szMsgA);
-#endif
+    LogRing_Commit(slot, nPos);
 }
 
 // wprintf関数と同じ文法でデバッグ出力を行う関数。
 void DebugPrintW(const WCHAR *lpszFormat, ...)
 {
-    WCHAR szMsg[1024];
-
     if (!g_bTrace)
         return;
 
+    LogRing_Init();
+
+    LONG nPos;
+    LOG_SLOT *slot = LogRing_Acquire(nPos);
+    if (!slot)
+        return;
+
     va_list marker;
     va_start(marker, lpszFormat);
-    StringCchVPrintfW(szMsg, _countof(szMsg), lpszFormat, marker);
+    StringCchVPrintfW(slot->szMsgW, _countof(slot->szMsgW), lpszFormat, marker);
     va_end(marker);
+    slot->bWide = TRUE;
 
-#ifdef USE_LOGFILE
-    FILE *fout = fopen("C:\\mzimeja.log", "a");
-    fprintf(fout, "%ls", szMsg);
-    fclose(fout);
-#else
-    OutputDebugStringW(szMsg);
-#endif
+    LogRing_Commit(slot, nPos);
+}
+
+// たまっているデバッグ出力を呼び出し元のスレッドで出力する。
+void DebugFlush(void)
+{
+    if (s_nLogInit == 2)
+        LogRing_Drain();
 }
 
 // ASSERT失敗時に呼び出される関数。
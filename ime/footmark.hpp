@@ -57,14 +57,14 @@ struct FootmarkLocation {
     FootmarkLocation() : m_file(NULL), m_line(0), m_func(NULL),
         m_entered(false), m_retval_type(RETVAL_NONE) 
     {
-        m_retval_lparam = 0;
+        m_retval_ptr = NULL;
     }
 
     FootmarkLocation(const char *file, int line, const char *func) :
         m_file(file), m_line(line), m_func(func), m_entered(true),
         m_retval_type(RETVAL_NONE) 
     {
-        m_retval_lparam = 0;
+        m_retval_ptr = NULL;
         Enter();
     }
 
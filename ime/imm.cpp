@@ -304,11 +304,15 @@ BOOL WINAPI ImeSelect(HIMC hIMC, BOOL fSelect)
     FOOTMARK_FORMAT("(%p, %u)\n", hIMC, fSelect);
 
     if (fSelect) TheIME.UpdateIndicIcon(hIMC);
+    if (!fSelect) TheIME.CancelSpeculation(hIMC);
     if (hIMC != NULL) {
         InputContext *lpIMC = TheIME.LockIMC(hIMC);
         if (lpIMC) {
             if (fSelect) {
                 lpIMC->Initialize();
+            } else {
+                // 候補表の参照を手放す。
+                lpIMC->hCandInfo = CandInfo::ReCreate(lpIMC->hCandInfo, NULL);
             }
             TheIME.UnlockIMC(hIMC);
         }
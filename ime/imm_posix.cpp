@@ -0,0 +1,231 @@
+﻿// imm_posix.cpp --- IMM functions for non-Windows builds
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 入力コンテキストとそのメモリ（IMCC）をヒープで真似る。
+
+#include "mzconv.h"
+#include "input.h"
+
+IMCC_STATS g_imcc_stats;
+
+// IMCCの先頭。データはこの後に続く。
+struct IMCC_HEADER {
+    DWORD dwSize;       // データの大きさ。
+    DWORD dwLockCount;  // ロックの数。
+};
+
+HIMCC ImmCreateIMCC(DWORD dwSize)
+{
+    // Windowsと同じく、ゼロで埋める。
+    IMCC_HEADER *pHeader = (IMCC_HEADER *)calloc(1, sizeof(IMCC_HEADER) + dwSize);
+    if (!pHeader)
+        return NULL;
+    pHeader->dwSize = dwSize;
+    InterlockedIncrement(&g_imcc_stats.nCreates);
+    return (HIMCC)pHeader;
+}
+
+HIMCC ImmDestroyIMCC(HIMCC hIMCC)
+{
+    free(hIMCC);
+    return NULL;
+}
+
+LPVOID ImmLockIMCC(HIMCC hIMCC)
+{
+    IMCC_HEADER *pHeader = (IMCC_HEADER *)hIMCC;
+    if (!pHeader)
+        return NULL;
+    ++pHeader->dwLockCount;
+    return pHeader + 1;
+}
+
+BOOL ImmUnlockIMCC(HIMCC hIMCC)
+{
+    IMCC_HEADER *pHeader = (IMCC_HEADER *)hIMCC;
+    if (!pHeader || pHeader->dwLockCount == 0)
+        return FALSE;
+    return --pHeader->dwLockCount != 0;
+}
+
+HIMCC ImmReSizeIMCC(HIMCC hIMCC, DWORD dwSize)
+{
+    IMCC_HEADER *pHeader = (IMCC_HEADER *)hIMCC;
+    if (!pHeader)
+        return NULL;
+    if (pHeader->dwLockCount) {
+        // ロック中は動かせない。
+        ASSERT(0);
+        return NULL;
+    }
+
+    DWORD dwOldSize = pHeader->dwSize;
+    IMCC_HEADER *pNew = (IMCC_HEADER *)realloc(pHeader, sizeof(IMCC_HEADER) + dwSize);
+    if (!pNew)
+        return NULL;
+    if (dwSize > dwOldSize)
+        memset((BYTE *)(pNew + 1) + dwOldSize, 0, dwSize - dwOldSize);
+    pNew->dwSize = dwSize;
+
+    InterlockedIncrement(&g_imcc_stats.nReSizes);
+    if (pNew != pHeader)
+        InterlockedIncrement(&g_imcc_stats.nMoves);
+    return (HIMCC)pNew;
+}
+
+DWORD ImmGetIMCCSize(HIMCC hIMCC)
+{
+    IMCC_HEADER *pHeader = (IMCC_HEADER *)hIMCC;
+    return pHeader ? pHeader->dwSize : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 入力コンテキスト。HIMCはINPUTCONTEXTを指す。
+
+HIMC ImmCreateContext(void)
+{
+    LPINPUTCONTEXT lpIMC = (LPINPUTCONTEXT)calloc(1, sizeof(INPUTCONTEXT));
+    if (!lpIMC)
+        return NULL;
+    // IMMと同じく、空のIMCCを作っておく。
+    lpIMC->hCompStr = ImmCreateIMCC(sizeof(COMPOSITIONSTRING));
+    lpIMC->hCandInfo = ImmCreateIMCC(sizeof(CANDIDATEINFO));
+    lpIMC->hGuideLine = ImmCreateIMCC(sizeof(GUIDELINE));
+    lpIMC->hMsgBuf = ImmCreateIMCC(sizeof(TRANSMSG));
+    return (HIMC)lpIMC;
+}
+
+BOOL ImmDestroyContext(HIMC hIMC)
+{
+    LPINPUTCONTEXT lpIMC = (LPINPUTCONTEXT)hIMC;
+    if (!lpIMC)
+        return FALSE;
+    ImmDestroyIMCC(lpIMC->hCompStr);
+    ImmDestroyIMCC(lpIMC->hCandInfo);
+    ImmDestroyIMCC(lpIMC->hGuideLine);
+    ImmDestroyIMCC(lpIMC->hPrivate);
+    ImmDestroyIMCC(lpIMC->hMsgBuf);
+    free(lpIMC);
+    return TRUE;
+}
+
+LPINPUTCONTEXT ImmLockIMC(HIMC hIMC)
+{
+    return (LPINPUTCONTEXT)hIMC;
+}
+
+BOOL ImmUnlockIMC(HIMC hIMC)
+{
+    return hIMC != NULL;
+}
+
+BOOL ImmGetOpenStatus(HIMC hIMC)
+{
+    LPINPUTCONTEXT lpIMC = ImmLockIMC(hIMC);
+    return lpIMC ? lpIMC->fOpen : FALSE;
+}
+
+BOOL ImmSetOpenStatus(HIMC hIMC, BOOL fOpen)
+{
+    LPINPUTCONTEXT lpIMC = ImmLockIMC(hIMC);
+    if (!lpIMC)
+        return FALSE;
+    lpIMC->fOpen = fOpen;
+    return TRUE;
+}
+
+BOOL ImmGetConversionStatus(HIMC hIMC, LPDWORD lpfdwConversion, LPDWORD lpfdwSentence)
+{
+    LPINPUTCONTEXT lpIMC = ImmLockIMC(hIMC);
+    if (!lpIMC)
+        return FALSE;
+    if (lpfdwConversion)
+        *lpfdwConversion = lpIMC->fdwConversion;
+    if (lpfdwSentence)
+        *lpfdwSentence = lpIMC->fdwSentence;
+    return TRUE;
+}
+
+BOOL ImmSetConversionStatus(HIMC hIMC, DWORD fdwConversion, DWORD fdwSentence)
+{
+    LPINPUTCONTEXT lpIMC = ImmLockIMC(hIMC);
+    if (!lpIMC)
+        return FALSE;
+    lpIMC->fdwConversion = fdwConversion;
+    lpIMC->fdwSentence = fdwSentence;
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzIme
+
+MzIme TheIME;
+
+// メッセージを生成する。ウィンドウがないので、貯めておくだけ。
+BOOL MzIme::GenerateMessage(UINT message, WPARAM wParam, LPARAM lParam)
+{
+    TRANSMSG msg;
+    msg.message = message;
+    msg.wParam = wParam;
+    msg.lParam = lParam;
+    m_msgs.push_back(msg);
+    return TRUE;
+}
+
+// 複数文節を変換する。
+BOOL MzIme::ConvertMultiClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    MzConvResult result;
+    std::wstring str = ARRAY_AT(comp.extra.hiragana_clauses, comp.extra.iClause);
+    if (!m_pConverter || !m_pConverter->ConvertMultiClause(str, result))
+        return FALSE;
+    return comp.StoreResult(result, cand);
+}
+
+// 単一文節を変換する。
+BOOL MzIme::ConvertSingleClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    MzConvResult result;
+    std::wstring str = ARRAY_AT(comp.extra.hiragana_clauses, comp.extra.iClause);
+    if (!m_pConverter || !m_pConverter->ConvertSingleClause(str, result))
+        return FALSE;
+    return comp.StoreClauseResult(result, cand, bRoman);
+}
+
+// 候補表から消えた候補リストを、文節を変換し直して作り直す。
+BOOL MzIme::RebuildCandList(const LogCompStr& comp, LogCandInfo& cand, DWORD iClause)
+{
+    if (iClause >= comp.extra.hiragana_clauses.size())
+        return FALSE;
+
+    MzConvResult result;
+    if (!m_pConverter ||
+        !m_pConverter->ConvertSingleClause(comp.extra.hiragana_clauses[iClause], result) ||
+        result.clauses.empty())
+    {
+        return FALSE;
+    }
+    return cand.RebuildList(iClause, result.clauses[0]);
+}
+
+// 文節の伸縮はしない。
+BOOL MzIme::StretchClauseLeft(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    return FALSE;
+}
+
+// 文節の伸縮はしない。
+BOOL MzIme::StretchClauseRight(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman)
+{
+    return FALSE;
+}
+
+// コード変換。
+BOOL MzIme::ConvertCode(LogCompStr& comp, LogCandInfo& cand)
+{
+    MzConvResult result;
+    std::wstring strTyping = comp.extra.typing_clauses[comp.extra.iClause];
+    if (!m_pConverter || !m_pConverter->ConvertCode(strTyping, result))
+        return FALSE;
+    return comp.StoreResult(result, cand);
+}
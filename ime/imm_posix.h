@@ -0,0 +1,210 @@
+﻿// imm_posix.h --- IMM data structures for non-Windows builds
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// Windows以外で、入力コンテキスト（input.cpp）を動かすためのIMMの型と関数。
+// 入力コンテキストとそのメモリ（IMCC）はヒープに置く。キー入力の再生ツール（mzreplay）が使う。
+// ウィンドウに関わるもの（位置、フォント、インジケーター）は持たない。
+
+#pragma once
+
+#ifdef _WIN32
+    #error Use <immdev.h> on Windows.
+#endif
+
+#include "platform.h"
+#include <vector>
+
+typedef HANDLE HIMC;
+typedef HANDLE HIMCC;
+typedef HANDLE HWND;
+typedef UINT_PTR WPARAM;
+typedef INT_PTR LPARAM;
+
+typedef struct tagCANDIDATELIST {
+    DWORD dwSize;
+    DWORD dwStyle;
+    DWORD dwCount;
+    DWORD dwSelection;
+    DWORD dwPageStart;
+    DWORD dwPageSize;
+    DWORD dwOffset[1];
+} CANDIDATELIST, *PCANDIDATELIST, *LPCANDIDATELIST;
+
+typedef struct tagCOMPOSITIONSTRING {
+    DWORD dwSize;
+    DWORD dwCompReadAttrLen;
+    DWORD dwCompReadAttrOffset;
+    DWORD dwCompReadClauseLen;
+    DWORD dwCompReadClauseOffset;
+    DWORD dwCompReadStrLen;
+    DWORD dwCompReadStrOffset;
+    DWORD dwCompAttrLen;
+    DWORD dwCompAttrOffset;
+    DWORD dwCompClauseLen;
+    DWORD dwCompClauseOffset;
+    DWORD dwCompStrLen;
+    DWORD dwCompStrOffset;
+    DWORD dwCursorPos;
+    DWORD dwDeltaStart;
+    DWORD dwResultReadClauseLen;
+    DWORD dwResultReadClauseOffset;
+    DWORD dwResultReadStrLen;
+    DWORD dwResultReadStrOffset;
+    DWORD dwResultClauseLen;
+    DWORD dwResultClauseOffset;
+    DWORD dwResultStrLen;
+    DWORD dwResultStrOffset;
+    DWORD dwPrivateSize;
+    DWORD dwPrivateOffset;
+} COMPOSITIONSTRING, *PCOMPOSITIONSTRING, *LPCOMPOSITIONSTRING;
+
+typedef struct tagCANDIDATEINFO {
+    DWORD               dwSize;
+    DWORD               dwCount;
+    DWORD               dwOffset[32];
+    DWORD               dwPrivateSize;
+    DWORD               dwPrivateOffset;
+} CANDIDATEINFO, *PCANDIDATEINFO, *LPCANDIDATEINFO;
+
+typedef struct tagINPUTCONTEXT {
+    HWND                hWnd;
+    BOOL                fOpen;
+    DWORD               fdwConversion;
+    DWORD               fdwSentence;
+    HIMCC               hCompStr;
+    HIMCC               hCandInfo;
+    HIMCC               hGuideLine;
+    HIMCC               hPrivate;
+    DWORD               dwNumMsgBuf;
+    HIMCC               hMsgBuf;
+    DWORD               fdwInit;
+} INPUTCONTEXT, *PINPUTCONTEXT, *LPINPUTCONTEXT;
+
+typedef struct tagTRANSMSG {
+    UINT                message;
+    WPARAM              wParam;
+    LPARAM              lParam;
+} TRANSMSG, *PTRANSMSG, *LPTRANSMSG;
+
+typedef struct tagGUIDELINE {
+    DWORD dwSize;
+    DWORD dwLevel;
+    DWORD dwIndex;
+    DWORD dwStrLen;
+    DWORD dwStrOffset;
+    DWORD dwPrivateSize;
+    DWORD dwPrivateOffset;
+} GUIDELINE, *PGUIDELINE, *LPGUIDELINE;
+
+#define INIT_STATUSWNDPOS               0x00000001
+#define INIT_CONVERSION                 0x00000002
+#define INIT_SENTENCE                   0x00000004
+#define INIT_LOGFONT                    0x00000008
+#define INIT_COMPFORM                   0x00000010
+#define INIT_SOFTKBDPOS                 0x00000020
+
+#define WM_IME_STARTCOMPOSITION         0x010D
+#define WM_IME_ENDCOMPOSITION           0x010E
+#define WM_IME_COMPOSITION              0x010F
+#define WM_IME_NOTIFY                   0x0282
+
+#define IMN_CHANGECANDIDATE             0x0003
+#define IMN_CLOSECANDIDATE              0x0004
+#define IMN_OPENCANDIDATE               0x0005
+#define IMN_GUIDELINE                   0x000D
+
+#define GCS_COMPREADSTR                 0x0001
+#define GCS_COMPREADATTR                0x0002
+#define GCS_COMPREADCLAUSE              0x0004
+#define GCS_COMPSTR                     0x0008
+#define GCS_COMPATTR                    0x0010
+#define GCS_COMPCLAUSE                  0x0020
+#define GCS_CURSORPOS                   0x0080
+#define GCS_DELTASTART                  0x0100
+#define GCS_RESULTREADSTR               0x0200
+#define GCS_RESULTREADCLAUSE            0x0400
+#define GCS_RESULTSTR                   0x0800
+#define GCS_RESULTCLAUSE                0x1000
+
+#define ATTR_INPUT                      0x00
+#define ATTR_TARGET_CONVERTED           0x01
+#define ATTR_CONVERTED                  0x02
+#define ATTR_TARGET_NOTCONVERTED        0x03
+#define ATTR_INPUT_ERROR                0x04
+#define ATTR_FIXEDCONVERTED             0x05
+
+#define IME_CMODE_ALPHANUMERIC          0x0000
+#define IME_CMODE_NATIVE                0x0001
+#define IME_CMODE_JAPANESE              IME_CMODE_NATIVE
+#define IME_CMODE_KATAKANA              0x0002
+#define IME_CMODE_FULLSHAPE             0x0008
+#define IME_CMODE_ROMAN                 0x0010
+#define IME_CMODE_CHARCODE              0x0020
+
+#define IME_CAND_UNKNOWN                0x0000
+#define IME_CAND_READ                   0x0001
+
+extern "C" {
+
+HIMCC ImmCreateIMCC(DWORD dwSize);
+HIMCC ImmDestroyIMCC(HIMCC hIMCC);
+LPVOID ImmLockIMCC(HIMCC hIMCC);
+BOOL ImmUnlockIMCC(HIMCC hIMCC);
+HIMCC ImmReSizeIMCC(HIMCC hIMCC, DWORD dwSize);
+DWORD ImmGetIMCCSize(HIMCC hIMCC);
+
+HIMC ImmCreateContext(void);
+BOOL ImmDestroyContext(HIMC hIMC);
+LPINPUTCONTEXT ImmLockIMC(HIMC hIMC);
+BOOL ImmUnlockIMC(HIMC hIMC);
+BOOL ImmGetOpenStatus(HIMC hIMC);
+BOOL ImmSetOpenStatus(HIMC hIMC, BOOL fOpen);
+BOOL ImmGetConversionStatus(HIMC hIMC, LPDWORD lpfdwConversion, LPDWORD lpfdwSentence);
+BOOL ImmSetConversionStatus(HIMC hIMC, DWORD fdwConversion, DWORD fdwSentence);
+
+} // extern "C"
+
+// IMCCの統計。
+struct IMCC_STATS {
+    LONG nCreates;  // 作った数。
+    LONG nReSizes;  // 大きさを変えた回数。
+    LONG nMoves;    // 大きさを変えて、ハンドルが変わった回数。
+};
+extern IMCC_STATS g_imcc_stats;
+
+//////////////////////////////////////////////////////////////////////////////
+// MzIme - 入力コンテキストが呼ぶIMEの機能の代わり。
+// メッセージは送らずに貯め、変換はMzConverterに頼む。先読みと学習はしない。
+
+#define GCS_COMPALL \
+        (GCS_COMPSTR | GCS_COMPATTR | GCS_COMPREADSTR | GCS_COMPREADATTR | \
+         GCS_COMPCLAUSE | GCS_COMPREADCLAUSE)
+
+#define GCS_RESULTALL \
+        (GCS_RESULTSTR | GCS_RESULTREADSTR | GCS_RESULTCLAUSE | GCS_RESULTREADCLAUSE)
+
+struct LogCompStr;
+struct LogCandInfo;
+class MzConverter;
+
+class MzIme {
+public:
+    MzConverter *m_pConverter;      // 変換に使う。
+    std::vector<TRANSMSG> m_msgs;   // 生成したメッセージ。
+
+    MzIme() : m_pConverter(NULL) { }
+
+    BOOL GenerateMessage(UINT message, WPARAM wParam = 0, LPARAM lParam = 0);
+
+    BOOL ConvertMultiClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman);
+    BOOL ConvertSingleClause(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman);
+    BOOL RebuildCandList(const LogCompStr& comp, LogCandInfo& cand, DWORD iClause);
+    BOOL StretchClauseLeft(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman);
+    BOOL StretchClauseRight(LogCompStr& comp, LogCandInfo& cand, BOOL bRoman);
+    BOOL ConvertCode(LogCompStr& comp, LogCandInfo& cand);
+    void Speculate(const LogCompStr& comp) { }
+    void CancelSpeculation(HIMC hIMC) { }
+    void LearnResult(const LogCompStr& comp) { }
+}; // class MzIme
+
+extern MzIme TheIME;
@@ -2,7 +2,7 @@
 // IMMセキュリティ関連。
 //////////////////////////////////////////////////////////////////////////////
 
-#include "mzimeja.h"
+#include "mzconv.h"
 
 #define MEMALLOC(x) LocalAlloc(LMEM_FIXED, x)
 #define MEMFREE(x) LocalFree(x)
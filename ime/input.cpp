@@ -2,8 +2,13 @@
 // 入力コンテキスト関連。
 //////////////////////////////////////////////////////////////////////////////
 
-#include "mzimeja.h"
-#include "resource.h"
+#ifdef _WIN32
+    #include "mzimeja.h"
+    #include "resource.h"
+#else
+    #include "mzconv.h"
+    #include "input.h"  // TheIMEはimm_posix.hのMzIme。
+#endif
 
 //////////////////////////////////////////////////////////////////////////////
 // input modes
@@ -24,32 +29,7 @@ BOOL IsInputModeOpen(INPUT_MODE imode)
     }
 }
 
-// IME変換モードから入力モードを返す。
-INPUT_MODE InputModeFromConversionMode(BOOL bOpen, DWORD dwConversion)
-{
-    if (bOpen) {
-        if (dwConversion & IME_CMODE_FULLSHAPE) {
-            if (dwConversion & IME_CMODE_JAPANESE) {
-                if (dwConversion & IME_CMODE_KATAKANA) {
-                    return IMODE_FULL_KATAKANA;
-                } else {
-                    return IMODE_FULL_HIRAGANA;
-                }
-            } else {
-                return IMODE_FULL_ASCII;
-            }
-        } else {
-            if (dwConversion & (IME_CMODE_JAPANESE | IME_CMODE_KATAKANA)) {
-                return IMODE_HALF_KANA;
-            } else {
-                return IMODE_HALF_ASCII;
-            }
-        }
-    } else {
-        return IMODE_HALF_ASCII;
-    }
-}
-
+#ifdef _WIN32
 // 入力モードからコマンドIDを返す。
 UINT CommandFromInputMode(INPUT_MODE imode)
 {
@@ -68,6 +48,7 @@ UINT CommandFromInputMode(INPUT_MODE imode)
         return IDM_HALF_ASCII;
     }
 }
+#endif  // def _WIN32
 
 // 入力モードを取得する。
 INPUT_MODE GetInputMode(HIMC hIMC)
@@ -101,6 +82,7 @@ INPUT_MODE NextInputMode(INPUT_MODE imode)
     }
 }
 
+#ifdef _WIN32
 // 入力モードを設定。
 void SetInputMode(HIMC hIMC, INPUT_MODE imode, BOOL bOpenClose)
 {
@@ -189,6 +171,7 @@ void SetInputMode(HIMC hIMC, INPUT_MODE imode, BOOL bOpenClose)
     if (!::ImmSetConversionStatus(hIMC, dwConversion, dwSentence))
         DPRINTA("!ImmSetConversionStatus\n");
 }
+#endif  // def _WIN32
 
 // ローマ字入力モードか？
 BOOL IsRomanMode(HIMC hIMC)
@@ -232,12 +215,13 @@ void InputContext::Dump()
     DPRINTA("### INPUTCONTEXT ###\n");
     DPRINTA("hWnd: %p\n", hWnd);
     DPRINTA("fOpen: %d\n", fOpen);
+    DPRINTA("fdwConversion: %08X\n", fdwConversion);
+    DPRINTA("fdwSentence: %08X\n", fdwSentence);
+#ifdef _WIN32
     DPRINTA("ptStatusWndPos.x: %d\n", ptStatusWndPos.x);
     DPRINTA("ptStatusWndPos.y: %d\n", ptStatusWndPos.y);
     DPRINTA("ptSoftKbdPos.x: %d\n", ptSoftKbdPos.x);
     DPRINTA("ptSoftKbdPos.y: %d\n", ptSoftKbdPos.y);
-    DPRINTA("fdwConversion: %08X\n", fdwConversion);
-    DPRINTA("fdwSentence: %08X\n", fdwSentence);
     DPRINTA("lfFont.W.lfHeight: %d\n", lfFont.W.lfHeight);
     DPRINTA("lfFont.W.lfCharSet: %d\n", lfFont.W.lfCharSet);
     DPRINTW(L"lfFont.W.lfFaceName: %s\n", lfFont.W.lfFaceName);
@@ -256,6 +240,7 @@ void InputContext::Dump()
     DPRINTA("cfCandForm[0].rcArea.top: %d\n", cfCandForm[0].rcArea.top);
     DPRINTA("cfCandForm[0].rcArea.right: %d\n", cfCandForm[0].rcArea.right);
     DPRINTA("cfCandForm[0].rcArea.bottom: %d\n", cfCandForm[0].rcArea.bottom);
+#endif
     DPRINTA("hCompStr: %p\n", hCompStr);
     DPRINTA("hCandInfo: %p\n", hCandInfo);
     DPRINTA("hGuideLine: %p\n", hGuideLine);
@@ -271,9 +256,11 @@ void InputContext::Initialize()
     FOOTMARK();
     Dump();
 
+#ifdef _WIN32
     lfFont.W.lfCharSet = SHIFTJIS_CHARSET;
     lfFont.W.lfFaceName[0] = 0;
     fdwInit |= INIT_LOGFONT;
+#endif
 
     fdwConversion = IME_CMODE_ROMAN | IME_CMODE_FULLSHAPE |
                     IME_CMODE_JAPANESE;
@@ -377,6 +364,7 @@ const DWORD& InputContext::NumMsgBuf() const
     return dwNumMsgBuf;
 }
 
+#ifdef _WIN32
 // ガイドラインを作成。
 void InputContext::MakeGuideLine(DWORD dwID)
 {
@@ -412,6 +400,7 @@ void InputContext::MakeGuideLine(DWORD dwID)
 
     UnlockGuideLine(); // ガイドラインのロックを解除。
 }
+#endif  // def _WIN32
 
 // ガイドラインをロック。
 LPGUIDELINE InputContext::LockGuideLine()
@@ -441,6 +430,13 @@ void InputContext::GetLogObjects(LogCompStr& comp, LogCandInfo& cand)
         lpCandInfo->GetLog(cand);
         UnlockCandInfo();
     }
+
+    // 候補が欠けていれば、変換し直す。
+    for (DWORD iList = 0; iList < cand.cand_lists.size(); ++iList) {
+        if (cand.cand_lists[iList].bLost && !TheIME.RebuildCandList(comp, cand, iList)) {
+            EPRINTA("RebuildCandList failed: %u\n", iList);
+        }
+    }
 } // InputContext::GetLogObjects
 
 // 候補を選択する。
@@ -474,17 +470,15 @@ BOOL InputContext::SelectCand(UINT uCandIndex)
 // 文字を追加。
 void InputContext::AddChar(WCHAR chTyped, WCHAR chTranslated)
 {
+    // 未確定文字列の論理データを取得。前のキーの写しがあればそれを使う。
     LogCompStr comp;
-    CompStr *lpCompStr = LockCompStr(); // 未確定文字列をロック。
-    if (lpCompStr) {
-        lpCompStr->GetLog(comp); // 未確定文字列の論理データを取得。
-        UnlockCompStr(); // 未確定文字列のロックを解除。
-    }
+    CompStr::TakeLog(hCompStr, comp);
 
     // if the current clause is converted,
     BOOL bHasResult = FALSE;
     if (comp.IsClauseConverted()) {
         // determinate composition
+        TheIME.LearnResult(comp);
         comp.MakeResult();
         CloseCandidate();
         bHasResult = TRUE;
@@ -498,6 +492,7 @@ void InputContext::AddChar(WCHAR chTyped, WCHAR chTranslated)
 
     // １文字を追加。
     comp.AssertValid();
+    comp.dwDeltaStart = comp.GetCompCharCount(); // 変わり始めた位置まで下がる。
     if ((Conversion() & IME_CMODE_JAPANESE) && !::IsCharAlphaW(chTyped)) {
         if (IsRomanMode() && comp.PrevCharInClause() == L'n') {
             comp.AddChar(L'n', L'n', Conversion());
@@ -507,8 +502,15 @@ void InputContext::AddChar(WCHAR chTyped, WCHAR chTranslated)
     comp.AddChar(chTyped, chTranslated, Conversion());
     comp.AssertValid();
 
-    // 未確定文字列の再作成。
-    hCompStr = CompStr::ReCreate(hCompStr, &comp);
+    // 変換キーが押される前に、別のスレッドで変換しておく。
+    TheIME.Speculate(comp);
+
+    // 未確定文字列の再作成。結果がなければ、変わったところだけを書き換える。
+    if (bHasResult) {
+        hCompStr = CompStr::ReCreate(hCompStr, &comp);
+    } else {
+        hCompStr = CompStr::Update(hCompStr, comp);
+    }
 
     // 未確定文字列のメッセージを生成。
     if (bHasResult) { // 結果がある？
@@ -584,7 +586,7 @@ BOOL InputContext::Convert(BOOL bShift)
             } else {
                 cand_list.MoveNext();
             }
-            std::wstring str = cand_list.cand_strs[cand_list.dwSelection];
+            std::wstring str = cand_list.GetString();
             comp.SetClauseCompString(comp.extra.iClause, str);
         } else {
             // 候補を開くメッセージを生成。
@@ -639,6 +641,7 @@ void InputContext::MakeResult()
 
     // 結果を作成。
     comp.AssertValid();
+    TheIME.LearnResult(comp);
     comp.MakeResult();
     comp.AssertValid();
 
@@ -940,16 +943,13 @@ void InputContext::RevertTextForClause()
 // 文字を削除する。
 void InputContext::DeleteChar(BOOL bBackSpace)
 {
-    // 未確定文字列の論理データを取得。
+    // 未確定文字列の論理データを取得。前のキーの写しがあればそれを使う。
     LogCompStr comp;
-    CompStr *lpCompStr = LockCompStr();
-    if (lpCompStr) {
-        lpCompStr->GetLog(comp);
-        UnlockCompStr();
-    }
+    CompStr::TakeLog(hCompStr, comp);
 
     // 文字を削除。
     comp.AssertValid();
+    comp.dwDeltaStart = comp.GetCompCharCount(); // 変わり始めた位置まで下がる。
     comp.DeleteChar(bBackSpace, Conversion());
     comp.AssertValid();
 
@@ -966,8 +966,8 @@ void InputContext::DeleteChar(BOOL bBackSpace)
         // 未確定文字列の終了メッセージを生成。
         TheIME.GenerateMessage(WM_IME_ENDCOMPOSITION);
     } else {
-        // 未確定文字列の再作成。
-        hCompStr = CompStr::ReCreate(hCompStr, &comp);
+        // 未確定文字列の変わったところだけを書き換える。
+        hCompStr = CompStr::Update(hCompStr, comp);
 
         // 未確定文字列のメッセージを生成。
         LPARAM lParam = GCS_COMPALL | GCS_CURSORPOS;
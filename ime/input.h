@@ -5,10 +5,14 @@
 #ifndef INPUT_H_
 #define INPUT_H_
 
-#ifndef _INC_WINDOWS
-  #include <windows.h>
+#ifdef _WIN32
+  #ifndef _INC_WINDOWS
+    #include <windows.h>
+  #endif
+  #include "immdev.h"
+#else
+  #include "imm_posix.h"  // ウィンドウのない入力コンテキスト。
 #endif
-#include "immdev.h"
 
 #include <string>
 #include <vector>
@@ -38,6 +42,8 @@ UINT        CommandFromInputMode(INPUT_MODE imode);
 // 未確定文字列。
 
 struct LogCandInfo;
+struct MzConvResult;
+struct MzConvClause;
 
 // 未確定文字列の余剰情報の論理データ。
 struct LogCompStrExtra {
@@ -55,6 +61,7 @@ struct LogCompStrExtra {
         clear();
     }
     void clear();
+    void swap(LogCompStrExtra& other);
     DWORD GetTotalSize() const;
 }; // struct LogCompStrExtra
 
@@ -66,6 +73,7 @@ struct COMPSTREXTRA {
     DWORD dwHiraganaClauseOffset;   // ひらがな文節のオフセット。
     DWORD dwTypingClauseCount;      // 入力文節の個数。
     DWORD dwTypingClauseOffset;     // 入力文節のオフセット。
+    DWORD dwSerial;                 // 書き込むたびに変わる通し番号。
 
     BYTE *GetBytes() { return (LPBYTE) this; }  // バイト列の取得。
     WCHAR *GetHiraganaClauses(DWORD& dwCount);  // ひらがな文節の取得。
@@ -90,8 +98,10 @@ struct LogCompStr {
     std::vector<DWORD>  result_clause;      // 結果文節インデックスから結果文字インデックスへの写像。
     std::wstring result_str;                // 結果文字列。
     LogCompStrExtra extra;                  // 余剰情報。
+    DWORD dwSerial;                         // 読み込んだ物理データの通し番号。0なら不明。
 
     LogCompStr() {
+        dwSerial = 0;
         clear();
     }
 
@@ -101,6 +111,7 @@ struct LogCompStr {
     void clear_comp();
     void clear_result();
     void clear_extra() { extra.clear(); }
+    void swap(LogCompStr& other);
 
     void fix(); // 補正。
     DWORD GetTotalSize() const; // 物理データの合計サイズ。
@@ -140,6 +151,8 @@ struct LogCompStr {
     void RevertTextForClause();
     void RevertTextForClause(DWORD& iClause);
     void MakeResult();
+    BOOL StoreResult(const MzConvResult& result, LogCandInfo& cand);
+    BOOL StoreClauseResult(const MzConvResult& result, LogCandInfo& cand, BOOL bRoman);
 
     BOOL MoveLeft();
     BOOL MoveRight();
@@ -160,6 +173,7 @@ struct LogCompStr {
 protected:
     void MergeAt(std::vector<std::wstring>& strs, DWORD istr);
     void UpdateCompStr();
+    void UpdateClauseCompStr(DWORD iClause, DWORD ichFrom);
     void UpdateCompReadStr();
     void SetClauseReadAttr(DWORD dwClauseIndex, BYTE attr);
 }; // struct LogCompStr
@@ -172,9 +186,12 @@ inline void SetClause(DWORD *lpdw, DWORD num) {
 // 未確定文字列の物理データ。
 struct CompStr : public COMPOSITIONSTRING {
     static HIMCC ReCreate(HIMCC hCompStr, const LogCompStr *log = NULL);
+    static void TakeLog(HIMCC hCompStr, LogCompStr& log);
+    static HIMCC Update(HIMCC hCompStr, LogCompStr& log);
 
     void GetLog(LogCompStr& log);
     DWORD Store(const LogCompStr *log);
+    BOOL Patch(const LogCompStr *log, DWORD cbCapacity);
 
     BYTE *GetBytes() {
         return (LPBYTE) this;
@@ -225,25 +242,40 @@ private:
 //////////////////////////////////////////////////////////////////////////////
 // 候補情報。
 
+#define MAX_CANDLISTS   32 // 候補リストの最大数。
+
 // private data of CANDIDATEINFO
 struct CANDINFOEXTRA {
     DWORD dwSignature; // must be 0xDEADFACE
     DWORD iClause; // index of selected clause
+    DWORD dwHandles[MAX_CANDLISTS]; // 候補リストごとの候補表の番号。
+    DWORD dwFirsts[MAX_CANDLISTS]; // 候補リストごとの、物理データの最初の候補の論理データでの番号。
+    DWORD dwTotals[MAX_CANDLISTS]; // 候補リストごとの、論理データの候補の数。
 };
 
+// 候補の文字列群。論理データをコピーしても共有する。
+typedef unboost::shared_ptr<std::vector<std::wstring> > CandStrsPtr;
+
 // 候補リストの論理データ。
+// 候補の文字列は候補表に置き、物理データには見えているページの周りだけを書く。
+// 物理データのdwCount、dwSelection、dwPageStartは、書いた範囲の中での値である。
 struct LogCandList {
     DWORD dwStyle;
     DWORD dwSelection;
     DWORD dwPageStart;
     DWORD dwPageSize;
-    std::vector<std::wstring> cand_strs;
+    DWORD dwHandle;         // 候補表の番号。0なら登録していない。
+    CandStrsPtr cand_strs;  // 候補の文字列群。
+    BOOL bLost;             // 候補表になく、候補の一部が欠けている。
 
     LogCandList() {
         clear();
     }
     void clear();
+    void AddString(const std::wstring& str);
+    void AddClause(const MzConvClause& clause);
     DWORD GetTotalSize() const;
+    void GetWindow(DWORD& iFirst, DWORD& iLast) const;
 
     void MoveNext();
     void MovePrev();
@@ -277,6 +309,7 @@ struct LogCandInfo {
     void PageUp();
     void PageDown();
     BOOL SelectCand(UINT uCandIndex);
+    BOOL RebuildList(DWORD iList, const MzConvClause& clause);
 
     std::wstring GetString() const;
     std::wstring GetString(DWORD iCand) const;
@@ -290,7 +323,7 @@ struct CandList : public CANDIDATELIST {
     WCHAR *GetCandString(DWORD i)   { return LPTSTR(GetBytes() + dwOffset[i]); }
     WCHAR *GetCurString()           { return GetCandString(dwSelection); }
     DWORD  GetPageEnd() const;
-    void GetLog(LogCandList& log);
+    void GetLog(LogCandList& log, DWORD dwHandle, DWORD dwFirst, DWORD dwTotal);
     DWORD Store(const LogCandList *log);
 
 private:
@@ -358,7 +391,9 @@ struct InputContext : public INPUTCONTEXT {
     const DWORD& NumMsgBuf() const;
 
     // ガイドライン。
+#ifdef _WIN32
     void MakeGuideLine(DWORD dwID);
+#endif
     LPGUIDELINE LockGuideLine();
     void UnlockGuideLine();
 
@@ -2,7 +2,7 @@
 // キー入力と文字。
 // (Japanese, UTF-8)
 
-#include "mzimeja.h"
+#include "mzconv.h"
 #include "vksub.h"
 
 //////////////////////////////////////////////////////////////////////////////
@@ -102,6 +102,8 @@ struct KEYVALUEEXTRA {
     const WCHAR *extra;
 };
 
+#ifdef _WIN32 // どこからも使っていない表。Windowsのビルドにだけ残す。
+
 // 全角ひらがなから半角への変換テーブル。
 static KEYVALUE halfkana_table[] = {
     {L"゛", L"ﾞ"},
@@ -291,6 +293,8 @@ static KEYVALUE kana_table[] = {
     {L"ほﾟ", L"ぽ"},
 };
 
+#endif  // def _WIN32
+
 // 記号の変換テーブル。
 static KEYVALUE kigou_table[] = {
     //{L",", L"、"}, // bCommaPeriodで処理する。
@@ -1488,121 +1492,71 @@ std::wstring mz_roman_to_halfwidth_katakana(std::wstring roman)
     return katakana;
 } // mz_roman_to_halfwidth_katakana
 
-// ローマ字からひらがなへ文字列を変換。
-std::wstring mz_roman_to_hiragana(std::wstring roman, size_t ichTarget)
+// ichTargetで終わるローマ字のうち、一番長く一致するキーを探してその長さを返す。
+// 記号は長さに関わらず後から上書きする。一時的な文字列を作らないこと。
+static size_t
+RomanTailMatch(const std::wstring& roman, size_t ichTarget,
+               const WCHAR *& value, const WCHAR *& extra)
 {
-    std::wstring str, key, value, extra;
     size_t key_len = 0;
+    value = extra = NULL;
     for (size_t i = 0; i < _countof(sokuon_table); ++i) {
-        str = sokuon_table[i].key;
-        key_len = str.size();
-        if (key_len <= ichTarget) {
-            if (roman.substr(ichTarget - key_len, key_len) == str) {
-                if (key_len > key.size()) {
-                    key = str;
-                    value = sokuon_table[i].value;
-                }
-            }
+        size_t len = wcslen(sokuon_table[i].key);
+        if (len <= ichTarget && len > key_len &&
+            roman.compare(ichTarget - len, len, sokuon_table[i].key) == 0)
+        {
+            key_len = len;
+            value = sokuon_table[i].value;
         }
     }
     for (size_t i = 0; i < _countof(normal_roman_table); ++i) {
-        if (normal_roman_table[i].extra) {
-            str = normal_roman_table[i].key;
-            key_len = str.size();
-            if (key_len <= ichTarget) {
-                if (roman.substr(ichTarget - key_len, key_len) == str) {
-                    if (key_len > key.size()) {
-                        key = str;
-                        value = normal_roman_table[i].value;
-                        extra = normal_roman_table[i].extra;
-                    }
-                }
-            }
-        } else {
-            str = normal_roman_table[i].key;
-            key_len = str.size();
-            if (key_len <= ichTarget) {
-                if (roman.substr(ichTarget - key_len, key_len) == str) {
-                    if (key_len > key.size()) {
-                        key = str;
-                        value = normal_roman_table[i].value;
-                        extra.clear();
-                    }
-                }
-            }
+        size_t len = wcslen(normal_roman_table[i].key);
+        if (len <= ichTarget && len > key_len &&
+            roman.compare(ichTarget - len, len, normal_roman_table[i].key) == 0)
+        {
+            key_len = len;
+            value = normal_roman_table[i].value;
+            extra = normal_roman_table[i].extra;
         }
     }
     for (size_t i = 0; i < _countof(kigou_table); ++i) {
-        key_len = 1;
-        if (roman[ichTarget - key_len] == kigou_table[i].key[0]) {
-            if (key_len <= ichTarget) {
-                key = kigou_table[i].key;
-                value = kigou_table[i].value;
-            }
+        if (ichTarget >= 1 && roman[ichTarget - 1] == kigou_table[i].key[0]) {
+            key_len = 1;
+            value = kigou_table[i].value;
         }
     }
-    if (key.size()) {
-        roman.replace(ichTarget - key.size(), key.size(), value + extra);
-    }
+    return key_len;
+}
+
+// 一致したキーを値と余りに置き換える。
+static void
+RomanTailReplace(std::wstring& roman, size_t ichTarget, size_t key_len,
+                 const WCHAR *value, const WCHAR *extra)
+{
+    size_t ich = ichTarget - key_len;
+    roman.replace(ich, key_len, value);
+    if (extra)
+        roman.insert(ich + wcslen(value), extra);
+}
+
+// ローマ字からひらがなへ文字列を変換。
+std::wstring mz_roman_to_hiragana(std::wstring roman, size_t ichTarget)
+{
+    const WCHAR *value, *extra;
+    size_t key_len = RomanTailMatch(roman, ichTarget, value, extra);
+    if (key_len)
+        RomanTailReplace(roman, ichTarget, key_len, value, extra);
     return roman;
 } // mz_roman_to_hiragana
 
 // ローマ字からカタカナへ文字列を変換。
 std::wstring mz_roman_to_katakana(std::wstring roman, size_t ichTarget)
 {
-    std::wstring str, key, value, extra;
-    size_t key_len = 0;
-    for (size_t i = 0; i < _countof(sokuon_table); ++i) {
-        str = sokuon_table[i].key;
-        key_len = str.size();
-        if (key_len <= ichTarget) {
-            if (roman.substr(ichTarget - key_len, key_len) == str) {
-                if (key_len > key.size()) {
-                    key = str;
-                    value = sokuon_table[i].value;
-                }
-            }
-        }
-    }
-    for (size_t i = 0; i < _countof(normal_roman_table); ++i) {
-        if (normal_roman_table[i].extra) {
-            str = normal_roman_table[i].key;
-            key_len = str.size();
-            if (key_len <= ichTarget) {
-                if (roman.substr(ichTarget - key_len, key_len) == str) {
-                    if (key_len > key.size()) {
-                        key = str;
-                        value = normal_roman_table[i].value;
-                        extra = normal_roman_table[i].extra;
-                    }
-                }
-            }
-        } else {
-            str = normal_roman_table[i].key;
-            key_len = str.size();
-            if (key_len <= ichTarget) {
-                if (roman.substr(ichTarget - key_len, key_len) == str) {
-                    if (key_len > key.size()) {
-                        key = str;
-                        value = normal_roman_table[i].value;
-                        extra.clear();
-                    }
-                }
-            }
-        }
-    }
-    for (size_t i = 0; i < _countof(kigou_table); ++i) {
-        key_len = 1;
-        if (roman[ichTarget - key_len] == kigou_table[i].key[0]) {
-            if (key_len <= ichTarget) {
-                key = kigou_table[i].key;
-                value = kigou_table[i].value;
-            }
-        }
-    }
-    if (key.size()) {
-        value = mz_lcmap(value, LCMAP_KATAKANA);
-        roman.replace(ichTarget - key.size(), key.size(), value + extra);
+    const WCHAR *value, *extra;
+    size_t key_len = RomanTailMatch(roman, ichTarget, value, extra);
+    if (key_len) {
+        std::wstring str = mz_lcmap(value, LCMAP_KATAKANA);
+        RomanTailReplace(roman, ichTarget, key_len, str.c_str(), extra);
     }
     return roman;
 } // mz_roman_to_katakana
@@ -1610,62 +1564,12 @@ std::wstring mz_roman_to_katakana(std::wstring roman, size_t ichTarget)
 // ローマ字から半角カナへ文字列を変換。
 std::wstring mz_roman_to_halfwidth_katakana(std::wstring roman, size_t ichTarget)
 {
-    //DPRINTW(L"mz_roman_to_halfwidth_katakana(%s,%d)\n", roman.c_str(), (int)ichTarget);
-    std::wstring str, key, value, extra;
-    size_t key_len = 0;
-    for (size_t i = 0; i < _countof(sokuon_table); ++i) {
-        str = sokuon_table[i].key;
-        key_len = str.size();
-        if (key_len <= ichTarget) {
-            if (roman.substr(ichTarget - key_len, key_len) == str) {
-                if (key_len > key.size()) {
-                    key = str;
-                    value = sokuon_table[i].value;
-                }
-            }
-        }
+    const WCHAR *value, *extra;
+    size_t key_len = RomanTailMatch(roman, ichTarget, value, extra);
+    if (key_len) {
+        std::wstring str = mz_lcmap(value, LCMAP_HALFWIDTH | LCMAP_KATAKANA);
+        RomanTailReplace(roman, ichTarget, key_len, str.c_str(), extra);
     }
-    for (size_t i = 0; i < _countof(normal_roman_table); ++i) {
-        if (normal_roman_table[i].extra) {
-            str = normal_roman_table[i].key;
-            key_len = str.size();
-            if (key_len <= ichTarget) {
-                if (roman.substr(ichTarget - key_len, key_len) == str) {
-                    if (key_len > key.size()) {
-                        key = str;
-                        value = normal_roman_table[i].value;
-                        extra = normal_roman_table[i].extra;
-                    }
-                }
-            }
-        } else {
-            str = normal_roman_table[i].key;
-            key_len = str.size();
-            if (key_len <= ichTarget) {
-                if (roman.substr(ichTarget - key_len, key_len) == str) {
-                    if (key_len > key.size()) {
-                        key = str;
-                        value = normal_roman_table[i].value;
-                        extra.clear();
-                    }
-                }
-            }
-        }
-    }
-    for (size_t i = 0; i < _countof(kigou_table); ++i) {
-        key_len = 1;
-        if (roman[ichTarget - key_len] == kigou_table[i].key[0]) {
-            if (key_len <= ichTarget) {
-                key = kigou_table[i].key;
-                value = kigou_table[i].value;
-            }
-        }
-    }
-    if (key.size()) {
-        value = mz_lcmap(value, LCMAP_HALFWIDTH | LCMAP_KATAKANA);
-        roman.replace(ichTarget - key.size(), key.size(), value + extra);
-    }
-    //DPRINTW(L"mz_roman_to_halfwidth_katakana: %s\n", roman.c_str());
     return roman;
 } // mz_roman_to_halfwidth_katakana
 
@@ -2101,16 +2005,6 @@ WCHAR mz_dakuon_shori(WCHAR ch0, WCHAR ch1)
     }
 }
 
-// 文字種変換。
-std::wstring mz_lcmap(const std::wstring& str, DWORD dwFlags)
-{
-    WCHAR szBuf[1024];
-    const LCID langid = MAKELANGID(LANG_JAPANESE, SUBLANG_DEFAULT);
-    ::LCMapStringW(MAKELCID(langid, SORT_DEFAULT), dwFlags,
-                   str.c_str(), -1, szBuf, 1024);
-    return szBuf;
-}
-
 // 全角英数から半角への文字列変換。
 std::wstring mz_fullwidth_ascii_to_halfwidth(const std::wstring& str)
 {
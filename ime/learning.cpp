@@ -0,0 +1,700 @@
+﻿// learning.cpp --- mzimeja user learning
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 学習。ユーザーが確定した組を覚えて、ラティスのコストに反映する。
+// ログはUTF-8のテキストで、一行に一つの組を「種類<TAB>文字列<TAB>文字列」と書く。
+// 先頭の行「#世代」はスナップショットの世代で、作り直すたびに増える。
+// 複数のプロセスが同じファイルを使うので、書き込むときは名前付きミューテックスで
+// 排他制御し、ほかのプロセスが書いたログも読み込む。
+
+#include "mzconv.h"
+
+#define MZ_LEARN_WORD       1   // （読み, 変換後）。
+#define MZ_LEARN_PAIR       2   // （前の変換後, 変換後）。
+#define MZ_LEARN_SURFACE    3   // 連結を覚えた変換後。ノードに印を付けるために使う。
+
+#define MZ_LEARN_SIGNATURE  0x4E4C5A4D  // "MZLN"
+#define MZ_LEARN_VERSION    1
+
+#define MZ_LEARN_MAX_ENTRIES    10000
+#define MZ_LEARN_FLUSH_DELAY    500
+#define MZ_LEARN_COMPACT_COUNT  1000
+#define MZ_LEARN_IDLE_TIMEOUT   10000
+#define MZ_LEARN_MAX_COUNT      0xFFFF
+
+// 学習によるコスト差分。回数と新しさで決める。
+#define MZ_LEARN_COST_BASE      150     // 一度でも確定したら。
+#define MZ_LEARN_COST_COUNT     50      // 一回ごとに。
+#define MZ_LEARN_COUNT_MAX      6       // 回数はここまで数える。
+#define MZ_LEARN_COST_RECENT    150     // 最近確定したら。
+#define MZ_LEARN_RECENT         256     // 最近とみなす確定の数。
+
+MzLearning g_learning;
+
+// スナップショットのヘッダー。スロットと記録が続く。
+struct MZ_LEARN_HEADER {
+    DWORD dwSignature;
+    DWORD dwVersion;
+    DWORD dwGeneration;     // 世代。
+    DWORD dwSeq;            // 確定の通し番号。
+    DWORD cSlots;           // スロット数。
+    DWORD cRecords;         // 記録の数。
+};
+
+// スナップショットの記録。UTF-8の文字列が二つ続き、4バイト境界に揃える。
+struct MZ_LEARN_RECORD {
+    WORD wKind;
+    WORD cbA;
+    WORD cbB;
+    WORD wReserved;
+    DWORD dwCount;
+    DWORD dwLast;
+};
+
+// 覚えた組。
+struct MzLearning::Record {
+    WORD wKind;
+    std::wstring a, b;
+    DWORD dwCount;          // 確定した回数。
+    DWORD dwLast;           // 最後に確定したときの通し番号。
+    ULONGLONG key;
+};
+
+// 組のハッシュ値（FNV-1a）。
+static ULONGLONG mz_learn_hash(WORD wKind, const WCHAR *a, size_t cch_a,
+                               const WCHAR *b, size_t cch_b)
+{
+    ULONGLONG hash = 14695981039346656037ULL ^ wKind;
+    for (size_t i = 0; i < cch_a; ++i) {
+        hash ^= (DWORD)a[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= 0xFFFF; // 区切り。
+    hash *= 1099511628211ULL;
+    for (size_t i = 0; i < cch_b; ++i) {
+        hash ^= (DWORD)b[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+// 読みと変換後に共通するひらがなの語尾を除く。同じならそのまま。
+static void mz_learn_word_stem(const WCHAR *pre, size_t& cch_pre,
+                               const WCHAR *post, size_t& cch_post)
+{
+    if (cch_pre == cch_post && memcmp(pre, post, cch_pre * sizeof(WCHAR)) == 0)
+        return;
+    while (cch_pre > 1 && cch_post > 1 && pre[cch_pre - 1] == post[cch_post - 1] &&
+           mz_is_hiragana(post[cch_post - 1]))
+    {
+        --cch_pre;
+        --cch_post;
+    }
+}
+
+// 変換後からひらがなの語尾を除く。ひらがなだけなら0になる。
+static size_t mz_learn_surface_stem(const WCHAR *post, size_t cch_post)
+{
+    while (cch_post > 0 && mz_is_hiragana(post[cch_post - 1]))
+        --cch_post;
+    return cch_post;
+}
+
+// 回数と新しさからコスト差分を求める。
+static INT mz_learn_cost(DWORD dwCount, DWORD dwAge)
+{
+    DWORD count = (dwCount > MZ_LEARN_COUNT_MAX) ? MZ_LEARN_COUNT_MAX : dwCount;
+    INT cost = MZ_LEARN_COST_BASE + MZ_LEARN_COST_COUNT * (INT)(count - 1);
+    if (dwAge < MZ_LEARN_RECENT)
+        cost += MZ_LEARN_COST_RECENT * (INT)(MZ_LEARN_RECENT - dwAge) / MZ_LEARN_RECENT;
+    return -cost;
+}
+
+static std::string mz_learn_to_utf8(const std::wstring& str)
+{
+    std::string ret;
+    if (str.empty())
+        return ret;
+    int cb = WideCharToMultiByte(CP_UTF8, 0, str.c_str(), (int)str.size(), NULL, 0, NULL, NULL);
+    if (cb <= 0)
+        return ret;
+    ret.resize(cb);
+    WideCharToMultiByte(CP_UTF8, 0, str.c_str(), (int)str.size(), &ret[0], cb, NULL, NULL);
+    return ret;
+}
+
+static std::wstring mz_learn_from_utf8(const char *psz, size_t cb)
+{
+    std::wstring ret;
+    if (cb == 0)
+        return ret;
+    int cch = MultiByteToWideChar(CP_UTF8, 0, psz, (int)cb, NULL, 0);
+    if (cch <= 0)
+        return ret;
+    ret.resize(cch);
+    MultiByteToWideChar(CP_UTF8, 0, psz, (int)cb, &ret[0], cch);
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzLearningTable
+
+MzLearningTable::MzLearningTable()
+    : m_nRefCount(1)
+    , m_slots(NULL)
+    , m_mask(0)
+    , m_pvMap(NULL)
+    , m_cbMap(0)
+{
+}
+
+MzLearningTable::~MzLearningTable()
+{
+    mz_unmap_file(m_pvMap, m_cbMap);
+}
+
+INT MzLearningTable::Find(ULONGLONG key) const
+{
+    DWORD i = (DWORD)key & m_mask;
+    for (DWORD k = 0; k <= m_mask; ++k, i = (i + 1) & m_mask) {
+        const Slot& slot = m_slots[i];
+        if (slot.key == key)
+            return slot.value;
+        if (slot.key == 0)
+            break;
+    }
+    return 0;
+}
+
+// 挿入する。すでにあれば何もしない。スロットには十分な空きがあること。
+void MzLearningTable::Insert(ULONGLONG key, INT value)
+{
+    for (DWORD i = (DWORD)key & m_mask;; i = (i + 1) & m_mask) {
+        Slot& slot = m_buffer[i];
+        if (slot.key == key)
+            return;
+        if (slot.key == 0) {
+            slot.key = key;
+            slot.value = value;
+            return;
+        }
+    }
+}
+
+void MzLearningTable::Apply(LatticeNode& node) const
+{
+    size_t cch_pre = node.pre_len, cch_post = node.post_len;
+    mz_learn_word_stem(node.pre, cch_pre, node.post, cch_post);
+    node.deltaCost += Find(mz_learn_hash(MZ_LEARN_WORD, node.pre, cch_pre, node.post, cch_post));
+
+    // 連結を覚えた変換後なら、ConnectCostで引けるように印を付ける。
+    size_t cch_stem = mz_learn_surface_stem(node.post, node.post_len);
+    if (cch_stem && Find(mz_learn_hash(MZ_LEARN_SURFACE, node.post, cch_stem, NULL, 0)))
+        node.learning = this;
+}
+
+INT MzLearningTable::PairCost(const LatticeNode& node0, const LatticeNode& node1) const
+{
+    size_t cch0 = mz_learn_surface_stem(node0.post, node0.post_len);
+    size_t cch1 = mz_learn_surface_stem(node1.post, node1.post_len);
+    if (!cch0 || !cch1)
+        return 0;
+    return Find(mz_learn_hash(MZ_LEARN_PAIR, node0.post, cch0, node1.post, cch1));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzLearning
+
+MzLearning::MzLearning()
+    : m_dwMaxEntries(MZ_LEARN_MAX_ENTRIES)
+    , m_dwFlushDelay(MZ_LEARN_FLUSH_DELAY)
+    , m_dwCompactCount(MZ_LEARN_COMPACT_COUNT)
+    , m_dwIdleTimeout(MZ_LEARN_IDLE_TIMEOUT)
+    , m_bOpen(FALSE)
+    , m_hWriteLock(NULL)
+    , m_bThread(FALSE)
+    , m_bStopping(FALSE)
+    , m_table(NULL)
+    , m_dwSeq(0)
+    , m_dwGeneration(0)
+    , m_cbLogRead(0)
+    , m_nLogged(0)
+{
+    m_hLock = mz_mutex_open(NULL);
+    m_hWake = mz_event_create(FALSE);
+    m_hIdle = mz_event_create(TRUE);
+}
+
+MzLearning::~MzLearning()
+{
+    // プロセスの終了時にはスレッドはもういないので、待たない。
+    Close(0);
+    if (m_bThread)
+        return; // スレッドが使っているので、ハンドルを閉じない。
+    mz_event_close(m_hIdle);
+    mz_event_close(m_hWake);
+    mz_mutex_close(m_hLock);
+}
+
+BOOL MzLearning::Open(LPCWSTR snapshot_file, LPCWSTR log_file)
+{
+    if (m_bOpen)
+        return TRUE;
+
+    m_snapshot_file = snapshot_file;
+    m_log_file = log_file;
+    m_hWriteLock = mz_mutex_open(L"MzimejaLearning");
+    if (!m_hWriteLock)
+        return FALSE;
+
+    mz_mutex_lock(m_hWriteLock, INFINITE);
+    Reload();
+    ReadLog();
+    if (m_nLogged > 0)
+        SetTable(BuildTable());
+    mz_mutex_unlock(m_hWriteLock);
+
+    m_bStopping = FALSE;
+    m_bOpen = TRUE;
+    DPRINTW(L"learning: %d records\n", (int)m_records.size());
+    return TRUE;
+}
+
+void MzLearning::Close(DWORD dwMilliseconds)
+{
+    if (!m_bOpen)
+        return;
+
+    mz_mutex_lock(m_hLock, INFINITE);
+    m_bStopping = TRUE;
+    BOOL bThread = m_bThread;
+    mz_mutex_unlock(m_hLock);
+    if (bThread) {
+        mz_event_set(m_hWake);
+        if (!mz_event_wait(m_hIdle, dwMilliseconds))
+            return; // スレッドが終わっていない。
+    }
+
+    Flush();
+    if (m_nLogged > 0)
+        Compact();
+
+    SetTable(NULL);
+    m_records.clear();
+    m_index.clear();
+    m_bOpen = FALSE;
+    mz_mutex_close(m_hWriteLock);
+    m_hWriteLock = NULL;
+}
+
+void MzLearning::Learn(const std::wstring& pre, const std::wstring& post,
+                       const std::wstring& prev_post)
+{
+    if (!m_bOpen || pre.empty() || post.empty())
+        return;
+
+    Event event;
+    event.pre = pre;
+    event.post = post;
+    event.prev_post = prev_post;
+
+    mz_mutex_lock(m_hLock, INFINITE);
+    if (m_bStopping) {
+        mz_mutex_unlock(m_hLock);
+        return;
+    }
+    m_events.push_back(event);
+
+    // スレッドがなければ作る。
+    if (!m_bThread) {
+        m_bThread = TRUE;
+        mz_event_reset(m_hIdle);
+        if (!mz_create_thread(WorkProc, this)) {
+            m_bThread = FALSE;
+            mz_event_set(m_hIdle);
+        }
+    }
+    mz_mutex_unlock(m_hLock);
+
+    mz_event_set(m_hWake);
+}
+
+// 記録を新しくする。なければ作り、多すぎれば古いものを忘れる。
+void MzLearning::Touch(WORD wKind, const std::wstring& a, const std::wstring& b)
+{
+    ULONGLONG key = mz_learn_hash(wKind, a.c_str(), a.size(), b.c_str(), b.size());
+    std::map<ULONGLONG, std::list<Record>::iterator>::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+        Record& record = *it->second;
+        if (record.dwCount < MZ_LEARN_MAX_COUNT)
+            ++record.dwCount;
+        record.dwLast = ++m_dwSeq;
+        m_records.splice(m_records.begin(), m_records, it->second);
+        return;
+    }
+
+    Record record;
+    record.wKind = wKind;
+    record.a = a;
+    record.b = b;
+    record.dwCount = 1;
+    record.dwLast = ++m_dwSeq;
+    record.key = key;
+    m_records.push_front(record);
+    m_index[key] = m_records.begin();
+
+    while (m_records.size() > m_dwMaxEntries && m_dwMaxEntries > 0) {
+        m_index.erase(m_records.back().key);
+        m_records.pop_back();
+    }
+}
+
+// スナップショットを読み直し、ログを始めから読む。
+void MzLearning::Reload()
+{
+    m_records.clear();
+    m_index.clear();
+    m_dwSeq = 0;
+    m_dwGeneration = 0;
+    m_cbLogRead = 0;
+    m_nLogged = 0;
+    SetTable(NULL);
+
+    DWORD cbMap;
+    const BYTE *pb = (const BYTE *)mz_map_file(m_snapshot_file.c_str(), &cbMap);
+    if (!pb)
+        return;
+
+    // スロットはマップしたまま表として使う。
+    const MZ_LEARN_HEADER *header = (const MZ_LEARN_HEADER *)pb;
+    if (cbMap < sizeof(MZ_LEARN_HEADER) ||
+        header->dwSignature != MZ_LEARN_SIGNATURE || header->dwVersion != MZ_LEARN_VERSION ||
+        (header->cSlots & (header->cSlots - 1)) != 0 ||
+        header->cSlots > (cbMap - sizeof(MZ_LEARN_HEADER)) / sizeof(MzLearningTable::Slot))
+    {
+        EPRINTW(L"bad snapshot: %s\n", m_snapshot_file.c_str());
+        mz_unmap_file(pb, cbMap);
+        return;
+    }
+    DWORD cbSlots = header->cSlots * sizeof(MzLearningTable::Slot);
+
+    // 記録を新しい順に読み込む。
+    DWORD ib = sizeof(MZ_LEARN_HEADER) + cbSlots;
+    for (DWORD i = 0; i < header->cRecords; ++i) {
+        if (cbMap - ib < sizeof(MZ_LEARN_RECORD))
+            break;
+        const MZ_LEARN_RECORD *rec = (const MZ_LEARN_RECORD *)(pb + ib);
+        DWORD cb = (sizeof(MZ_LEARN_RECORD) + rec->cbA + rec->cbB + 3) & ~3;
+        if (cbMap - ib < cb)
+            break;
+        const char *psz = (const char *)(rec + 1);
+
+        Record record;
+        record.wKind = rec->wKind;
+        record.a = mz_learn_from_utf8(psz, rec->cbA);
+        record.b = mz_learn_from_utf8(psz + rec->cbA, rec->cbB);
+        record.dwCount = rec->dwCount;
+        record.dwLast = rec->dwLast;
+        record.key = mz_learn_hash(record.wKind, record.a.c_str(), record.a.size(),
+                                   record.b.c_str(), record.b.size());
+        if (!m_index.count(record.key)) {
+            m_records.push_back(record);
+            m_index[record.key] = --m_records.end();
+        }
+        ib += cb;
+    }
+    m_dwSeq = header->dwSeq;
+    m_dwGeneration = header->dwGeneration;
+
+    // 上限を小さくしていたら、古いものを忘れる。
+    while (m_records.size() > m_dwMaxEntries && m_dwMaxEntries > 0) {
+        m_index.erase(m_records.back().key);
+        m_records.pop_back();
+    }
+
+    if (header->cSlots == 0 || m_records.size() < header->cRecords) {
+        // 空か、忘れたものがある。表は記録から作る。
+        mz_unmap_file(pb, cbMap);
+        SetTable(BuildTable());
+        return;
+    }
+
+    MzLearningTable *table = new MzLearningTable;
+    table->m_pvMap = pb;
+    table->m_cbMap = cbMap;
+    table->m_slots = (const MzLearningTable::Slot *)(header + 1);
+    table->m_mask = header->cSlots - 1;
+    SetTable(table);
+}
+
+// ログのまだ読んでいない部分を読み込む。
+// ほかのプロセスがスナップショットを作り直していたら、読み直す。
+void MzLearning::ReadLog()
+{
+    DWORD cbMap;
+    const char *pch = (const char *)mz_map_file(m_log_file.c_str(), &cbMap);
+    if (!pch) {
+        if (m_cbLogRead > 0)
+            Reload(); // ログが空になった。
+        return;
+    }
+
+    // 先頭の行は世代。
+    const char *pchEnd = pch + cbMap;
+    const char *pchLine = (const char *)memchr(pch, '\n', cbMap);
+    DWORD dwGeneration = (DWORD)-1;
+    if (pch[0] == '#' && pchLine)
+        dwGeneration = (DWORD)strtoul(std::string(pch + 1, pchLine).c_str(), NULL, 10);
+    if (dwGeneration != m_dwGeneration || cbMap < m_cbLogRead) {
+        Reload();
+        if (dwGeneration != m_dwGeneration) {
+            // スナップショットに含まれているか、壊れたログ。
+            mz_unmap_file(pch, cbMap);
+            return;
+        }
+    }
+    if (m_cbLogRead == 0 && pchLine)
+        m_cbLogRead = (DWORD)(pchLine + 1 - pch);
+
+    // 完全な行だけを読む。
+    const char *pchNext = pch + m_cbLogRead;
+    while (pchNext < pchEnd) {
+        const char *pchEOL = (const char *)memchr(pchNext, '\n', pchEnd - pchNext);
+        if (!pchEOL)
+            break;
+        const char *pchTab1 = (const char *)memchr(pchNext, '\t', pchEOL - pchNext);
+        const char *pchTab2 = pchTab1 ? (const char *)memchr(pchTab1 + 1, '\t', pchEOL - pchTab1 - 1) : NULL;
+        if (pchTab2) {
+            WORD wKind = (WORD)strtoul(std::string(pchNext, pchTab1).c_str(), NULL, 10);
+            std::wstring a = mz_learn_from_utf8(pchTab1 + 1, pchTab2 - pchTab1 - 1);
+            std::wstring b = mz_learn_from_utf8(pchTab2 + 1, pchEOL - pchTab2 - 1);
+            if ((wKind == MZ_LEARN_WORD || wKind == MZ_LEARN_PAIR) && a.size() && b.size())
+                Touch(wKind, a, b);
+        }
+        ++m_nLogged;
+        pchNext = pchEOL + 1;
+    }
+    m_cbLogRead = (DWORD)(pchNext - pch);
+    mz_unmap_file(pch, cbMap);
+}
+
+// 記録から表を作る。
+MzLearningTable *MzLearning::BuildTable() const
+{
+    if (m_records.empty())
+        return NULL;
+
+    // 連結には変換後の印も入れるので、その分も見込んで半分以上空ける。
+    size_t cEntries = 0;
+    std::list<Record>::const_iterator it, end = m_records.end();
+    for (it = m_records.begin(); it != end; ++it)
+        cEntries += (it->wKind == MZ_LEARN_PAIR) ? 3 : 1;
+    DWORD cSlots = 16;
+    while (cSlots < cEntries * 2)
+        cSlots <<= 1;
+
+    MzLearningTable *table = new MzLearningTable;
+    MzLearningTable::Slot empty = { 0, 0, 0 };
+    table->m_buffer.assign(cSlots, empty);
+    table->m_slots = &table->m_buffer[0];
+    table->m_mask = cSlots - 1;
+
+    for (it = m_records.begin(); it != end; ++it) {
+        const Record& record = *it;
+        INT value = mz_learn_cost(record.dwCount, m_dwSeq - record.dwLast);
+        if (record.wKind == MZ_LEARN_PAIR) {
+            value /= 2;
+            table->Insert(mz_learn_hash(MZ_LEARN_SURFACE, record.a.c_str(), record.a.size(), NULL, 0), 1);
+            table->Insert(mz_learn_hash(MZ_LEARN_SURFACE, record.b.c_str(), record.b.size(), NULL, 0), 1);
+        }
+        table->Insert(record.key, value);
+    }
+    return table;
+}
+
+void MzLearning::SetTable(MzLearningTable *table)
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    MzLearningTable *old = m_table;
+    m_table = table;
+    mz_mutex_unlock(m_hLock);
+    Release(old);
+}
+
+MzLearningTable *MzLearning::Acquire()
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    MzLearningTable *table = m_table;
+    if (table)
+        InterlockedIncrement(&table->m_nRefCount);
+    mz_mutex_unlock(m_hLock);
+    return table;
+}
+
+void MzLearning::Release(MzLearningTable *table)
+{
+    if (table && InterlockedDecrement(&table->m_nRefCount) == 0)
+        delete table;
+}
+
+void MzLearning::Flush()
+{
+    std::vector<Event> events;
+    mz_mutex_lock(m_hLock, INFINITE);
+    events.swap(m_events);
+    mz_mutex_unlock(m_hLock);
+    if (events.empty() || !m_hWriteLock)
+        return;
+
+    // 確定した文節を組にしてログに書く。
+    std::string lines;
+    for (size_t i = 0; i < events.size(); ++i) {
+        const Event& event = events[i];
+        size_t cch_pre = event.pre.size(), cch_post = event.post.size();
+        mz_learn_word_stem(event.pre.c_str(), cch_pre, event.post.c_str(), cch_post);
+        std::string a = mz_learn_to_utf8(event.pre.substr(0, cch_pre));
+        std::string b = mz_learn_to_utf8(event.post.substr(0, cch_post));
+        if (a.find_first_of("\t\n") == std::string::npos &&
+            b.find_first_of("\t\n") == std::string::npos)
+        {
+            lines += "1\t" + a + "\t" + b + "\n";
+        }
+
+        size_t cch0 = mz_learn_surface_stem(event.prev_post.c_str(), event.prev_post.size());
+        size_t cch1 = mz_learn_surface_stem(event.post.c_str(), event.post.size());
+        if (cch0 && cch1) {
+            a = mz_learn_to_utf8(event.prev_post.substr(0, cch0));
+            b = mz_learn_to_utf8(event.post.substr(0, cch1));
+            if (a.find_first_of("\t\n") == std::string::npos &&
+                b.find_first_of("\t\n") == std::string::npos)
+            {
+                lines += "2\t" + a + "\t" + b + "\n";
+            }
+        }
+    }
+
+    mz_mutex_lock(m_hWriteLock, INFINITE);
+    ReadLog(); // ほかのプロセスが書いた分を先に読む。
+    // 読めるログがなければ、作り直す。
+    FILE *fp = _wfopen(m_log_file.c_str(), m_cbLogRead ? L"ab" : L"wb");
+    if (fp) {
+        if (m_cbLogRead == 0) {
+            char sz[32];
+            StringCchPrintfA(sz, _countof(sz), "#%lu\n", (unsigned long)m_dwGeneration);
+            fputs(sz, fp);
+        }
+        fwrite(lines.data(), 1, lines.size(), fp);
+        fclose(fp);
+    } else {
+        EPRINTW(L"cannot write %s\n", m_log_file.c_str());
+    }
+    ReadLog(); // 書いた分を読んで記録に反映する。
+    SetTable(BuildTable());
+    if (m_nLogged >= m_dwCompactCount)
+        Compact();
+    mz_mutex_unlock(m_hWriteLock);
+}
+
+BOOL MzLearning::Compact()
+{
+    if (!m_hWriteLock)
+        return FALSE;
+
+    mz_mutex_lock(m_hWriteLock, INFINITE);
+    ReadLog();
+
+    MzLearningTable *table = BuildTable();
+    MZ_LEARN_HEADER header;
+    header.dwSignature = MZ_LEARN_SIGNATURE;
+    header.dwVersion = MZ_LEARN_VERSION;
+    header.dwGeneration = m_dwGeneration + 1;
+    header.dwSeq = m_dwSeq;
+    header.cSlots = table ? (DWORD)table->m_buffer.size() : 0;
+    header.cRecords = table ? (DWORD)m_records.size() : 0;
+
+    std::string data((const char *)&header, sizeof(header));
+    if (table)
+        data.append((const char *)&table->m_buffer[0], header.cSlots * sizeof(MzLearningTable::Slot));
+    std::list<Record>::const_iterator it, end = m_records.end();
+    for (it = m_records.begin(); it != end && table; ++it) {
+        std::string a = mz_learn_to_utf8(it->a), b = mz_learn_to_utf8(it->b);
+        MZ_LEARN_RECORD rec;
+        rec.wKind = it->wKind;
+        rec.cbA = (WORD)a.size();
+        rec.cbB = (WORD)b.size();
+        rec.wReserved = 0;
+        rec.dwCount = it->dwCount;
+        rec.dwLast = it->dwLast;
+        data.append((const char *)&rec, sizeof(rec));
+        data += a;
+        data += b;
+        data.resize((data.size() + 3) & ~3, 0);
+    }
+    // マップした古いスナップショットを使っていれば、手放す。
+    SetTable(table);
+
+    // 一時ファイルに書いてから置き換える。ログは置き換えた後で空にする。
+    BOOL ret = FALSE;
+    std::wstring tmp_file = m_snapshot_file + L".tmp";
+    FILE *fp = _wfopen(tmp_file.c_str(), L"wb");
+    if (fp) {
+        ret = (fwrite(data.data(), 1, data.size(), fp) == data.size());
+        ret = (fclose(fp) == 0) && ret;
+    }
+    // Windowsでは、ほかのプロセスが古いスナップショットをマップしていると失敗する。
+    // そのときはログを残しておき、次の機会にやり直す。
+    if (ret && mz_replace_file(tmp_file.c_str(), m_snapshot_file.c_str())) {
+        ++m_dwGeneration;
+        fp = _wfopen(m_log_file.c_str(), L"wb");
+        if (fp) {
+            char sz[32];
+            StringCchPrintfA(sz, _countof(sz), "#%lu\n", (unsigned long)m_dwGeneration);
+            fputs(sz, fp);
+            fclose(fp);
+        }
+        m_cbLogRead = 0;
+        m_nLogged = 0;
+        ReadLog();
+    } else {
+        EPRINTW(L"cannot write %s\n", m_snapshot_file.c_str());
+        ret = FALSE;
+    }
+
+    mz_mutex_unlock(m_hWriteLock);
+    return ret;
+}
+
+// スレッドの本体。確定が続いている間は待って、まとめて書き込む。
+void MzLearning::WorkLoop()
+{
+    BOOL bIdle = FALSE;
+    for (;;) {
+        // 止めたら、残りはCloseが書き込む。
+        mz_mutex_lock(m_hLock, INFINITE);
+        BOOL bPending = !m_events.empty();
+        if (m_bStopping || (!bPending && bIdle)) {
+            m_bThread = FALSE;
+            mz_event_set(m_hIdle);
+            mz_mutex_unlock(m_hLock);
+            break;
+        }
+        mz_mutex_unlock(m_hLock);
+
+        if (bPending) {
+            while (!m_bStopping && mz_event_wait(m_hWake, m_dwFlushDelay))
+                ;
+            if (!m_bStopping)
+                Flush();
+            bIdle = FALSE;
+        } else {
+            bIdle = !mz_event_wait(m_hWake, m_dwIdleTimeout);
+        }
+    }
+}
+
+DWORD WINAPI MzLearning::WorkProc(LPVOID lpParam)
+{
+    MzLearning *pThis = (MzLearning *)lpParam;
+    pThis->WorkLoop();
+    return 0;
+}
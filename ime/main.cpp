@@ -54,7 +54,7 @@ void RepositionWindow(HWND hWnd)
 MzIme TheIME;
 
 // mzimejaのコンストラクタ。
-MzIme::MzIme()
+MzIme::MzIme() : m_speculator(this)
 {
     m_hInst = NULL;
     m_hMyKL = NULL;
@@ -68,6 +68,16 @@ MzIme::MzIme()
     m_hIMC = NULL;
     m_lpIMC = NULL;
     ZeroMemory(m_atoms, sizeof(m_atoms));
+
+    m_hConvLock = NULL;
+    m_conv_client.m_dwTimeout = 1000;
+
+    m_hDictReady = NULL;
+    m_dwDictLoadStart = 0;
+    m_nDictLoadTime = -1;
+
+    // ユーザー辞書はIMMから列挙する。
+    g_pfnScanUserDict = ImeScanUserDict;
 }
 
 // mzimejaの辞書を読み込む。
@@ -107,6 +117,27 @@ BOOL MzIme::LoadDict()
         g_name_dict.Unload();
     }
 
+    // 分野別の辞書。分割辞書の目録のパス名をセミコロンで区切って並べる。
+    // 分割は変換で使うときに読み込む。
+    g_domain_dict.Unload();
+    g_domain_dict.m_cbBudget = Config_GetDWORD(L"DomainDictMemoryBudget",
+                                               g_domain_dict.m_cbBudget / 1024) * 1024;
+    std::wstring domain;
+    if (Config_GetSz(L"DomainDictPathNames", domain) && domain.size()) {
+        WStrings manifests;
+        str_split(manifests, domain, std::wstring(L";"));
+        for (size_t i = 0; i < manifests.size(); ++i) {
+            if (manifests[i].size() && !g_domain_dict.Load(manifests[i].c_str()))
+                EPRINTW(L"%s: cannot load\n", manifests[i].c_str());
+        }
+    }
+
+    // 特別な変換。ユーザーのデータのspecial.txtがあれば、組み込みの項目に追加する。
+    g_special_convs.Reset();
+    std::wstring special;
+    if (mz_get_user_data_path(special, L"special.txt") && mz_get_file_size(special.c_str()))
+        g_special_convs.Load(special.c_str());
+
     return ret;
 }
 
@@ -115,18 +146,25 @@ void MzIme::UnloadDict()
 {
     g_basic_dict.Unload();
     g_name_dict.Unload();
+    g_domain_dict.Unload();
 }
 
-// mzimejaを初期化。
-BOOL MzIme::Init(HINSTANCE hInstance)
+// 辞書を読み込むスレッド。
+DWORD WINAPI MzIme::LoadDictProc(LPVOID lpParam)
 {
-    m_hInst = hInstance;
-    //::InitCommonControls();
+    MzIme *pThis = &TheIME;
 
-    mz_make_literal_maps();
+    pThis->LoadDict();
 
-    // load dict
-    LoadDict();
+    // 学習を読み込む。設定Learningが0なら学習しない。
+    std::wstring snapshot_file, log_file;
+    if (Config_GetDWORD(L"Learning", TRUE) &&
+        mz_get_user_data_path(snapshot_file, L"learning.dat") &&
+        mz_get_user_data_path(log_file, L"learning.log"))
+    {
+        g_learning.m_dwMaxEntries = Config_GetDWORD(L"LearningMaxEntries", g_learning.m_dwMaxEntries);
+        g_learning.Open(snapshot_file.c_str(), log_file.c_str());
+    }
 
 #ifdef HAVE_VIBRATO
     // Vibrato engine initialization
@@ -139,13 +177,63 @@ BOOL MzIme::Init(HINSTANCE hInstance)
         if (g_vibrato_engine.Initialize(vibrato_dict_path)) {
             DPRINTW(L"Vibrato engine enabled\n");
         } else {
-            DPRINTW(L"Vibrato engine initialization failed\n");
+            EPRINTW(L"Vibrato engine initialization failed\n");
         }
     } else {
         DPRINTW(L"Vibrato dictionary not found, using legacy engine\n");
     }
 #endif
 
+    // 読み込みにかかった時間を記録して、待っているスレッドを起こす。
+    LONG nTime = (LONG)(::GetTickCount() - pThis->m_dwDictLoadStart);
+    ::InterlockedExchange(&pThis->m_nDictLoadTime, nTime);
+    DPRINTW(L"dictionaries ready in %ld ms\n", nTime);
+    if (pThis->m_hDictReady)
+        mz_event_set(pThis->m_hDictReady);
+    return 0;
+}
+
+// 辞書の読み込みを始める。スレッドを作れなければ、ここで読み込む。
+BOOL MzIme::StartLoadDict()
+{
+    m_dwDictLoadStart = ::GetTickCount();
+    m_hDictReady = mz_event_create(TRUE);
+
+    // スレッドが終わるまでDLLは解放されない。
+    if (m_hDictReady && mz_create_thread(LoadDictProc, NULL))
+        return TRUE;
+
+    LoadDictProc(NULL);
+    return FALSE;
+}
+
+// 辞書が使えるか？ 使えるまで最大dwMilliseconds待つ。
+BOOL MzIme::WaitForDict(DWORD dwMilliseconds)
+{
+    if (m_nDictLoadTime >= 0)
+        return TRUE;
+    if (!m_hDictReady)
+        return TRUE; // 読み込みを始めていない。呼び出し側が辞書を読み込んだ。
+    if (!mz_event_wait(m_hDictReady, dwMilliseconds)) {
+        DPRINTW(L"dictionaries not ready\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// mzimejaを初期化。
+BOOL MzIme::Init(HINSTANCE hInstance)
+{
+    m_hInst = hInstance;
+    //::InitCommonControls();
+
+    mz_make_literal_maps();
+
+    m_hConvLock = mz_mutex_open(NULL);
+
+    // load dict (in background)
+    StartLoadDict();
+
     // Load atoms
     LoadAtoms();
 
@@ -156,9 +244,22 @@ BOOL MzIme::Init(HINSTANCE hInstance)
 // mzimejaを逆初期化。
 VOID MzIme::Uninit(VOID)
 {
+    m_speculator.Stop(0);
+    g_learning.Close(0);
     UnregisterClasses();
     UnloadDict();
     UnloadAtoms();
+
+    if (m_hDictReady) {
+        mz_event_close(m_hDictReady);
+        m_hDictReady = NULL;
+    }
+
+    m_conv_client.Close();
+    if (m_hConvLock) {
+        mz_mutex_close(m_hConvLock);
+        m_hConvLock = NULL;
+    }
 }
 
 BOOL MzIme::LoadAtoms()
@@ -501,6 +602,16 @@ WCHAR *MzIme::LoadSTR(INT nID)
     return sz;
 }
 
+// リソースから文字列を読み込む（再入可能版）。
+BOOL MzIme::LoadSTR(INT nID, std::wstring& str)
+{
+    WCHAR sz[512];
+    sz[0] = 0;
+    INT cch = ::LoadStringW(m_hInst, nID, sz, _countof(sz));
+    str = sz;
+    return cch > 0;
+}
+
 // 入力コンテキストをロックする。
 InputContext *MzIme::LockIMC(HIMC hIMC)
 {
@@ -623,6 +734,7 @@ BOOL WINAPI DllMain(HINSTANCE hInstDLL, DWORD fdwReason, LPVOID lpvReserved)
 
     case DLL_PROCESS_DETACH:
         TheIME.Uninit(); // 逆初期化。
+        DebugFlush(); // 残っているデバッグ出力を出す。
         break;
 
     case DLL_THREAD_ATTACH:
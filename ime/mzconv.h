@@ -0,0 +1,909 @@
+﻿// mzconv.h --- mzimeja kana kanji conversion core
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// かな漢字変換エンジン（mzconv_core）。UIを持たず、platform.hの機能だけを使う。
+
+#pragma once
+
+#define _CRT_SECURE_NO_WARNINGS   // use fopen
+
+#ifndef _WIN32
+    #define UNBOOST_USE_CXX11   // Windows以外はC++11の標準ライブラリを使う。
+#endif
+#include "unboost/unboost.h"
+#include "unboost/shared_ptr.hpp"
+#include "unboost/conversion.hpp"
+
+#include "platform.h"       // platform layer
+
+#include <string>           // for std::string, std::wstring, ...
+#include <vector>           // for std::vector
+#include <set>              // for std::set
+#include <map>              // for std::map
+#include <list>             // for std::list
+
+#include "../dict.hpp"      // for dictionary
+#include "../str.hpp"       // for str_*
+
+//////////////////////////////////////////////////////////////////////////////
+// _countof macro --- get the number of elements in an array
+
+#ifndef _countof
+    #define _countof(array)   (sizeof(array) / sizeof(array[0]))
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// For debugging.
+// デバッグ用。
+
+// ログレベル。MZ_LOGLEVEL未満のマクロは空になり、引数も評価されない。
+#define MZ_LOGLEVEL_NONE    0   // 出力なし。
+#define MZ_LOGLEVEL_ERROR   1   // EPRINTA/EPRINTW: エラー。
+#define MZ_LOGLEVEL_DEBUG   2   // DPRINTA/DPRINTW: デバッグ情報。
+#define MZ_LOGLEVEL_TRACE   3   // FOOTMARK系: 関数の出入り。
+
+#ifndef MZ_LOGLEVEL
+    #ifdef NDEBUG
+        #define MZ_LOGLEVEL MZ_LOGLEVEL_ERROR
+    #else
+        #define MZ_LOGLEVEL MZ_LOGLEVEL_TRACE
+    #endif
+#endif
+
+extern "C" {
+    extern BOOL g_bTrace;
+    void DebugPrintA(const char *lpszFormat, ...);
+    void DebugPrintW(const WCHAR *lpszFormat, ...);
+    void DebugAssert(const char *file, int line, const char *exp);
+    void DebugFlush(void);
+} // extern "C"
+
+#if MZ_LOGLEVEL >= MZ_LOGLEVEL_ERROR
+    #define EPRINTA(fmt, ...) DebugPrintA("%s (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+    #define EPRINTW(fmt, ...) DebugPrintW(L"%hs (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+    // 評価しないが、引数は使ったことにする。
+    #define EPRINTA(fmt, ...) \
+        ((void)sizeof((DebugPrintA("%s (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__), 0)))
+    #define EPRINTW(fmt, ...) \
+        ((void)sizeof((DebugPrintW(L"%hs (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__), 0)))
+#endif
+#if MZ_LOGLEVEL >= MZ_LOGLEVEL_DEBUG
+    #define DPRINTA(fmt, ...) DebugPrintA("%s (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+    #define DPRINTW(fmt, ...) DebugPrintW(L"%hs (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+    // 評価しないが、引数は使ったことにする。
+    #define DPRINTA(fmt, ...) \
+        ((void)sizeof((DebugPrintA("%s (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__), 0)))
+    #define DPRINTW(fmt, ...) \
+        ((void)sizeof((DebugPrintW(L"%hs (%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__), 0)))
+#endif
+#ifdef UNICODE
+    #define DPRINT DebugPrintW
+    #define DebugPrint DebugPrintW
+#else
+    #define DPRINT DebugPrintA
+    #define DebugPrint DebugPrintA
+#endif
+#ifdef NDEBUG
+    #define ASSERT(exp) ((void)sizeof((exp) ? 1 : 0))  // 評価しない。
+#else
+    #define ASSERT(exp) ((exp) ? (void)0 : DebugAssert(__FILE__, __LINE__, #exp))
+#endif
+#define TRACE_ON()    do { g_bTrace = TRUE; } while (0)
+#define TRACE_OFF()   do { g_bTrace = FALSE; } while (0)
+
+/* ArrayAt for std::vector */
+template <typename T_ITEM>
+T_ITEM& Array_At(std::vector<T_ITEM>& array, size_t index, const char *file, int line) {
+    if (index >= array.size())
+        DebugAssert(file, line, "index >= array.size()");
+    return array[index];
+}
+template <typename T_ITEM>
+const T_ITEM& Array_At(const std::vector<T_ITEM>& array, size_t index, const char *file, int line) {
+    if (index >= array.size())
+        DebugAssert(file, line, "index >= array.size()");
+    return array[index];
+}
+
+/* ArrayAt for raw array */
+template <typename T_ITEM, size_t t_size>
+T_ITEM& Array_At(T_ITEM (&array)[t_size], size_t index, const char *file, int line) {
+    if (index >= t_size)
+        DebugAssert(file, line, "index >= t_size");
+    return array[index];
+}
+template <typename T_ITEM, size_t t_size>
+const T_ITEM& Array_At(const T_ITEM (&array)[t_size], size_t index, const char *file, int line) {
+    if (index >= t_size)
+        DebugAssert(file, line, "index >= t_size");
+    return array[index];
+}
+
+#define ARRAY_AT(array, index) \
+    Array_At((array), (index), __FILE__, __LINE__)
+#define ARRAY_AT_AT(array, index0, index1) \
+    ARRAY_AT(ARRAY_AT((array), (index0)), (index1))
+
+#if MZ_LOGLEVEL >= MZ_LOGLEVEL_TRACE
+    #define FootmarkDebugPrint DPRINTA
+    #include "footmark.hpp"   // for footmark++
+#else
+    // トレースしないときは、FOOTMARK系マクロは何もしない。
+    #define FOOTMARK()
+    #define FOOTMARK_POINT()
+    #define FOOTMARK_FORMAT                         (void)sizeof
+    #define FOOTMARK_RETURN_INT(retval)             return (int)(retval)
+    #define FOOTMARK_RETURN_LONG(retval)            return (long)(retval)
+    #define FOOTMARK_RETURN_PTR(ptrtype,retval)     return (ptrtype)(retval)
+    #define FOOTMARK_RETURN_LPARAM(retval)          return (LPARAM)(retval)
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Codepages
+#define CODEPAGE_SJIS_932 932 // Shift_JIS
+
+extern "C" {
+
+// convert.cpp
+extern std::map<WCHAR, Dan>  g_hiragana_to_dan;  // 母音写像。
+extern std::map<WCHAR, Gyou> g_hiragana_to_gyou; // 子音写像。
+void mz_make_literal_maps(); // 子音の写像と母音の写像を作成する。
+LPCWSTR mz_bunrui_to_string(HinshiBunrui bunrui);
+LPCTSTR mz_hinshi_to_string(HinshiBunrui hinshi);
+HinshiBunrui mz_string_to_hinshi(LPCTSTR str);
+
+}  // extern "C"
+
+// postal.cpp
+std::wstring mz_normalize_postal_code(const std::wstring& str);
+std::wstring mz_convert_postal_code(const std::wstring& code);
+
+//////////////////////////////////////////////////////////////////////////////
+// keychar.cpp
+
+// conversion between roman and hiragana
+std::wstring hiragana_to_roman(std::wstring hiragana);
+std::wstring mz_roman_to_hiragana(std::wstring roman);
+std::wstring mz_roman_to_hiragana(std::wstring roman, size_t ichTarget);
+// conversion between roman and katakana
+std::wstring mz_roman_to_katakana(std::wstring roman);
+std::wstring mz_roman_to_katakana(std::wstring roman, size_t ichTarget);
+// conversion between roman and halfwidth katakana
+std::wstring mz_roman_to_halfwidth_katakana(std::wstring roman);
+std::wstring mz_roman_to_halfwidth_katakana(std::wstring roman, size_t ichTarget);
+
+// character map for kana input
+WCHAR mz_vkey_to_hiragana(BYTE vk, BOOL bShift);
+// character map for typing keys
+WCHAR mz_typing_key_to_char(BYTE vk, BOOL bShift, BOOL bCapsLock);
+// dakuon (voiced consonant) processor
+WCHAR mz_dakuon_shori(WCHAR ch0, WCHAR ch1);
+// convert hiragana to typing characters
+std::wstring mz_hiragana_to_typing(std::wstring hiragana);
+// convert fullwidth ascii to halfwidth
+std::wstring mz_fullwidth_ascii_to_halfwidth(const std::wstring& str);
+// convert halfwidth ascii to fullwidth
+std::wstring mz_halfwidth_ascii_to_fullwidth(const std::wstring& str);
+
+// is the character hiragana?
+BOOL mz_is_hiragana(WCHAR ch);
+// is the character fullwidth katakana?
+BOOL mz_is_fullwidth_katakana(WCHAR ch);
+// is the character halfwidth katakana?
+BOOL mz_is_halfwidth_katakana(WCHAR ch);
+// is the character fullwidth ascii?
+BOOL mz_is_fullwidth_ascii(WCHAR ch);
+// is the character kanji?
+BOOL mz_is_kanji(WCHAR ch);
+// is the character the education kanji?
+BOOL mz_is_education_kanji(WCHAR ch);
+// is the character the common use kanji?
+BOOL mz_is_common_use_kanji(WCHAR ch);
+// is the character fullwidth ASCII?
+BOOL mz_is_fullwidth_ascii(WCHAR ch);
+// are all the characters numeric?
+BOOL mz_are_all_chars_numeric(const std::wstring& str);
+// convert numeric
+std::wstring mz_convert_to_kansuuji_1(wchar_t ch, size_t digit_level);
+std::wstring mz_convert_to_kansuuji_4(const std::wstring& halfwidth);
+std::wstring mz_convert_to_kansuuji(const std::wstring& str);
+std::wstring mz_convert_to_kansuuji_brief(const std::wstring& str);
+std::wstring mz_convert_to_kansuuji_formal(const std::wstring& str);
+std::wstring mz_convert_to_kansuuji_brief_formal(const std::wstring& str);
+std::wstring mz_convert_to_maru_suuji(const std::wstring& str);
+// ピリオドか？
+BOOL mz_is_period(WCHAR ch);
+// カンマか？
+BOOL mz_is_comma(WCHAR ch);
+// ハイフンか？
+BOOL mz_is_hyphen(WCHAR ch);
+// 設定に応じて文字を変換する。
+WCHAR mz_translate_char(WCHAR ch);
+WCHAR mz_translate_char(WCHAR ch, BOOL bCommaPeriod);
+WCHAR mz_translate_char(WCHAR ch, BOOL bCommaPeriod, BOOL bNoFullwidthSpace);
+// 設定に応じて文字列を変換する。
+std::wstring mz_translate_string(const std::wstring& str);
+std::wstring mz_translate_string_2(const std::wstring& str);
+
+//////////////////////////////////////////////////////////////////////////////
+// LatticeNode and Lattice.
+// 言語学でよく扱われるラティス構造を実現する。
+
+struct LatticeNode;
+typedef LatticeNode *LatticeNodePtr;
+typedef std::vector<LatticeNodePtr> branches_t;
+
+// 単語のタグ。辞書の「[人名]」などをビットで表す。
+enum {
+    MZ_TAG_JINMEI               = 0x00000001,   // [人名]
+    MZ_TAG_CHIMEI               = 0x00000002,   // [地名]
+    MZ_TAG_EKIMEI               = 0x00000004,   // [駅名]
+    MZ_TAG_HIHYOUJUN            = 0x00000008,   // [非標準]
+    MZ_TAG_SUUTANI              = 0x00000010,   // [数単位]
+    MZ_TAG_DOUSHOKUBUTSU        = 0x00000020,   // [動植物]
+    MZ_TAG_SUUSHI               = 0x00000040,   // [数詞]
+    MZ_TAG_YUUSEN_PP            = 0x00000080,   // [優先++]
+    MZ_TAG_YUUSEN_P             = 0x00000100,   // [優先+]
+    MZ_TAG_YUUSEN_M             = 0x00000200,   // [優先-]
+    MZ_TAG_YUUSEN_MM            = 0x00000400,   // [優先--]
+    MZ_TAG_KAIHISAKU            = 0x00000800,   // [回避策]
+    MZ_TAG_MIZEN_RENKETSU       = 0x00001000,   // [未然形に連結]
+    MZ_TAG_RENYOU_RENKETSU      = 0x00002000,   // [連用形に連結]
+    MZ_TAG_SHUUSHI_RENKETSU     = 0x00004000,   // [終止形に連結]
+    MZ_TAG_KANYOUKU             = 0x00008000,   // [慣用句]
+    MZ_TAG_FUKINSHIN            = 0x00010000,   // [不謹慎]
+    MZ_TAG_USER_DICT            = 0x00020000,   // [ユーザ辞書]
+    MZ_TAG_SHUJU_NO_GO          = 0x00040000,   // [種々の語]
+    MZ_TAG_SUUJI                = 0x00080000,   // [数字] 数字の並び。ほかの表記は結果を作るときに作る。
+};
+// タグ文字列をビットに変換する。知らないタグは無視する。
+DWORD mz_tags_from_string(const std::wstring& tags);
+// タグのビットを文字列に変換する。
+std::wstring mz_tags_to_string(DWORD tags);
+
+// 文字列プール。追加した文字列のアドレスはクリアするまで変わらない。
+class MzStringPool {
+public:
+    MzStringPool() : m_used(0) { }
+    ~MzStringPool() { clear(); }
+    const WCHAR *add(const WCHAR *str, size_t len);
+    const WCHAR *add(const std::wstring& str) { return add(str.c_str(), str.size()); }
+    void clear();
+
+protected:
+    std::vector<WCHAR *> m_blocks;  // 確保したブロック。
+    size_t m_used;                  // 最後のブロックの使用量。
+
+private:
+    MzStringPool(const MzStringPool&);
+    MzStringPool& operator=(const MzStringPool&);
+};
+
+class MzLearningTable; // 学習の表。
+class MzShardedDict;   // 分割辞書。
+
+// ラティス（lattice）ノード。
+// 文字列は持たず、変換前は入力文字列を、変換後は文字列プールを指す。
+// 枝はラティスの配列（Lattice::m_branches）の[branch_begin, branch_begin + branch_count)
+// の範囲で表す。枝の先は一つの位置のノードに限られるので、数はWORDで足りる。
+// PODなので、コンストラクタの代わりにclear()で初期化する。
+struct LatticeNode {
+    const WCHAR *pre;                       // 変換前。
+    const WCHAR *post;                      // 変換後。
+    const MzLearningTable *learning;        // 学習した連結があれば、その表。
+    WORD pre_len;                           // 変換前の長さ。
+    WORD post_len;                          // 変換後の長さ。
+    BYTE bunrui;                            // 分類（HinshiBunrui）。
+    BYTE gyou;                              // 活用の行（Gyou）。
+    BYTE katsuyou;                          // 動詞活用形（KatsuyouKei）。
+    BYTE marked;                            // マーキング。
+    DWORD tags;                             // タグ（MZ_TAG_*）。
+    INT deltaCost;                          // コスト差分。
+    INT subtotal_cost;                      // 部分合計コスト。
+    DWORD linked;                           // リンク数。
+    DWORD serial;                           // 追加した順番。コストが同じときに先のものを選ぶ。
+    DWORD branch_begin;                     // 枝分かれの先頭（Lattice::m_branches）。
+    DWORD reverse_begin;                    // 逆向き枝分かれの先頭（Lattice::m_reverse_branches）。
+    WORD branch_count;                      // 枝分かれの数。
+    WORD reverse_count;                     // 逆向き枝分かれの数。
+
+    // 既定の値にする。
+    void clear() {
+        pre = post = L"";
+        learning = NULL;
+        pre_len = post_len = 0;
+        bunrui = HB_UNKNOWN;
+        gyou = GYOU_A;
+        katsuyou = NONE_KEI;
+        marked = 0;
+        tags = 0;
+        deltaCost = 0;
+        subtotal_cost = MAXLONG;
+        linked = 0;
+        serial = 0;
+        branch_begin = branch_count = 0;
+        reverse_begin = reverse_count = 0;
+    }
+
+    bool IsDoushi() const;      // 動詞か？
+    bool IsJoshi() const;       // 助詞か？
+    bool IsJodoushi() const;    // 助動詞か？
+    bool IsKeiyoushi() const;   // 形容詞か？
+
+    // 変換前の文字列。
+    std::wstring GetPre() const { return std::wstring(pre, pre_len); }
+    // 変換後の文字列。
+    std::wstring GetPost() const { return std::wstring(post, post_len); }
+    // 変換前の文字列が一致するか？
+    bool PreIs(const WCHAR *str) const {
+        return wcslen(str) == pre_len && memcmp(pre, str, pre_len * sizeof(WCHAR)) == 0;
+    }
+    // 変換後の文字列が一致するか？
+    bool PostIs(const WCHAR *str) const {
+        return wcslen(str) == post_len && memcmp(post, str, post_len * sizeof(WCHAR)) == 0;
+    }
+    // 変換前の文字列を設定する。strはノードを使う間、破棄してはならない。
+    void SetPre(const std::wstring& str) {
+        pre = str.c_str();
+        pre_len = (WORD)str.size();
+    }
+    // 変換後の文字列を設定する。strはノードを使う間、破棄してはならない。
+    void SetPost(const std::wstring& str) {
+        post = str.c_str();
+        post_len = (WORD)str.size();
+    }
+    void SetPost(const WCHAR *str) {
+        post = str;
+        post_len = (WORD)wcslen(str);
+    }
+    // 指定したタグがあるか？
+    bool HasTag(DWORD tag) const {
+        return (tags & tag) != 0;
+    }
+    // 単語コスト。
+    INT WordCost() const;
+    // 連結コスト。
+    INT ConnectCost(const LatticeNode& other) const;
+    // 連結可能性。
+    BOOL CanConnectTo(const LatticeNode& other) const;
+};
+// ノードはブロックにまとめて置き、コピーで詰め直すので、小さなPODにしておく。
+static_assert(sizeof(LatticeNode) <= 64, "LatticeNode must stay small");
+typedef std::vector<LatticeNodePtr> LatticeChunk;
+
+struct KATSUYOU_TABLE; // 活用規則の表。
+
+// ラティス。
+struct Lattice {
+    std::wstring                    m_pre;    // 変換前。
+    std::string                     m_key;    // 変換前を読みの鍵の符号にしたもの。
+    std::vector<size_t>             m_key_pos; // 各インデックス位置のm_keyでの位置。
+    LatticeNodePtr                  m_head;   // 先頭ノード。
+    LatticeNodePtr                  m_tail;   // 末端ノード。
+    std::vector<LatticeChunk>       m_chunks; // インデックス位置に対するノード集合。
+    // m_pre.size() + 1 == m_chunks.size().
+    MzStringPool                    m_strings; // ノードの変換後の文字列。
+    branches_t                      m_branches; // 全ノードの枝分かれ。
+    branches_t                      m_reverse_branches; // 全ノードの逆向き枝分かれ。
+
+    Lattice()
+        : m_head(NULL), m_tail(NULL), m_nodes_used(0), m_nodes_capacity(0), m_nodes_added(0)
+        , m_learning(NULL), m_bLearning(FALSE) { }
+    ~Lattice();
+
+    // ノードをブロックから確保する。
+    LatticeNodePtr NewNode(const LatticeNode& node);
+    // チャンクのノードを、チャンクの順に一つのブロックに詰め直す。
+    void PackNodes(size_t extra);
+
+    // 枝分かれ。
+    LatticeNode *Branch(const LatticeNode *node, size_t i) const {
+        return m_branches[node->branch_begin + i];
+    }
+    // 逆向き枝分かれ。
+    LatticeNode *ReverseBranch(const LatticeNode *node, size_t i) const {
+        return m_reverse_branches[node->reverse_begin + i];
+    }
+
+    BOOL AddNodesForMulti(const std::wstring& pre);
+    BOOL AddNodesForSingle(const std::wstring& pre);
+    void AddExtraNodes();
+    void SetDay(LPCWSTR text, const SYSTEMTIME& st, LONGLONG delta = 0);
+    void SetMonth(LPCWSTR text, const SYSTEMTIME& st, LONGLONG delta = 0);
+    void SetYear(LPCWSTR text, WORD wYear);
+    void SetTime(LPCWSTR text, const SYSTEMTIME& st);
+    void SetDateTime(LPCWSTR text, const SYSTEMTIME& st);
+    void SetUser();
+    void SetWords(const std::wstring& words);
+    void SetSymbols(const std::wstring& symbols);
+
+    void SetPre(const std::wstring& pre);
+    size_t ScanDict(WStrings& records, const WCHAR *dict_data, size_t ichKeys, size_t index);
+    BOOL AddNodesFromDict(size_t index, const WCHAR *dict_data, size_t ichKeys);
+    BOOL AddNodesFromDict(const WCHAR *dict_data, size_t ichKeys);
+    BOOL AddNodesFromShards(MzShardedDict& dict, BOOL bSingle);
+    void ResetLatticeInfo();
+    void UpdateLinksAndBranches();
+    BOOL OptimizeMarking(LatticeNode *ptr0);
+    void AddComplement();
+    void AddComplement(size_t index, size_t min_size, size_t max_size);
+    void CutUnlinkedNodes();
+    void PruneByBeam(size_t beam_width, INT threshold);
+    void MakeReverseBranches(LatticeNode *ptr0);
+    void MakeReverseBranchesPass(LatticeNode *ptr0, WORD *filled);
+    INT CalcSubTotalCosts(LatticeNode *ptr1);
+    INT CalculateClauseBoundaryScore(size_t pos) const;
+    size_t GetLastLinkedIndex() const;
+
+    void Dump(int num = 0);
+    void Fix(const std::wstring& pre);
+    void AddNode(size_t index, const LatticeNode& node);
+
+protected:
+    void DoFields(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoMeishi(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoIkeiyoushi(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoNakeiyoushi(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoGodanDoushi(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoIchidanDoushi(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoKahenDoushi(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoSahenDoushi(size_t index, const WStrings& fields, INT deltaCost = 0);
+    void DoKatsuyou(size_t index, const WStrings& fields, INT deltaCost,
+                    const KATSUYOU_TABLE& table);
+    void DoFukushi(size_t index, const WStrings& fields, INT deltaCost = 0);
+
+    std::vector<void *> m_node_blocks;          // ノードのブロック。
+    size_t m_nodes_used;                        // 最後のブロックの使用数。
+    size_t m_nodes_capacity;                    // 最後のブロックの大きさ。
+    DWORD m_nodes_added;                        // これまでに追加したノードの数。
+    MzLearningTable *m_learning;                // 学習の表。なければNULL。
+    BOOL m_bLearning;                           // 学習の表を取得したか？
+
+private:
+    Lattice(const Lattice&);
+    Lattice& operator=(const Lattice&);
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+// 変換候補。
+struct MzConvCandidate {
+    std::wstring pre;              // ひらがな。
+    std::wstring post;             // 変換後。
+    INT cost;                      // コスト。
+    INT word_cost;                 // 単語コスト。
+    std::set<HinshiBunrui> bunruis; // 品詞分類集合。
+    DWORD tags;                    // タグ（MZ_TAG_*）。
+    HinshiBunrui bunrui;           // 品詞分類。
+    KatsuyouKei katsuyou;          // 活用形。
+
+    MzConvCandidate()
+        : cost(0)
+        , word_cost(0)
+        , tags(0)
+    {
+        bunrui = HB_UNKNOWN;
+        katsuyou = MIZEN_KEI;
+    }
+
+    void clear() {
+        pre.clear();
+        post.clear();
+        cost = 0;
+        bunruis.clear();
+        tags = 0;
+    }
+};
+
+typedef std::vector<MzConvCandidate> candidates_t;
+
+// 変換文節。
+struct MzConvClause {
+    candidates_t candidates; // 候補群。
+    void sort();                                // ソートする。
+    void add(const LatticeNode *node);          // ノードを追加する。
+    void expand_numeric();                      // 数字の並びのほかの表記を足す。
+    void clear() {
+        candidates.clear();
+    }
+};
+
+typedef std::vector<MzConvClause> clauses_t;
+
+// 変換結果。
+struct MzConvResult {
+    clauses_t clauses;      // 文節群。
+    void sort();                            // ソートする。
+    void clear() { clauses.clear(); }       // クリアする。
+    std::wstring get_str(bool detailed = false) const;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// dictionary - 辞書
+
+class Dict {
+public:
+    Dict();
+    ~Dict();
+
+    // 辞書を読み込む。
+    BOOL Load(const wchar_t *file_name, const wchar_t *object_name);
+    // 辞書をアンロードする。
+    void Unload();
+
+    BOOL IsLoaded() const;  // 読み込み済みか？
+    DWORD GetSize() const;  // サイズを取得する。
+    size_t GetLength() const { return m_cbData / sizeof(WCHAR); } // 文字数。
+
+    wchar_t *Lock();            // ロックして読み込みを開始する。
+    void Unlock(wchar_t *data); // ロックを解除して読み込みを終了する。
+
+protected:
+    std::wstring m_strFileName;     // ファイル名。
+    std::wstring m_strObjectName;   // 複数の辞書を使うので、オブジェクト名で区別する。
+    HANDLE m_hMutex;                // 排他制御用。
+    HANDLE m_hFileMapping;          // ファイルマッピング。
+    DWORD m_cbData;                 // ファイルマッピングのサイズ。
+};
+
+extern Dict g_basic_dict;
+extern Dict g_name_dict;
+
+// ユーザー辞書から、読みが文字chで始まる単語のレコードを追加する関数。
+// chが0ならすべての単語、pThisはNULLのこともある。
+// IMEが設定する。NULLならユーザー辞書は使わない。
+typedef size_t (*MZ_SCAN_USER_DICT)(WStrings& records, WCHAR ch, Lattice *pThis);
+extern MZ_SCAN_USER_DICT g_pfnScanUserDict;
+
+// 辞書データから、読みが文字chで始まる単語のレコードを得る。
+size_t ScanBasicDict(WStrings& records, const WCHAR *dict_data, WCHAR ch);
+// 辞書データの読みの索引（dict.hppを参照）の位置。なければ0。
+// 索引があれば、レコードの読みは鍵の符号になっている。
+size_t FindKeyIndex(const WCHAR *dict_data, size_t cch);
+// 辞書データの位置ichのレコードを得る。bPackedなら読みを鍵の符号から戻す。
+BOOL GetDictRecord(std::wstring& record, const WCHAR *dict_data, size_t cch, size_t ich,
+                   BOOL bPacked);
+// 読みの索引から、読みが鍵key[ib...]の先頭の部分と一致する単語のレコードを得る。
+size_t ScanKeyIndex(WStrings& records, const WCHAR *dict_data, size_t ichIndex,
+                    const std::string& key, size_t ib);
+
+//////////////////////////////////////////////////////////////////////////////
+// 分割辞書 - 分野別の辞書など。読みの先頭の文字で分けた辞書ファイル（分割）を、
+// その文字が変換に現れたときに読み込む。使っていない分割は予算を超えたら捨てる。
+// 分割はプロセスごとのメモリに読み込む。
+
+class MzShardedDict {
+public:
+    MzShardedDict();
+    ~MzShardedDict();
+
+    // 分割辞書の目録を読み込む。辞書ごとに呼ぶ。
+    BOOL Load(LPCWSTR manifest_file);
+    // すべての分割辞書をアンロードする。
+    void Unload();
+    BOOL IsLoaded() const { return !m_shards.empty(); }
+
+    // 読みが文字chで始まる単語のレコードを追加する。必要なら分割を読み込む。
+    // 読みの索引がある分割では、読みが鍵key[ib...]の先頭の部分と一致する単語だけ。
+    size_t Scan(WStrings& records, WCHAR ch, const std::string& key, size_t ib);
+
+    DWORD GetResidentSize() const { return m_cbResident; } // 読み込んだ分割の大きさ。
+
+    DWORD m_cbBudget;       // 読み込んだ分割の大きさの予算（バイト）。
+    // 統計。
+    LONG m_nLoads;          // 分割を読み込んだ回数。
+    LONG m_nEvictions;      // 分割を捨てた回数。
+
+protected:
+    struct Shard;
+    std::vector<Shard *> m_shards;                  // すべての分割。
+    std::map<WCHAR, std::vector<Shard *> > m_index; // 先頭の文字から分割へ。
+    std::list<Shard *> m_lru;                       // 読み込んだ分割。最近使ったものが先頭。
+    DWORD m_cbResident;
+    HANDLE m_hLock;
+
+    BOOL LoadShard(Shard *shard);
+    void Evict(Shard *keep);
+};
+
+extern MzShardedDict g_domain_dict;
+
+//////////////////////////////////////////////////////////////////////////////
+// 特別な変換 - 「きょう」から日付、「さんかく」から記号など、読みに決まった生成器。
+// 組み込みの表とユーザーのデータファイルから、読みの完全ハッシュを作って引く。
+
+// 特別な変換の種類。
+enum MZ_SPECIAL_KIND {
+    MZSC_DAY,           // 日付。値は今日からの日数。
+    MZSC_MONTH,         // 月。値は今月からの月数。
+    MZSC_YEAR,          // 年。値は今年からの年数。
+    MZSC_TIME,          // 現在の時刻。
+    MZSC_DATETIME,      // 現在の日時。
+    MZSC_USER,          // ユーザー名。
+    MZSC_WORDS,         // タブで区切った語を候補にする。
+    MZSC_SYMBOLS        // 一文字ずつ記号の候補にする。
+};
+
+// 特別な変換の項目。
+struct MzSpecialConv {
+    std::wstring pre;       // 読み。
+    MZ_SPECIAL_KIND kind;   // 種類。
+    INT value;              // 日付などの差分。
+    std::wstring text;      // 表記。MZSC_WORDSならタブで区切った語。
+};
+
+class MzSpecialConvs {
+public:
+    MzSpecialConvs();
+    ~MzSpecialConvs();
+
+    // データファイルから項目を追加する。同じ読みなら組み込みの項目を置き換える。
+    BOOL Load(LPCWSTR file_name);
+    // 組み込みの項目だけに戻す。
+    void Reset();
+    // 読みから項目を引く。ロックしない。
+    BOOL Find(const std::wstring& pre, MzSpecialConv& entry) const;
+    size_t GetCount() const;
+
+protected:
+    // 作ったら書き換えない表。LoadとResetは新しい表を作って入れ替える。
+    struct Table {
+        std::vector<MzSpecialConv> entries; // すべての項目。
+        std::vector<INT> displace;  // バケツごとの変位。負なら-(スロット+1)。
+        std::vector<DWORD> slots;   // スロットから項目の番号へ。
+
+        void Build();
+        const MzSpecialConv *Find(const std::wstring& pre) const;
+    };
+    Table *volatile m_table;                // 公開中の表。
+    volatile LONG m_nEpoch;                 // 表を入れ替えるたびに増える世代。
+    mutable volatile LONG m_nReaders[2];    // 世代の偶奇ごとの、表を読んでいる途中のスレッドの数。
+    HANDLE m_hLock;                         // LoadとResetの排他制御。
+
+    const Table *AcquireTable(LONG& nEpoch) const;
+    void ReleaseTable(LONG nEpoch) const;
+    void Publish(Table *table);
+};
+
+extern MzSpecialConvs g_special_convs;
+
+//////////////////////////////////////////////////////////////////////////////
+// 学習 - ユーザーが確定した候補を覚えて、次の変換のコストを下げる。
+// 覚えるのは（読み, 変換後）と（前の文節の変換後, 変換後）の組。
+// 活用しても同じ組になるように、読みと変換後に共通するひらがなの語尾は除く。
+
+// 学習の表。作ったら変えないので、ロックせずに引ける。参照カウントで寿命を管理する。
+class MzLearningTable {
+public:
+    struct Slot {
+        ULONGLONG key;      // 組のハッシュ値。0は空き。
+        INT value;          // コスト差分。
+        DWORD reserved;
+    };
+
+    // ノードの単語コストに学習を反映する。
+    void Apply(LatticeNode& node) const;
+    // 二つのノードの連結の学習によるコスト差分。
+    INT PairCost(const LatticeNode& node0, const LatticeNode& node1) const;
+    // キーを引く。なければ0を返す。
+    INT Find(ULONGLONG key) const;
+
+protected:
+    friend class MzLearning;
+    MzLearningTable();
+    ~MzLearningTable();
+
+    volatile LONG m_nRefCount;
+    const Slot *m_slots;
+    DWORD m_mask;                   // スロット数-1。スロット数は2のべき。
+    std::vector<Slot> m_buffer;     // メモリ上に作ったスロット。
+    const void *m_pvMap;            // スナップショットをマップしたときのアドレス。
+    DWORD m_cbMap;
+
+    void Insert(ULONGLONG key, INT value);
+
+private:
+    MzLearningTable(const MzLearningTable&);
+    MzLearningTable& operator=(const MzLearningTable&);
+};
+
+// 学習の記憶。確定のたびにLearnを呼ぶ。書き込みは別のスレッドで行う。
+// ファイルは追記だけするログと、ときどき作り直すスナップショットからなる。
+class MzLearning {
+public:
+    MzLearning();
+    ~MzLearning();
+
+    // ファイルから読み込む。ファイルがなければ空で始める。
+    BOOL Open(LPCWSTR snapshot_file, LPCWSTR log_file);
+    // 書き込んで閉じる。スレッドの終了を最大dwMilliseconds待つ。
+    void Close(DWORD dwMilliseconds = INFINITE);
+    BOOL IsOpen() const { return m_bOpen; }
+
+    // 確定した文節を覚える。prev_postは前の文節の変換後（なければ空）。
+    void Learn(const std::wstring& pre, const std::wstring& post,
+               const std::wstring& prev_post);
+    // 覚えたことを表とログに反映する。ふつうはスレッドが行う。
+    void Flush();
+    // スナップショットを作り直し、ログを空にする。
+    BOOL Compact();
+
+    // 変換に使う表を取得する。学習がなければNULL。使い終わったらReleaseする。
+    MzLearningTable *Acquire();
+    static void Release(MzLearningTable *table);
+
+    size_t GetCount() const { return m_records.size(); }
+
+    DWORD m_dwMaxEntries;       // 覚える組の最大数。超えたら古いものから忘れる。
+    DWORD m_dwFlushDelay;       // 書き込みをまとめるために待つ時間（ミリ秒）。
+    DWORD m_dwCompactCount;     // ログがこの数を超えたらスナップショットを作り直す。
+    DWORD m_dwIdleTimeout;      // 仕事がなければスレッドを終えるまで（ミリ秒）。
+
+    struct Record;
+
+protected:
+    struct Event {
+        std::wstring pre, post, prev_post;
+    };
+
+    BOOL m_bOpen;
+    std::wstring m_snapshot_file;
+    std::wstring m_log_file;
+    HANDLE m_hLock;             // m_events, m_tableなどの排他制御。
+    HANDLE m_hWriteLock;        // 記録とファイルの書き込みの排他制御。
+    HANDLE m_hWake;
+    HANDLE m_hIdle;
+    BOOL m_bThread;
+    BOOL m_bStopping;
+    std::vector<Event> m_events;    // まだ反映していない確定。
+    MzLearningTable *m_table;       // 変換に使う表。
+
+    // 以下はm_hWriteLockで保護する。m_hWriteLockはプロセス間で共有する。
+    std::list<Record> m_records;    // 覚えた組。新しい順。
+    std::map<ULONGLONG, std::list<Record>::iterator> m_index;
+    DWORD m_dwSeq;                  // 確定の通し番号。
+    DWORD m_dwGeneration;           // スナップショットの世代。
+    DWORD m_cbLogRead;              // ログを読んだバイト数。
+    DWORD m_nLogged;                // スナップショットの後にログにある数。
+
+    void Touch(WORD wKind, const std::wstring& a, const std::wstring& b);
+    void Reload();
+    void ReadLog();
+    MzLearningTable *BuildTable() const;
+    void SetTable(MzLearningTable *table);
+    void WorkLoop();
+    static DWORD WINAPI WorkProc(LPVOID lpParam);
+
+private:
+    MzLearning(const MzLearning&);
+    MzLearning& operator=(const MzLearning&);
+};
+
+extern MzLearning g_learning;
+
+//////////////////////////////////////////////////////////////////////////////
+// MzConverter - かな漢字変換。
+
+// 取り消されたか？
+#define MZ_CANCELLED(pbCancel) ((pbCancel) && *(pbCancel))
+
+class MzConverter {
+public:
+    // make result
+    void MakeResultOnFailure(MzConvResult& result, const std::wstring& pre);
+    void MakeResultForMulti(MzConvResult& result, Lattice& lattice);
+    void MakeResultForSingle(MzConvResult& result, Lattice& lattice);
+
+    // 変換。
+    // pbCancelが指す値が0でなくなったら、途中でやめてFALSEを返す。
+    BOOL ConvertMultiClause(const std::wstring& str, MzConvResult& result,
+                            volatile LONG *pbCancel = NULL);
+    BOOL ConvertLegacy(const std::wstring& pre, MzConvResult& result,
+                       volatile LONG *pbCancel = NULL);
+    void ConvertSentence(const std::wstring& pre, MzConvResult& result,
+                         volatile LONG *pbCancel = NULL);
+    void ConvertWithBeam(const std::wstring& pre, MzConvResult& result,
+                         size_t beam_width, INT threshold,
+                         volatile LONG *pbCancel = NULL);
+    void ConvertSentencesInParallel(const WStrings& sentences, MzConvResult& result);
+    BOOL ConvertSingleClause(const std::wstring& str, MzConvResult& result);
+    BOOL ConvertCode(const std::wstring& strTyping, MzConvResult& result);
+
+    // 予測変換。読みがprefixで始まる単語を、最大k個の候補として一つの文節に入れる。
+    BOOL Predict(const std::wstring& prefix, MzConvResult& result,
+                 size_t k = DICT_PREDICT_TOPK);
+
+    // 再変換。確定した文字列（漢字かな交じり）を辞書の逆引きで読みに戻す。
+    BOOL GetReading(const std::wstring& text, std::wstring& reading);
+    BOOL Reconvert(const std::wstring& text, MzConvResult& result);
+}; // class MzConverter
+
+//////////////////////////////////////////////////////////////////////////////
+// MzPredictor - 予測変換。
+// 辞書の索引（dict.hppを参照）をたどり、読みが一文字伸びるごとに
+// 一段だけ進む。候補は索引のノードにある上位候補から作るので、部分木を
+// 走査しない。ユーザー辞書は小さいので、最初に読み込んで読みの順に並べておく。
+
+class MzPredictor {
+public:
+    MzPredictor();
+    ~MzPredictor();
+
+    void Reset();                                   // 読みを空にする。
+    BOOL SetPrefix(const std::wstring& prefix);     // 読みを設定する。
+    BOOL Push(WCHAR ch);                            // 読みを一文字伸ばす。
+    void Pop();                                     // 読みを一文字縮める。
+    const std::wstring& GetPrefix() const { return m_prefix; }
+
+    // 上位k個の候補を得る。候補がなければFALSE。
+    BOOL GetCandidates(MzConvResult& result, size_t k = DICT_PREDICT_TOPK) const;
+
+    struct Source;  // 辞書ごとの索引の状態。
+    struct Word;    // 見出し語。
+
+protected:
+    std::vector<Source *> m_sources;    // 辞書ごとの索引の状態。
+    std::vector<Word> m_user_words;     // ユーザー辞書の見出し語（読みの順）。
+    std::wstring m_prefix;              // 読み。
+
+    void AddSource(Dict& dict);
+
+private:
+    MzPredictor(const MzPredictor&);
+    MzPredictor& operator=(const MzPredictor&);
+}; // class MzPredictor
+
+//////////////////////////////////////////////////////////////////////////////
+// MzSpeculator - 先読み変換。
+// 入力のたびに文脈（key）ごとの変換を予約し、入力が少し止まったら別のスレッドで
+// 複数文節変換しておく。変換キーが押されたらTakeで結果を受け取る。
+// 新しい入力で予約し直すと、古い予約と変換中の仕事は取り消す。
+// スレッドは必要になったら作り、しばらく仕事がなければ終える。
+
+class MzSpeculator {
+public:
+    MzSpeculator(MzConverter *pConverter);
+    ~MzSpeculator();
+
+    // keyの文脈でstrの変換を予約する。同じkeyの古い予約は取り消す。
+    void Schedule(const void *key, const std::wstring& str);
+    // keyの文脈の予約を取り消す。
+    void Cancel(const void *key);
+    // keyの文脈でstrを変換した結果があれば受け取る。変換中なら最大dwMilliseconds待つ。
+    // 受け取れなければFALSEを返すので、呼び出し側で変換する。
+    BOOL Take(const void *key, const std::wstring& str, MzConvResult& result,
+              DWORD dwMilliseconds);
+    // すべて取り消し、スレッドの終了を最大dwMilliseconds待つ。以後は予約できない。
+    void Stop(DWORD dwMilliseconds = INFINITE);
+
+    DWORD m_dwDelay;        // 入力が止まってから変換を始めるまで（ミリ秒）。
+    DWORD m_dwIdleTimeout;  // 仕事がなければスレッドを終えるまで（ミリ秒）。
+
+    // 統計。
+    volatile LONG m_nScheduled; // 予約の数。
+    volatile LONG m_nConverted; // 変換を終えた数。
+    volatile LONG m_nCancelled; // 取り消した数（変換中のものを含む）。
+    volatile LONG m_nHits;      // Takeで結果を渡せた数。
+
+    struct Entry;   // 文脈ごとの予約。
+
+protected:
+    MzConverter *m_pConverter;
+    HANDLE m_hLock;             // m_entriesなどの排他制御。
+    HANDLE m_hWake;             // 予約が変わったらスレッドを起こす。
+    HANDLE m_hIdle;             // スレッドが動いていなければシグナル状態。
+    std::map<const void *, Entry *> m_entries;
+    BOOL m_bThread;             // スレッドが動いているか？
+    BOOL m_bStopping;           // 止めたか？
+
+    void Drop(Entry *entry);
+    void WorkLoop();
+    static DWORD WINAPI WorkProc(LPVOID lpParam);
+
+private:
+    MzSpeculator(const MzSpeculator&);
+    MzSpeculator& operator=(const MzSpeculator&);
+}; // class MzSpeculator
@@ -0,0 +1,690 @@
+﻿// mzconv_server.cpp --- mzimeja conversion server and client
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+
+#include "mzconv_server.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// 符号化と復号。
+
+static void mzconv_put_word(std::string& buf, WORD w)
+{
+    buf += (char)LOBYTE(w);
+    buf += (char)HIBYTE(w);
+}
+
+static void mzconv_put_dword(std::string& buf, DWORD dw)
+{
+    mzconv_put_word(buf, LOWORD(dw));
+    mzconv_put_word(buf, HIWORD(dw));
+}
+
+static WORD mzconv_word_at(const BYTE *pb)
+{
+    return (WORD)(pb[0] | (pb[1] << 8));
+}
+
+static DWORD mzconv_dword_at(const BYTE *pb)
+{
+    return mzconv_word_at(pb) | ((DWORD)mzconv_word_at(pb + 2) << 16);
+}
+
+// 文字列をUTF-16の並びにする。WCHARが32ビットならサロゲートペアに分ける。
+static void mzconv_to_utf16(std::vector<WORD>& units, const std::wstring& str)
+{
+    units.clear();
+    for (size_t i = 0; i < str.size(); ++i) {
+        DWORD ch = (DWORD)str[i];
+        if (sizeof(WCHAR) > 2 && ch > 0xFFFF) {
+            ch -= 0x10000;
+            units.push_back((WORD)(0xD800 + (ch >> 10)));
+            units.push_back((WORD)(0xDC00 + (ch & 0x3FF)));
+        } else {
+            units.push_back((WORD)ch);
+        }
+    }
+}
+
+// UTF-16の並びを文字列にする。
+static void mzconv_from_utf16(std::wstring& str, const BYTE *pb, size_t cch)
+{
+    str.clear();
+    str.reserve(cch);
+    for (size_t i = 0; i < cch; ++i) {
+        WORD w = mzconv_word_at(pb + i * 2);
+        if (sizeof(WCHAR) > 2 && 0xD800 <= w && w <= 0xDBFF && i + 1 < cch) {
+            WORD w2 = mzconv_word_at(pb + (i + 1) * 2);
+            if (0xDC00 <= w2 && w2 <= 0xDFFF) {
+                str += (WCHAR)(0x10000 + ((w - 0xD800) << 10) + (w2 - 0xDC00));
+                ++i;
+                continue;
+            }
+        }
+        str += (WCHAR)w;
+    }
+}
+
+// 長さ付きの文字列を書く。
+static void mzconv_put_string(std::string& buf, const std::wstring& str)
+{
+    std::vector<WORD> units;
+    mzconv_to_utf16(units, str);
+    if (units.size() > 0xFFFF)
+        units.resize(0xFFFF);
+    mzconv_put_word(buf, (WORD)units.size());
+    for (size_t i = 0; i < units.size(); ++i)
+        mzconv_put_word(buf, units[i]);
+}
+
+// 本体を読むためのカーソル。
+struct MZCONV_READER {
+    const BYTE *pb;
+    size_t cb;
+    size_t ib;
+
+    BOOL GetWord(WORD& w) {
+        if (ib + 2 > cb)
+            return FALSE;
+        w = mzconv_word_at(pb + ib);
+        ib += 2;
+        return TRUE;
+    }
+    BOOL GetDWord(DWORD& dw) {
+        if (ib + 4 > cb)
+            return FALSE;
+        dw = mzconv_dword_at(pb + ib);
+        ib += 4;
+        return TRUE;
+    }
+    BOOL GetString(std::wstring& str) {
+        WORD cch;
+        if (!GetWord(cch) || ib + cch * 2 > cb)
+            return FALSE;
+        mzconv_from_utf16(str, pb + ib, cch);
+        ib += cch * 2;
+        return TRUE;
+    }
+};
+
+void mzconv_put_header(std::string& buf, DWORD dwId, WORD wType, DWORD cbBody)
+{
+    mzconv_put_dword(buf, MZCONV_MAGIC);
+    mzconv_put_dword(buf, dwId);
+    mzconv_put_word(buf, wType);
+    mzconv_put_word(buf, 0);
+    mzconv_put_dword(buf, cbBody);
+}
+
+BOOL mzconv_get_header(const BYTE *pb, MZCONV_HEADER& header)
+{
+    header.dwMagic = mzconv_dword_at(pb);
+    header.dwId = mzconv_dword_at(pb + 4);
+    header.wType = mzconv_word_at(pb + 8);
+    header.wFlags = mzconv_word_at(pb + 10);
+    header.cbBody = mzconv_dword_at(pb + 12);
+    return header.dwMagic == MZCONV_MAGIC && header.cbBody <= MZCONV_MAX_BODY;
+}
+
+void mzconv_put_text(std::string& buf, const std::wstring& str)
+{
+    std::vector<WORD> units;
+    mzconv_to_utf16(units, str);
+    for (size_t i = 0; i < units.size(); ++i)
+        mzconv_put_word(buf, units[i]);
+}
+
+BOOL mzconv_get_text(const std::string& body, std::wstring& str)
+{
+    if (body.size() % 2)
+        return FALSE;
+    if (body.empty()) {
+        str.clear();
+        return TRUE;
+    }
+    mzconv_from_utf16(str, (const BYTE *)&body[0], body.size() / 2);
+    return TRUE;
+}
+
+void mzconv_put_result(std::string& buf, const MzConvResult& result)
+{
+    size_t cClauses = result.clauses.size();
+    if (cClauses > 0xFFFF)
+        cClauses = 0xFFFF;
+    mzconv_put_word(buf, (WORD)cClauses);
+    for (size_t i = 0; i < cClauses; ++i) {
+        const MzConvClause& clause = result.clauses[i];
+        size_t cCands = clause.candidates.size();
+        if (cCands > 0xFFFF)
+            cCands = 0xFFFF;
+        mzconv_put_word(buf, (WORD)cCands);
+        for (size_t k = 0; k < cCands; ++k) {
+            const MzConvCandidate& cand = clause.candidates[k];
+            mzconv_put_string(buf, cand.pre);
+            mzconv_put_string(buf, cand.post);
+            mzconv_put_word(buf, (WORD)cand.bunrui);
+            mzconv_put_word(buf, (WORD)cand.katsuyou);
+            mzconv_put_dword(buf, (DWORD)cand.cost);
+            mzconv_put_dword(buf, (DWORD)cand.word_cost);
+            mzconv_put_dword(buf, cand.tags);
+        }
+    }
+}
+
+BOOL mzconv_get_result(const std::string& body, MzConvResult& result)
+{
+    result.clear();
+
+    MZCONV_READER reader;
+    reader.pb = (const BYTE *)body.data();
+    reader.cb = body.size();
+    reader.ib = 0;
+
+    WORD cClauses;
+    if (!reader.GetWord(cClauses))
+        return FALSE;
+    result.clauses.resize(cClauses);
+    for (WORD i = 0; i < cClauses; ++i) {
+        MzConvClause& clause = result.clauses[i];
+        WORD cCands;
+        if (!reader.GetWord(cCands))
+            return FALSE;
+        clause.candidates.resize(cCands);
+        for (WORD k = 0; k < cCands; ++k) {
+            MzConvCandidate& cand = clause.candidates[k];
+            WORD bunrui, katsuyou;
+            DWORD cost, word_cost;
+            if (!reader.GetString(cand.pre) || !reader.GetString(cand.post) ||
+                !reader.GetWord(bunrui) || !reader.GetWord(katsuyou) ||
+                !reader.GetDWord(cost) || !reader.GetDWord(word_cost) ||
+                !reader.GetDWord(cand.tags))
+            {
+                return FALSE;
+            }
+            cand.bunrui = (HinshiBunrui)bunrui;
+            cand.bunruis.insert(cand.bunrui);
+            cand.katsuyou = (KatsuyouKei)katsuyou;
+            cand.cost = (INT)cost;
+            cand.word_cost = (INT)word_cost;
+        }
+    }
+    return reader.ib == reader.cb;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzConvServer - 変換サーバー。
+// 接続ごとに読み込み用のスレッドがあり、要求を待ち行列に入れる。
+// ワーカーは待ち行列からまとめて取り出して変換し、応答を返す。
+// 待ち行列にある同じ要求は一つにまとめ、一度だけ変換する。
+
+// 接続。要求が残っている間は参照カウントで生かしておく。
+struct MzConvServer::Connection {
+    MzConvServer *pServer;
+    HANDLE hChannel;
+    HANDLE hWriteLock;      // 応答の書き込みの排他制御。
+    volatile LONG nRefCount;
+};
+
+// 要求。同じ要求を待っている相手が複数いることがある。
+struct MzConvServer::Request {
+    struct Target {
+        Connection *conn;
+        DWORD dwId;
+    };
+    WORD wType;
+    std::wstring text;
+    std::vector<Target> targets;
+};
+
+// 待ち行列の中の要求を探すためのキー。要求の種類と文字列からなる。
+static std::wstring mzconv_request_key(WORD wType, const std::wstring& text)
+{
+    std::wstring key;
+    key += (WCHAR)(L'0' + wType);
+    key += text;
+    return key;
+}
+
+MzConvServer::MzConvServer(MzConverter *pConverter)
+    : m_nRequests(0)
+    , m_nBatches(0)
+    , m_nCoalesced(0)
+    , m_pConverter(pConverter)
+    , m_hListen(NULL)
+    , m_nThreads(0)
+    , m_bStopping(FALSE)
+{
+    m_hLock = mz_mutex_open(NULL);
+    m_hWake = mz_event_create(FALSE);
+    m_hIdle = mz_event_create(TRUE);
+}
+
+MzConvServer::~MzConvServer()
+{
+    Stop();
+    mz_event_close(m_hIdle);
+    mz_event_close(m_hWake);
+    mz_mutex_close(m_hLock);
+}
+
+BOOL MzConvServer::Start(LPCWSTR name, DWORD dwWorkers)
+{
+    if (m_hListen)
+        return FALSE;
+
+    // 関数内の静的変数の初期化はスレッドセーフではないので、先に一度変換しておく。
+    MzConvResult result;
+    m_pConverter->ConvertMultiClause(L"へんかん", result);
+    m_pConverter->ConvertSingleClause(L"へんかん", result);
+
+    m_hListen = mz_channel_listen(name);
+    if (!m_hListen) {
+        EPRINTW(L"mz_channel_listen(%s) failed\n", name);
+        return FALSE;
+    }
+
+    if (dwWorkers == 0)
+        dwWorkers = mz_get_processor_count();
+    if (dwWorkers > MZCONV_MAX_WORKERS)
+        dwWorkers = MZCONV_MAX_WORKERS;
+    if (dwWorkers == 0)
+        dwWorkers = 1;
+
+    for (DWORD i = 0; i < dwWorkers; ++i) {
+        if (!StartThread(WorkProc, this))
+            break;
+    }
+    if (m_nThreads == 0 || !StartThread(AcceptProc, this)) {
+        Stop();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void MzConvServer::Stop()
+{
+    if (!m_hListen)
+        return;
+
+    // 待ち受けと読み込みを中断させる。
+    mz_mutex_lock(m_hLock, INFINITE);
+    InterlockedExchange(&m_bStopping, TRUE);
+    mz_channel_shutdown(m_hListen);
+    for (size_t i = 0; i < m_connections.size(); ++i)
+        mz_channel_shutdown(m_connections[i]->hChannel);
+    mz_mutex_unlock(m_hLock);
+
+    // ワーカーを起こして、すべてのスレッドの終了を待つ。
+    mz_event_set(m_hWake);
+    if (m_nThreads > 0)
+        mz_event_wait(m_hIdle, INFINITE);
+
+    // 残った要求を捨てる。
+    while (!m_queue.empty()) {
+        Request *req = m_queue.front();
+        m_queue.pop_front();
+        for (size_t i = 0; i < req->targets.size(); ++i)
+            Release(req->targets[i].conn);
+        delete req;
+    }
+    m_pending.clear();
+
+    mz_channel_close(m_hListen);
+    m_hListen = NULL;
+}
+
+BOOL MzConvServer::StartThread(LPTHREAD_START_ROUTINE fn, LPVOID param)
+{
+    InterlockedIncrement(&m_nThreads);
+    if (!mz_create_thread(fn, param)) {
+        EndThread();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void MzConvServer::EndThread()
+{
+    if (InterlockedDecrement(&m_nThreads) == 0)
+        mz_event_set(m_hIdle);
+}
+
+void MzConvServer::Release(Connection *conn)
+{
+    if (InterlockedDecrement(&conn->nRefCount) != 0)
+        return;
+    mz_channel_close(conn->hChannel);
+    mz_mutex_close(conn->hWriteLock);
+    delete conn;
+}
+
+// 応答を返す。相手が切断していれば何もしない。
+void MzConvServer::Reply(Connection *conn, DWORD dwId, WORD wType, const std::string& body)
+{
+    std::string buf;
+    buf.reserve(MZCONV_HEADER_SIZE + body.size());
+    mzconv_put_header(buf, dwId, wType, (DWORD)body.size());
+    buf += body;
+
+    mz_mutex_lock(conn->hWriteLock, INFINITE);
+    mz_channel_write(conn->hChannel, buf.data(), (DWORD)buf.size());
+    mz_mutex_unlock(conn->hWriteLock);
+}
+
+// 待ち受けのスレッド。
+void MzConvServer::AcceptLoop()
+{
+    for (;;) {
+        HANDLE hChannel = mz_channel_accept(m_hListen);
+        if (!hChannel) {
+            if (!m_bStopping)
+                EPRINTA("mz_channel_accept failed\n");
+            break;
+        }
+
+        Connection *conn = new Connection;
+        conn->pServer = this;
+        conn->hChannel = hChannel;
+        conn->hWriteLock = mz_mutex_open(NULL);
+        conn->nRefCount = 1;
+
+        // Stopと行き違わないように、ロックしたまま確認して登録する。
+        mz_mutex_lock(m_hLock, INFINITE);
+        BOOL bStopping = m_bStopping;
+        if (!bStopping)
+            m_connections.push_back(conn);
+        mz_mutex_unlock(m_hLock);
+        if (bStopping) {
+            Release(conn);
+            break;
+        }
+
+        if (!StartThread(ReadProc, conn)) {
+            mz_mutex_lock(m_hLock, INFINITE);
+            m_connections.pop_back();
+            mz_mutex_unlock(m_hLock);
+            Release(conn);
+        }
+    }
+}
+
+// 接続ごとの読み込みのスレッド。
+void MzConvServer::ReadLoop(Connection *conn)
+{
+    BYTE abHeader[MZCONV_HEADER_SIZE];
+    std::string body;
+    while (!m_bStopping) {
+        MZCONV_HEADER header;
+        if (!mz_channel_read(conn->hChannel, abHeader, sizeof(abHeader), INFINITE))
+            break;
+        if (!mzconv_get_header(abHeader, header)) {
+            EPRINTA("bad header\n");
+            break; // 通信規約に従わない相手は切る。
+        }
+        body.resize(header.cbBody);
+        if (header.cbBody &&
+            !mz_channel_read(conn->hChannel, &body[0], header.cbBody, INFINITE))
+        {
+            break;
+        }
+        InterlockedIncrement(&m_nRequests);
+
+        std::wstring text;
+        if (header.wType == MZCONV_PING) {
+            Reply(conn, header.dwId, MZCONV_REPLY, std::string());
+            continue;
+        }
+        if ((header.wType != MZCONV_MULTI && header.wType != MZCONV_SINGLE) ||
+            !mzconv_get_text(body, text))
+        {
+            Reply(conn, header.dwId, MZCONV_ERROR, std::string());
+            continue;
+        }
+
+        Request::Target target;
+        target.conn = conn;
+        target.dwId = header.dwId;
+        InterlockedIncrement(&conn->nRefCount);
+
+        // 同じ要求が待ち行列にあれば相乗りする。
+        std::wstring key = mzconv_request_key(header.wType, text);
+        mz_mutex_lock(m_hLock, INFINITE);
+        std::map<std::wstring, Request *>::iterator it = m_pending.find(key);
+        if (it != m_pending.end()) {
+            it->second->targets.push_back(target);
+            InterlockedIncrement(&m_nCoalesced);
+        } else {
+            Request *req = new Request;
+            req->wType = header.wType;
+            req->text.swap(text);
+            req->targets.push_back(target);
+            m_queue.push_back(req);
+            m_pending[key] = req;
+        }
+        mz_mutex_unlock(m_hLock);
+        mz_event_set(m_hWake);
+    }
+
+    mz_mutex_lock(m_hLock, INFINITE);
+    for (size_t i = 0; i < m_connections.size(); ++i) {
+        if (m_connections[i] == conn) {
+            m_connections.erase(m_connections.begin() + i);
+            break;
+        }
+    }
+    mz_mutex_unlock(m_hLock);
+    Release(conn);
+}
+
+// ワーカーのスレッド。
+void MzConvServer::WorkLoop()
+{
+    std::vector<Request *> batch;
+    for (;;) {
+        mz_event_wait(m_hWake, INFINITE);
+        if (m_bStopping) {
+            mz_event_set(m_hWake); // 次のワーカーも終わらせる。
+            break;
+        }
+
+        // 待ち行列が空になるまで、まとめて取り出して処理する。
+        for (;;) {
+            batch.clear();
+            mz_mutex_lock(m_hLock, INFINITE);
+            while (batch.size() < MZCONV_BATCH_MAX && !m_queue.empty()) {
+                Request *req = m_queue.front();
+                m_queue.pop_front();
+                m_pending.erase(mzconv_request_key(req->wType, req->text));
+                batch.push_back(req);
+            }
+            BOOL bMore = !m_queue.empty();
+            mz_mutex_unlock(m_hLock);
+
+            if (bMore)
+                mz_event_set(m_hWake); // 残りは他のワーカーにも手伝わせる。
+            if (batch.empty() || m_bStopping)
+                break;
+
+            ProcessBatch(batch);
+        }
+
+        // 取り出したが処理しなかった要求を捨てる。
+        for (size_t i = 0; i < batch.size(); ++i) {
+            for (size_t k = 0; k < batch[i]->targets.size(); ++k)
+                Release(batch[i]->targets[k].conn);
+            delete batch[i];
+        }
+        batch.clear();
+    }
+    EndThread();
+}
+
+// まとめて取り出した要求を変換して、応答を返す。
+void MzConvServer::ProcessBatch(std::vector<Request *>& batch)
+{
+    InterlockedIncrement(&m_nBatches);
+
+    std::string body;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        Request *req = batch[i];
+
+        MzConvResult result;
+        BOOL ret;
+        if (req->wType == MZCONV_SINGLE)
+            ret = m_pConverter->ConvertSingleClause(req->text, result);
+        else
+            ret = m_pConverter->ConvertMultiClause(req->text, result);
+
+        body.clear();
+        if (ret)
+            mzconv_put_result(body, result);
+        for (size_t k = 0; k < req->targets.size(); ++k) {
+            Request::Target& target = req->targets[k];
+            Reply(target.conn, target.dwId, (ret ? MZCONV_REPLY : MZCONV_ERROR), body);
+            Release(target.conn);
+        }
+        delete req;
+    }
+    batch.clear();
+}
+
+DWORD WINAPI MzConvServer::AcceptProc(LPVOID lpParam)
+{
+    MzConvServer *pThis = (MzConvServer *)lpParam;
+    pThis->AcceptLoop();
+    pThis->EndThread();
+    return 0;
+}
+
+DWORD WINAPI MzConvServer::ReadProc(LPVOID lpParam)
+{
+    Connection *conn = (Connection *)lpParam;
+    MzConvServer *pThis = conn->pServer;
+    pThis->ReadLoop(conn);
+    pThis->EndThread();
+    return 0;
+}
+
+DWORD WINAPI MzConvServer::WorkProc(LPVOID lpParam)
+{
+    MzConvServer *pThis = (MzConvServer *)lpParam;
+    pThis->WorkLoop();
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzConvClient - 変換サーバーのクライアント。
+
+MzConvClient::MzConvClient()
+    : m_dwTimeout(5000)
+    , m_hChannel(NULL)
+    , m_dwNextId(1)
+{
+}
+
+MzConvClient::~MzConvClient()
+{
+    Close();
+}
+
+BOOL MzConvClient::Connect(LPCWSTR name)
+{
+    Close();
+    m_hChannel = mz_channel_connect(name);
+    return m_hChannel != NULL;
+}
+
+void MzConvClient::Close()
+{
+    if (m_hChannel) {
+        mz_channel_close(m_hChannel);
+        m_hChannel = NULL;
+    }
+}
+
+BOOL MzConvClient::Send(WORD wType, const std::wstring& str, DWORD *pdwId)
+{
+    if (!m_hChannel)
+        return FALSE;
+
+    std::string body;
+    mzconv_put_text(body, str);
+    if (body.size() > MZCONV_MAX_BODY)
+        return FALSE;
+
+    DWORD dwId = m_dwNextId++;
+    std::string buf;
+    mzconv_put_header(buf, dwId, wType, (DWORD)body.size());
+    buf += body;
+    if (!mz_channel_write(m_hChannel, buf.data(), (DWORD)buf.size())) {
+        Close();
+        return FALSE;
+    }
+    if (pdwId)
+        *pdwId = dwId;
+    return TRUE;
+}
+
+BOOL MzConvClient::Receive(DWORD *pdwId, WORD *pwType, MzConvResult& result)
+{
+    if (!m_hChannel)
+        return FALSE;
+
+    // 途中で失敗すると続きが読めなくなるので、切断する。
+    BYTE abHeader[MZCONV_HEADER_SIZE];
+    MZCONV_HEADER header;
+    std::string body;
+    if (!mz_channel_read(m_hChannel, abHeader, sizeof(abHeader), m_dwTimeout) ||
+        !mzconv_get_header(abHeader, header))
+    {
+        Close();
+        return FALSE;
+    }
+    body.resize(header.cbBody);
+    if (header.cbBody && !mz_channel_read(m_hChannel, &body[0], header.cbBody, m_dwTimeout)) {
+        Close();
+        return FALSE;
+    }
+
+    result.clear();
+    if (header.wType == MZCONV_REPLY && body.size() && !mzconv_get_result(body, result)) {
+        Close();
+        return FALSE;
+    }
+    if (pdwId)
+        *pdwId = header.dwId;
+    if (pwType)
+        *pwType = header.wType;
+    return TRUE;
+}
+
+BOOL MzConvClient::Call(WORD wType, const std::wstring& str, MzConvResult& result)
+{
+    DWORD dwId;
+    if (!Send(wType, str, &dwId))
+        return FALSE;
+
+    // 先に送った要求の応答は読み捨てる。
+    DWORD dwGotId;
+    WORD wGotType;
+    do {
+        if (!Receive(&dwGotId, &wGotType, result))
+            return FALSE;
+    } while (dwGotId != dwId);
+    return wGotType == MZCONV_REPLY;
+}
+
+BOOL MzConvClient::ConvertMultiClause(const std::wstring& str, MzConvResult& result)
+{
+    return Call(MZCONV_MULTI, str, result);
+}
+
+BOOL MzConvClient::ConvertSingleClause(const std::wstring& str, MzConvResult& result)
+{
+    return Call(MZCONV_SINGLE, str, result);
+}
+
+BOOL MzConvClient::Ping()
+{
+    MzConvResult result;
+    return Call(MZCONV_PING, L"", result);
+}
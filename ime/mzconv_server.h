@@ -0,0 +1,135 @@
+﻿// mzconv_server.h --- mzimeja conversion server and client
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 変換サーバー（mzconvd）の通信規約とサーバー・クライアント。
+// 辞書とキャッシュを一つのプロセスに置き、複数のアプリからの変換要求を
+// まとめてワーカーで処理する。
+
+#pragma once
+
+#include "mzconv.h"
+#include <deque>            // for std::deque
+
+//////////////////////////////////////////////////////////////////////////////
+// 通信規約。数値はすべてリトルエンディアン。
+//
+// 要求・応答とも、MZCONV_HEADERに続いてcbBodyバイトの本体が来る。
+// 要求の本体は変換前の文字列（UTF-16）。
+// 応答の本体は変換結果:
+//   WORD 文節数, 文節ごとに { WORD 候補数, 候補ごとに
+//     { 文字列 pre, 文字列 post, WORD bunrui, WORD katsuyou,
+//       LONG cost, LONG word_cost, DWORD tags } }
+//   文字列は WORD 長さ（UTF-16の単位）とUTF-16の並び。
+// 応答はdwIdで要求と対応させる。順番は要求の順とは限らない。
+
+#define MZCONV_PIPE_NAME    L"mzimeja-conv"     // 既定の通信路の名前。
+#define MZCONV_MAGIC        0x564E435A          // "ZCNV"
+#define MZCONV_MAX_BODY     (1024 * 1024)       // 本体の最大バイト数。
+#define MZCONV_BATCH_MAX    16                  // 一度にまとめる要求の最大数。
+#define MZCONV_MAX_WORKERS  8                   // ワーカーの最大数。
+
+// 要求と応答の種類。
+enum MZCONV_TYPE {
+    MZCONV_PING = 0,        // 生存確認。空の応答を返す。
+    MZCONV_MULTI = 1,       // 複数文節変換。
+    MZCONV_SINGLE = 2,      // 単一文節変換。
+    MZCONV_REPLY = 0x80,    // 応答。
+    MZCONV_ERROR = 0x81     // 失敗の応答。
+};
+
+struct MZCONV_HEADER {
+    DWORD dwMagic;          // MZCONV_MAGIC
+    DWORD dwId;             // 要求の番号。応答にそのまま返す。
+    WORD wType;             // MZCONV_TYPE
+    WORD wFlags;            // 予約。0にする。
+    DWORD cbBody;           // 本体のバイト数。
+};
+
+// 符号化と復号。
+void mzconv_put_header(std::string& buf, DWORD dwId, WORD wType, DWORD cbBody);
+BOOL mzconv_get_header(const BYTE *pb, MZCONV_HEADER& header);
+void mzconv_put_text(std::string& buf, const std::wstring& str);
+BOOL mzconv_get_text(const std::string& body, std::wstring& str);
+void mzconv_put_result(std::string& buf, const MzConvResult& result);
+BOOL mzconv_get_result(const std::string& body, MzConvResult& result);
+
+#define MZCONV_HEADER_SIZE  16  // 符号化したヘッダーのバイト数。
+
+//////////////////////////////////////////////////////////////////////////////
+// MzConvServer - 変換サーバー。
+
+class MzConvServer {
+public:
+    MzConvServer(MzConverter *pConverter);
+    ~MzConvServer();
+
+    // 待ち受けを始める。dwWorkersが0ならCPUの数から決める。
+    BOOL Start(LPCWSTR name, DWORD dwWorkers = 0);
+    // 止める。すべてのスレッドが終わるまで待つ。
+    void Stop();
+
+    // 統計。
+    volatile LONG m_nRequests;  // 受け取った要求の数。
+    volatile LONG m_nBatches;   // 処理したバッチの数。
+    volatile LONG m_nCoalesced; // 同じ要求をまとめて変換を省いた数。
+
+protected:
+    struct Connection;
+    struct Request;
+
+    MzConverter *m_pConverter;
+    HANDLE m_hListen;               // 待ち受けの通信路。
+    HANDLE m_hLock;                 // 待ち行列と接続一覧の排他制御。
+    HANDLE m_hWake;                 // 要求が来たらワーカーを起こす。
+    HANDLE m_hIdle;                 // すべてのスレッドが終わったらシグナル状態。
+    std::deque<Request *> m_queue;  // 要求の待ち行列。
+    std::map<std::wstring, Request *> m_pending; // 待ち行列の要求の索引。
+    std::vector<Connection *> m_connections;
+    volatile LONG m_nThreads;       // 動いているスレッドの数。
+    volatile LONG m_bStopping;      // 止めている途中か？
+
+    BOOL StartThread(LPTHREAD_START_ROUTINE fn, LPVOID param);
+    void EndThread();
+    void Release(Connection *conn);
+    void Reply(Connection *conn, DWORD dwId, WORD wType, const std::string& body);
+    void ProcessBatch(std::vector<Request *>& batch);
+
+    void AcceptLoop();
+    void ReadLoop(Connection *conn);
+    void WorkLoop();
+    static DWORD WINAPI AcceptProc(LPVOID lpParam);
+    static DWORD WINAPI ReadProc(LPVOID lpParam);
+    static DWORD WINAPI WorkProc(LPVOID lpParam);
+}; // class MzConvServer
+
+//////////////////////////////////////////////////////////////////////////////
+// MzConvClient - 変換サーバーのクライアント。
+
+class MzConvClient {
+public:
+    MzConvClient();
+    ~MzConvClient();
+
+    BOOL Connect(LPCWSTR name = MZCONV_PIPE_NAME);
+    void Close();
+    BOOL IsConnected() const { return m_hChannel != NULL; }
+
+    // 応答のタイムアウト（ミリ秒）。
+    DWORD m_dwTimeout;
+
+    // 要求を送って応答を待つ。
+    BOOL ConvertMultiClause(const std::wstring& str, MzConvResult& result);
+    BOOL ConvertSingleClause(const std::wstring& str, MzConvResult& result);
+    BOOL Ping();
+
+    // 要求を送る。応答はReceiveで受け取る（続けて何件も送ってよい）。
+    BOOL Send(WORD wType, const std::wstring& str, DWORD *pdwId);
+    // 応答を一つ受け取る。
+    BOOL Receive(DWORD *pdwId, WORD *pwType, MzConvResult& result);
+
+protected:
+    HANDLE m_hChannel;
+    DWORD m_dwNextId;
+
+    BOOL Call(WORD wType, const std::wstring& str, MzConvResult& result);
+}; // class MzConvClient
@@ -0,0 +1,353 @@
+﻿// platform.h --- mzimeja platform layer
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 変換エンジン（mzconv_core）が使うOS依存の機能。
+// 実装はplatform_win32.cppとplatform_posix.cppにある。
+// Windows以外では、変換エンジンが使う範囲でWin32の型と関数も用意する。
+
+#pragma once
+
+#include <string>           // for std::wstring
+
+#ifdef _WIN32
+    #include "../targetver.h"   // target Windows version
+    #ifndef _INC_WINDOWS
+        #include <windows.h>    // Windows
+    #endif
+    #include <tchar.h>          // for Windows generic text
+    #include <shlwapi.h>        // Shell Light-Weight API
+    #include <strsafe.h>        // for StringC... functions
+#else
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <wchar.h>
+    #include <wctype.h>
+    #include <stdarg.h>
+
+//////////////////////////////////////////////////////////////////////////////
+// Win32の型とマクロ。
+
+typedef int             BOOL;
+typedef short           SHORT;
+typedef int             INT;
+typedef unsigned int    UINT;
+typedef long            LONG;
+typedef unsigned long   ULONG;
+typedef uint8_t         BYTE;
+typedef uint16_t        WORD;
+typedef uint32_t        DWORD;
+typedef int64_t         LONGLONG;
+typedef uint64_t        ULONGLONG;
+typedef intptr_t        INT_PTR;
+typedef uintptr_t       UINT_PTR;
+typedef size_t          SIZE_T;
+typedef char            CHAR;
+typedef wchar_t         WCHAR;
+typedef wchar_t         TCHAR;
+typedef void           *HANDLE;
+typedef void           *LPVOID;
+typedef const void     *LPCVOID;
+typedef BYTE           *LPBYTE;
+typedef char           *LPSTR;
+typedef const char     *LPCSTR;
+typedef WCHAR          *LPWSTR;
+typedef const WCHAR    *LPCWSTR;
+typedef TCHAR          *LPTSTR;
+typedef const TCHAR    *LPCTSTR;
+typedef DWORD          *LPDWORD;
+typedef LONG            HRESULT;
+typedef void            VOID;
+
+#define TRUE    1
+#define FALSE   0
+#define CALLBACK
+#define WINAPI
+#define TEXT(str)   L##str
+#define _T(str)     L##str
+#define MAX_PATH    260
+#define MAXLONG     0x7FFFFFFF
+#define MAXWORD     0xFFFF
+#define INFINITE    0xFFFFFFFF
+#define S_OK        ((HRESULT)0)
+#define CP_UTF8     65001
+
+#define MAKEWORD(a, b)  ((WORD)(((BYTE)(a)) | (((WORD)((BYTE)(b))) << 8)))
+#define LOBYTE(w)       ((BYTE)((w) & 0xFF))
+#define HIBYTE(w)       ((BYTE)(((WORD)(w) >> 8) & 0xFF))
+#define LOWORD(l)       ((WORD)((l) & 0xFFFF))
+#define HIWORD(l)       ((WORD)(((DWORD)(l) >> 16) & 0xFFFF))
+#define MAKELONG(a, b)  ((LONG)(((WORD)(a)) | ((DWORD)((WORD)(b))) << 16))
+#define ZeroMemory(p, cb)   memset((p), 0, (cb))
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpThreadParameter);
+
+// LCMapStringWのフラグ。
+#define LCMAP_LOWERCASE     0x00000100
+#define LCMAP_UPPERCASE     0x00000200
+#define LCMAP_HIRAGANA      0x00100000
+#define LCMAP_KATAKANA      0x00200000
+#define LCMAP_HALFWIDTH     0x00400000
+#define LCMAP_FULLWIDTH     0x00800000
+
+// 仮想キーコード。
+#define VK_BACK         0x08
+#define VK_RETURN       0x0D
+#define VK_SHIFT        0x10
+#define VK_CONTROL      0x11
+#define VK_MENU         0x12
+#define VK_CAPITAL      0x14
+#define VK_ESCAPE       0x1B
+#define VK_CONVERT      0x1C
+#define VK_NONCONVERT   0x1D
+#define VK_SPACE        0x20
+#define VK_LEFT         0x25
+#define VK_UP           0x26
+#define VK_RIGHT        0x27
+#define VK_DOWN         0x28
+#define VK_DELETE       0x2E
+#define VK_NUMPAD0      0x60
+#define VK_NUMPAD1      0x61
+#define VK_NUMPAD2      0x62
+#define VK_NUMPAD3      0x63
+#define VK_NUMPAD4      0x64
+#define VK_NUMPAD5      0x65
+#define VK_NUMPAD6      0x66
+#define VK_NUMPAD7      0x67
+#define VK_NUMPAD8      0x68
+#define VK_NUMPAD9      0x69
+#define VK_MULTIPLY     0x6A
+#define VK_ADD          0x6B
+#define VK_SEPARATOR    0x6C
+#define VK_SUBTRACT     0x6D
+#define VK_DECIMAL      0x6E
+#define VK_DIVIDE       0x6F
+#define VK_OEM_1        0xBA
+#define VK_OEM_PLUS     0xBB
+#define VK_OEM_COMMA    0xBC
+#define VK_OEM_MINUS    0xBD
+#define VK_OEM_PERIOD   0xBE
+#define VK_OEM_2        0xBF
+#define VK_OEM_3        0xC0
+#define VK_OEM_4        0xDB
+#define VK_OEM_5        0xDC
+#define VK_OEM_6        0xDD
+#define VK_OEM_7        0xDE
+#define VK_OEM_102      0xE2
+
+// 日時。
+typedef struct _SYSTEMTIME {
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME, *LPSYSTEMTIME;
+
+typedef struct _FILETIME {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME, *LPFILETIME;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        int32_t HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+//////////////////////////////////////////////////////////////////////////////
+// Win32の関数。
+
+inline LONG InterlockedIncrement(volatile LONG *p) { return __sync_add_and_fetch(p, 1); }
+inline LONG InterlockedDecrement(volatile LONG *p) { return __sync_sub_and_fetch(p, 1); }
+inline LONG InterlockedExchange(volatile LONG *p, LONG value) {
+    __sync_synchronize();
+    return __sync_lock_test_and_set(p, value);
+}
+inline LONG InterlockedCompareExchange(volatile LONG *p, LONG exchange, LONG comparand) {
+    return __sync_val_compare_and_swap(p, comparand, exchange);
+}
+inline LPVOID InterlockedExchangePointer(LPVOID volatile *p, LPVOID value) {
+    __sync_synchronize();
+    return __sync_lock_test_and_set(p, value);
+}
+
+inline int lstrcmpA(LPCSTR psz1, LPCSTR psz2) { return strcmp(psz1, psz2); }
+inline int lstrcmpW(LPCWSTR psz1, LPCWSTR psz2) { return wcscmp(psz1, psz2); }
+inline int lstrlenW(LPCWSTR psz) { return (int)wcslen(psz); }
+inline BOOL IsCharAlphaW(WCHAR ch) { return iswalpha(ch) != 0; }
+
+extern "C" {
+
+void GetLocalTime(LPSYSTEMTIME pst);
+BOOL SystemTimeToFileTime(const SYSTEMTIME *pst, LPFILETIME pft);
+BOOL FileTimeToSystemTime(const FILETIME *pft, LPSYSTEMTIME pst);
+DWORD GetTickCount(void);
+BOOL GetUserNameW(LPWSTR pszName, LPDWORD pcchName);
+
+// CP_UTF8と932（Shift_JIS）だけに対応する。
+int MultiByteToWideChar(UINT uCodePage, DWORD dwFlags, LPCSTR psz, int cch,
+                        LPWSTR pszWide, int cchWide);
+int WideCharToMultiByte(UINT uCodePage, DWORD dwFlags, LPCWSTR pszWide, int cchWide,
+                        LPSTR psz, int cch, LPCSTR pszDefault, BOOL *pbUsedDefault);
+
+// 書式の%sと%cは、Windowsと同じく文字列と同じ幅の文字として扱う。
+HRESULT StringCchVPrintfW(LPWSTR psz, size_t cch, LPCWSTR pszFormat, va_list va);
+HRESULT StringCchPrintfW(LPWSTR psz, size_t cch, LPCWSTR pszFormat, ...);
+HRESULT StringCchVPrintfA(LPSTR psz, size_t cch, LPCSTR pszFormat, va_list va);
+HRESULT StringCchPrintfA(LPSTR psz, size_t cch, LPCSTR pszFormat, ...);
+HRESULT StringCchCopyW(LPWSTR psz, size_t cch, LPCWSTR pszSrc);
+HRESULT StringCchCatW(LPWSTR psz, size_t cch, LPCWSTR pszSrc);
+
+LPSTR StrTrimA(LPSTR psz, LPCSTR pszTrimChars);
+FILE *_wfopen(const wchar_t *filename, const wchar_t *mode);
+
+} // extern "C"
+
+#define StringCchPrintf StringCchPrintfW
+#define StringCchVPrintf StringCchVPrintfW
+#define StringCchCopy StringCchCopyW
+#define StringCchCat StringCchCatW
+
+#endif  // ndef _WIN32
+
+//////////////////////////////////////////////////////////////////////////////
+// プラットフォーム層。
+
+extern "C" {
+
+// 共有メモリ（名前付きファイルマッピング）。
+// 同じ名前で開くと同じメモリを共有する。新しく作成したときは*pbCreatedがTRUEになる。
+HANDLE mz_shmem_open(LPCWSTR name, DWORD cbSize, BOOL *pbCreated);
+void *mz_shmem_map(HANDLE hShmem, DWORD cbSize);
+void mz_shmem_unmap(void *pv, DWORD cbSize);
+void mz_shmem_close(HANDLE hShmem);
+
+// 名前付きミューテックス。
+HANDLE mz_mutex_open(LPCWSTR name);
+BOOL mz_mutex_lock(HANDLE hMutex, DWORD dwMilliseconds);
+void mz_mutex_unlock(HANDLE hMutex);
+void mz_mutex_close(HANDLE hMutex);
+
+// イベントとスレッドプール。
+HANDLE mz_event_create(BOOL bManualReset);
+void mz_event_set(HANDLE hEvent);
+void mz_event_reset(HANDLE hEvent);
+BOOL mz_event_wait(HANDLE hEvent, DWORD dwMilliseconds);
+void mz_event_close(HANDLE hEvent);
+BOOL mz_queue_work_item(LPTHREAD_START_ROUTINE fn, LPVOID param);
+DWORD mz_get_processor_count(void);
+// ほかのスレッドに実行を譲る。
+void mz_yield(void);
+// 長く動くスレッドを作る。スレッドプールを使わない。
+// スレッドが動いている間、このモジュール（DLL）は解放されない。
+BOOL mz_create_thread(LPTHREAD_START_ROUTINE fn, LPVOID param);
+
+// 時間を計るための、単調に増える時刻（マイクロ秒）。
+ULONGLONG mz_get_microseconds(void);
+
+// ローカルの通信路。WindowsはNamed Pipe、POSIXはUnixドメインソケット。
+// 読み書きは別々のスレッドから同時に行ってよい。
+HANDLE mz_channel_listen(LPCWSTR name);
+HANDLE mz_channel_accept(HANDLE hListen); // 接続を待つ。
+HANDLE mz_channel_connect(LPCWSTR name);
+// ちょうどcbバイトを読む。切断、タイムアウト、シャットダウンのときはFALSE。
+BOOL mz_channel_read(HANDLE hChannel, void *pv, DWORD cb, DWORD dwMilliseconds);
+BOOL mz_channel_write(HANDLE hChannel, const void *pv, DWORD cb);
+// 待っているacceptやreadを中断させる。ハンドルは閉じない。
+void mz_channel_shutdown(HANDLE hChannel);
+void mz_channel_close(HANDLE hChannel);
+
+// ファイル。
+DWORD mz_get_file_size(LPCWSTR file_name);
+// UTF-16LEのファイルを読み込む。最大cch文字を読み込み、読み込んだ文字数を返す。
+// WCHARが32ビットでも、UTF-16の単位を一つずつ入れる（サロゲートペアはそのまま）。
+// 辞書の索引の位置がOSによらず同じになる。
+size_t mz_read_utf16_file(LPCWSTR file_name, WCHAR *pch, size_t cch);
+// 実行ファイルの近くのファイルを探す。
+BOOL FindLocalFile(std::wstring& path, LPCWSTR filename);
+// アプリフォルダのファイルを探す。
+BOOL FindAppFile(std::wstring& path, LPCTSTR filename);
+// ユーザーごとのデータのファイルのパスを得る。フォルダがなければ作る。
+BOOL mz_get_user_data_path(std::wstring& path, LPCWSTR filename);
+// ファイルを読み込み専用でメモリにマップする。空のファイルや失敗のときはNULL。
+const void *mz_map_file(LPCWSTR file_name, DWORD *pcbSize);
+void mz_unmap_file(const void *pv, DWORD cbSize);
+// fromをtoに移動する。toがあれば置き換える。
+BOOL mz_replace_file(LPCWSTR from, LPCWSTR to);
+
+// 設定。
+DWORD Config_GetDWORD(LPCTSTR name, DWORD dwDefault);
+BOOL Config_GetSz(LPCTSTR name, std::wstring& str, LPCWSTR def_value = L"");
+
+// リソース文字列。
+BOOL mz_load_string(UINT nID, std::wstring& str);
+
+} // extern "C"
+
+// 大文字・小文字、全角・半角、ひらがな・カタカナの変換（LCMAP_*）。
+std::wstring mz_lcmap(const std::wstring& str, DWORD dwFlags);
+
+// mz_read_utf16_fileで読み込んだUTF-16の単位の並びを文字列にする。
+// WCHARが32ビットなら、サロゲートペアを一文字にまとめる。
+inline void mz_assign_utf16(std::wstring& str, const WCHAR *pch1, const WCHAR *pch2)
+{
+#ifdef _WIN32
+    str.assign(pch1, pch2);
+#else
+    str.clear();
+    str.reserve(pch2 - pch1);
+    for (; pch1 < pch2; ++pch1) {
+        WCHAR ch = *pch1;
+        if (0xD800 <= ch && ch <= 0xDBFF && pch1 + 1 < pch2 &&
+            0xDC00 <= pch1[1] && pch1[1] <= 0xDFFF)
+        {
+            ch = 0x10000 + ((ch - 0xD800) << 10) + (pch1[1] - 0xDC00);
+            ++pch1;
+        }
+        str += ch;
+    }
+#endif
+}
+
+// mz_assign_utf16の逆。文字列をUTF-16の単位の並びにする。
+inline void mz_split_utf16(std::wstring& units, const std::wstring& str)
+{
+#ifdef _WIN32
+    units = str;
+#else
+    units.clear();
+    units.reserve(str.size());
+    for (size_t i = 0; i < str.size(); ++i) {
+        DWORD ch = (DWORD)str[i];
+        if (ch >= 0x10000) {
+            ch -= 0x10000;
+            units += (WCHAR)(0xD800 + (ch >> 10));
+            units += (WCHAR)(0xDC00 + (ch & 0x3FF));
+        } else {
+            units += (WCHAR)ch;
+        }
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+extern "C" {
+// platform_win32.cpp
+HKEY Config_OpenAppKey(VOID);
+
+// immsec.cpp
+SECURITY_ATTRIBUTES *CreateSecurityAttributes(void);
+void FreeSecurityAttributes(SECURITY_ATTRIBUTES *psa);
+BOOL IsNT(void);
+} // extern "C"
+#endif
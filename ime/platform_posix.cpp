@@ -0,0 +1,1237 @@
+﻿// platform_posix.cpp --- mzimeja platform layer for POSIX
+// (Japanese, UTF-8)
+// platform.hの機能のPOSIX（Linuxなど）版。
+// 変換エンジンだけを動かすためのもので、IMEとしての機能はない。
+// 共有メモリはプロセス内だけで共有する。設定は環境変数MZIMEJA_<名前>から読む。
+
+#include "mzconv.h"
+#include "resource.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pwd.h>
+#include <iconv.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+
+//////////////////////////////////////////////////////////////////////////////
+// 内部関数。
+
+// ワイド文字列をUTF-8に変換する。
+static std::string mz_to_utf8(const WCHAR *psz, size_t cch)
+{
+    std::string ret;
+    for (size_t i = 0; i < cch; ++i) {
+        DWORD ch = (DWORD)psz[i];
+        if (ch < 0x80) {
+            ret += (char)ch;
+        } else if (ch < 0x800) {
+            ret += (char)(0xC0 | (ch >> 6));
+            ret += (char)(0x80 | (ch & 0x3F));
+        } else if (ch < 0x10000) {
+            ret += (char)(0xE0 | (ch >> 12));
+            ret += (char)(0x80 | ((ch >> 6) & 0x3F));
+            ret += (char)(0x80 | (ch & 0x3F));
+        } else {
+            ret += (char)(0xF0 | (ch >> 18));
+            ret += (char)(0x80 | ((ch >> 12) & 0x3F));
+            ret += (char)(0x80 | ((ch >> 6) & 0x3F));
+            ret += (char)(0x80 | (ch & 0x3F));
+        }
+    }
+    return ret;
+}
+
+// UTF-8をワイド文字列に変換する。
+static std::wstring mz_from_utf8(const char *psz, size_t cb)
+{
+    std::wstring ret;
+    const BYTE *pb = (const BYTE *)psz;
+    for (size_t i = 0; i < cb; ) {
+        DWORD ch = pb[i];
+        size_t n = 0;
+        if (ch < 0x80) {
+            n = 0;
+        } else if ((ch & 0xE0) == 0xC0) {
+            ch &= 0x1F; n = 1;
+        } else if ((ch & 0xF0) == 0xE0) {
+            ch &= 0x0F; n = 2;
+        } else if ((ch & 0xF8) == 0xF0) {
+            ch &= 0x07; n = 3;
+        } else {
+            ret += L'?';
+            ++i;
+            continue;
+        }
+        ++i;
+        for (; n > 0 && i < cb && (pb[i] & 0xC0) == 0x80; --n, ++i)
+            ch = (ch << 6) | (pb[i] & 0x3F);
+        ret += (WCHAR)ch;
+    }
+    return ret;
+}
+
+// ファイル名をUTF-8にする。区切りの'\\'は'/'にする。
+static std::string mz_path_to_utf8(LPCWSTR pszPath)
+{
+    std::wstring path = pszPath;
+    for (size_t i = 0; i < path.size(); ++i) {
+        if (path[i] == L'\\')
+            path[i] = L'/';
+    }
+    return mz_to_utf8(path.c_str(), path.size());
+}
+
+// 変換結果をバッファに書き込む。cchDestが0なら必要な長さを返す。
+template <typename T_CHAR, typename T_STR>
+static int mz_store_result(const T_STR& str, T_CHAR *pchDest, int cchDest)
+{
+    if (cchDest == 0)
+        return (int)str.size();
+    if ((int)str.size() > cchDest)
+        return 0;
+    memcpy(pchDest, str.c_str(), str.size() * sizeof(T_CHAR));
+    return (int)str.size();
+}
+
+// 絶対時刻を求める。
+static void mz_abs_time(struct timespec *pts, DWORD dwMilliseconds)
+{
+    clock_gettime(CLOCK_REALTIME, pts);
+    pts->tv_sec += dwMilliseconds / 1000;
+    pts->tv_nsec += (long)(dwMilliseconds % 1000) * 1000000;
+    if (pts->tv_nsec >= 1000000000) {
+        pts->tv_sec += 1;
+        pts->tv_nsec -= 1000000000;
+    }
+}
+
+extern "C" {
+
+//////////////////////////////////////////////////////////////////////////////
+// 日時。
+
+#define FILETIME_EPOCH_DIFF 11644473600LL   // 1601年から1970年までの秒数。
+
+void GetLocalTime(LPSYSTEMTIME pst)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t t = ts.tv_sec;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    pst->wYear = (WORD)(tm.tm_year + 1900);
+    pst->wMonth = (WORD)(tm.tm_mon + 1);
+    pst->wDayOfWeek = (WORD)tm.tm_wday;
+    pst->wDay = (WORD)tm.tm_mday;
+    pst->wHour = (WORD)tm.tm_hour;
+    pst->wMinute = (WORD)tm.tm_min;
+    pst->wSecond = (WORD)tm.tm_sec;
+    pst->wMilliseconds = (WORD)(ts.tv_nsec / 1000000);
+}
+
+BOOL SystemTimeToFileTime(const SYSTEMTIME *pst, LPFILETIME pft)
+{
+    struct tm tm;
+    ZeroMemory(&tm, sizeof(tm));
+    tm.tm_year = pst->wYear - 1900;
+    tm.tm_mon = pst->wMonth - 1;
+    tm.tm_mday = pst->wDay;
+    tm.tm_hour = pst->wHour;
+    tm.tm_min = pst->wMinute;
+    tm.tm_sec = pst->wSecond;
+    LONGLONG secs = (LONGLONG)timegm(&tm) + FILETIME_EPOCH_DIFF;
+    if (secs < 0)
+        return FALSE;
+    ULONGLONG value = (ULONGLONG)secs * 10000000 + (ULONGLONG)pst->wMilliseconds * 10000;
+    pft->dwLowDateTime = (DWORD)value;
+    pft->dwHighDateTime = (DWORD)(value >> 32);
+    return TRUE;
+}
+
+BOOL FileTimeToSystemTime(const FILETIME *pft, LPSYSTEMTIME pst)
+{
+    ULONGLONG value = ((ULONGLONG)pft->dwHighDateTime << 32) | pft->dwLowDateTime;
+    time_t t = (time_t)((LONGLONG)(value / 10000000) - FILETIME_EPOCH_DIFF);
+    struct tm tm;
+    if (!gmtime_r(&t, &tm))
+        return FALSE;
+    pst->wYear = (WORD)(tm.tm_year + 1900);
+    pst->wMonth = (WORD)(tm.tm_mon + 1);
+    pst->wDayOfWeek = (WORD)tm.tm_wday;
+    pst->wDay = (WORD)tm.tm_mday;
+    pst->wHour = (WORD)tm.tm_hour;
+    pst->wMinute = (WORD)tm.tm_min;
+    pst->wSecond = (WORD)tm.tm_sec;
+    pst->wMilliseconds = (WORD)((value / 10000) % 1000);
+    return TRUE;
+}
+
+DWORD GetTickCount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (DWORD)((ULONGLONG)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+BOOL GetUserNameW(LPWSTR pszName, LPDWORD pcchName)
+{
+    const char *name = getenv("USER");
+    struct passwd *pw = getpwuid(getuid());
+    if (pw && pw->pw_name)
+        name = pw->pw_name;
+    if (!name)
+        name = "";
+    std::wstring str = mz_from_utf8(name, strlen(name));
+    if (str.size() + 1 > *pcchName) {
+        *pcchName = (DWORD)(str.size() + 1);
+        return FALSE;
+    }
+    memcpy(pszName, str.c_str(), (str.size() + 1) * sizeof(WCHAR));
+    *pcchName = (DWORD)(str.size() + 1);
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 文字コード。
+
+int MultiByteToWideChar(UINT uCodePage, DWORD dwFlags, LPCSTR psz, int cch,
+                        LPWSTR pszWide, int cchWide)
+{
+    size_t cb = (cch < 0) ? strlen(psz) + 1 : (size_t)cch;
+    if (uCodePage == CP_UTF8)
+        return mz_store_result(mz_from_utf8(psz, cb), pszWide, cchWide);
+    if (uCodePage != CODEPAGE_SJIS_932)
+        return 0;
+
+    // Shift_JISはiconvで一度UTF-8にする。
+    iconv_t cd = iconv_open("UTF-8", "CP932");
+    if (cd == (iconv_t)-1)
+        return 0;
+    std::string utf8(cb * 3 + 4, 0);
+    char *pchIn = const_cast<char *>(psz), *pchOut = &utf8[0];
+    size_t cbIn = cb, cbOut = utf8.size();
+    size_t ret = iconv(cd, &pchIn, &cbIn, &pchOut, &cbOut);
+    iconv_close(cd);
+    if (ret == (size_t)-1)
+        return 0;
+    utf8.resize(utf8.size() - cbOut);
+    return mz_store_result(mz_from_utf8(utf8.c_str(), utf8.size()), pszWide, cchWide);
+}
+
+int WideCharToMultiByte(UINT uCodePage, DWORD dwFlags, LPCWSTR pszWide, int cchWide,
+                        LPSTR psz, int cch, LPCSTR pszDefault, BOOL *pbUsedDefault)
+{
+    if (pbUsedDefault)
+        *pbUsedDefault = FALSE;
+    size_t cchSrc = (cchWide < 0) ? wcslen(pszWide) + 1 : (size_t)cchWide;
+    std::string utf8 = mz_to_utf8(pszWide, cchSrc);
+    if (uCodePage == CP_UTF8)
+        return mz_store_result(utf8, psz, cch);
+    if (uCodePage != CODEPAGE_SJIS_932)
+        return 0;
+
+    iconv_t cd = iconv_open("CP932", "UTF-8");
+    if (cd == (iconv_t)-1)
+        return 0;
+    std::string sjis(utf8.size() + 4, 0);
+    char *pchIn = &utf8[0], *pchOut = &sjis[0];
+    size_t cbIn = utf8.size(), cbOut = sjis.size();
+    size_t ret = iconv(cd, &pchIn, &cbIn, &pchOut, &cbOut);
+    iconv_close(cd);
+    if (ret == (size_t)-1)
+        return 0;
+    sjis.resize(sjis.size() - cbOut);
+    return mz_store_result(sjis, psz, cch);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 文字列。
+
+// Windowsの書式をCの書式にする。ワイド文字版の%sと%cはワイド文字列。
+static std::wstring mz_fix_format(LPCWSTR pszFormat)
+{
+    std::wstring ret;
+    for (LPCWSTR pch = pszFormat; *pch; ++pch) {
+        ret += *pch;
+        if (*pch != L'%')
+            continue;
+        ++pch;
+        while (*pch && wcschr(L"-+ #0123456789.*", *pch))
+            ret += *pch++;
+        if (!*pch)
+            break;
+        if (*pch == L'h' && (pch[1] == L's' || pch[1] == L'c')) {
+            ++pch;
+            ret += *pch;
+        } else if (*pch == L's' || *pch == L'c') {
+            ret += L'l';
+            ret += *pch;
+        } else if (*pch == L'l' && (pch[1] == L's' || pch[1] == L'c')) {
+            ret += L'l';
+            ret += *++pch;
+        } else {
+            ret += *pch;
+        }
+    }
+    return ret;
+}
+
+HRESULT StringCchVPrintfW(LPWSTR psz, size_t cch, LPCWSTR pszFormat, va_list va)
+{
+    if (cch == 0)
+        return (HRESULT)-1;
+    std::wstring format = mz_fix_format(pszFormat);
+    int ret = vswprintf(psz, cch, format.c_str(), va);
+    psz[cch - 1] = 0;
+    return (ret < 0) ? (HRESULT)-1 : S_OK;
+}
+
+HRESULT StringCchPrintfW(LPWSTR psz, size_t cch, LPCWSTR pszFormat, ...)
+{
+    va_list va;
+    va_start(va, pszFormat);
+    HRESULT hr = StringCchVPrintfW(psz, cch, pszFormat, va);
+    va_end(va);
+    return hr;
+}
+
+HRESULT StringCchVPrintfA(LPSTR psz, size_t cch, LPCSTR pszFormat, va_list va)
+{
+    if (cch == 0)
+        return (HRESULT)-1;
+    int ret = vsnprintf(psz, cch, pszFormat, va);
+    return (ret < 0 || (size_t)ret >= cch) ? (HRESULT)-1 : S_OK;
+}
+
+HRESULT StringCchPrintfA(LPSTR psz, size_t cch, LPCSTR pszFormat, ...)
+{
+    va_list va;
+    va_start(va, pszFormat);
+    HRESULT hr = StringCchVPrintfA(psz, cch, pszFormat, va);
+    va_end(va);
+    return hr;
+}
+
+HRESULT StringCchCopyW(LPWSTR psz, size_t cch, LPCWSTR pszSrc)
+{
+    if (cch == 0)
+        return (HRESULT)-1;
+    size_t len = wcslen(pszSrc);
+    if (len >= cch) {
+        wmemcpy(psz, pszSrc, cch - 1);
+        psz[cch - 1] = 0;
+        return (HRESULT)-1;
+    }
+    wmemcpy(psz, pszSrc, len + 1);
+    return S_OK;
+}
+
+HRESULT StringCchCatW(LPWSTR psz, size_t cch, LPCWSTR pszSrc)
+{
+    size_t len = wcslen(psz);
+    if (len >= cch)
+        return (HRESULT)-1;
+    return StringCchCopyW(psz + len, cch - len, pszSrc);
+}
+
+LPSTR StrTrimA(LPSTR psz, LPCSTR pszTrimChars)
+{
+    size_t len = strlen(psz);
+    while (len > 0 && strchr(pszTrimChars, psz[len - 1]))
+        psz[--len] = 0;
+    size_t ich = 0;
+    while (psz[ich] && strchr(pszTrimChars, psz[ich]))
+        ++ich;
+    if (ich)
+        memmove(psz, psz + ich, len - ich + 1);
+    return psz;
+}
+
+FILE *_wfopen(const wchar_t *filename, const wchar_t *mode)
+{
+    std::string strMode = mz_to_utf8(mode, wcslen(mode));
+    return fopen(mz_path_to_utf8(filename).c_str(), strMode.c_str());
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// デバッグ用。出力は標準エラーに行う。環境変数MZIMEJA_DEBUGがなければ出力しない。
+
+BOOL g_bTrace = TRUE;   // この変数がFALSEのときはデバッグ出力しない。
+
+static BOOL mz_debug_enabled(void)
+{
+    static int s_nEnabled = -1;
+    if (s_nEnabled < 0)
+        s_nEnabled = (getenv("MZIMEJA_DEBUG") != NULL);
+    return g_bTrace && s_nEnabled;
+}
+
+void DebugPrintA(const char *lpszFormat, ...)
+{
+    if (!mz_debug_enabled())
+        return;
+
+    va_list marker;
+    va_start(marker, lpszFormat);
+    vfprintf(stderr, lpszFormat, marker);
+    va_end(marker);
+}
+
+void DebugPrintW(const WCHAR *lpszFormat, ...)
+{
+    if (!mz_debug_enabled())
+        return;
+
+    WCHAR szMsg[512];
+    va_list marker;
+    va_start(marker, lpszFormat);
+    StringCchVPrintfW(szMsg, _countof(szMsg), lpszFormat, marker);
+    va_end(marker);
+    fputs(mz_to_utf8(szMsg, wcslen(szMsg)).c_str(), stderr);
+}
+
+void DebugFlush(void)
+{
+    fflush(stderr);
+}
+
+void DebugAssert(const char *file, int line, const char *exp)
+{
+    fprintf(stderr, "%s (%d): ASSERT(%s) failed\n", file, line, exp);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 共有メモリとミューテックス。
+// 名前で引けるようにプロセス内の表に登録し、参照カウントで管理する。
+
+struct MZ_SHMEM {
+    std::wstring name;
+    LONG nRefCount;
+    std::vector<BYTE> data;
+};
+
+struct MZ_MUTEX {
+    std::wstring name;
+    LONG nRefCount;
+    pthread_mutex_t mutex;
+};
+
+typedef std::map<std::wstring, MZ_SHMEM *> shmem_table_t;
+typedef std::map<std::wstring, MZ_MUTEX *> mutex_table_t;
+
+static pthread_mutex_t s_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 静的なDictのデストラクタから呼ばれるので、表は破棄しない。
+static shmem_table_t& mz_shmem_table(void)
+{
+    static shmem_table_t *s_table = new shmem_table_t;
+    return *s_table;
+}
+static mutex_table_t& mz_mutex_table(void)
+{
+    static mutex_table_t *s_table = new mutex_table_t;
+    return *s_table;
+}
+
+HANDLE mz_shmem_open(LPCWSTR name, DWORD cbSize, BOOL *pbCreated)
+{
+    pthread_mutex_lock(&s_table_lock);
+    MZ_SHMEM *pShmem = NULL;
+    if (name && mz_shmem_table().count(name)) {
+        pShmem = mz_shmem_table()[name];
+        ++pShmem->nRefCount;
+        *pbCreated = FALSE;
+    } else {
+        pShmem = new MZ_SHMEM;
+        pShmem->nRefCount = 1;
+        pShmem->data.assign(cbSize + sizeof(WCHAR), 0);
+        if (name) {
+            pShmem->name = name;
+            mz_shmem_table()[name] = pShmem;
+        }
+        *pbCreated = TRUE;
+    }
+    pthread_mutex_unlock(&s_table_lock);
+    return pShmem;
+}
+
+void *mz_shmem_map(HANDLE hShmem, DWORD cbSize)
+{
+    MZ_SHMEM *pShmem = (MZ_SHMEM *)hShmem;
+    if (!pShmem || cbSize > pShmem->data.size())
+        return NULL;
+    return &pShmem->data[0];
+}
+
+void mz_shmem_unmap(void *pv, DWORD cbSize)
+{
+}
+
+void mz_shmem_close(HANDLE hShmem)
+{
+    MZ_SHMEM *pShmem = (MZ_SHMEM *)hShmem;
+    if (!pShmem)
+        return;
+    pthread_mutex_lock(&s_table_lock);
+    if (--pShmem->nRefCount == 0) {
+        if (pShmem->name.size())
+            mz_shmem_table().erase(pShmem->name);
+        delete pShmem;
+    }
+    pthread_mutex_unlock(&s_table_lock);
+}
+
+HANDLE mz_mutex_open(LPCWSTR name)
+{
+    pthread_mutex_lock(&s_table_lock);
+    MZ_MUTEX *pMutex = NULL;
+    if (name && mz_mutex_table().count(name)) {
+        pMutex = mz_mutex_table()[name];
+        ++pMutex->nRefCount;
+    } else {
+        pMutex = new MZ_MUTEX;
+        pMutex->nRefCount = 1;
+        // Windowsのミューテックスと同じく、同じスレッドからは何度でもロックできる。
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&pMutex->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if (name) {
+            pMutex->name = name;
+            mz_mutex_table()[name] = pMutex;
+        }
+    }
+    pthread_mutex_unlock(&s_table_lock);
+    return pMutex;
+}
+
+BOOL mz_mutex_lock(HANDLE hMutex, DWORD dwMilliseconds)
+{
+    MZ_MUTEX *pMutex = (MZ_MUTEX *)hMutex;
+    if (dwMilliseconds == INFINITE)
+        return pthread_mutex_lock(&pMutex->mutex) == 0;
+
+    // pthread_mutex_timedlockがない環境もあるので、少しずつ待つ。
+    DWORD dwStart = GetTickCount();
+    for (;;) {
+        if (pthread_mutex_trylock(&pMutex->mutex) == 0)
+            return TRUE;
+        if (GetTickCount() - dwStart >= dwMilliseconds)
+            return FALSE;
+        usleep(1000);
+    }
+}
+
+void mz_mutex_unlock(HANDLE hMutex)
+{
+    MZ_MUTEX *pMutex = (MZ_MUTEX *)hMutex;
+    pthread_mutex_unlock(&pMutex->mutex);
+}
+
+void mz_mutex_close(HANDLE hMutex)
+{
+    MZ_MUTEX *pMutex = (MZ_MUTEX *)hMutex;
+    if (!pMutex)
+        return;
+    pthread_mutex_lock(&s_table_lock);
+    if (--pMutex->nRefCount == 0) {
+        if (pMutex->name.size())
+            mz_mutex_table().erase(pMutex->name);
+        pthread_mutex_destroy(&pMutex->mutex);
+        delete pMutex;
+    }
+    pthread_mutex_unlock(&s_table_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// イベントとスレッド。
+
+struct MZ_EVENT {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    BOOL bManualReset;
+    BOOL bSignaled;
+};
+
+HANDLE mz_event_create(BOOL bManualReset)
+{
+    MZ_EVENT *pEvent = new MZ_EVENT;
+    pthread_mutex_init(&pEvent->mutex, NULL);
+    pthread_cond_init(&pEvent->cond, NULL);
+    pEvent->bManualReset = bManualReset;
+    pEvent->bSignaled = FALSE;
+    return pEvent;
+}
+
+void mz_event_set(HANDLE hEvent)
+{
+    MZ_EVENT *pEvent = (MZ_EVENT *)hEvent;
+    pthread_mutex_lock(&pEvent->mutex);
+    pEvent->bSignaled = TRUE;
+    pthread_cond_broadcast(&pEvent->cond);
+    pthread_mutex_unlock(&pEvent->mutex);
+}
+
+void mz_event_reset(HANDLE hEvent)
+{
+    MZ_EVENT *pEvent = (MZ_EVENT *)hEvent;
+    pthread_mutex_lock(&pEvent->mutex);
+    pEvent->bSignaled = FALSE;
+    pthread_mutex_unlock(&pEvent->mutex);
+}
+
+BOOL mz_event_wait(HANDLE hEvent, DWORD dwMilliseconds)
+{
+    MZ_EVENT *pEvent = (MZ_EVENT *)hEvent;
+    struct timespec ts;
+    if (dwMilliseconds != INFINITE)
+        mz_abs_time(&ts, dwMilliseconds);
+
+    pthread_mutex_lock(&pEvent->mutex);
+    int error = 0;
+    while (!pEvent->bSignaled && error != ETIMEDOUT) {
+        if (dwMilliseconds == INFINITE)
+            error = pthread_cond_wait(&pEvent->cond, &pEvent->mutex);
+        else
+            error = pthread_cond_timedwait(&pEvent->cond, &pEvent->mutex, &ts);
+    }
+    BOOL ret = pEvent->bSignaled;
+    if (ret && !pEvent->bManualReset)
+        pEvent->bSignaled = FALSE;
+    pthread_mutex_unlock(&pEvent->mutex);
+    return ret;
+}
+
+void mz_event_close(HANDLE hEvent)
+{
+    MZ_EVENT *pEvent = (MZ_EVENT *)hEvent;
+    if (!pEvent)
+        return;
+    pthread_cond_destroy(&pEvent->cond);
+    pthread_mutex_destroy(&pEvent->mutex);
+    delete pEvent;
+}
+
+struct MZ_WORK_ITEM {
+    LPTHREAD_START_ROUTINE fn;
+    LPVOID param;
+};
+
+static void *mz_work_item_proc(void *arg)
+{
+    MZ_WORK_ITEM *item = (MZ_WORK_ITEM *)arg;
+    item->fn(item->param);
+    delete item;
+    return NULL;
+}
+
+// スレッドプールの代わりに、切り離したスレッドで実行する。
+BOOL mz_queue_work_item(LPTHREAD_START_ROUTINE fn, LPVOID param)
+{
+    MZ_WORK_ITEM *item = new MZ_WORK_ITEM;
+    item->fn = fn;
+    item->param = param;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, mz_work_item_proc, item) != 0) {
+        delete item;
+        return FALSE;
+    }
+    pthread_detach(thread);
+    return TRUE;
+}
+
+DWORD mz_get_processor_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (DWORD)n : 1;
+}
+
+void mz_yield(void)
+{
+    sched_yield();
+}
+
+ULONGLONG mz_get_microseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+BOOL mz_create_thread(LPTHREAD_START_ROUTINE fn, LPVOID param)
+{
+    return mz_queue_work_item(fn, param);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 通信路（Unixドメインソケット）。
+// シャットダウンはパイプに書き込んで、pollで待っているスレッドを起こす。
+
+struct MZ_CHANNEL {
+    int fd;
+    int wake[2];        // シャットダウン用のパイプ。
+    std::string path;   // 待ち受けのときのソケットのパス。
+};
+
+// ディレクトリが自分のもので、他のユーザーが読み書きできないか確かめる。
+// シンボリックリンクはたどらない。
+static BOOL mz_channel_check_dir(const std::string& dir)
+{
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0)
+        return FALSE;
+    return S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 077) == 0;
+}
+
+// 名前からソケットのパスを作る。'/'を含んでいればそのままパスとする。
+// そうでなければ、自分だけが使えるディレクトリ（XDG_RUNTIME_DIRか、
+// /tmp/mzimeja-<uid>を0700で作ったもの）に置く。確かめられなければ空を返す。
+static std::string mz_channel_path(LPCWSTR name)
+{
+    std::string str = mz_to_utf8(name, wcslen(name));
+    if (str.find('/') != std::string::npos)
+        return str;
+
+    std::string dir;
+    const char *env = getenv("XDG_RUNTIME_DIR");
+    if (env && *env) {
+        dir = env;
+    } else {
+        char sz[32];
+        snprintf(sz, sizeof(sz), "/tmp/mzimeja-%u", (unsigned)getuid());
+        dir = sz;
+        if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+            return std::string();
+    }
+    if (!mz_channel_check_dir(dir))
+        return std::string();
+    return dir + "/" + str;
+}
+
+static MZ_CHANNEL *mz_channel_new(int fd)
+{
+    MZ_CHANNEL *pChannel = new MZ_CHANNEL;
+    pChannel->fd = fd;
+    if (pipe(pChannel->wake) != 0) {
+        close(fd);
+        delete pChannel;
+        return NULL;
+    }
+    fcntl(pChannel->wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pChannel->wake[1], F_SETFD, FD_CLOEXEC);
+    return pChannel;
+}
+
+// 読めるようになるまで待つ。シャットダウンかタイムアウトならFALSE。
+static BOOL mz_channel_poll(MZ_CHANNEL *pChannel, DWORD dwMilliseconds)
+{
+    struct pollfd fds[2];
+    fds[0].fd = pChannel->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = pChannel->wake[0];
+    fds[1].events = POLLIN;
+    int timeout = (dwMilliseconds == INFINITE) ? -1 : (int)dwMilliseconds;
+    for (;;) {
+        fds[0].revents = fds[1].revents = 0;
+        int ret = poll(fds, 2, timeout);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0 || fds[1].revents)
+            return FALSE;
+        return TRUE;
+    }
+}
+
+static int mz_socket_unix(struct sockaddr_un *addr, const std::string& path)
+{
+    if (path.empty() || path.size() >= sizeof(addr->sun_path))
+        return -1;
+    ZeroMemory(addr, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return fd;
+}
+
+HANDLE mz_channel_listen(LPCWSTR name)
+{
+    std::string path = mz_channel_path(name);
+    struct sockaddr_un addr;
+    int fd = mz_socket_unix(&addr, path);
+    if (fd < 0)
+        return NULL;
+
+    unlink(path.c_str()); // 前回のソケットが残っていれば消す。
+    // 作った瞬間から自分だけが使えるよう、bindの間だけumaskを絞る。
+    mode_t mask = umask(077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    MZ_CHANNEL *pChannel = mz_channel_new(fd);
+    if (pChannel)
+        pChannel->path = path;
+    return pChannel;
+}
+
+HANDLE mz_channel_accept(HANDLE hListen)
+{
+    MZ_CHANNEL *pListen = (MZ_CHANNEL *)hListen;
+    for (;;) {
+        if (!mz_channel_poll(pListen, INFINITE))
+            return NULL;
+        int fd = accept(pListen->fd, NULL, NULL);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            return mz_channel_new(fd);
+        }
+        if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+            return NULL;
+    }
+}
+
+HANDLE mz_channel_connect(LPCWSTR name)
+{
+    struct sockaddr_un addr;
+    int fd = mz_socket_unix(&addr, mz_channel_path(name));
+    if (fd < 0)
+        return NULL;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    return mz_channel_new(fd);
+}
+
+BOOL mz_channel_read(HANDLE hChannel, void *pv, DWORD cb, DWORD dwMilliseconds)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+    BYTE *pb = (BYTE *)pv;
+    while (cb > 0) {
+        if (!mz_channel_poll(pChannel, dwMilliseconds))
+            return FALSE;
+        ssize_t ret = recv(pChannel->fd, pb, cb, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pb += ret;
+        cb -= (DWORD)ret;
+    }
+    return TRUE;
+}
+
+BOOL mz_channel_write(HANDLE hChannel, const void *pv, DWORD cb)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL; // 切断されていてもSIGPIPEを出さない。
+#else
+    const int flags = 0;
+#endif
+    const BYTE *pb = (const BYTE *)pv;
+    while (cb > 0) {
+        ssize_t ret = send(pChannel->fd, pb, cb, flags);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pb += ret;
+        cb -= (DWORD)ret;
+    }
+    return TRUE;
+}
+
+void mz_channel_shutdown(HANDLE hChannel)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+    char ch = 0;
+    while (write(pChannel->wake[1], &ch, 1) < 0 && errno == EINTR)
+        ;
+    shutdown(pChannel->fd, SHUT_RDWR);
+}
+
+void mz_channel_close(HANDLE hChannel)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+    if (!pChannel)
+        return;
+    close(pChannel->fd);
+    close(pChannel->wake[0]);
+    close(pChannel->wake[1]);
+    if (pChannel->path.size())
+        unlink(pChannel->path.c_str());
+    delete pChannel;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// ファイル。
+
+DWORD mz_get_file_size(LPCWSTR file_name)
+{
+    struct stat st;
+    if (stat(mz_path_to_utf8(file_name).c_str(), &st) != 0)
+        return 0;
+    return (DWORD)st.st_size;
+}
+
+// UTF-16LEのファイルを読み込む。wchar_tは32ビットだが、UTF-16の単位を一つずつ入れる。
+size_t mz_read_utf16_file(LPCWSTR file_name, WCHAR *pch, size_t cch)
+{
+    FILE *fp = _wfopen(file_name, L"rb");
+    if (!fp)
+        return 0;
+
+    size_t cchRead = 0;
+    BYTE buf[4096];
+    size_t cb;
+    while (cchRead < cch &&
+           (cb = fread(buf, 1, std::min(sizeof(buf), (cch - cchRead) * 2), fp)) >= 2)
+    {
+        for (size_t i = 0; i + 1 < cb; i += 2)
+            pch[cchRead++] = (WCHAR)(WORD)(buf[i] | (buf[i + 1] << 8));
+    }
+    fclose(fp);
+
+    return cchRead;
+}
+
+// 実行ファイルの近くのファイルを探す。
+BOOL FindLocalFile(std::wstring& path, LPCWSTR filename)
+{
+    char szExe[1024];
+    ssize_t cb = readlink("/proc/self/exe", szExe, sizeof(szExe) - 1);
+    if (cb <= 0)
+        return FALSE;
+    szExe[cb] = 0;
+
+    std::string dir = szExe;
+    std::string name = mz_path_to_utf8(filename);
+    for (INT i = 0; i < 5; ++i) {
+        size_t ich = dir.rfind('/');
+        if (ich == std::string::npos)
+            break;
+        dir.resize(ich);
+
+        std::string candidates[2] = {
+            dir + "/" + name,
+            dir + "/mzimeja/" + name,
+        };
+        for (size_t k = 0; k < _countof(candidates); ++k) {
+            if (access(candidates[k].c_str(), R_OK) == 0) {
+                path = mz_from_utf8(candidates[k].c_str(), candidates[k].size());
+                return TRUE;
+            }
+        }
+    }
+
+    path.clear();
+    return FALSE;
+}
+
+// アプリフォルダのファイルを探す。
+BOOL FindAppFile(std::wstring& path, LPCTSTR filename)
+{
+    std::string file = "/usr/share/mzimeja/" + mz_path_to_utf8(filename);
+    if (access(file.c_str(), R_OK) == 0) {
+        path = mz_from_utf8(file.c_str(), file.size());
+        return TRUE;
+    }
+    path.clear();
+    return FALSE;
+}
+
+// ユーザーごとのデータは$XDG_DATA_HOME/mzimejaか~/.local/share/mzimejaに置く。
+BOOL mz_get_user_data_path(std::wstring& path, LPCWSTR filename)
+{
+    std::string dir;
+    const char *data_home = getenv("XDG_DATA_HOME");
+    if (data_home && *data_home) {
+        dir = data_home;
+    } else {
+        const char *home = getenv("HOME");
+        if (!home || !*home) {
+            struct passwd *pw = getpwuid(getuid());
+            if (!pw)
+                return FALSE;
+            home = pw->pw_dir;
+        }
+        dir = home;
+        dir += "/.local";
+        mkdir(dir.c_str(), 0700);
+        dir += "/share";
+        mkdir(dir.c_str(), 0700);
+    }
+    dir += "/mzimeja";
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+        return FALSE;
+
+    std::string file = dir + "/" + mz_path_to_utf8(filename);
+    path = mz_from_utf8(file.c_str(), file.size());
+    return TRUE;
+}
+
+const void *mz_map_file(LPCWSTR file_name, DWORD *pcbSize)
+{
+    *pcbSize = 0;
+    int fd = open(mz_path_to_utf8(file_name).c_str(), O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    void *pv = NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= 0x7FFFFFFF) {
+        pv = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pv == MAP_FAILED)
+            pv = NULL;
+        else
+            *pcbSize = (DWORD)st.st_size;
+    }
+    close(fd);
+    return pv;
+}
+
+void mz_unmap_file(const void *pv, DWORD cbSize)
+{
+    if (pv)
+        munmap(const_cast<void *>(pv), cbSize);
+}
+
+BOOL mz_replace_file(LPCWSTR from, LPCWSTR to)
+{
+    return rename(mz_path_to_utf8(from).c_str(), mz_path_to_utf8(to).c_str()) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 設定。環境変数MZIMEJA_<名前>から読む。
+
+static const char *mz_config_getenv(LPCTSTR name)
+{
+    std::string var = "MZIMEJA_" + mz_to_utf8(name, wcslen(name));
+    return getenv(var.c_str());
+}
+
+DWORD Config_GetDWORD(LPCTSTR name, DWORD dwDefault)
+{
+    const char *value = mz_config_getenv(name);
+    if (!value || !*value)
+        return dwDefault;
+    return (DWORD)strtoul(value, NULL, 0);
+}
+
+BOOL Config_GetSz(LPCTSTR name, std::wstring& str, LPCWSTR def_value)
+{
+    const char *value = mz_config_getenv(name);
+    if (!value) {
+        str = def_value;
+        return FALSE;
+    }
+    str = mz_from_utf8(value, strlen(value));
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// リソース文字列。変換エンジンが使うものだけを持つ（lang/ja_JP.rcと同じ）。
+
+struct MZ_STRING_ENTRY {
+    UINT nID;
+    LPCWSTR psz;
+};
+
+static const MZ_STRING_ENTRY s_string_table[] = {
+    { IDS_HINSHI_00, L"名詞" },
+    { IDS_HINSHI_01, L"い形容詞" },
+    { IDS_HINSHI_02, L"な形容詞" },
+    { IDS_HINSHI_03, L"連体詞" },
+    { IDS_HINSHI_04, L"副詞" },
+    { IDS_HINSHI_05, L"接続詞" },
+    { IDS_HINSHI_06, L"感動詞" },
+    { IDS_HINSHI_07, L"格助詞" },
+    { IDS_HINSHI_08, L"接続助詞" },
+    { IDS_HINSHI_09, L"副助詞" },
+    { IDS_HINSHI_10, L"終助詞" },
+    { IDS_HINSHI_11, L"助動詞" },
+    { IDS_HINSHI_12, L"未然助動詞" },
+    { IDS_HINSHI_13, L"連用助動詞" },
+    { IDS_HINSHI_14, L"終止助動詞" },
+    { IDS_HINSHI_15, L"連体助動詞" },
+    { IDS_HINSHI_16, L"仮定助動詞" },
+    { IDS_HINSHI_17, L"命令助動詞" },
+    { IDS_HINSHI_18, L"五段動詞" },
+    { IDS_HINSHI_19, L"一段動詞" },
+    { IDS_HINSHI_20, L"カ変動詞" },
+    { IDS_HINSHI_21, L"サ変動詞" },
+    { IDS_HINSHI_22, L"漢語" },
+    { IDS_HINSHI_23, L"接頭辞" },
+    { IDS_HINSHI_24, L"接尾辞" },
+    { IDS_HINSHI_25, L"ピリオド" },
+    { IDS_HINSHI_26, L"カンマ" },
+    { IDS_HINSHI_27, L"記号類" },
+};
+
+BOOL mz_load_string(UINT nID, std::wstring& str)
+{
+    for (size_t i = 0; i < _countof(s_string_table); ++i) {
+        if (s_string_table[i].nID == nID) {
+            str = s_string_table[i].psz;
+            return TRUE;
+        }
+    }
+    str.clear();
+    return FALSE;
+}
+
+} // extern "C"
+
+//////////////////////////////////////////////////////////////////////////////
+// 文字種変換。LCMapStringWの日本語の範囲だけを表で行う。
+
+// U+FF61からU+FF9Dまでの半角カナに対応する全角文字。
+static const WCHAR s_halfwidth_kana[] =
+    L"。「」、・ヲァィゥェォャュョッーアイウエオカキクケコサシスセソ"
+    L"タチツテトナニヌネノハヒフヘホマミムメモヤユヨラリルレロワン";
+
+// 濁点を付けられるか？
+static BOOL mz_has_dakuon(WCHAR kana)
+{
+    return (0x30AB <= kana && kana <= 0x30C8 && kana != L'ッ') ||
+           (0x30CF <= kana && kana <= 0x30DB);
+}
+
+// 半濁点を付けられるか？（ハ行）
+static BOOL mz_has_handakuon(WCHAR kana)
+{
+    return 0x30CF <= kana && kana <= 0x30DB;
+}
+
+// 全角文字から半角カナへ。濁点・半濁点付きは2文字になる。
+static BOOL mz_to_halfwidth_kana(WCHAR ch, std::wstring& ret)
+{
+    if (ch == L'゛') { ret += (WCHAR)0xFF9E; return TRUE; }
+    if (ch == L'゜') { ret += (WCHAR)0xFF9F; return TRUE; }
+    if (ch == L'ヴ') { ret += (WCHAR)0xFF73; ret += (WCHAR)0xFF9E; return TRUE; }
+    for (size_t i = 0; i + 1 < _countof(s_halfwidth_kana); ++i) {
+        WCHAR kana = s_halfwidth_kana[i];
+        if (kana == ch) {
+            ret += (WCHAR)(0xFF61 + i);
+            return TRUE;
+        }
+        if (mz_has_dakuon(kana) && kana + 1 == ch) { // 濁音。
+            ret += (WCHAR)(0xFF61 + i);
+            ret += (WCHAR)0xFF9E;
+            return TRUE;
+        }
+        if (mz_has_handakuon(kana) && kana + 2 == ch) { // 半濁音。
+            ret += (WCHAR)(0xFF61 + i);
+            ret += (WCHAR)0xFF9F;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+std::wstring mz_lcmap(const std::wstring& str, DWORD dwFlags)
+{
+    std::wstring ret;
+
+    // 全角にする。
+    if (dwFlags & LCMAP_FULLWIDTH) {
+        for (size_t i = 0; i < str.size(); ++i) {
+            WCHAR ch = str[i];
+            if (ch == L' ') {
+                ret += (WCHAR)0x3000;
+            } else if (0x21 <= ch && ch <= 0x7E) {
+                ret += (WCHAR)(ch + 0xFEE0);
+            } else if (0xFF61 <= ch && ch <= 0xFF9D) {
+                WCHAR kana = s_halfwidth_kana[ch - 0xFF61];
+                WCHAR next = (i + 1 < str.size()) ? str[i + 1] : 0;
+                if (next == 0xFF9E && kana == L'ウ') {
+                    kana = L'ヴ';
+                    ++i;
+                } else if (next == 0xFF9E && mz_has_dakuon(kana)) {
+                    kana += 1;
+                    ++i;
+                } else if (next == 0xFF9F && mz_has_handakuon(kana)) {
+                    kana += 2;
+                    ++i;
+                }
+                ret += kana;
+            } else if (ch == 0xFF9E) {
+                ret += L'゛';
+            } else if (ch == 0xFF9F) {
+                ret += L'゜';
+            } else {
+                ret += ch;
+            }
+        }
+    } else {
+        ret = str;
+    }
+
+    // ひらがな・カタカナにする。
+    for (size_t i = 0; i < ret.size(); ++i) {
+        WCHAR& ch = ret[i];
+        if (dwFlags & LCMAP_HIRAGANA) {
+            if ((0x30A1 <= ch && ch <= 0x30F6) || ch == L'ヽ' || ch == L'ヾ')
+                ch -= 0x60;
+        } else if (dwFlags & LCMAP_KATAKANA) {
+            if ((0x3041 <= ch && ch <= 0x3096) || ch == L'ゝ' || ch == L'ゞ')
+                ch += 0x60;
+        }
+    }
+
+    // 半角にする。
+    if (dwFlags & LCMAP_HALFWIDTH) {
+        std::wstring tmp;
+        for (size_t i = 0; i < ret.size(); ++i) {
+            WCHAR ch = ret[i];
+            if (ch == 0x3000)
+                tmp += L' ';
+            else if (0xFF01 <= ch && ch <= 0xFF5E)
+                tmp += (WCHAR)(ch - 0xFEE0);
+            else if (!mz_to_halfwidth_kana(ch, tmp))
+                tmp += ch;
+        }
+        ret.swap(tmp);
+    }
+
+    // 大文字・小文字にする。
+    if (dwFlags & (LCMAP_LOWERCASE | LCMAP_UPPERCASE)) {
+        for (size_t i = 0; i < ret.size(); ++i) {
+            WCHAR& ch = ret[i];
+            if (dwFlags & LCMAP_LOWERCASE) {
+                if ((L'A' <= ch && ch <= L'Z') || (0xFF21 <= ch && ch <= 0xFF3A))
+                    ch += 0x20;
+            } else {
+                if ((L'a' <= ch && ch <= L'z') || (0xFF41 <= ch && ch <= 0xFF5A))
+                    ch -= 0x20;
+            }
+        }
+    }
+
+    return ret;
+}
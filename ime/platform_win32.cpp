@@ -0,0 +1,687 @@
+﻿// platform_win32.cpp --- mzimeja platform layer for Windows
+// (Japanese, UTF-8)
+// platform.hの機能のWindows版。
+
+#include "mzconv.h"
+#include <shlobj.h>
+#include <sddl.h>
+
+extern "C" {
+
+//////////////////////////////////////////////////////////////////////////////
+// 共有メモリ（ファイルマッピング）とミューテックス。
+
+// 共有メモリを開く。
+HANDLE mz_shmem_open(LPCWSTR name, DWORD cbSize, BOOL *pbCreated)
+{
+    SECURITY_ATTRIBUTES *psa = CreateSecurityAttributes(); // セキュリティ属性を作成。
+    ASSERT(psa);
+
+    HANDLE hShmem = ::CreateFileMappingW(INVALID_HANDLE_VALUE, psa, PAGE_READWRITE,
+                                         0, cbSize, name);
+    *pbCreated = (hShmem && ::GetLastError() != ERROR_ALREADY_EXISTS);
+
+    FreeSecurityAttributes(psa);
+    return hShmem;
+}
+
+// 共有メモリをマップする。
+void *mz_shmem_map(HANDLE hShmem, DWORD cbSize)
+{
+    return ::MapViewOfFile(hShmem, FILE_MAP_ALL_ACCESS, 0, 0, cbSize);
+}
+
+// 共有メモリのマップを解除する。
+void mz_shmem_unmap(void *pv, DWORD cbSize)
+{
+    ::UnmapViewOfFile(pv);
+}
+
+// 共有メモリを閉じる。
+void mz_shmem_close(HANDLE hShmem)
+{
+    ::CloseHandle(hShmem);
+}
+
+// ミューテックスを開く。
+HANDLE mz_mutex_open(LPCWSTR name)
+{
+    SECURITY_ATTRIBUTES *psa = CreateSecurityAttributes(); // セキュリティ属性を作成。
+    ASSERT(psa);
+
+    HANDLE hMutex = ::CreateMutexW(psa, FALSE, name);
+
+    FreeSecurityAttributes(psa);
+    return hMutex;
+}
+
+// ミューテックスをロックする。
+BOOL mz_mutex_lock(HANDLE hMutex, DWORD dwMilliseconds)
+{
+    return ::WaitForSingleObject(hMutex, dwMilliseconds) == WAIT_OBJECT_0;
+}
+
+// ミューテックスのロックを解除する。
+void mz_mutex_unlock(HANDLE hMutex)
+{
+    ::ReleaseMutex(hMutex);
+}
+
+// ミューテックスを閉じる。
+void mz_mutex_close(HANDLE hMutex)
+{
+    ::CloseHandle(hMutex);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// イベントとスレッドプール。
+
+HANDLE mz_event_create(BOOL bManualReset)
+{
+    return ::CreateEventW(NULL, bManualReset, FALSE, NULL);
+}
+
+void mz_event_set(HANDLE hEvent)
+{
+    ::SetEvent(hEvent);
+}
+
+void mz_event_reset(HANDLE hEvent)
+{
+    ::ResetEvent(hEvent);
+}
+
+BOOL mz_event_wait(HANDLE hEvent, DWORD dwMilliseconds)
+{
+    return ::WaitForSingleObject(hEvent, dwMilliseconds) == WAIT_OBJECT_0;
+}
+
+void mz_event_close(HANDLE hEvent)
+{
+    ::CloseHandle(hEvent);
+}
+
+BOOL mz_queue_work_item(LPTHREAD_START_ROUTINE fn, LPVOID param)
+{
+    return ::QueueUserWorkItem(fn, param, WT_EXECUTEDEFAULT);
+}
+
+DWORD mz_get_processor_count(void)
+{
+    SYSTEM_INFO si;
+    ::GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+}
+
+void mz_yield(void)
+{
+    ::SwitchToThread();
+}
+
+ULONGLONG mz_get_microseconds(void)
+{
+    static LARGE_INTEGER s_freq;
+    if (!s_freq.QuadPart)
+        ::QueryPerformanceFrequency(&s_freq);
+    LARGE_INTEGER count;
+    ::QueryPerformanceCounter(&count);
+    return (ULONGLONG)(count.QuadPart / s_freq.QuadPart * 1000000 +
+                       count.QuadPart % s_freq.QuadPart * 1000000 / s_freq.QuadPart);
+}
+
+// 長く動くスレッドの引数。
+struct MZ_THREAD_ITEM {
+    LPTHREAD_START_ROUTINE fn;
+    LPVOID param;
+    HMODULE hModule;
+};
+
+static DWORD WINAPI mz_thread_proc(LPVOID lpParam)
+{
+    MZ_THREAD_ITEM item = *(MZ_THREAD_ITEM *)lpParam;
+    delete (MZ_THREAD_ITEM *)lpParam;
+    DWORD ret = item.fn(item.param);
+    // スレッドが動いている間、DLLが解放されないよう参照を持っていた。
+    if (item.hModule)
+        ::FreeLibraryAndExitThread(item.hModule, ret);
+    return ret;
+}
+
+BOOL mz_create_thread(LPTHREAD_START_ROUTINE fn, LPVOID param)
+{
+    MZ_THREAD_ITEM *item = new MZ_THREAD_ITEM;
+    item->fn = fn;
+    item->param = param;
+    item->hModule = NULL;
+    ::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS,
+                         reinterpret_cast<LPCWSTR>(mz_thread_proc), &item->hModule);
+
+    HANDLE hThread = ::CreateThread(NULL, 0, mz_thread_proc, item, 0, NULL);
+    if (!hThread) {
+        if (item->hModule)
+            ::FreeLibrary(item->hModule);
+        delete item;
+        return FALSE;
+    }
+    ::CloseHandle(hThread);
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 通信路（Named Pipe）。
+// 読み書きを別のスレッドから同時に行えるように、重複I/Oを使う。
+// パイプはユーザーとセッションごとに分け、そのユーザーだけが開けるようにする。
+
+#define MZ_PIPE_BUFSIZE 65536
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+    #define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+#ifndef PROCESS_QUERY_LIMITED_INFORMATION
+    #define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+#endif
+
+struct MZ_CHANNEL {
+    HANDLE hPipe;       // 待ち受けのときは、次の接続を待つインスタンス。
+    HANDLE hStop;       // シャットダウンでシグナル状態になる。
+    std::wstring path;  // 待ち受けのときのパイプ名。
+};
+
+// プロセスのユーザーのSIDを文字列で得る。
+static BOOL mz_get_process_user(HANDLE hProcess, std::wstring& sid)
+{
+    HANDLE hToken;
+    if (!::OpenProcessToken(hProcess, TOKEN_QUERY, &hToken))
+        return FALSE;
+
+    BOOL ret = FALSE;
+    DWORD cb = 0;
+    ::GetTokenInformation(hToken, TokenUser, NULL, 0, &cb);
+    if (cb) {
+        std::vector<BYTE> buf(cb);
+        LPWSTR psz;
+        if (::GetTokenInformation(hToken, TokenUser, &buf[0], cb, &cb) &&
+            ::ConvertSidToStringSidW(((TOKEN_USER *)&buf[0])->User.Sid, &psz))
+        {
+            sid = psz;
+            ::LocalFree(psz);
+            ret = TRUE;
+        }
+    }
+    ::CloseHandle(hToken);
+    return ret;
+}
+
+// 名前からパイプのパスを作る。ユーザーのSIDとセッション番号を付けて、
+// 別のユーザーやセッションのサーバーと混ざらないようにする。
+static BOOL mz_channel_path(LPCWSTR name, std::wstring& path)
+{
+    std::wstring sid;
+    if (!mz_get_process_user(::GetCurrentProcess(), sid))
+        return FALSE;
+
+    DWORD dwSession = 0;
+    ::ProcessIdToSessionId(::GetCurrentProcessId(), &dwSession);
+
+    WCHAR sz[32];
+    StringCchPrintfW(sz, _countof(sz), L"-%lu", dwSession);
+    path = L"\\\\.\\pipe\\";
+    path += name;
+    path += L"-";
+    path += sid;
+    path += sz;
+    return TRUE;
+}
+
+// パイプのインスタンスを作る。最初のインスタンスなら、同名のパイプが既にあれば失敗する。
+static HANDLE mz_channel_create_pipe(const std::wstring& path, BOOL bFirst)
+{
+    // 自分（所有者）だけに全権を与えるDACL。
+    std::wstring sid;
+    if (!mz_get_process_user(::GetCurrentProcess(), sid))
+        return INVALID_HANDLE_VALUE;
+    std::wstring sddl = L"D:P(A;;GA;;;" + sid + L")";
+
+    SECURITY_ATTRIBUTES sa;
+    ZeroMemory(&sa, sizeof(sa));
+    sa.nLength = sizeof(sa);
+    if (!::ConvertStringSecurityDescriptorToSecurityDescriptorW(
+            sddl.c_str(), SDDL_REVISION_1, &sa.lpSecurityDescriptor, NULL))
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    DWORD dwOpenMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED;
+    if (bFirst)
+        dwOpenMode |= FILE_FLAG_FIRST_PIPE_INSTANCE;
+    HANDLE hPipe = ::CreateNamedPipeW(path.c_str(), dwOpenMode,
+                                      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+                                      PIPE_REJECT_REMOTE_CLIENTS,
+                                      PIPE_UNLIMITED_INSTANCES, MZ_PIPE_BUFSIZE,
+                                      MZ_PIPE_BUFSIZE, 0, &sa);
+    ::LocalFree(sa.lpSecurityDescriptor);
+    return hPipe;
+}
+
+// パイプのサーバーが自分と同じユーザーで動いているか確かめる。
+// GetNamedPipeServerProcessIdはVista以降にしかないので、動的に得る。
+static BOOL mz_channel_verify_server(HANDLE hPipe)
+{
+    typedef BOOL (WINAPI *FN_GetNamedPipeServerProcessId)(HANDLE, PULONG);
+    HMODULE hKernel32 = ::GetModuleHandleW(L"kernel32");
+    FN_GetNamedPipeServerProcessId fn = (FN_GetNamedPipeServerProcessId)
+        ::GetProcAddress(hKernel32, "GetNamedPipeServerProcessId");
+    ULONG pid;
+    if (!fn || !fn(hPipe, &pid))
+        return FALSE;
+
+    HANDLE hProcess = ::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!hProcess)
+        return FALSE;
+    std::wstring sid0, sid1;
+    BOOL ret = mz_get_process_user(hProcess, sid0) &&
+               mz_get_process_user(::GetCurrentProcess(), sid1) &&
+               sid0 == sid1;
+    ::CloseHandle(hProcess);
+    return ret;
+}
+
+static MZ_CHANNEL *mz_channel_new(HANDLE hPipe)
+{
+    MZ_CHANNEL *pChannel = new MZ_CHANNEL;
+    pChannel->hPipe = hPipe;
+    pChannel->hStop = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    return pChannel;
+}
+
+// 重複I/Oの完了を待つ。シャットダウンかタイムアウトなら取り消す。
+static BOOL mz_channel_wait(MZ_CHANNEL *pChannel, HANDLE hPipe, OVERLAPPED *pov,
+                            DWORD *pcb, DWORD dwMilliseconds)
+{
+    HANDLE ahWait[2] = { pov->hEvent, pChannel->hStop };
+    DWORD dwWait = ::WaitForMultipleObjects(2, ahWait, FALSE, dwMilliseconds);
+    if (dwWait != WAIT_OBJECT_0) {
+        ::CancelIo(hPipe);
+        ::GetOverlappedResult(hPipe, pov, pcb, TRUE);
+        return FALSE;
+    }
+    return ::GetOverlappedResult(hPipe, pov, pcb, FALSE);
+}
+
+// 最初のインスタンスをここで作り、常に一つは待ち受けのインスタンスを残しておく。
+// こうすれば、他のプロセスが同じ名前のパイプを先に作ることはできない。
+HANDLE mz_channel_listen(LPCWSTR name)
+{
+    std::wstring path;
+    if (!mz_channel_path(name, path))
+        return NULL;
+    HANDLE hPipe = mz_channel_create_pipe(path, TRUE);
+    if (hPipe == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    MZ_CHANNEL *pChannel = mz_channel_new(hPipe);
+    pChannel->path = path;
+    return pChannel;
+}
+
+HANDLE mz_channel_accept(HANDLE hListen)
+{
+    MZ_CHANNEL *pListen = (MZ_CHANNEL *)hListen;
+    HANDLE hPipe = pListen->hPipe;
+    if (!hPipe)
+        return NULL;
+
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    BOOL bConnected = ::ConnectNamedPipe(hPipe, &ov);
+    if (!bConnected) {
+        DWORD dwError = ::GetLastError();
+        if (dwError == ERROR_PIPE_CONNECTED) {
+            bConnected = TRUE;
+        } else if (dwError == ERROR_IO_PENDING) {
+            DWORD cb;
+            bConnected = mz_channel_wait(pListen, hPipe, &ov, &cb, INFINITE);
+        }
+    }
+    ::CloseHandle(ov.hEvent);
+
+    if (!bConnected) {
+        // 失敗してもインスタンスは再利用できるよう、接続を切るだけにする。
+        ::DisconnectNamedPipe(hPipe);
+        return NULL;
+    }
+
+    // 接続したインスタンスを渡し、次の接続のためのインスタンスを作る。
+    HANDLE hNext = mz_channel_create_pipe(pListen->path, FALSE);
+    pListen->hPipe = (hNext != INVALID_HANDLE_VALUE) ? hNext : NULL;
+    return mz_channel_new(hPipe);
+}
+
+HANDLE mz_channel_connect(LPCWSTR name)
+{
+    std::wstring path;
+    if (!mz_channel_path(name, path))
+        return NULL;
+    // サーバーに成り済まされても、こちらの権限では動けないように識別レベルに留める。
+    HANDLE hPipe = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                 OPEN_EXISTING,
+                                 FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT |
+                                 SECURITY_IDENTIFICATION, NULL);
+    if (hPipe == INVALID_HANDLE_VALUE)
+        return NULL;
+    if (!mz_channel_verify_server(hPipe)) {
+        ::CloseHandle(hPipe);
+        return NULL;
+    }
+    return mz_channel_new(hPipe);
+}
+
+BOOL mz_channel_read(HANDLE hChannel, void *pv, DWORD cb, DWORD dwMilliseconds)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    BYTE *pb = (BYTE *)pv;
+    BOOL ret = TRUE;
+    while (ret && cb > 0) {
+        DWORD cbRead = 0;
+        ::ResetEvent(ov.hEvent);
+        if (!::ReadFile(pChannel->hPipe, pb, cb, &cbRead, &ov)) {
+            if (::GetLastError() != ERROR_IO_PENDING ||
+                !mz_channel_wait(pChannel, pChannel->hPipe, &ov, &cbRead, dwMilliseconds))
+            {
+                ret = FALSE;
+                break;
+            }
+        }
+        if (cbRead == 0)
+            ret = FALSE;
+        pb += cbRead;
+        cb -= cbRead;
+    }
+
+    ::CloseHandle(ov.hEvent);
+    return ret;
+}
+
+BOOL mz_channel_write(HANDLE hChannel, const void *pv, DWORD cb)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+    OVERLAPPED ov;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    const BYTE *pb = (const BYTE *)pv;
+    BOOL ret = TRUE;
+    while (ret && cb > 0) {
+        DWORD cbWritten = 0;
+        ::ResetEvent(ov.hEvent);
+        if (!::WriteFile(pChannel->hPipe, pb, cb, &cbWritten, &ov)) {
+            if (::GetLastError() != ERROR_IO_PENDING ||
+                !mz_channel_wait(pChannel, pChannel->hPipe, &ov, &cbWritten, INFINITE))
+            {
+                ret = FALSE;
+                break;
+            }
+        }
+        if (cbWritten == 0)
+            ret = FALSE;
+        pb += cbWritten;
+        cb -= cbWritten;
+    }
+
+    ::CloseHandle(ov.hEvent);
+    return ret;
+}
+
+void mz_channel_shutdown(HANDLE hChannel)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+    ::SetEvent(pChannel->hStop);
+}
+
+void mz_channel_close(HANDLE hChannel)
+{
+    MZ_CHANNEL *pChannel = (MZ_CHANNEL *)hChannel;
+    if (!pChannel)
+        return;
+    if (pChannel->hPipe)
+        ::CloseHandle(pChannel->hPipe);
+    if (pChannel->hStop)
+        ::CloseHandle(pChannel->hStop);
+    delete pChannel;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// ファイル。
+
+// ファイルのサイズを取得する。
+DWORD mz_get_file_size(LPCWSTR file_name)
+{
+    WIN32_FIND_DATAW find;
+    HANDLE hFind = ::FindFirstFileW(file_name, &find);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        ::FindClose(hFind);
+        return find.nFileSizeLow;
+    }
+    return 0;
+}
+
+// UTF-16LEのファイルを読み込む。WCHARもUTF-16なので、そのまま読み込む。
+size_t mz_read_utf16_file(LPCWSTR file_name, WCHAR *pch, size_t cch)
+{
+    FILE *fp = _wfopen(file_name, L"rb");
+    if (!fp)
+        return 0;
+    size_t ret = fread(pch, sizeof(WCHAR), cch, fp);
+    fclose(fp);
+    return ret;
+}
+
+// ローカルのファイルを探す。
+BOOL FindLocalFile(std::wstring& path, LPCWSTR filename) {
+    WCHAR szPath[MAX_PATH];
+    ::GetModuleFileNameW(NULL, szPath, MAX_PATH);
+    PathRemoveFileSpecW(szPath);
+
+    for (INT i = 0; i < 5; ++i) {
+        size_t ich = wcslen(szPath);
+        {
+            PathAppendW(szPath, filename);
+            if (PathFileExistsW(szPath)) {
+                path = szPath;
+                return TRUE;
+            }
+        }
+        szPath[ich] = 0;
+        {
+            PathAppendW(szPath, L"mzimeja");
+            PathAppendW(szPath, filename);
+            if (PathFileExistsW(szPath)) {
+                path = szPath;
+                return TRUE;
+            }
+        }
+        szPath[ich] = 0;
+        PathRemoveFileSpecW(szPath);
+    }
+
+    path.clear();
+    return FALSE;
+}
+
+// アプリフォルダのファイルを探す
+BOOL FindAppFile(std::wstring& path, LPCTSTR filename) {
+    LPITEMIDLIST pidl;
+    SHGetSpecialFolderLocation(NULL, CSIDL_PROGRAM_FILES, &pidl);
+    WCHAR szPath[MAX_PATH];
+    SHGetPathFromIDListW(pidl, szPath);
+    CoTaskMemFree(pidl);
+    PathAppendW(szPath, L"mzimeja");
+    PathAppendW(szPath, filename);
+    if (PathFileExistsW(szPath)) {
+        path = szPath;
+        return TRUE;
+    }
+    path.clear();
+    return FALSE;
+}
+
+// ユーザーごとのデータは%APPDATA%\mzimejaに置く。
+BOOL mz_get_user_data_path(std::wstring& path, LPCWSTR filename)
+{
+    WCHAR szPath[MAX_PATH];
+    if (!SHGetSpecialFolderPathW(NULL, szPath, CSIDL_APPDATA, TRUE))
+        return FALSE;
+    PathAppendW(szPath, L"mzimeja");
+    if (!::CreateDirectoryW(szPath, NULL) && ::GetLastError() != ERROR_ALREADY_EXISTS)
+        return FALSE;
+    PathAppendW(szPath, filename);
+    path = szPath;
+    return TRUE;
+}
+
+const void *mz_map_file(LPCWSTR file_name, DWORD *pcbSize)
+{
+    *pcbSize = 0;
+    HANDLE hFile = ::CreateFileW(file_name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                 NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    void *pv = NULL;
+    DWORD cbHigh = 0, cbSize = ::GetFileSize(hFile, &cbHigh);
+    if (cbSize != INVALID_FILE_SIZE && cbSize > 0 && cbHigh == 0) {
+        HANDLE hMapping = ::CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping) {
+            // ビューがあれば、マッピングを閉じてもよい。
+            pv = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            ::CloseHandle(hMapping);
+            if (pv)
+                *pcbSize = cbSize;
+        }
+    }
+    ::CloseHandle(hFile);
+    return pv;
+}
+
+void mz_unmap_file(const void *pv, DWORD cbSize)
+{
+    if (pv)
+        ::UnmapViewOfFile(pv);
+}
+
+BOOL mz_replace_file(LPCWSTR from, LPCWSTR to)
+{
+    return ::MoveFileExW(from, to, MOVEFILE_REPLACE_EXISTING);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 設定（レジストリ）。
+
+// レジストリのアプリキーを開く。
+HKEY Config_OpenAppKey(VOID)
+{
+    HKEY hAppKey;
+    LSTATUS error = ::RegOpenKeyEx(HKEY_CURRENT_USER,
+                                   TEXT("SOFTWARE\\Katayama Hirofumi MZ\\mzimeja"),
+                                   0, KEY_READ, &hAppKey);
+    if (error) {
+        DPRINTA("0x%08lX\n", error);
+        return NULL;
+    }
+    return hAppKey;
+}
+
+// レジストリからDWORD値を読み込む。
+DWORD Config_GetDWORD(LPCTSTR name, DWORD dwDefault)
+{
+    HKEY hKey = Config_OpenAppKey();
+    if (!hKey)
+        return dwDefault;
+
+    DWORD dwValue = dwDefault;
+    DWORD cbValue = sizeof(dwValue);
+    LSTATUS error = ::RegQueryValueEx(hKey, name, NULL, NULL, (LPBYTE)&dwValue, &cbValue);
+    ::RegCloseKey(hKey);
+    if (error || cbValue != sizeof(DWORD)) {
+        DPRINTA("error: 0x%08lX\n", error);
+        return dwDefault;
+    }
+
+    return dwValue;
+}
+
+// レジストリから文字列値を読み込む。
+BOOL Config_GetSz(LPCTSTR name, std::wstring& str, LPCWSTR def_value)
+{
+    ASSERT(def_value);
+    str = def_value;
+
+    HKEY hKey = Config_OpenAppKey();
+    if (!hKey)
+        return FALSE;
+
+    TCHAR szText[MAX_PATH];
+    DWORD cbData = sizeof(szText);
+    LSTATUS error = ::RegQueryValueEx(hKey, name, NULL, NULL, (LPBYTE)szText, &cbData);
+    szText[_countof(szText) - 1] = 0;
+    ::RegCloseKey(hKey);
+    if (error) {
+        DPRINTA("error: 0x%08lX\n", error);
+        return FALSE;
+    }
+
+    str = szText;
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// リソース文字列。
+
+// このソースを含むモジュールのハンドルを取得する。
+static HMODULE mz_get_module(void)
+{
+    MEMORY_BASIC_INFORMATION mbi;
+    if (!VirtualQuery((LPCVOID)&mz_get_module, &mbi, sizeof(mbi)))
+        return NULL;
+    return (HMODULE)mbi.AllocationBase;
+}
+
+// リソースから文字列を読み込む。
+BOOL mz_load_string(UINT nID, std::wstring& str)
+{
+    WCHAR sz[512];
+    sz[0] = 0;
+    INT cch = ::LoadStringW(mz_get_module(), nID, sz, _countof(sz));
+    str = sz;
+    return cch > 0;
+}
+
+} // extern "C"
+
+//////////////////////////////////////////////////////////////////////////////
+// 文字種変換。
+
+std::wstring mz_lcmap(const std::wstring& str, DWORD dwFlags)
+{
+    WCHAR szBuf[1024];
+    const LCID langid = MAKELANGID(LANG_JAPANESE, SUBLANG_DEFAULT);
+    const LCID lcid = MAKELCID(langid, SORT_DEFAULT);
+    if (str.size() < _countof(szBuf) / 2) {
+        szBuf[0] = 0;
+        ::LCMapStringW(lcid, dwFlags, str.c_str(), -1, szBuf, _countof(szBuf));
+        return szBuf;
+    }
+
+    // 長い文字列（貼り付けられた文章など）はバッファを確保する。
+    INT cch = ::LCMapStringW(lcid, dwFlags, str.c_str(), -1, NULL, 0);
+    if (cch <= 0)
+        return L"";
+    std::vector<WCHAR> buf(cch);
+    ::LCMapStringW(lcid, dwFlags, str.c_str(), -1, &buf[0], cch);
+    return &buf[0];
+}
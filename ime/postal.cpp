@@ -1,5 +1,5 @@
 ﻿// 郵便番号変換。
-#include "mzimeja.h"
+#include "mzconv.h"
 
 // 郵便番号を正規化する。
 // 与えられた文字列が郵便番号ではない場合は空文字列を返す。
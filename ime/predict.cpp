@@ -0,0 +1,346 @@
+﻿// predict.cpp --- mzimeja predictive conversion
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 予測変換。読みの先頭の部分から、辞書の見出し語を単語コストの順に探す。
+
+#include "mzconv.h"
+#include <algorithm>        // for std::stable_sort, std::lower_bound
+
+#define MZ_PREDICT_NONE 0xFFFFFFFF  // 候補のないノード。
+
+// 二つの単位から32ビットの値を読む。
+static inline DWORD mz_predict_dword(const WCHAR *pch)
+{
+    return (WORD)pch[0] | ((DWORD)(WORD)pch[1] << 16);
+}
+
+// 見出し語。
+struct MzPredictor::Word {
+    std::wstring pre;       // 読み。
+    std::wstring post;      // 変換後。
+    HinshiBunrui bunrui;    // 品詞分類。
+    std::wstring tags;      // タグ。
+    INT cost;               // 静的な単語コスト。
+};
+
+static inline bool mz_predict_word_compare_by_pre(const MzPredictor::Word& w1,
+                                                  const MzPredictor::Word& w2)
+{
+    return w1.pre < w2.pre;
+}
+
+static inline bool mz_predict_word_compare_by_cost(const MzPredictor::Word& w1,
+                                                   const MzPredictor::Word& w2)
+{
+    if (w1.cost != w2.cost)
+        return w1.cost < w2.cost;
+    return w1.pre.size() < w2.pre.size();
+}
+
+// 辞書のレコードを分けて、見出し語にする。見出し語にならなければFALSE。
+static BOOL mz_predict_word_from_fields(MzPredictor::Word& word, const WStrings& fields)
+{
+    if (fields.size() < NUM_FIELDS - 1 || fields[I_FIELD_HINSHI].empty())
+        return FALSE;
+    WORD w = (WORD)fields[I_FIELD_HINSHI][0];
+    word.bunrui = (HinshiBunrui)LOBYTE(w);
+    word.pre = fields[I_FIELD_PRE];
+    word.post = fields[I_FIELD_POST];
+    word.tags = (fields.size() > I_FIELD_TAGS) ? fields[I_FIELD_TAGS] : L"";
+    return DictEntryToWord(word.bunrui, (Gyou)HIBYTE(w), word.pre, word.post);
+}
+
+// 索引の上位候補が指すレコードを読む。bPackedなら読みは鍵の符号。
+static BOOL mz_predict_read_word(MzPredictor::Word& word, const WCHAR *data, size_t cch,
+                                 BOOL bPacked, const WCHAR *entry)
+{
+    std::wstring record;
+    if (!GetDictRecord(record, data, cch, mz_predict_dword(entry), bPacked))
+        return FALSE;
+    WStrings fields;
+    WCHAR sep[] = { FIELD_SEP, 0 };
+    str_split(fields, record, sep);
+    if (!mz_predict_word_from_fields(word, fields))
+        return FALSE;
+    word.cost = (WORD)entry[2];
+    return TRUE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzPredictor::Source - 辞書ごとの索引の状態。
+
+struct MzPredictor::Source {
+    // 読みの長さごとの位置。
+    struct Step {
+        DWORD iNode;        // ノード。MZ_PREDICT_NONEなら候補なし。
+        BOOL bFilter;       // ノードより深い。上位候補を読みで絞り込む。
+    };
+
+    Dict *dict;
+    WCHAR *data;            // 辞書データ。
+    size_t cch;             // 辞書データの文字数。
+    BOOL bPacked;           // レコードの読みが鍵の符号か。
+    const WCHAR *nodes;     // ノード群。
+    DWORD cNodes;           // ノードの数。
+    std::vector<Step> steps;
+
+    const WCHAR *Node(DWORD iNode) const {
+        return nodes + iNode * DICT_PREDICT_NODE;
+    }
+    DWORD FirstChild(DWORD iNode) const {
+        return mz_predict_dword(Node(iNode) + 1);
+    }
+    DWORD ChildCount(DWORD iNode) const {
+        return FirstChild(iNode + 1) - FirstChild(iNode);
+    }
+    // 上位候補の並びと数。
+    const WCHAR *Top(DWORD iNode, DWORD *pcTop) const {
+        DWORD dw = mz_predict_dword(Node(iNode) + 3);
+        *pcTop = dw >> DICT_PREDICT_COUNT_SHIFT;
+        DWORD pos = dw & DICT_PREDICT_POS_MASK;
+        if (pos + *pcTop * DICT_PREDICT_ENTRY > cch)
+            *pcTop = 0;
+        return data + pos;
+    }
+
+    // 文字chの子を二分探索する。
+    DWORD FindChild(DWORD iNode, WCHAR ch) const {
+        DWORD lo = FirstChild(iNode), hi = lo + ChildCount(iNode);
+        if (hi > cNodes)
+            return MZ_PREDICT_NONE;
+        while (lo < hi) {
+            DWORD mid = (lo + hi) / 2;
+            WORD w = (WORD)Node(mid)[0];
+            if (w == (WORD)ch)
+                return mid;
+            if (w < (WORD)ch)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return MZ_PREDICT_NONE;
+    }
+
+    // 上位候補に読みがprefixで始まる単語があるか？
+    BOOL HasMatch(DWORD iNode, const std::wstring& prefix) const {
+        DWORD cTop;
+        const WCHAR *top = Top(iNode, &cTop);
+        for (DWORD i = 0; i < cTop; ++i) {
+            MzPredictor::Word word;
+            if (mz_predict_read_word(word, data, cch, bPacked, top + i * DICT_PREDICT_ENTRY) &&
+                word.pre.compare(0, prefix.size(), prefix) == 0)
+            {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// MzPredictor
+
+MzPredictor::MzPredictor()
+{
+    AddSource(g_basic_dict);
+    AddSource(g_name_dict);
+
+    // ユーザー辞書の見出し語を読みの順に並べる。
+    if (g_pfnScanUserDict) {
+        WStrings records;
+        g_pfnScanUserDict(records, 0, NULL);
+        WCHAR sep[] = { FIELD_SEP, 0 };
+        for (size_t i = 0; i < records.size(); ++i) {
+            WStrings fields;
+            str_split(fields, records[i], sep);
+            Word word;
+            if (!mz_predict_word_from_fields(word, fields))
+                continue;
+            word.cost = DictEntryStaticCost(word.bunrui, word.tags, word.pre.size());
+            m_user_words.push_back(word);
+        }
+        std::sort(m_user_words.begin(), m_user_words.end(), mz_predict_word_compare_by_pre);
+    }
+
+    Reset();
+}
+
+MzPredictor::~MzPredictor()
+{
+    for (size_t i = 0; i < m_sources.size(); ++i) {
+        m_sources[i]->dict->Unlock(m_sources[i]->data);
+        delete m_sources[i];
+    }
+}
+
+// 辞書に索引があれば使う。
+void MzPredictor::AddSource(Dict& dict)
+{
+    if (!dict.IsLoaded())
+        return;
+    WCHAR *data = dict.Lock();
+    if (!data)
+        return;
+
+    // 末尾から索引の位置を探し、確かめる。
+    size_t cch = dict.GetLength();
+    DWORD ibIndex = (DWORD)DictFindIndex(data, cch, DICT_PREDICT_SIG1), cNodes = 0;
+    BOOL bValid = FALSE;
+    if (ibIndex && ibIndex + DICT_PREDICT_HEADER <= cch) {
+        const WCHAR *header = data + ibIndex;
+        cNodes = mz_predict_dword(header + 4);
+        bValid = ((WORD)header[0] == DICT_PREDICT_SIG0 &&
+                  (WORD)header[1] == DICT_PREDICT_SIG1 &&
+                  (WORD)header[2] == DICT_PREDICT_VERSION && cNodes > 0 &&
+                  ibIndex + DICT_PREDICT_HEADER + (cNodes + 1) * DICT_PREDICT_NODE <= cch);
+    }
+    if (!bValid) {
+        DPRINTW(L"no predict index\n");
+        dict.Unlock(data);
+        return;
+    }
+
+    Source *source = new Source;
+    source->dict = &dict;
+    source->data = data;
+    source->cch = cch;
+    source->bPacked = (FindKeyIndex(data, cch) != 0);
+    source->nodes = data + ibIndex + DICT_PREDICT_HEADER;
+    source->cNodes = cNodes;
+    m_sources.push_back(source);
+}
+
+void MzPredictor::Reset()
+{
+    m_prefix.clear();
+    for (size_t i = 0; i < m_sources.size(); ++i) {
+        Source::Step step = { 0, FALSE }; // 根。
+        m_sources[i]->steps.assign(1, step);
+    }
+}
+
+BOOL MzPredictor::SetPrefix(const std::wstring& prefix)
+{
+    Reset();
+    BOOL ret = TRUE;
+    for (size_t i = 0; i < prefix.size(); ++i)
+        ret = Push(prefix[i]);
+    return ret;
+}
+
+// 読みを一文字伸ばす。どの辞書にも候補がなくなればFALSEを返すが、
+// Popで戻れるように読みは伸ばしておく。
+BOOL MzPredictor::Push(WCHAR ch)
+{
+    m_prefix += ch;
+
+    BOOL ret = FALSE;
+    for (size_t i = 0; i < m_sources.size(); ++i) {
+        Source *source = m_sources[i];
+        Source::Step step = source->steps.back();
+        if (step.iNode != MZ_PREDICT_NONE) {
+            if (!step.bFilter && source->ChildCount(step.iNode) > 0) {
+                step.iNode = source->FindChild(step.iNode, ch);
+            } else {
+                // 子のないノードの上位候補はその下の単語のすべて。読みで絞り込む。
+                step.bFilter = TRUE;
+                if (!source->HasMatch(step.iNode, m_prefix))
+                    step.iNode = MZ_PREDICT_NONE;
+            }
+        }
+        source->steps.push_back(step);
+        if (step.iNode != MZ_PREDICT_NONE)
+            ret = TRUE;
+    }
+
+    if (!ret) {
+        Word key;
+        key.pre = m_prefix;
+        std::vector<Word>::const_iterator it;
+        it = std::lower_bound(m_user_words.begin(), m_user_words.end(), key,
+                              mz_predict_word_compare_by_pre);
+        ret = (it != m_user_words.end() && it->pre.compare(0, m_prefix.size(), m_prefix) == 0);
+    }
+    return ret;
+}
+
+void MzPredictor::Pop()
+{
+    if (m_prefix.empty())
+        return;
+    m_prefix.resize(m_prefix.size() - 1);
+    for (size_t i = 0; i < m_sources.size(); ++i)
+        m_sources[i]->steps.pop_back();
+}
+
+BOOL MzPredictor::GetCandidates(MzConvResult& result, size_t k) const
+{
+    result.clear();
+
+    // 辞書ごとのノードの上位候補を集める。
+    std::vector<Word> words;
+    for (size_t i = 0; i < m_sources.size(); ++i) {
+        const Source *source = m_sources[i];
+        const Source::Step& step = source->steps.back();
+        if (step.iNode == MZ_PREDICT_NONE)
+            continue;
+        DWORD cTop;
+        const WCHAR *top = source->Top(step.iNode, &cTop);
+        for (DWORD iTop = 0; iTop < cTop; ++iTop) {
+            Word word;
+            if (!mz_predict_read_word(word, source->data, source->cch, source->bPacked,
+                                      top + iTop * DICT_PREDICT_ENTRY))
+            {
+                continue;
+            }
+            if (step.bFilter && word.pre.compare(0, m_prefix.size(), m_prefix) != 0)
+                continue;
+            words.push_back(word);
+        }
+    }
+
+    // ユーザー辞書の見出し語を加える。
+    Word key;
+    key.pre = m_prefix;
+    std::vector<Word>::const_iterator it;
+    it = std::lower_bound(m_user_words.begin(), m_user_words.end(), key,
+                          mz_predict_word_compare_by_pre);
+    for (; it != m_user_words.end(); ++it) {
+        if (it->pre.compare(0, m_prefix.size(), m_prefix) != 0)
+            break;
+        words.push_back(*it);
+    }
+
+    // コストの順に並べ、同じ単語を除いて上位k個にする。
+    std::stable_sort(words.begin(), words.end(), mz_predict_word_compare_by_cost);
+    MzConvClause clause;
+    std::set<std::wstring> seen;
+    for (size_t i = 0; i < words.size() && clause.candidates.size() < k; ++i) {
+        const Word& word = words[i];
+        if (!seen.insert(word.pre + FIELD_SEP + word.post).second)
+            continue;
+        MzConvCandidate cand;
+        cand.pre = word.pre;
+        cand.post = word.post;
+        cand.cost = cand.word_cost = word.cost;
+        cand.bunrui = word.bunrui;
+        cand.bunruis.insert(word.bunrui);
+        cand.tags = mz_tags_from_string(word.tags);
+        clause.candidates.push_back(cand);
+    }
+    if (clause.candidates.empty())
+        return FALSE;
+
+    result.clauses.push_back(clause);
+    return TRUE;
+} // MzPredictor::GetCandidates
+
+//////////////////////////////////////////////////////////////////////////////
+
+// 予測変換。
+BOOL MzConverter::Predict(const std::wstring& prefix, MzConvResult& result, size_t k)
+{
+    MzPredictor predictor;
+    predictor.SetPrefix(prefix);
+    return predictor.GetCandidates(result, k);
+}
@@ -0,0 +1,411 @@
+﻿// reconvert.cpp --- mzimeja reconversion
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 再変換。確定した文字列（表記）を辞書の逆引きの索引で区切って読みに戻し、
+// 通常の変換にかける。
+
+#include "mzconv.h"
+#include <algorithm>        // for std::sort, std::lower_bound
+
+#define MZ_REVERSE_INFINITE 0x7FFFFFFF  // たどり着けない位置のコスト。
+#define MZ_REVERSE_KANA_COST    10      // 辞書にないかな一文字のコスト。
+#define MZ_REVERSE_UNKNOWN_COST 5000    // 辞書にない文字一つのコスト。
+#define MZ_REVERSE_OKURI_BONUS  100     // 活用する語幹に送りがなが続くときに引くコスト。
+
+// 表記の候補。文字列はUTF-16の単位の並び。
+struct MzReverseWord {
+    std::wstring post;      // 表記。
+    std::wstring pre;       // 読み。
+    HinshiBunrui bunrui;    // 品詞分類。
+    Gyou gyou;              // 活用の行。
+    INT cost;               // 静的な単語コスト。
+};
+
+// 語幹の後の文字chが送りがな（活用語尾）になりうるか？
+// かなは読みが決まっているので、かなで区切るより語幹と送りがなに分けたい。
+static BOOL mz_reverse_is_okurigana(HinshiBunrui bunrui, Gyou gyou, WCHAR ch)
+{
+    // 五段動詞の行ごとの活用語尾（音便を含む）。
+    static const wchar_t *s_godan_rows[] = {
+        L"わいうえおっ", L"かきくけこい", L"がぎぐげごい", L"さしすせそ",
+        L"ざじずぜぞ", L"たちつてとっ", L"だぢづでど", L"なにぬねのん",
+        L"はひふへほ", L"ばびぶべぼん", L"ぱぴぷぺぽ", L"まみむめもん",
+        L"やゆよ", L"らりるれろっ", L"わいうえおっ",
+    };
+
+    switch (bunrui) {
+    case HB_GODAN_DOUSHI:
+        if (gyou >= GYOU_NN)
+            return FALSE;
+        return wcschr(s_godan_rows[gyou], ch) != NULL;
+    case HB_IKEIYOUSHI:
+        return wcschr(L"いかきくけさそ", ch) != NULL;
+    default:
+        return FALSE;
+    }
+}
+
+static inline bool mz_reverse_word_compare(const MzReverseWord& w1, const MzReverseWord& w2)
+{
+    return w1.post < w2.post;
+}
+
+// 二つの単位から32ビットの値を読む。
+static inline DWORD mz_reverse_dword(const WCHAR *pch)
+{
+    return (WORD)pch[0] | ((DWORD)(WORD)pch[1] << 16);
+}
+
+// レコードの位置から表記の位置と長さを得る。読みが鍵の符号でも、区切りは同じ。
+static const WCHAR *mz_reverse_post(const WCHAR *data, size_t cch, DWORD offset, size_t *pcch)
+{
+    *pcch = 0;
+    if (offset >= cch)
+        return NULL;
+    const WCHAR *pch = data + offset;
+    while (*pch && *pch != FIELD_SEP && *pch != RECORD_SEP)
+        ++pch;
+    if (*pch != FIELD_SEP)
+        return NULL;
+    const WCHAR *post = ++pch;
+    while (*pch && *pch != FIELD_SEP && *pch != RECORD_SEP)
+        ++pch;
+    *pcch = pch - post;
+    return post;
+}
+
+// 表記の先頭cchKey単位とkeyを比べる。
+static int mz_reverse_compare(const WCHAR *post, size_t cchPost, const WCHAR *key, size_t cchKey)
+{
+    for (size_t i = 0; i < cchKey; ++i) {
+        if (i >= cchPost)
+            return -1;
+        if ((WORD)post[i] != (WORD)key[i])
+            return ((WORD)post[i] < (WORD)key[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// MzReverseDict - 辞書の逆引きの索引。
+
+class MzReverseDict {
+public:
+    MzReverseDict(Dict& dict);
+    ~MzReverseDict();
+
+    BOOL IsValid() const { return m_entries != NULL; }
+
+    // 表記がunits[ich]から始まる単語をwordsに加える。
+    void Lookup(std::vector<MzReverseWord>& words, const std::wstring& units, size_t ich) const;
+
+protected:
+    Dict& m_dict;
+    WCHAR *m_data;              // 辞書データ。
+    size_t m_cch;               // 辞書データの文字数。
+    const WCHAR *m_entries;     // 表記の順のレコードの位置。
+    DWORD m_cEntries;           // レコードの数。
+    BOOL m_bPacked;             // レコードの読みが鍵の符号か。
+
+    const WCHAR *Post(DWORD iEntry, size_t *pcch) const {
+        DWORD offset = mz_reverse_dword(m_entries + iEntry * DICT_REVERSE_ENTRY);
+        return mz_reverse_post(m_data, m_cch, offset, pcch);
+    }
+    // [lo, hi)のうち、表記の先頭cchKey単位がkeyと比べてbUpperなら以下、でなければ未満でない最初。
+    DWORD Bound(DWORD lo, DWORD hi, const WCHAR *key, size_t cchKey, BOOL bUpper) const;
+
+private:
+    MzReverseDict(const MzReverseDict&);
+    MzReverseDict& operator=(const MzReverseDict&);
+};
+
+MzReverseDict::MzReverseDict(Dict& dict) : m_dict(dict), m_data(NULL), m_cch(0),
+                                           m_entries(NULL), m_cEntries(0), m_bPacked(FALSE)
+{
+    if (!dict.IsLoaded())
+        return;
+    m_data = dict.Lock();
+    if (!m_data)
+        return;
+
+    // 末尾から索引の位置を探し、確かめる。
+    m_cch = dict.GetLength();
+    DWORD ibIndex = (DWORD)DictFindIndex(m_data, m_cch, DICT_REVERSE_SIG1);
+    if (ibIndex && ibIndex + DICT_REVERSE_HEADER <= m_cch) {
+        const WCHAR *header = m_data + ibIndex;
+        DWORD cEntries = mz_reverse_dword(header + 4);
+        if ((WORD)header[0] == DICT_PREDICT_SIG0 &&
+            (WORD)header[1] == DICT_REVERSE_SIG1 &&
+            (WORD)header[2] == DICT_REVERSE_VERSION &&
+            ibIndex + DICT_REVERSE_HEADER + cEntries * DICT_REVERSE_ENTRY <= m_cch)
+        {
+            m_entries = header + DICT_REVERSE_HEADER;
+            m_cEntries = cEntries;
+        }
+    }
+    if (!m_entries)
+        DPRINTW(L"no reverse index\n");
+    m_bPacked = (FindKeyIndex(m_data, m_cch) != 0);
+}
+
+MzReverseDict::~MzReverseDict()
+{
+    if (m_data)
+        m_dict.Unlock(m_data);
+}
+
+DWORD MzReverseDict::Bound(DWORD lo, DWORD hi, const WCHAR *key, size_t cchKey, BOOL bUpper) const
+{
+    while (lo < hi) {
+        DWORD mid = (lo + hi) / 2;
+        size_t cchPost;
+        const WCHAR *post = Post(mid, &cchPost);
+        int cmp = post ? mz_reverse_compare(post, cchPost, key, cchKey) : -1;
+        if (cmp < 0 || (bUpper && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// 一単位ずつ伸ばしながら範囲を二分探索で狭める。表記の順なので、
+// 範囲の先頭にあるのが伸ばした長さとちょうど同じ表記。
+void MzReverseDict::Lookup(std::vector<MzReverseWord>& words, const std::wstring& units,
+                           size_t ich) const
+{
+    if (!m_entries)
+        return;
+
+    const WCHAR *key = units.c_str() + ich;
+    DWORD lo = 0, hi = m_cEntries;
+    WCHAR sep[] = { FIELD_SEP, 0 };
+    for (size_t cchKey = 1; ich + cchKey <= units.size() && lo < hi; ++cchKey) {
+        lo = Bound(lo, hi, key, cchKey, FALSE);
+        hi = Bound(lo, hi, key, cchKey, TRUE);
+        for (DWORD i = lo; i < hi; ++i) {
+            size_t cchPost;
+            const WCHAR *post = Post(i, &cchPost);
+            if (cchPost != cchKey)
+                break;
+
+            // レコードを分けて、読みとコストを得る。
+            DWORD offset = mz_reverse_dword(m_entries + i * DICT_REVERSE_ENTRY);
+            const WCHAR *pch1 = m_data + offset, *pch2 = pch1;
+            while (*pch2 && *pch2 != RECORD_SEP)
+                ++pch2;
+            WStrings fields;
+            str_split(fields, std::wstring(pch1, pch2), sep);
+            if (fields.size() < NUM_FIELDS - 1 || fields[I_FIELD_HINSHI].empty())
+                continue;
+
+            MzReverseWord word;
+            word.post.assign(post, cchPost);
+            if (m_bPacked) {
+                const std::wstring& pre = fields[I_FIELD_PRE];
+                if (!DictKeyDecode(word.pre, pre.c_str(), pre.size()))
+                    continue;
+            } else {
+                word.pre = fields[I_FIELD_PRE];
+            }
+            WORD w = (WORD)fields[I_FIELD_HINSHI][0];
+            word.bunrui = (HinshiBunrui)LOBYTE(w);
+            word.gyou = (Gyou)HIBYTE(w);
+            std::wstring tags = (fields.size() > I_FIELD_TAGS) ? fields[I_FIELD_TAGS] : L"";
+            word.cost = DictEntryStaticCost(word.bunrui, tags, cchPost);
+            words.push_back(word);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// ユーザー辞書の単語を表記の順に並べる。小さいので索引は作らない。
+static void mz_reverse_user_words(std::vector<MzReverseWord>& user_words)
+{
+    if (!g_pfnScanUserDict)
+        return;
+
+    WStrings records;
+    g_pfnScanUserDict(records, 0, NULL);
+    WCHAR sep[] = { FIELD_SEP, 0 };
+    for (size_t i = 0; i < records.size(); ++i) {
+        WStrings fields;
+        str_split(fields, records[i], sep);
+        if (fields.size() < NUM_FIELDS - 1 || fields[I_FIELD_HINSHI].empty())
+            continue;
+        MzReverseWord word;
+        mz_split_utf16(word.post, fields[I_FIELD_POST]);
+        mz_split_utf16(word.pre, fields[I_FIELD_PRE]);
+        if (word.post.empty() || word.pre.empty())
+            continue;
+        WORD w = (WORD)fields[I_FIELD_HINSHI][0];
+        word.bunrui = (HinshiBunrui)LOBYTE(w);
+        word.gyou = (Gyou)HIBYTE(w);
+        std::wstring tags = (fields.size() > I_FIELD_TAGS) ? fields[I_FIELD_TAGS] : L"";
+        word.cost = DictEntryStaticCost(word.bunrui, tags, fields[I_FIELD_POST].size());
+        user_words.push_back(word);
+    }
+    std::sort(user_words.begin(), user_words.end(), mz_reverse_word_compare);
+}
+
+// 表記の区切り。
+struct MzReverseSegment {
+    std::wstring post;      // 表記。
+    std::wstring pre;       // 読み。
+};
+
+// 表記を区切って読みを得る。表記の上で最小コストの経路を求める。
+// 単語のコストは読みではなく表記の長さで求める（同じ表記の読みを公平に比べる）。
+// 辞書にないかなはそのまま（カタカナはひらがなにして）読みとし、
+// 辞書にないその他の文字もそのまま残す。
+static BOOL mz_reverse_segment(const std::wstring& text, std::vector<MzReverseSegment>& segments)
+{
+    segments.clear();
+    if (text.empty())
+        return FALSE;
+
+    std::wstring units;
+    mz_split_utf16(units, text);
+
+    MzReverseDict basic(g_basic_dict), name(g_name_dict);
+    if (!basic.IsValid() && !name.IsValid())
+        return FALSE;
+    std::vector<MzReverseWord> user_words;
+    mz_reverse_user_words(user_words);
+
+    // 位置ごとの最小コストと、そこへ来た単語。
+    const size_t cch = units.size();
+    std::vector<INT> costs(cch + 1, MZ_REVERSE_INFINITE);
+    std::vector<size_t> froms(cch + 1, 0);
+    std::vector<std::wstring> pres(cch + 1);
+    costs[0] = 0;
+
+    for (size_t ich = 0; ich < cch; ++ich) {
+        if (costs[ich] == MZ_REVERSE_INFINITE)
+            continue;
+
+        std::vector<MzReverseWord> words;
+        basic.Lookup(words, units, ich);
+        name.Lookup(words, units, ich);
+
+        // ユーザー辞書は最初の単位が同じ単語を調べる。
+        MzReverseWord key;
+        key.post = units.substr(ich, 1);
+        std::vector<MzReverseWord>::const_iterator it;
+        it = std::lower_bound(user_words.begin(), user_words.end(), key, mz_reverse_word_compare);
+        for (; it != user_words.end() && it->post[0] == units[ich]; ++it) {
+            if (units.compare(ich, it->post.size(), it->post) == 0)
+                words.push_back(*it);
+        }
+
+        // 辞書にない一文字。サロゲートペアは分けない。
+        MzReverseWord word;
+        size_t cchChar = 1;
+        if (0xD800 <= units[ich] && units[ich] <= 0xDBFF && ich + 1 < cch &&
+            0xDC00 <= units[ich + 1] && units[ich + 1] <= 0xDFFF)
+        {
+            cchChar = 2;
+        }
+        word.post = units.substr(ich, cchChar);
+        word.bunrui = HB_UNKNOWN;
+        word.gyou = GYOU_NN;
+        if (mz_is_hiragana(units[ich])) {
+            word.pre = word.post;
+            word.cost = MZ_REVERSE_KANA_COST;
+        } else if (mz_is_fullwidth_katakana(units[ich])) {
+            word.pre = mz_lcmap(word.post, LCMAP_HIRAGANA);
+            word.cost = MZ_REVERSE_KANA_COST;
+        } else {
+            word.pre = word.post;
+            word.cost = MZ_REVERSE_UNKNOWN_COST;
+        }
+        words.push_back(word);
+
+        for (size_t i = 0; i < words.size(); ++i) {
+            size_t ichEnd = ich + words[i].post.size();
+            INT cost = costs[ich] + words[i].cost;
+            if (ichEnd < cch && mz_reverse_is_okurigana(words[i].bunrui, words[i].gyou, units[ichEnd]))
+                cost -= MZ_REVERSE_OKURI_BONUS;
+            if (cost < costs[ichEnd]) {
+                costs[ichEnd] = cost;
+                froms[ichEnd] = ich;
+                pres[ichEnd] = words[i].pre;
+            }
+        }
+    }
+
+    // 後ろからたどる。
+    for (size_t ich = cch; ich > 0; ich = froms[ich]) {
+        MzReverseSegment segment;
+        const WCHAR *post = units.c_str() + froms[ich];
+        mz_assign_utf16(segment.post, post, units.c_str() + ich);
+        mz_assign_utf16(segment.pre, pres[ich].c_str(), pres[ich].c_str() + pres[ich].size());
+        segments.insert(segments.begin(), segment);
+    }
+    return TRUE;
+}
+
+// 表記から読みを得る。
+BOOL MzConverter::GetReading(const std::wstring& text, std::wstring& reading)
+{
+    reading.clear();
+    std::vector<MzReverseSegment> segments;
+    if (!mz_reverse_segment(text, segments))
+        return FALSE;
+    for (size_t i = 0; i < segments.size(); ++i)
+        reading += segments[i].pre;
+    return TRUE;
+} // MzConverter::GetReading
+
+// 再変換。表記を読みに戻して複数文節変換し、文節の区切りが表記の区切りと
+// 合う文節では、元の表記を最初の候補にする。
+BOOL MzConverter::Reconvert(const std::wstring& text, MzConvResult& result)
+{
+    std::vector<MzReverseSegment> segments;
+    if (!mz_reverse_segment(text, segments))
+        return FALSE;
+    std::wstring reading;
+    for (size_t i = 0; i < segments.size(); ++i)
+        reading += segments[i].pre;
+    if (!ConvertMultiClause(reading, result))
+        return FALSE;
+
+    size_t iSegment = 0, ichSegment = 0; // 表記の区切りと、その読みの位置。
+    size_t ich = 0;                         // 文節の読みの位置。
+    for (size_t iClause = 0; iClause < result.clauses.size(); ++iClause) {
+        MzConvClause& clause = result.clauses[iClause];
+        if (clause.candidates.empty())
+            continue;
+        size_t ichEnd = ich + clause.candidates[0].pre.size();
+
+        // 文節の始まりより前の区切りを飛ばす。
+        while (iSegment < segments.size() && ichSegment < ich)
+            ichSegment += segments[iSegment++].pre.size();
+
+        // 文節に収まる区切りの表記をつなげる。
+        std::wstring post;
+        BOOL bAligned = (ichSegment == ich);
+        while (bAligned && iSegment < segments.size() && ichSegment < ichEnd) {
+            post += segments[iSegment].post;
+            ichSegment += segments[iSegment++].pre.size();
+        }
+        ich = ichEnd;
+        if (!bAligned || ichSegment != ichEnd)
+            continue;
+
+        candidates_t::iterator it, end = clause.candidates.end();
+        for (it = clause.candidates.begin(); it != end; ++it) {
+            if (it->post == post)
+                break;
+        }
+        if (it == clause.candidates.begin())
+            continue;
+        MzConvCandidate cand = (it != end) ? *it : clause.candidates[0];
+        if (it != end)
+            clause.candidates.erase(it);
+        cand.post = post;
+        clause.candidates.insert(clause.candidates.begin(), cand);
+    }
+    return TRUE;
+} // MzConverter::Reconvert
@@ -29,40 +29,6 @@
 #define IDM_RADICALS                        40018
 #define IDM_IME_PROPERTY                    40019
 
-#define IDS_PAREN                           100
-#define IDS_SYMBOLS                         101
-#define IDS_KEISEN                          102
-#define IDS_MATH                            103
-#define IDS_SANKAKU                         104
-#define IDS_SHIKAKU                         105
-#define IDS_ZUKEI                           106
-#define IDS_MARU                            107
-#define IDS_STARS                           108
-#define IDS_HISHI                           109
-#define IDS_POINTS                          110
-#define IDS_UNITS                           111
-#define IDS_FUTOUGOU                        112
-#define IDS_TATE                            113
-#define IDS_TATE_HIDARI                     114
-#define IDS_TATE_MIGI                       115
-#define IDS_HIDARI_UE                       116
-#define IDS_HIDARI_SHITA                    117
-#define IDS_FUTO_WAKU                       118
-#define IDS_HOSO_WAKU                       119
-#define IDS_MANNAKA                         120
-#define IDS_MIGI_UE                         121
-#define IDS_MIGI_SHITA                      122
-#define IDS_YOKO                            123
-#define IDS_YOKO_UE                         124
-#define IDS_YOKO_SHITA                      125
-#define IDS_SAME                            126
-#define IDS_ARROWS                          127
-#define IDS_GREEK                           128
-#define IDS_UP                              129
-#define IDS_DOWN                            130
-#define IDS_LEFT                            131
-#define IDS_RIGHT                           132
-#define IDS_ARROWS2                         133
 #define IDS_WORD                            134
 #define IDS_READING                         135
 #define IDS_HINSHI                          136
@@ -0,0 +1,180 @@
+﻿// shard.cpp --- mzimeja sharded dictionaries
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 分割辞書。読みの先頭の文字で分けた辞書ファイルを、必要になったときに読み込む。
+
+#include "mzconv.h"
+
+#define MZ_SHARD_BUDGET (8 * 1024 * 1024)   // 読み込んだ分割の大きさの既定の予算（バイト）。
+
+MzShardedDict g_domain_dict;
+
+// 分割。
+struct MzShardedDict::Shard {
+    std::wstring file;                  // ファイルのパス名。
+    std::vector<WCHAR> data;            // 辞書データ。空なら読み込んでいない。
+    size_t ichKeys;                     // 読みの索引の位置。なければ0。
+    std::list<Shard *>::iterator lru;   // m_lruでの位置。読み込んだときだけ有効。
+    BOOL bBroken;                       // 読み込めなかったか？
+};
+
+MzShardedDict::MzShardedDict()
+    : m_cbBudget(MZ_SHARD_BUDGET)
+    , m_nLoads(0)
+    , m_nEvictions(0)
+    , m_cbResident(0)
+{
+    m_hLock = mz_mutex_open(NULL);
+}
+
+MzShardedDict::~MzShardedDict()
+{
+    Unload();
+    mz_mutex_close(m_hLock);
+}
+
+// 分割辞書の目録を読み込む。
+BOOL MzShardedDict::Load(LPCWSTR manifest_file)
+{
+    // 目録はUTF-16LEのテキスト。
+    DWORD cbSize = mz_get_file_size(manifest_file);
+    if (cbSize < 2 * sizeof(WORD))
+        return FALSE;
+    std::vector<WCHAR> buf(cbSize / 2);
+    if (mz_read_utf16_file(manifest_file, &buf[0], buf.size()) != buf.size())
+        return FALSE;
+    std::wstring text;
+    mz_assign_utf16(text, &buf[0] + 1, &buf[0] + buf.size()); // BOMを除く。
+
+    WStrings lines, fields;
+    str_split(lines, text, std::wstring(L"\n"));
+
+    // 署名とバージョンを確かめる。
+    WCHAR sz[32];
+    StringCchPrintfW(sz, _countof(sz), L"%s\t%d", DICT_SHARD_SIGNATURE, DICT_SHARD_VERSION);
+    str_trim_right(lines[0], L"\r");
+    if (lines[0] != sz) {
+        DPRINTW(L"%s: bad manifest\n", manifest_file);
+        return FALSE;
+    }
+
+    // 分割のファイル名は目録のフォルダからの相対。
+    std::wstring dir = manifest_file;
+    size_t ich = dir.find_last_of(L"\\/");
+    dir.resize(ich == dir.npos ? 0 : ich + 1);
+
+    // 行は「ファイル名 \t 先頭の文字の並び」。分割はまだ読み込まない。
+    size_t count = 0;
+    mz_mutex_lock(m_hLock, INFINITE);
+    for (size_t i = 1; i < lines.size(); ++i) {
+        str_trim_right(lines[i], L"\r");
+        str_split(fields, lines[i], std::wstring(L"\t"));
+        if (fields.size() != 2 || fields[0].empty() || fields[1].empty())
+            continue;
+        Shard *shard = new Shard;
+        shard->file = dir + fields[0];
+        shard->bBroken = FALSE;
+        m_shards.push_back(shard);
+        const std::wstring& chars = fields[1];
+        for (size_t j = 0; j < chars.size(); ++j)
+            m_index[chars[j]].push_back(shard);
+        ++count;
+    }
+    mz_mutex_unlock(m_hLock);
+
+    DPRINTW(L"%s: %d shards\n", manifest_file, (INT)count);
+    return count != 0;
+}
+
+// すべての分割辞書をアンロードする。
+void MzShardedDict::Unload()
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    for (size_t i = 0; i < m_shards.size(); ++i)
+        delete m_shards[i];
+    m_shards.clear();
+    m_index.clear();
+    m_lru.clear();
+    m_cbResident = 0;
+    mz_mutex_unlock(m_hLock);
+}
+
+// 分割を読み込む。ロックしてから呼ぶこと。
+BOOL MzShardedDict::LoadShard(Shard *shard)
+{
+    DWORD cbSize = mz_get_file_size(shard->file.c_str());
+    size_t cch = cbSize / 2;
+    if (cch < 2) {
+        shard->bBroken = TRUE;
+        return FALSE;
+    }
+
+    // レコード群はNULで終わるが、念のためNULを足しておく。
+    shard->data.resize(cch + 1);
+    if (mz_read_utf16_file(shard->file.c_str(), &shard->data[0], cch) != cch) {
+        EPRINTW(L"%s: cannot read\n", shard->file.c_str());
+        std::vector<WCHAR>().swap(shard->data);
+        shard->bBroken = TRUE;
+        return FALSE;
+    }
+    shard->data[cch] = 0;
+    shard->ichKeys = FindKeyIndex(&shard->data[0], cch);
+
+    m_lru.push_front(shard);
+    shard->lru = m_lru.begin();
+    m_cbResident += DWORD(shard->data.size() * sizeof(WCHAR));
+    InterlockedIncrement(&m_nLoads);
+    return TRUE;
+}
+
+// 予算を超えていたら、しばらく使っていない分割から捨てる。keepは捨てない。
+// ロックしてから呼ぶこと。
+void MzShardedDict::Evict(Shard *keep)
+{
+    while (m_cbResident > m_cbBudget && !m_lru.empty()) {
+        Shard *shard = m_lru.back();
+        if (shard == keep)
+            break;
+        m_lru.pop_back();
+        m_cbResident -= DWORD(shard->data.size() * sizeof(WCHAR));
+        std::vector<WCHAR>().swap(shard->data);
+        InterlockedIncrement(&m_nEvictions);
+    }
+}
+
+// 読みが文字chで始まる単語のレコードを追加する。
+size_t MzShardedDict::Scan(WStrings& records, WCHAR ch, const std::string& key, size_t ib)
+{
+    if (ch == 0 || m_shards.empty())
+        return 0;
+
+    size_t count = 0;
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<WCHAR, std::vector<Shard *> >::iterator it = m_index.find(ch);
+    if (it != m_index.end()) {
+        WStrings found;
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            Shard *shard = it->second[i];
+            if (shard->data.empty()) {
+                if (shard->bBroken || !LoadShard(shard))
+                    continue;
+                Evict(shard);
+            } else {
+                m_lru.splice(m_lru.begin(), m_lru, shard->lru); // 最近使った。
+            }
+
+            // レコードは文字列にしてから返すので、ロックを解除したら捨ててよい。
+            BOOL bFound;
+            if (shard->ichKeys)
+                bFound = ScanKeyIndex(found, &shard->data[0], shard->ichKeys, key, ib) != 0;
+            else
+                bFound = ScanBasicDict(found, &shard->data[0], ch) != 0;
+            if (bFound) {
+                records.insert(records.end(), found.begin(), found.end());
+                count += found.size();
+            }
+        }
+    }
+    mz_mutex_unlock(m_hLock);
+    return count;
+}
@@ -0,0 +1,355 @@
+﻿// special.cpp --- mzimeja special conversions
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 特別な変換。読みの完全ハッシュで、日付や記号などの生成器を引く。
+
+#include "mzconv.h"
+#include <algorithm>        // for std::sort, std::find
+
+MzSpecialConvs g_special_convs;
+
+// 組み込みの特別な変換。記号の並びもここに入れてビルドする。
+static const struct {
+    LPCWSTR pre;
+    MZ_SPECIAL_KIND kind;
+    INT value;
+    LPCWSTR text;
+} s_builtin[] = {
+    { L"きょう", MZSC_DAY, 0, L"今日" },
+    { L"きのう", MZSC_DAY, -1, L"昨日" },
+    { L"さくじつ", MZSC_DAY, -1, L"昨日" },
+    { L"あす", MZSC_DAY, +1, L"明日" },
+    { L"あした", MZSC_DAY, +1, L"明日" },
+    { L"あさって", MZSC_DAY, +2, L"明後日" },
+    { L"おととい", MZSC_DAY, -2, L"一昨日" },
+    { L"ことし", MZSC_YEAR, 0, L"今年" },
+    { L"きょねん", MZSC_YEAR, -1, L"去年" },
+    { L"さくねん", MZSC_YEAR, -1, L"昨年" },
+    { L"らいねん", MZSC_YEAR, +1, L"来年" },
+    { L"さらいねん", MZSC_YEAR, +2, L"再来年" },
+    { L"こんげつ", MZSC_MONTH, 0, L"今月" },
+    { L"せんげつ", MZSC_MONTH, -1, L"先月" },
+    { L"らいげつ", MZSC_MONTH, +1, L"来月" },
+    { L"じこく", MZSC_TIME, 0, L"時刻" },
+    { L"ただいま", MZSC_TIME, 0, L"ただ今" },
+    { L"にちじ", MZSC_DATETIME, 0, L"日時" },
+    { L"じぶん", MZSC_USER, 0, L"" },
+    { L"かっこ", MZSC_WORDS, 0, L"【】\t『』\t《》\t“\"\t「」\t〈〉\t｛｝\t［］\t（）\t≪≫\t｢｣\t{}\t[]\t<>\t()\t<>\t‘’\t〔〕" },
+    { L"きごう", MZSC_SYMBOLS, 0, L"〃仝ゝゞ々〆ヾ―‐／〇ヽ＿￣¨｀´゜゛＼§＾≫￢⇒⇔∀∃∠⊥⌒∂∇≡∨≪†√∽∝∵∫∬Å‰♯♭♪‡～′≒×∥∧｜…±÷≠≦≧∞∴♂♀∪‥°⊃⊂⊇∩⊆∋∈〓〒※″" },
+    { L"けいせん", MZSC_SYMBOLS, 0, L"─│┌┐┘└├┬┤┴┼━┃┏┓┛┗┣┳┫┻╋┠┯┨┷┿┝┰┥┸╂" },
+    { L"けいさん", MZSC_SYMBOLS, 0, L"≧÷±－×＋＝≠＜≦＞" },
+    { L"さんかく", MZSC_SYMBOLS, 0, L"▲▽△▼" },
+    { L"しかく", MZSC_SYMBOLS, 0, L"◇◆□■" },
+    { L"ずけい", MZSC_SYMBOLS, 0, L"★○▼▽▲△■□◆◇◎●☆" },
+    { L"まる", MZSC_SYMBOLS, 0, L"．｡〇。●○◎" },
+    { L"ほし", MZSC_SYMBOLS, 0, L"☆※★" },
+    { L"ひし", MZSC_SYMBOLS, 0, L"◆◇" },
+    { L"てん", MZSC_SYMBOLS, 0, L"゜゛；：．，、´.・｀¨…‥∵･:;ﾞﾟ∴" },
+    { L"たんい", MZSC_SYMBOLS, 0, L"′″℃￥Å￠￡％‰＄°" },
+    { L"ふとうごう", MZSC_SYMBOLS, 0, L"≧≦≠" },
+    { L"たて", MZSC_SYMBOLS, 0, L"│┃" },
+    { L"たてひだり", MZSC_SYMBOLS, 0, L"┨┥┤┫" },
+    { L"たてみぎ", MZSC_SYMBOLS, 0, L"┣┠┝├" },
+    { L"ひだりうえ", MZSC_SYMBOLS, 0, L"┌┏" },
+    { L"ひだりした", MZSC_SYMBOLS, 0, L"└┗" },
+    { L"ふとわく", MZSC_SYMBOLS, 0, L"┗┻━┛┏┳━┓" },
+    { L"ほそわく", MZSC_SYMBOLS, 0, L"└┴─┘┌┬─┐" },
+    { L"まんなか", MZSC_SYMBOLS, 0, L"┼╋┿╂" },
+    { L"みぎうえ", MZSC_SYMBOLS, 0, L"┐┓" },
+    { L"みぎした", MZSC_SYMBOLS, 0, L"┘┛" },
+    { L"よこ", MZSC_SYMBOLS, 0, L"─━" },
+    { L"よこうえ", MZSC_SYMBOLS, 0, L"┻┷┸┴" },
+    { L"よこした", MZSC_SYMBOLS, 0, L"┳┯┰┬" },
+    { L"おなじ", MZSC_SYMBOLS, 0, L"〃仝ゞゝヾヽ々" },
+    { L"やじるし", MZSC_SYMBOLS, 0, L"→↓←↑⇒⇔" },
+    { L"ぎりしゃ", MZSC_SYMBOLS, 0, L"αβγδεζηθθικλμνξοπρστυφχψωΑΒΓΔΕΖΗΘΘΙΚΛΜΝΞΟΠΡΣΤΥΦΧΨΩ" },
+    { L"うえ", MZSC_SYMBOLS, 0, L"↑" },
+    { L"した", MZSC_SYMBOLS, 0, L"↓" },
+    { L"ひだり", MZSC_SYMBOLS, 0, L"←" },
+    { L"みぎ", MZSC_SYMBOLS, 0, L"→⇒" },
+    { L"や", MZSC_SYMBOLS, 0, L"→↓←↑⇒⇔" },
+};
+
+// データファイルでの種類の名前。
+static const struct {
+    LPCWSTR name;
+    MZ_SPECIAL_KIND kind;
+} s_kind_names[] = {
+    { L"day", MZSC_DAY },
+    { L"month", MZSC_MONTH },
+    { L"year", MZSC_YEAR },
+    { L"time", MZSC_TIME },
+    { L"datetime", MZSC_DATETIME },
+    { L"user", MZSC_USER },
+    { L"words", MZSC_WORDS },
+    { L"symbols", MZSC_SYMBOLS },
+};
+
+// 読みのハッシュ値。FNV-1aに種seedを混ぜる。
+static DWORD SpecialHash(DWORD seed, const std::wstring& pre)
+{
+    DWORD hash = 2166136261U ^ (seed * 0x9E3779B9U);
+    for (size_t i = 0; i < pre.size(); ++i) {
+        hash ^= DWORD(pre[i]);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+MzSpecialConvs::MzSpecialConvs() : m_table(NULL), m_nEpoch(0)
+{
+    m_nReaders[0] = m_nReaders[1] = 0;
+    m_hLock = mz_mutex_open(NULL);
+    Reset();
+}
+
+MzSpecialConvs::~MzSpecialConvs()
+{
+    delete m_table;
+    mz_mutex_close(m_hLock);
+}
+
+// 公開中の表を読み始める。読み終わったらReleaseTableを呼ぶこと。
+// 今の世代で数えてから、世代が変わっていなければ表を読む。
+const MzSpecialConvs::Table *MzSpecialConvs::AcquireTable(LONG& nEpoch) const
+{
+    for (;;) {
+        nEpoch = m_nEpoch;
+        InterlockedIncrement(&m_nReaders[nEpoch & 1]);
+        if (InterlockedCompareExchange((volatile LONG *)&m_nEpoch, nEpoch, nEpoch) == nEpoch)
+            return m_table;
+        InterlockedDecrement(&m_nReaders[nEpoch & 1]);
+    }
+}
+
+void MzSpecialConvs::ReleaseTable(LONG nEpoch) const
+{
+    InterlockedDecrement(&m_nReaders[nEpoch & 1]);
+}
+
+// 新しい表を公開する。m_hLockを持って呼ぶこと。
+// 表を入れ替えてから世代を進める。古い表を読んでいるかもしれないのは前の世代で
+// 数えたスレッドだけで、そこにはもう誰も加わらないので、数が0になったら古い表を消す。
+void MzSpecialConvs::Publish(Table *table)
+{
+    Table *old = (Table *)InterlockedExchangePointer((LPVOID volatile *)&m_table, table);
+    LONG nEpoch = m_nEpoch;
+    InterlockedExchange(&m_nEpoch, nEpoch + 1);
+    while (m_nReaders[nEpoch & 1] != 0)
+        mz_yield();
+    delete old;
+}
+
+// 組み込みの項目だけに戻す。
+void MzSpecialConvs::Reset()
+{
+    Table *table = new Table;
+    table->entries.resize(_countof(s_builtin));
+    for (size_t i = 0; i < _countof(s_builtin); ++i) {
+        table->entries[i].pre = s_builtin[i].pre;
+        table->entries[i].kind = s_builtin[i].kind;
+        table->entries[i].value = s_builtin[i].value;
+        table->entries[i].text = s_builtin[i].text;
+    }
+    table->Build();
+
+    mz_mutex_lock(m_hLock, INFINITE);
+    Publish(table);
+    mz_mutex_unlock(m_hLock);
+}
+
+// 完全ハッシュを作る（hash and displace）。公開する前に呼ぶこと。
+// 読みの数と同じ数のバケツに分け、大きいバケツから順に、
+// すべての読みが空いたスロットに入る種を探す。一つだけのバケツは空きスロットに直接入れる。
+void MzSpecialConvs::Table::Build()
+{
+    const size_t count = entries.size();
+    displace.assign(count, 0);
+    slots.assign(count, DWORD(-1));
+    if (count == 0)
+        return;
+
+    std::vector<std::vector<DWORD> > buckets(count);
+    for (size_t i = 0; i < count; ++i)
+        buckets[SpecialHash(0, entries[i].pre) % count].push_back(DWORD(i));
+
+    std::vector<std::pair<size_t, size_t> > order; // (大きさ, バケツ)
+    for (size_t b = 0; b < count; ++b) {
+        if (buckets[b].size())
+            order.push_back(std::make_pair(buckets[b].size(), b));
+    }
+    std::sort(order.rbegin(), order.rend());
+
+    size_t iOrder;
+    std::vector<size_t> used;
+    for (iOrder = 0; iOrder < order.size(); ++iOrder) {
+        const std::vector<DWORD>& bucket = buckets[order[iOrder].second];
+        if (bucket.size() <= 1)
+            break;
+        for (DWORD seed = 1; ; ++seed) {
+            used.clear();
+            size_t k;
+            for (k = 0; k < bucket.size(); ++k) {
+                size_t slot = SpecialHash(seed, entries[bucket[k]].pre) % count;
+                if (slots[slot] != DWORD(-1) ||
+                    std::find(used.begin(), used.end(), slot) != used.end())
+                {
+                    break;
+                }
+                used.push_back(slot);
+            }
+            if (k == bucket.size()) {
+                for (k = 0; k < bucket.size(); ++k)
+                    slots[used[k]] = bucket[k];
+                displace[order[iOrder].second] = INT(seed);
+                break;
+            }
+        }
+    }
+
+    size_t slot = 0;
+    for (; iOrder < order.size(); ++iOrder) {
+        while (slots[slot] != DWORD(-1))
+            ++slot;
+        slots[slot] = buckets[order[iOrder].second][0];
+        displace[order[iOrder].second] = -INT(slot + 1);
+    }
+}
+
+// 読みから項目を引く。文字列の比較は一回だけ。
+const MzSpecialConv *MzSpecialConvs::Table::Find(const std::wstring& pre) const
+{
+    const size_t count = entries.size();
+    if (count == 0)
+        return NULL;
+    INT disp = displace[SpecialHash(0, pre) % count];
+    size_t slot;
+    if (disp < 0)
+        slot = size_t(-disp - 1);
+    else
+        slot = SpecialHash(DWORD(disp), pre) % count;
+    DWORD i = slots[slot];
+    if (i != DWORD(-1) && entries[i].pre == pre)
+        return &entries[i];
+    return NULL;
+}
+
+// 読みから項目を引く。表は公開した後は変わらないので、ロックしない。
+BOOL MzSpecialConvs::Find(const std::wstring& pre, MzSpecialConv& entry) const
+{
+    LONG nEpoch;
+    const Table *table = AcquireTable(nEpoch);
+    const MzSpecialConv *found = (table ? table->Find(pre) : NULL);
+    if (found)
+        entry = *found;
+    ReleaseTable(nEpoch);
+    return found != NULL;
+}
+
+size_t MzSpecialConvs::GetCount() const
+{
+    LONG nEpoch;
+    const Table *table = AcquireTable(nEpoch);
+    size_t count = (table ? table->entries.size() : 0);
+    ReleaseTable(nEpoch);
+    return count;
+}
+
+// データファイルから項目を追加する。
+// ファイルはUTF-16LEのテキストで、行は「読み \t 種類 \t ...」。;で始まる行は注釈。
+//   day/month/year: 読み \t 種類 \t 差分 \t 表記
+//   time/datetime:  読み \t 種類 \t 表記
+//   user:           読み \t user
+//   words:          読み \t words \t 語 \t 語 ...
+//   symbols:        読み \t symbols \t 記号の並び
+BOOL MzSpecialConvs::Load(LPCWSTR file_name)
+{
+    DWORD cbSize = mz_get_file_size(file_name);
+    if (cbSize < 2 * sizeof(WORD))
+        return FALSE;
+    std::vector<WCHAR> buf(cbSize / 2);
+    if (mz_read_utf16_file(file_name, &buf[0], buf.size()) != buf.size())
+        return FALSE;
+    std::wstring text;
+    mz_assign_utf16(text, &buf[0] + 1, &buf[0] + buf.size()); // BOMを除く。
+
+    WStrings lines, fields;
+    str_split(lines, text, std::wstring(L"\n"));
+
+    std::vector<MzSpecialConv> added;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        str_trim_right(lines[i], L"\r");
+        if (lines[i].empty() || lines[i][0] == L';')
+            continue;
+        str_split(fields, lines[i], std::wstring(L"\t"));
+        if (fields.size() < 2 || fields[0].empty())
+            continue;
+
+        size_t k;
+        for (k = 0; k < _countof(s_kind_names); ++k) {
+            if (fields[1] == s_kind_names[k].name)
+                break;
+        }
+        if (k == _countof(s_kind_names)) {
+            DPRINTW(L"%s: line %d: bad kind\n", file_name, INT(i + 1));
+            continue;
+        }
+
+        MzSpecialConv entry;
+        entry.pre = fields[0];
+        entry.kind = s_kind_names[k].kind;
+        entry.value = 0;
+        switch (entry.kind) {
+        case MZSC_DAY:
+        case MZSC_MONTH:
+        case MZSC_YEAR:
+            if (fields.size() != 4)
+                continue;
+            entry.value = INT(wcstol(fields[2].c_str(), NULL, 10));
+            entry.text = fields[3];
+            break;
+        case MZSC_TIME:
+        case MZSC_DATETIME:
+        case MZSC_SYMBOLS:
+            if (fields.size() != 3 || fields[2].empty())
+                continue;
+            entry.text = fields[2];
+            break;
+        case MZSC_USER:
+            break;
+        case MZSC_WORDS:
+            if (fields.size() < 3)
+                continue;
+            for (size_t j = 2; j < fields.size(); ++j) {
+                if (j > 2)
+                    entry.text += L'\t';
+                entry.text += fields[j];
+            }
+            break;
+        }
+        added.push_back(entry);
+    }
+
+    // 今の表を写して、同じ読みの項目は置き換える。表を変えるのはm_hLockを持つ者だけ。
+    mz_mutex_lock(m_hLock, INFINITE);
+    Table *table = new Table;
+    table->entries = m_table->entries;
+    std::vector<MzSpecialConv>& entries = table->entries;
+    for (size_t i = 0; i < added.size(); ++i) {
+        size_t j;
+        for (j = 0; j < entries.size(); ++j) {
+            if (entries[j].pre == added[i].pre)
+                break;
+        }
+        if (j < entries.size())
+            entries[j] = added[i];
+        else
+            entries.push_back(added[i]);
+    }
+    table->Build();
+    Publish(table);
+    mz_mutex_unlock(m_hLock);
+
+    DPRINTW(L"%s: %d special conversions\n", file_name, INT(added.size()));
+    return added.size() != 0;
+}
@@ -0,0 +1,244 @@
+﻿// speculate.cpp --- mzimeja speculative conversion
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 先読み変換。入力が止まっている間に、別のスレッドで文節を変換しておく。
+
+#include "mzconv.h"
+
+#define MZ_SPECULATE_DELAY          80      // 入力が止まってから変換を始めるまで（ミリ秒）。
+#define MZ_SPECULATE_IDLE_TIMEOUT   10000   // 仕事がなければスレッドを終えるまで（ミリ秒）。
+
+// 文脈ごとの予約。
+// m_entriesから外れた予約はDropで消す。変換中ならbOrphanにして、スレッドが終わってから消す。
+struct MzSpeculator::Entry {
+    std::wstring str;       // 変換する文字列。
+    MzConvResult result;    // 変換結果。
+    DWORD dwDue;            // 変換を始める時刻。
+    BOOL bRunning;          // 変換中か？
+    BOOL bDone;             // 変換が終わったか？
+    BOOL bOrphan;           // 取り消されたか？
+    volatile LONG bCancel;  // 変換を途中でやめさせる。
+    HANDLE hDone;           // 変換が終わったらシグナル状態になる。
+};
+
+MzSpeculator::MzSpeculator(MzConverter *pConverter)
+    : m_dwDelay(MZ_SPECULATE_DELAY)
+    , m_dwIdleTimeout(MZ_SPECULATE_IDLE_TIMEOUT)
+    , m_nScheduled(0)
+    , m_nConverted(0)
+    , m_nCancelled(0)
+    , m_nHits(0)
+    , m_pConverter(pConverter)
+    , m_bThread(FALSE)
+    , m_bStopping(FALSE)
+{
+    m_hLock = mz_mutex_open(NULL);
+    m_hWake = mz_event_create(FALSE);
+    m_hIdle = mz_event_create(TRUE);
+}
+
+MzSpeculator::~MzSpeculator()
+{
+    // プロセスの終了時にはスレッドはもういないので、待たない。
+    Stop(0);
+    if (m_bThread)
+        return; // スレッドが使っているので、ハンドルを閉じない。
+    mz_event_close(m_hIdle);
+    mz_event_close(m_hWake);
+    mz_mutex_close(m_hLock);
+}
+
+// m_entriesから外した予約を捨てる。ロックしてから呼ぶこと。
+void MzSpeculator::Drop(Entry *entry)
+{
+    if (!entry->bDone)
+        InterlockedIncrement(&m_nCancelled);
+    if (entry->bRunning) {
+        // 変換中なら、やめさせてスレッドに消させる。
+        InterlockedExchange(&entry->bCancel, TRUE);
+        entry->bOrphan = TRUE;
+        return;
+    }
+    mz_event_close(entry->hDone);
+    delete entry;
+}
+
+void MzSpeculator::Schedule(const void *key, const std::wstring& str)
+{
+    if (str.empty()) {
+        Cancel(key);
+        return;
+    }
+
+    mz_mutex_lock(m_hLock, INFINITE);
+    if (m_bStopping) {
+        mz_mutex_unlock(m_hLock);
+        return;
+    }
+
+    std::map<const void *, Entry *>::iterator it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        if (it->second->str == str) {
+            mz_mutex_unlock(m_hLock);
+            return; // 同じ文字列なら予約し直さない。
+        }
+        Drop(it->second);
+        m_entries.erase(it);
+    }
+
+    Entry *entry = new Entry;
+    entry->str = str;
+    entry->dwDue = ::GetTickCount() + m_dwDelay;
+    entry->bRunning = entry->bDone = entry->bOrphan = FALSE;
+    entry->bCancel = FALSE;
+    entry->hDone = mz_event_create(TRUE);
+    m_entries[key] = entry;
+    InterlockedIncrement(&m_nScheduled);
+
+    // スレッドがなければ作る。
+    if (!m_bThread) {
+        m_bThread = TRUE;
+        mz_event_reset(m_hIdle);
+        if (!mz_create_thread(WorkProc, this)) {
+            m_bThread = FALSE;
+            mz_event_set(m_hIdle);
+        }
+    }
+    mz_mutex_unlock(m_hLock);
+
+    mz_event_set(m_hWake);
+}
+
+void MzSpeculator::Cancel(const void *key)
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<const void *, Entry *>::iterator it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        Drop(it->second);
+        m_entries.erase(it);
+    }
+    mz_mutex_unlock(m_hLock);
+}
+
+BOOL MzSpeculator::Take(const void *key, const std::wstring& str, MzConvResult& result,
+                        DWORD dwMilliseconds)
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    std::map<const void *, Entry *>::iterator it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        mz_mutex_unlock(m_hLock);
+        return FALSE;
+    }
+
+    // 予約は一度しか使えない。
+    Entry *entry = it->second;
+    m_entries.erase(it);
+    if (entry->str != str || !entry->bRunning) {
+        // 文字列が違うか、まだ始まっていないか、終わっている。
+        BOOL bHit = (entry->str == str && entry->bDone);
+        if (bHit) {
+            result.clauses.swap(entry->result.clauses);
+            InterlockedIncrement(&m_nHits);
+        }
+        Drop(entry);
+        mz_mutex_unlock(m_hLock);
+        return bHit;
+    }
+
+    // 変換中なら終わるのを待つ。
+    mz_mutex_unlock(m_hLock);
+    mz_event_wait(entry->hDone, dwMilliseconds);
+    mz_mutex_lock(m_hLock, INFINITE);
+    BOOL bHit = entry->bDone;
+    if (bHit) {
+        result.clauses.swap(entry->result.clauses);
+        InterlockedIncrement(&m_nHits);
+    }
+    Drop(entry); // 間に合わなければ取り消す。
+    mz_mutex_unlock(m_hLock);
+    return bHit;
+}
+
+void MzSpeculator::Stop(DWORD dwMilliseconds)
+{
+    mz_mutex_lock(m_hLock, INFINITE);
+    m_bStopping = TRUE;
+    std::map<const void *, Entry *>::iterator it, end = m_entries.end();
+    for (it = m_entries.begin(); it != end; ++it)
+        Drop(it->second);
+    m_entries.clear();
+    BOOL bThread = m_bThread;
+    mz_mutex_unlock(m_hLock);
+
+    if (bThread) {
+        mz_event_set(m_hWake);
+        mz_event_wait(m_hIdle, dwMilliseconds);
+    }
+}
+
+// スレッドの本体。
+void MzSpeculator::WorkLoop()
+{
+    BOOL bIdle = FALSE;
+    for (;;) {
+        mz_mutex_lock(m_hLock, INFINITE);
+
+        // 一番早く変換を始める予約を探す。
+        Entry *entry = NULL;
+        DWORD dwNow = ::GetTickCount();
+        std::map<const void *, Entry *>::iterator it, end = m_entries.end();
+        for (it = m_entries.begin(); it != end; ++it) {
+            Entry *e = it->second;
+            if (e->bDone || e->bRunning)
+                continue;
+            if (!entry || (INT)(e->dwDue - entry->dwDue) < 0)
+                entry = e;
+        }
+
+        // 止めたか、しばらく仕事がなければ終わる。
+        if (m_bStopping || (!entry && bIdle)) {
+            m_bThread = FALSE;
+            mz_event_set(m_hIdle);
+            mz_mutex_unlock(m_hLock);
+            break;
+        }
+
+        // 予約の時刻まで待つ。その間に予約し直されることがある。
+        if (!entry || (INT)(entry->dwDue - dwNow) > 0) {
+            DWORD dwWait = entry ? (entry->dwDue - dwNow) : m_dwIdleTimeout;
+            mz_mutex_unlock(m_hLock);
+            BOOL bWoken = mz_event_wait(m_hWake, dwWait);
+            bIdle = (!entry && !bWoken);
+            continue;
+        }
+        bIdle = FALSE;
+
+        // 変換する。strは予約し直しても変わらないので、ロックしなくてよい。
+        entry->bRunning = TRUE;
+        mz_mutex_unlock(m_hLock);
+        MzConvResult result;
+        BOOL bOK = m_pConverter->ConvertMultiClause(entry->str, result, &entry->bCancel);
+
+        mz_mutex_lock(m_hLock, INFINITE);
+        entry->bRunning = FALSE;
+        if (bOK && !entry->bCancel) {
+            entry->result.clauses.swap(result.clauses);
+            entry->bDone = TRUE;
+            InterlockedIncrement(&m_nConverted);
+        }
+        if (entry->bOrphan) {
+            mz_event_close(entry->hDone);
+            delete entry;
+        } else {
+            mz_event_set(entry->hDone);
+        }
+        mz_mutex_unlock(m_hLock);
+    }
+}
+
+DWORD WINAPI MzSpeculator::WorkProc(LPVOID lpParam)
+{
+    MzSpeculator *pThis = (MzSpeculator *)lpParam;
+    pThis->WorkLoop();
+    return 0;
+}
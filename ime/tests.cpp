@@ -236,6 +236,7 @@ int wmain(int argc, wchar_t **argv)
     g_basic_dict.Unload();
     g_name_dict.Unload();
 
+    DebugFlush();
     return 0;
 }
 
@@ -37,7 +37,7 @@ DWORD CandWnd_HitTest(HWND hWnd, POINT pt, InputContext *lpIMC)
                 ::GetTextExtentPoint32W(hDC, psz, ::lstrlenW(psz), &siz);
                 INT cy = siz.cy + CY_BORDER * 2;
                 if (height <= pt.y && pt.y < height + cy) {
-                    ret = i;
+                    ret = i - lpCandList->dwPageStart; // ページの中での番号。
                     break;
                 }
                 height += cy;
@@ -7,8 +7,10 @@
 #include "str.hpp"
 #include <vector>
 
-// Forward declaration of global IME instance
-extern MzIme TheIME;
+#define MZ_VIBRATO_BOUNDARY_BONUS   100     // Vibratoの区切りに合うノードのコストの割引。
+
+// 結果の作成には変換エンジンを使う。IMEには依存しない。
+static MzConverter s_converter;
 
 //////////////////////////////////////////////////////////////////////////////
 // Constructor / Destructor
@@ -17,12 +19,25 @@ VibratoEngine::VibratoEngine()
     : initialized_(FALSE)
     , tokenizer_(nullptr)
 {
+#ifdef HAVE_VIBRATO
+    load_state_ = LOAD_NONE;
+    slots_lock_ = mz_mutex_open(NULL);
+#endif
 }
 
 VibratoEngine::~VibratoEngine()
 {
 #ifdef HAVE_VIBRATO
-    if (tokenizer_) {
+    // ワーカーはトークナイザーより先に解放する。
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        vibrato_worker_free(slots_[i]->worker);
+        delete slots_[i];
+    }
+    slots_.clear();
+    mz_mutex_close(slots_lock_);
+
+    // 読み込み中ならスレッドが使っているので、解放しない。
+    if (load_state_ == LOAD_DONE && tokenizer_) {
         vibrato_tokenizer_free(tokenizer_);
         tokenizer_ = nullptr;
     }
@@ -33,28 +48,24 @@ VibratoEngine::~VibratoEngine()
 //////////////////////////////////////////////////////////////////////////////
 // Initialization
 
-BOOL VibratoEngine::Initialize(const std::wstring& dict_path)
+BOOL VibratoEngine::Initialize(const std::wstring& dict_path, BOOL bLoadNow)
 {
     DPRINTW(L"VibratoEngine::Initialize: %s\n", dict_path.c_str());
     
 #ifdef HAVE_VIBRATO
     // 辞書パスの検証
-    if (dict_path.empty()) {
-        DPRINTW(L"VibratoEngine: Dictionary path is empty\n");
-        return FALSE;
-    }
-    
-    // UTF-8に変換
-    std::string dict_path_utf8 = WideToUTF8(dict_path);
-    
-    // トークナイザーの初期化
-    tokenizer_ = vibrato_tokenizer_load(dict_path_utf8.c_str());
-    if (!tokenizer_) {
-        DPRINTW(L"VibratoEngine: Failed to load tokenizer\n");
+    if (dict_path.empty() || mz_get_file_size(dict_path.c_str()) == 0) {
+        DPRINTW(L"VibratoEngine: Dictionary not found\n");
         return FALSE;
     }
     
+    // 辞書は数十MBあるので、最初に変換するときまで読み込まない。
+    // IMEを読み込んでも変換しないプロセスでは、メモリーを使わない。
+    dict_path_ = dict_path;
     initialized_ = TRUE;
+    if (bLoadNow && !Load())
+        return FALSE;
+
     DPRINTW(L"VibratoEngine: Initialized successfully\n");
     return TRUE;
     
@@ -65,10 +76,59 @@ BOOL VibratoEngine::Initialize(const std::wstring& dict_path)
 #endif
 }
 
+#ifdef HAVE_VIBRATO
+// 辞書を読み込む。辞書ファイルはメモリーにマップして渡すので、ヒープに複写しない。
+// ほかのスレッドが読み込んでいる途中ならFALSEを返す。
+BOOL VibratoEngine::Load()
+{
+    if (InterlockedCompareExchange(&load_state_, LOAD_BUSY, LOAD_NONE) != LOAD_NONE)
+        return load_state_ == LOAD_DONE;
+
+    DWORD dwStart = ::GetTickCount();
+    DWORD cbSize = 0;
+    const void* pv = mz_map_file(dict_path_.c_str(), &cbSize);
+    if (pv) {
+        tokenizer_ = vibrato_tokenizer_load_from_memory((const uint8_t*)pv, cbSize);
+        mz_unmap_file(pv, cbSize);
+    }
+    if (!tokenizer_) {
+        EPRINTW(L"VibratoEngine: Failed to load tokenizer: %s\n", dict_path_.c_str());
+        InterlockedExchange(&load_state_, LOAD_FAILED);
+        initialized_ = FALSE;
+        return FALSE;
+    }
+
+    DPRINTW(L"VibratoEngine: Loaded in %d ms\n", (INT)(::GetTickCount() - dwStart));
+    InterlockedExchange(&load_state_, LOAD_DONE);
+    return TRUE;
+}
+
+// スレッドプールで辞書を読み込む。
+DWORD WINAPI VibratoEngine::LoadProc(LPVOID lpParam)
+{
+    VibratoEngine* pThis = (VibratoEngine*)lpParam;
+    pThis->Load();
+    return 0;
+}
+
+// 辞書を読み込んでいればTRUE。まだなら読み込みを始めてFALSEを返す。
+// その間の変換は既存エンジンが受け持つ。
+BOOL VibratoEngine::IsLoaded()
+{
+    LONG state = load_state_;
+    if (state == LOAD_DONE)
+        return TRUE;
+    if (state == LOAD_NONE && !mz_queue_work_item(LoadProc, this))
+        return Load();
+    return FALSE;
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 // Conversion methods
 
-BOOL VibratoEngine::AnalyzeToLattice(const std::wstring& text, Lattice& lattice)
+BOOL VibratoEngine::AnalyzeToLattice(const std::wstring& text, Lattice& lattice,
+                                     volatile LONG* pbCancel)
 {
     if (!initialized_) {
         DPRINTW(L"VibratoEngine::AnalyzeToLattice: Not initialized\n");
@@ -76,50 +136,103 @@ BOOL VibratoEngine::AnalyzeToLattice(const std::wstring& text, Lattice& lattice)
     }
     
 #ifdef HAVE_VIBRATO
-    // テキストをUTF-8に変換
-    std::string text_utf8 = WideToUTF8(text);
-    
+    if (text.empty() || !IsLoaded())
+        return FALSE;
+
+    WorkerSlot* slot = AcquireSlot();
+    if (!slot) {
+        DPRINTW(L"VibratoEngine::AnalyzeToLattice: Cannot create worker\n");
+        return FALSE;
+    }
+
+    // UTF-16のまま渡す。WCHARが16ビットでなければ、位置が変わらないように
+    // BMPの外の文字をU+FFFDにして単位に詰める。
+    const uint16_t* units;
+    if (sizeof(WCHAR) == sizeof(uint16_t)) {
+        units = reinterpret_cast<const uint16_t*>(text.c_str());
+    } else {
+        slot->units.resize(text.size() + 1);
+        for (size_t i = 0; i < text.size(); ++i)
+            slot->units[i] = (text[i] > 0xFFFF) ? 0xFFFD : (uint16_t)text[i];
+        units = &slot->units[0];
+    }
+
     // Vibratoで形態素解析を実行
-    VibratoToken* tokens = nullptr;
     size_t num_tokens = 0;
-    
-    int result = vibrato_tokenize(tokenizer_, text_utf8.c_str(), &tokens, &num_tokens);
-    if (result != 0 || !tokens) {
+    if (vibrato_worker_tokenize_utf16(slot->worker, units, text.size(), &num_tokens) != 0) {
         DPRINTW(L"VibratoEngine::AnalyzeToLattice: Tokenization failed\n");
+        ReleaseSlot(slot);
         return FALSE;
     }
-    
-    // ラティスの初期化
-    lattice.m_pre = text;
-    lattice.m_chunks.clear();
-    lattice.m_chunks.resize(text.size() + 1);
-    
-    // 先頭ノードと末端ノードを作成
-    lattice.m_head = LatticeNodePtr(new LatticeNode());
-    lattice.m_head->bunrui = HB_HEAD;
-    lattice.m_head->deltaCost = 0;
-    
-    lattice.m_tail = LatticeNodePtr(new LatticeNode());
-    lattice.m_tail->bunrui = HB_TAIL;
-    lattice.m_tail->deltaCost = 0;
-    
-    // トークンをラティスノードに変換
+
+    // トークンを作業領域に受け取る。足りなければ広げる。
+    if (slot->spans.size() < num_tokens)
+        slot->spans.resize(num_tokens);
+    if (num_tokens)
+        vibrato_worker_tokens(slot->worker, &slot->spans[0], slot->spans.size());
+    
+    // 辞書のノードをすべて追加する。Vibratoの一位の解が誤っていても、ほかの区切りが残る。
+    lattice.AddNodesForMulti(text);
+    lattice.AddExtraNodes();
+    if (MZ_CANCELLED(pbCancel)) {
+        ReleaseSlot(slot);
+        return FALSE;
+    }
+
+    // Vibratoの区切りに両端が合うノードを優先する。
+    std::vector<BYTE>& boundaries = slot->boundaries;
+    boundaries.assign(text.size() + 1, FALSE);
+    boundaries[0] = boundaries[text.size()] = TRUE;
     for (size_t i = 0; i < num_tokens; i++) {
-        LatticeNode node;
-        std::string surface(tokens[i].surface);
-        std::string feature(tokens[i].feature);
-        
-        VibratoTokenToLatticeNode(surface, feature, tokens[i].start, tokens[i].end, node);
-        
-        // ノードをラティスに追加
-        size_t start_pos = tokens[i].start;
-        if (start_pos <= text.size()) {
-            lattice.AddNode(start_pos, node);
+        const VibratoTokenSpan& span = slot->spans[i];
+        if (span.start < span.end && span.end <= text.size())
+            boundaries[span.start] = boundaries[span.end] = TRUE;
+    }
+    for (size_t index = 0; index < text.size(); ++index) {
+        if (!boundaries[index])
+            continue;
+        LatticeChunk& chunk = lattice.m_chunks[index];
+        for (size_t k = 0; k < chunk.size(); ++k) {
+            if (boundaries[index + chunk[k]->pre_len])
+                chunk[k]->deltaCost -= MZ_VIBRATO_BOUNDARY_BONUS;
         }
     }
-    
-    // トークンのメモリを解放
-    vibrato_tokens_free(tokens, num_tokens);
+
+    // 辞書のノードがない区間は、Vibratoのトークンで補う。品詞分類は素性IDごとに一度だけ求める。
+    for (size_t i = 0; i < num_tokens; i++) {
+        const VibratoTokenSpan& span = slot->spans[i];
+        if (span.start >= span.end || span.end > text.size())
+            continue;
+
+        const LatticeChunk& chunk = lattice.m_chunks[span.start];
+        size_t k;
+        for (k = 0; k < chunk.size(); ++k) {
+            if (chunk[k]->pre_len == span.end - span.start)
+                break;
+        }
+        if (k < chunk.size())
+            continue;
+
+        HinshiBunrui bunrui;
+        std::map<uint32_t, BYTE>::iterator it = slot->bunrui.find(span.feature_id);
+        if (it != slot->bunrui.end()) {
+            bunrui = (HinshiBunrui)it->second;
+        } else {
+            const char* feature = vibrato_worker_feature(slot->worker, span.feature_id);
+            bunrui = ConvertPartOfSpeech(feature ? feature : "");
+            slot->bunrui[span.feature_id] = (BYTE)bunrui;
+        }
+
+        // ノードの文字列は入力を指す。AddNodeでラティスの文字列に付け替えられる。
+        LatticeNode node;
+        node.clear();
+        VibratoTokenToLatticeNode(text, span, bunrui, node);
+        lattice.AddNode(span.start, node);
+    }
+
+    ReleaseSlot(slot);
+    if (MZ_CANCELLED(pbCancel))
+        return FALSE;
     
     // ラティスの構造を更新
     lattice.Fix(text);
@@ -131,7 +244,8 @@ BOOL VibratoEngine::AnalyzeToLattice(const std::wstring& text, Lattice& lattice)
 #endif
 }
 
-BOOL VibratoEngine::ConvertMultiClause(const std::wstring& text, MzConvResult& result)
+BOOL VibratoEngine::ConvertMultiClause(const std::wstring& text, MzConvResult& result,
+                                       volatile LONG* pbCancel)
 {
     if (!initialized_) {
         DPRINTW(L"VibratoEngine::ConvertMultiClause: Not initialized\n");
@@ -141,13 +255,15 @@ BOOL VibratoEngine::ConvertMultiClause(const std::wstring& text, MzConvResult& r
 #ifdef HAVE_VIBRATO
     // ラティス構造を作成
     Lattice lattice;
-    if (!AnalyzeToLattice(text, lattice)) {
+    if (!AnalyzeToLattice(text, lattice, pbCancel)) {
         DPRINTW(L"VibratoEngine::ConvertMultiClause: AnalyzeToLattice failed\n");
         return FALSE;
     }
+    if (MZ_CANCELLED(pbCancel))
+        return FALSE;
     
     // ラティスから変換結果を生成
-    TheIME.MakeResultForMulti(result, lattice);
+    s_converter.MakeResultForMulti(result, lattice);
     
     return TRUE;
 #else
@@ -171,7 +287,7 @@ BOOL VibratoEngine::ConvertSingleClause(const std::wstring& text, MzConvResult&
     }
     
     // ラティスから変換結果を生成
-    TheIME.MakeResultForSingle(result, lattice);
+    s_converter.MakeResultForSingle(result, lattice);
     
     return TRUE;
 #else
@@ -182,28 +298,57 @@ BOOL VibratoEngine::ConvertSingleClause(const std::wstring& text, MzConvResult&
 //////////////////////////////////////////////////////////////////////////////
 // Private helper methods
 
-void VibratoEngine::VibratoTokenToLatticeNode(const std::string& surface, const std::string& feature,
-                                                size_t start_pos, size_t end_pos, LatticeNode& node)
-{
 #ifdef HAVE_VIBRATO
-    // 表層形をUTF-16に変換
-    node.pre = UTF8ToWide(surface);
-    node.post = node.pre;  // 初期値として同じ文字列を設定
-    
-    // 品詞情報を解析
-    node.bunrui = ConvertPartOfSpeech(feature);
+// 作業領域を借りる。空いていなければ作る。
+VibratoEngine::WorkerSlot* VibratoEngine::AcquireSlot()
+{
+    WorkerSlot* slot = nullptr;
+    mz_mutex_lock(slots_lock_, INFINITE);
+    if (!slots_.empty()) {
+        slot = slots_.back();
+        slots_.pop_back();
+    }
+    mz_mutex_unlock(slots_lock_);
+    if (slot)
+        return slot;
+
+    VibratoWorker* worker = vibrato_worker_new(tokenizer_);
+    if (!worker)
+        return nullptr;
+    slot = new WorkerSlot;
+    slot->worker = worker;
+    return slot;
+}
+
+// 作業領域を戻す。バッファはそのまま次の変換で使う。
+void VibratoEngine::ReleaseSlot(WorkerSlot* slot)
+{
+    mz_mutex_lock(slots_lock_, INFINITE);
+    slots_.push_back(slot);
+    mz_mutex_unlock(slots_lock_);
+}
+
+void VibratoEngine::VibratoTokenToLatticeNode(const std::wstring& text, const VibratoTokenSpan& span,
+                                              HinshiBunrui bunrui, LatticeNode& node)
+{
+    // 表層形は入力の部分文字列
+    node.pre = node.post = text.c_str() + span.start;
+    node.pre_len = node.post_len = (WORD)(span.end - span.start);
+
+    // 品詞情報
+    node.bunrui = bunrui;
     
     // コストの設定（デフォルト値）
     node.deltaCost = 0;
     
     // 活用形情報のデフォルト設定
-    node.gyou = DAN_NO_GYOU;
-    node.katsuyou = KATSUYOU_NONE;
+    node.gyou = GYOU_A;
+    node.katsuyou = NONE_KEI;
     
     // 特徴文字列からタグを抽出（必要に応じて）
-    node.tags.clear();
-#endif
+    node.tags = 0;
 }
+#endif
 
 HinshiBunrui VibratoEngine::ConvertPartOfSpeech(const std::string& feature)
 {
@@ -319,36 +464,3 @@ HinshiBunrui VibratoEngine::ConvertPartOfSpeech(const std::string& feature)
     return HB_UNKNOWN;
 #endif
 }
-
-//////////////////////////////////////////////////////////////////////////////
-// UTF-8/UTF-16 conversion utilities
-
-std::string VibratoEngine::WideToUTF8(const std::wstring& wstr)
-{
-    if (wstr.empty()) return std::string();
-    
-    // WideCharToMultiByte を使用（Windows専用）
-    int size_needed = WideCharToMultiByte(CP_UTF8, 0, wstr.c_str(), 
-                                          (int)wstr.size(), NULL, 0, NULL, NULL);
-    if (size_needed <= 0) return std::string();
-    
-    std::string result(size_needed, 0);
-    WideCharToMultiByte(CP_UTF8, 0, wstr.c_str(), (int)wstr.size(), 
-                       &result[0], size_needed, NULL, NULL);
-    return result;
-}
-
-std::wstring VibratoEngine::UTF8ToWide(const std::string& str)
-{
-    if (str.empty()) return std::wstring();
-    
-    // MultiByteToWideChar を使用（Windows専用）
-    int size_needed = MultiByteToWideChar(CP_UTF8, 0, str.c_str(), 
-                                          (int)str.size(), NULL, 0);
-    if (size_needed <= 0) return std::wstring();
-    
-    std::wstring result(size_needed, 0);
-    MultiByteToWideChar(CP_UTF8, 0, str.c_str(), (int)str.size(), 
-                       &result[0], size_needed);
-    return result;
-}
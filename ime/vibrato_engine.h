@@ -5,7 +5,7 @@
 
 #pragma once
 
-#include "mzimeja.h"
+#include "mzconv.h"
 
 #ifdef HAVE_VIBRATO
 // Vibrato C API
@@ -23,19 +23,23 @@ public:
     
     // Initialize the Vibrato engine
     // Vibratoエンジンを初期化
-    BOOL Initialize(const std::wstring& dict_path = L"");
+    // 辞書はbLoadNowでなければ、最初に変換するときにスレッドプールで読み込む。
+    BOOL Initialize(const std::wstring& dict_path = L"", BOOL bLoadNow = FALSE);
     
     // Check if the engine is initialized
     // エンジンが初期化されているかチェック
     BOOL IsInitialized() const { return initialized_; }
     
     // Analyze text and convert to Lattice structure
-    // テキストを解析してLattice構造に変換
-    BOOL AnalyzeToLattice(const std::wstring& text, Lattice& lattice);
+    // テキストを解析してLattice構造に変換。辞書のノードにVibratoの区切りを反映する。
+    // pbCancelが指す値が0でなくなったら、途中でやめてFALSEを返す。
+    BOOL AnalyzeToLattice(const std::wstring& text, Lattice& lattice,
+                          volatile LONG* pbCancel = NULL);
     
     // Convert text using multi-clause conversion
     // 文節変換を使用してテキストを変換
-    BOOL ConvertMultiClause(const std::wstring& text, MzConvResult& result);
+    BOOL ConvertMultiClause(const std::wstring& text, MzConvResult& result,
+                            volatile LONG* pbCancel = NULL);
     
     // Convert text using single-clause conversion
     // 単文節変換を使用してテキストを変換
@@ -45,27 +49,52 @@ private:
     BOOL initialized_;
 #ifdef HAVE_VIBRATO
     VibratoTokenizer* tokenizer_;
+
+    // Dictionary loading state
+    // 辞書の読み込みの状態
+    enum { LOAD_NONE, LOAD_BUSY, LOAD_DONE, LOAD_FAILED };
+    std::wstring dict_path_;
+    volatile LONG load_state_;
+
+    BOOL Load();
+    BOOL IsLoaded();
+    static DWORD WINAPI LoadProc(LPVOID lpParam);
+
+    // Reusable analysis context, one per concurrent conversion
+    // 解析の作業領域。同時に変換するスレッドごとに一つ使い、使い終わったら戻す。
+    struct WorkerSlot {
+        VibratoWorker* worker;
+        std::vector<VibratoTokenSpan> spans;    // トークンの出力領域。
+        std::vector<uint16_t> units;            // WCHARが16ビットでないときの入力。
+        std::vector<BYTE> boundaries;           // 位置ごとに、Vibratoの区切りか？
+        std::map<uint32_t, BYTE> bunrui;        // 素性IDごとの品詞分類。
+    };
+    std::vector<WorkerSlot*> slots_;            // 空いている作業領域。
+    HANDLE slots_lock_;
+
+    WorkerSlot* AcquireSlot();
+    void ReleaseSlot(WorkerSlot* slot);
+
+    // Convert Vibrato token to Lattice node
+    // Vibratoトークンをラティスノードに変換
+    void VibratoTokenToLatticeNode(const std::wstring& text, const VibratoTokenSpan& span,
+                                   HinshiBunrui bunrui, LatticeNode& node);
 #else
     void* tokenizer_;  // Placeholder when Vibrato is not available
 #endif
     
-    // Convert Vibrato token to Lattice node
-    // Vibratoトークンをラティスノードに変換
-    void VibratoTokenToLatticeNode(const std::string& surface, const std::string& feature,
-                                    size_t start_pos, size_t end_pos, LatticeNode& node);
-    
     // Convert MeCab/Vibrato part-of-speech to MZ-IMEja HinshiBunrui
     // MeCab/Vibratoの品詞をMZ-IMEjaの品詞分類に変換
     HinshiBunrui ConvertPartOfSpeech(const std::string& feature);
-    
-    // UTF-8/UTF-16 conversion utilities
-    // UTF-8/UTF-16変換ユーティリティ
-    std::string WideToUTF8(const std::wstring& wstr);
-    std::wstring UTF8ToWide(const std::string& str);
 };
 
 // Global Vibrato engine instance (defined in convert.cpp)
 // グローバルなVibratoエンジンインスタンス（convert.cppで定義）
 #ifdef HAVE_VIBRATO
 extern VibratoEngine g_vibrato_engine;
+
+// Hedged conversion counters (defined in convert.cpp)
+// 両エンジンを競わせた変換で、どちらの結果を使ったか（convert.cppで定義）
+extern volatile LONG g_nHedgeVibratoWins;
+extern volatile LONG g_nHedgeLegacyWins;
 #endif
@@ -11,8 +11,6 @@
 
 #include <string>           // for std::string, std::wstring, ...
 #include <vector>           // for std::vector
-#include <set>              // for std::set
-#include <map>              // for std::map
 #include <algorithm>        // for std::sort
 
 #include <cstdlib>          // for C standard library
@@ -25,6 +23,7 @@
 
 #include "Wow64.h"
 #include "../str.hpp"       // for str_*
+#include "../kanji.hpp"     // for KanjiIndex
 
 #include "resource.h"
 
@@ -45,34 +44,6 @@
 #define IDW_LISTBOX1 2
 #define IDW_LISTBOX2 3
 
-struct KANJI_ENTRY {
-    WORD kanji_id;
-    WCHAR kanji_char;
-    WORD radical_id2;
-    WORD strokes;
-    std::wstring readings;
-    KANJI_ENTRY()
-    {
-        kanji_id = 0;
-        kanji_char = 0;
-        radical_id2 = 0;
-        strokes = 0;
-    }
-};
-
-struct RADICAL_ENTRY {
-    WORD radical_id;
-    WORD radical_id2;
-    WORD strokes;
-    std::wstring readings;
-    RADICAL_ENTRY()
-    {
-        radical_id = 0;
-        radical_id2 = 0;
-        strokes = 0;
-    }
-};
-
 const WCHAR szImePadClassName[] = L"MZIMEPad";
 
 //////////////////////////////////////////////////////////////////////////////
@@ -91,15 +62,14 @@ protected:
     HWND m_hWnd;
 
     // data
-    std::vector<KANJI_ENTRY>            m_kanji_table;
-    std::map<WORD, std::vector<WORD> >  m_kanji_stroke_map;
-    std::vector<RADICAL_ENTRY>          m_radical_table;
-    std::map<WORD, std::vector<WORD> >  m_radical_stroke_map;
-    std::map<WORD, WORD>                m_radical_id_map;
-    std::map<WORD, std::vector<WORD> >  m_radical2_to_kanji_map;
-    BOOL LoadKanjiData();
-    BOOL LoadRadicalData();
+    KanjiIndex                          m_index;
+    std::vector<WORD>                   m_index_units;  // built from text
+    HANDLE                              m_hIndexMapping;
+    LPVOID                              m_pvIndexView;
+    BOOL MapKanjiIndex();
+    BOOL BuildKanjiIndex();
     BOOL LoadKanjiAndRadical();
+    void UnloadKanjiAndRadical();
 
     // UI
     HWND m_hTabCtrl;
@@ -233,11 +203,6 @@ static HBITMAP Create24BppBitmap(HDC hDC, INT cx, INT cy) {
     return ::CreateDIBSection(hDC, &bi, DIB_RGB_COLORS, &pvBits, NULL, 0);
 }
 
-inline bool
-radical_compare(const RADICAL_ENTRY& entry1, const RADICAL_ENTRY& entry2) {
-    return entry1.strokes < entry2.strokes;
-}
-
 LRESULT CALLBACK ImePad::ListBox1WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
     ImePad* pThis = (ImePad*)GetWindowLongPtr(hWnd, GWLP_USERDATA);
     if (!pThis)
@@ -305,28 +270,29 @@ void ImePad::OnDrawItemListBox2(HWND hWnd, LPDRAWITEMSTRUCT lpDraw) {
     HGDIOBJ hFontOld = SelectObject(hdcMem, m_hSmallFont);
 
     INT id = lpDraw->itemID;
-    const RADICAL_ENTRY& entry = m_radical_table[id];
+    INT iImage = m_index.GetRadicalID(id) - 1;
+    LPCWSTR readings = m_index.GetRadicalReadings(id);
     if (lpDraw->itemState & ODS_SELECTED) {
         ::FillRect(hdcMem, &rc, (HBRUSH)(COLOR_HIGHLIGHT + 1));
-        ImageList_Draw(m_himlRadical, entry.radical_id - 1, hdcMem, 0, 0, ILD_NORMAL);
+        ImageList_Draw(m_himlRadical, iImage, hdcMem, 0, 0, ILD_NORMAL);
         ::SelectObject(hdcMem, ::GetStockObject(BLACK_PEN));
         ::SelectObject(hdcMem, ::GetStockObject(NULL_BRUSH));
         ::Rectangle(hdcMem, 0, 0, RADICAL_SIZE, RADICAL_SIZE);
         rc.left += RADICAL_SIZE + 2;
         ::SetBkMode(hdcMem, TRANSPARENT);
         ::SetTextColor(hdcMem, GetSysColor(COLOR_HIGHLIGHTTEXT));
-        ::DrawText(hdcMem, entry.readings.c_str(), -1,
+        ::DrawText(hdcMem, readings, -1,
                    &rc, DT_SINGLELINE | DT_LEFT | DT_VCENTER | DT_NOCLIP | DT_NOPREFIX | DT_END_ELLIPSIS);
     } else {
         ::FillRect(hdcMem, &rc, (HBRUSH)(COLOR_WINDOW + 1));
-        ImageList_Draw(m_himlRadical, entry.radical_id - 1, hdcMem, 0, 0, ILD_NORMAL);
+        ImageList_Draw(m_himlRadical, iImage, hdcMem, 0, 0, ILD_NORMAL);
         ::SelectObject(hdcMem, ::GetStockObject(BLACK_PEN));
         ::SelectObject(hdcMem, ::GetStockObject(NULL_BRUSH));
         ::Rectangle(hdcMem, 0, 0, RADICAL_SIZE, RADICAL_SIZE);
         rc.left += RADICAL_SIZE + 2;
         ::SetBkMode(hdcMem, TRANSPARENT);
         ::SetTextColor(hdcMem, GetSysColor(COLOR_WINDOWTEXT));
-        ::DrawText(hdcMem, entry.readings.c_str(), -1,
+        ::DrawText(hdcMem, readings, -1,
                    &rc, DT_SINGLELINE | DT_LEFT | DT_VCENTER | DT_NOCLIP | DT_NOPREFIX | DT_END_ELLIPSIS);
     }
 
@@ -381,15 +347,18 @@ ImePad::ImePad() {
     m_fnListBox2OldWndProc = NULL;
     m_hTabCtrl = NULL;
     m_hListView = NULL;
+    m_hIndexMapping = NULL;
+    m_pvIndexView = NULL;
 }
 
 ImePad::~ImePad() {
     DeleteAllImages();
     DeleteAllFonts();
+    UnloadKanjiAndRadical();
 }
 
 //////////////////////////////////////////////////////////////////////////////
-// loading res/kanji.dat and res/radical.dat
+// loading res/kanji.idx, or res/kanji.dat and res/radical.dat
 
 BOOL FindLocalFile(std::wstring& path, LPCWSTR filename) {
     WCHAR szPath[MAX_PATH];
@@ -436,93 +405,92 @@ LPWSTR GetRadicalDataPathName(LPWSTR pszPath) {
     return NULL;
 }
 
-BOOL ImePad::LoadKanjiData() {
-    if (m_kanji_table.size()) {
-        return TRUE;
-    }
-    char buf[256];
-    wchar_t wbuf[256];
+LPWSTR GetKanjiIndexPathName(LPWSTR pszPath) {
+    std::wstring path;
+    if (FindLocalFile(path, L"kanji.idx") || FindLocalFile(path, L"res\\kanji.idx"))
+        return lstrcpynW(pszPath, path.c_str(), MAX_PATH);
+    return NULL;
+}
+
+// コンパイル済みの索引kanji.idxを写像する。
+BOOL ImePad::MapKanjiIndex() {
     WCHAR szPath[MAX_PATH];
-    if (!GetKanjiDataPathName(szPath)) {
+    if (!GetKanjiIndexPathName(szPath)) {
+        return FALSE;
+    }
+    HANDLE hFile = ::CreateFileW(szPath, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
         return FALSE;
     }
-    FILE *fp = _wfopen(szPath, L"rb");
+    DWORD cbFile = ::GetFileSize(hFile, NULL);
+    if (cbFile == INVALID_FILE_SIZE || cbFile < KANJI_INDEX_HEADER * sizeof(WORD)) {
+        ::CloseHandle(hFile);
+        return FALSE;
+    }
+    m_hIndexMapping = ::CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    ::CloseHandle(hFile);
+    if (m_hIndexMapping) {
+        m_pvIndexView = ::MapViewOfFile(m_hIndexMapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_pvIndexView &&
+            m_index.Attach((const WORD *)m_pvIndexView, cbFile / sizeof(WORD)))
+        {
+            return TRUE;
+        }
+    }
+    UnloadKanjiAndRadical();
+    return FALSE;
+} // ImePad::MapKanjiIndex
+
+// 索引がなければ、kanji.datとradical.datから作る。
+BOOL ImePad::BuildKanjiIndex() {
+    std::vector<std::wstring> lines;
+    std::vector<KANJI_ENTRY> kanji;
+    std::vector<RADICAL_ENTRY> radicals;
+    WCHAR szPath[MAX_PATH];
+
+    FILE *fp = GetKanjiDataPathName(szPath) ? _wfopen(szPath, L"rb") : NULL;
     if (!fp) {
         std::wstring kanji_file = GetSettingString(L"KanjiDataFile");
         fp = _wfopen(kanji_file.c_str(), L"rb");
     }
-    if (fp) {
+    if (!fp) {
+        return FALSE;
+    }
+    KanjiIndexReadLines(fp, lines);
+    fclose(fp);
+    for (size_t i = 0; i < lines.size(); ++i) {
         KANJI_ENTRY entry;
-        while (fgets(buf, 256, fp) != NULL) {
-            if (buf[0] == ';') continue;
-            ::MultiByteToWideChar(CP_UTF8, 0, buf, -1, wbuf, 256);
-            std::wstring str = wbuf;
-            str_trim_right(str, L"\r\n");
-            std::vector<std::wstring> vec;
-            str_split(vec, str, L"\t");
-            entry.kanji_id = _wtoi(vec[0].c_str());
-            entry.kanji_char = vec[1][0];
-            entry.radical_id2 = _wtoi(vec[2].c_str());
-            entry.strokes = _wtoi(vec[3].c_str());
-            entry.readings = vec[4];
-            m_kanji_table.push_back(entry);
-            m_kanji_stroke_map[entry.strokes].push_back(entry.kanji_id);
-        }
-        fclose(fp);
-        return TRUE;
+        if (KanjiIndexParseKanji(entry, lines[i]))
+            kanji.push_back(entry);
     }
-    return FALSE;
-} // ImePad::LoadKanjiData
 
-BOOL ImePad::LoadRadicalData() {
-    if (m_radical_table.size()) {
-        return TRUE;
-    }
-    char buf[256];
-    wchar_t wbuf[256];
-    WCHAR szPath[MAX_PATH];
-    GetRadicalDataPathName(szPath);
-    FILE *fp = _wfopen(szPath, L"rb");
+    lines.clear();
+    fp = GetRadicalDataPathName(szPath) ? _wfopen(szPath, L"rb") : NULL;
     if (!fp) {
         std::wstring radical_file = GetSettingString(L"RadicalDataFile");
         fp = _wfopen(radical_file.c_str(), L"rb");
     }
-    if (fp) {
+    if (!fp) {
+        return FALSE;
+    }
+    KanjiIndexReadLines(fp, lines);
+    fclose(fp);
+    for (size_t i = 0; i < lines.size(); ++i) {
         RADICAL_ENTRY entry;
-        while (fgets(buf, 256, fp) != NULL) {
-            if (buf[0] == ';') continue;
-            ::MultiByteToWideChar(CP_UTF8, 0, buf, -1, wbuf, 256);
-            std::wstring str = wbuf;
-            str_trim_right(str, L"\r\n");
-            std::vector<std::wstring> vec;
-            str_split(vec, str, L"\t");
-            entry.radical_id = _wtoi(vec[0].c_str());
-            entry.radical_id2 = _wtoi(vec[1].c_str());
-            entry.strokes = _wtoi(vec[3].c_str());
-            entry.readings = vec[4];
-            m_radical_table.push_back(entry);
-            m_radical_stroke_map[entry.strokes].push_back(entry.radical_id);
-            m_radical_id_map[entry.radical_id] = entry.radical_id2;
-        }
-        fclose(fp);
-        return TRUE;
+        if (KanjiIndexParseRadical(entry, lines[i]))
+            radicals.push_back(entry);
     }
-    assert(0);
-    return FALSE;
-} // ImePad::LoadRadicalData
 
-BOOL ImePad::LoadKanjiAndRadical() {
-    if (LoadKanjiData() && LoadRadicalData()) {
-        if (m_radical2_to_kanji_map.size()) {
-            return TRUE;
-        }
+    return KanjiIndexBuild(m_index_units, kanji, radicals) &&
+           m_index.Attach(&m_index_units[0], m_index_units.size());
+} // ImePad::BuildKanjiIndex
 
-        for (size_t i = 0; i < m_kanji_table.size(); ++i) {
-            const KANJI_ENTRY& kanji = m_kanji_table[i];
-            m_radical2_to_kanji_map[kanji.radical_id2].push_back(kanji.kanji_id);
-        }
-        std::sort(m_radical_table.begin(), m_radical_table.end(),
-                  radical_compare);
+BOOL ImePad::LoadKanjiAndRadical() {
+    if (m_index.IsAttached()) {
+        return TRUE;
+    }
+    if (MapKanjiIndex() || BuildKanjiIndex()) {
         return TRUE;
     }
     assert(0);
@@ -530,6 +498,19 @@ BOOL ImePad::LoadKanjiAndRadical() {
     return FALSE;
 }
 
+void ImePad::UnloadKanjiAndRadical() {
+    m_index = KanjiIndex();
+    if (m_pvIndexView) {
+        ::UnmapViewOfFile(m_pvIndexView);
+        m_pvIndexView = NULL;
+    }
+    if (m_hIndexMapping) {
+        ::CloseHandle(m_hIndexMapping);
+        m_hIndexMapping = NULL;
+    }
+    std::vector<WORD>().swap(m_index_units);
+}
+
 void ImePad::DeleteAllImages() {
     if (m_hbmRadical) {
         ::DeleteObject(m_hbmRadical);
@@ -603,7 +584,7 @@ BOOL ImePad::CreateKanjiImageList() {
     }
 
     m_himlKanji = ImageList_Create(CHAR_BOX_SIZE, CHAR_BOX_SIZE, ILC_COLOR,
-                                   (INT)m_kanji_table.size(), 1);
+                                   (INT)m_index.GetKanjiCount(), 1);
     if (m_himlKanji == NULL) {
         return FALSE;
     }
@@ -612,14 +593,15 @@ BOOL ImePad::CreateKanjiImageList() {
     ::SelectObject(hDC, GetStockObject(WHITE_BRUSH));
     ::SelectObject(hDC, GetStockObject(BLACK_PEN));
     HGDIOBJ hFontOld = ::SelectObject(hDC, m_hLargeFont);
-    for (size_t i = 0; i < m_kanji_table.size(); ++i) {
+    for (size_t i = 0; i < m_index.GetKanjiCount(); ++i) {
+        WCHAR ch = m_index.GetKanjiChar(i);
         HBITMAP hbm = Create24BppBitmap(hDC, CHAR_BOX_SIZE, CHAR_BOX_SIZE);
         HGDIOBJ hbmOld = ::SelectObject(hDC, hbm);
         {
             ::Rectangle(hDC, 0, 0, CHAR_BOX_SIZE, CHAR_BOX_SIZE);
             RECT rc;
             ::SetRect(&rc, 0, 0, CHAR_BOX_SIZE, CHAR_BOX_SIZE);
-            ::DrawTextW(hDC, &m_kanji_table[i].kanji_char, 1, &rc,
+            ::DrawTextW(hDC, &ch, 1, &rc,
                         DT_CENTER | DT_NOCLIP | DT_NOPREFIX | DT_SINGLELINE | DT_VCENTER);
         }
         ::SelectObject(hDC, hbmOld);
@@ -640,7 +622,7 @@ BOOL ImePad::CreateRadicalImageList() {
         ImageList_Destroy(m_himlRadical);
     }
     m_himlRadical = ImageList_Create(RADICAL_SIZE, RADICAL_SIZE, ILC_COLOR,
-                                     (INT)m_radical_table.size(), 1);
+                                     (INT)m_index.GetRadicalCount(), 1);
     if (m_himlRadical == NULL) {
         return FALSE;
     }
@@ -649,7 +631,7 @@ BOOL ImePad::CreateRadicalImageList() {
     HDC hDC = ::CreateCompatibleDC(NULL);
     HDC hDC2 = ::CreateCompatibleDC(NULL);
     HGDIOBJ hbm2Old = ::SelectObject(hDC2, m_hbmRadical);
-    for (size_t i = 0; i < m_radical_table.size(); ++i) {
+    for (size_t i = 0; i < m_index.GetRadicalCount(); ++i) {
         HBITMAP hbm = Create24BppBitmap(hDC, RADICAL_SIZE, RADICAL_SIZE);
         HGDIOBJ hbmOld = ::SelectObject(hDC, hbm);
         {
@@ -738,23 +720,22 @@ BOOL ImePad::OnCreate(HWND hWnd) {
     ListView_SetExtendedListViewStyleEx(m_hListView, LVS_EX_DOUBLEBUFFER, LVS_EX_DOUBLEBUFFER);
 
     // insert items to for strokes
-    std::set<WORD> strokes;
-    for (size_t i = 0; i < m_kanji_table.size(); ++i) {
-        strokes.insert(m_kanji_table[i].strokes);
-    }
-    std::set<WORD>::iterator it, end = strokes.end();
     TCHAR sz[128];
-    for (it = strokes.begin(); it != end; ++it) {
-        StringCchPrintfW(sz, _countof(sz), LoadStringDx(IDM_KAKUSUU), *it);
+    for (size_t strokes = 0; strokes < m_index.GetStrokesCount(); ++strokes) {
+        size_t count;
+        m_index.GetKanjiByStrokes(strokes, count);
+        if (count == 0) {
+            continue;
+        }
+        StringCchPrintfW(sz, _countof(sz), LoadStringDx(IDM_KAKUSUU), (INT)strokes);
         ::SendMessage(m_hListBox1, LB_ADDSTRING, 0, (LPARAM)sz);
     }
 
     // fill radical list box
-    for (size_t i = 0; i < m_radical_table.size(); ++i) {
-        const RADICAL_ENTRY& entry = m_radical_table[i];
-        LPCTSTR psz = entry.readings.c_str();
+    for (size_t i = 0; i < m_index.GetRadicalCount(); ++i) {
+        LPCTSTR psz = m_index.GetRadicalReadings(i);
         ::SendMessage(m_hListBox2, LB_ADDSTRING, 0, (LPARAM)psz);
-        ::SendMessage(m_hListBox2, LB_SETITEMDATA, i, (LPARAM)entry.radical_id);
+        ::SendMessage(m_hListBox2, LB_SETITEMDATA, i, (LPARAM)m_index.GetRadicalID(i));
     }
 
     // set image list to list view
@@ -837,18 +818,17 @@ void ImePad::OnLB1Changed(HWND hWnd) {
     sz[_countof(sz) - 1] = 0;
     int strokes = _ttoi(sz);
 
+    size_t count;
+    const WORD *kanji = m_index.GetKanjiByStrokes(strokes, count);
+
     LV_ITEMW lv_item;
     ZeroMemory(&lv_item, sizeof(lv_item));
     lv_item.mask = LVIF_TEXT | LVIF_IMAGE;
-    for (size_t i = 0; i < m_kanji_table.size(); ++i) {
-        const KANJI_ENTRY& entry = m_kanji_table[i];
-        if (entry.strokes != strokes) {
-            continue;
-        }
+    for (size_t i = 0; i < count; ++i) {
         lv_item.iItem = (INT)i;
         lv_item.iSubItem = 0;
-        lv_item.pszText = const_cast<WCHAR *>(entry.readings.c_str());
-        lv_item.iImage = (int)i;
+        lv_item.pszText = const_cast<WCHAR *>(m_index.GetKanjiReadings(kanji[i]));
+        lv_item.iImage = kanji[i];
         ListView_InsertItem(m_hListView, &lv_item);
     }
     OnSize(m_hWnd);
@@ -865,20 +845,18 @@ void ImePad::OnLB2Changed(HWND hWnd) {
         return;
     }
 
-    WORD radical_id2 = m_radical_table[i].radical_id2;
+    // the kanji of the radical, in stroke order
+    size_t count;
+    const WORD *kanji = m_index.GetKanjiByRadical(m_index.GetRadical2(i), count);
 
     LV_ITEMW lv_item;
     ZeroMemory(&lv_item, sizeof(lv_item));
     lv_item.mask = LVIF_TEXT | LVIF_IMAGE;
-    for (size_t i = 0; i < m_kanji_table.size(); ++i) {
-        const KANJI_ENTRY& entry = m_kanji_table[i];
-        if (entry.radical_id2 != radical_id2) {
-            continue;
-        }
+    for (size_t i = 0; i < count; ++i) {
         lv_item.iItem = (INT)i;
         lv_item.iSubItem = 0;
-        lv_item.pszText = const_cast<WCHAR *>(entry.readings.c_str());
-        lv_item.iImage = (int)i;
+        lv_item.pszText = const_cast<WCHAR *>(m_index.GetKanjiReadings(kanji[i]));
+        lv_item.iImage = kanji[i];
         ListView_InsertItem(m_hListView, &lv_item);
     }
 
@@ -1082,7 +1060,7 @@ WCHAR ImePad::GetCharFromListView() {
     ListView_GetItem(m_hListView, &item);
 
     // 漢字を取得して返す
-    return m_kanji_table[item.iImage].kanji_char;
+    return m_index.GetKanjiChar(item.iImage);
 }
 
 /*static*/ LRESULT CALLBACK
@@ -0,0 +1,439 @@
+﻿#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cwchar>
+
+#ifdef _WIN32
+    #ifndef _INC_WINDOWS
+        #include <windows.h>
+    #endif
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// ImePadの漢字の索引（kanji.idx）。
+//
+// dict_compile -kで、kanji.datとradical.datから作る。ファイルは辞書と同じく
+// UTF-16の単位（WORD）の並びで、そのままメモリーに写像して使う。
+// 漢字と部首の表のほかに、画数→漢字、部首→漢字、画数→部首の隣接配列
+// （CSR。始まりの位置の並びと番号の並び）と、読みの索引を持つ。
+//
+//   ヘッダー: KANJI_INDEX_SIG0, KANJI_INDEX_SIG1, バージョン, 0,
+//             漢字の数, 部首の数, 画数の数, 部首番号2の数,
+//             読みの数(32), 部分の位置(32)×KI_NUM_SECTIONS
+//   漢字:     字, 部首番号2, 画数, 読みの位置(32)       （漢字の数だけ、kanji.datの順）
+//   部首:     部首番号, 部首番号2, 画数, 読みの位置(32)  （部首の数だけ、画数の順）
+//   画数→漢字: 始まり×(画数の数 + 1), 漢字の番号×漢字の数
+//   部首→漢字: 始まり×(部首番号2の数 + 1), 漢字の番号×漢字の数（部首の中は画数の順）
+//   画数→部首: 始まり×(画数の数 + 1)                   （部首の表の番号）
+//   読み:     読みの位置(32), 漢字の番号               （読みの数だけ、読みの順）
+//   文字列:   NUL終端の文字列の並び
+//
+// 32ビットの値は下位、上位の順に二つの単位に入れる。部分の位置はファイルの
+// 先頭からの単位数、読みの位置は文字列の部分の先頭からの単位数。
+// 読みは「、」で区切った読みの一つ一つから「-」を除いたもの。
+
+#define KANJI_INDEX_SIG0        0x5A4D  // "MZ"
+#define KANJI_INDEX_SIG1        0x4A4B  // "KJ"
+#define KANJI_INDEX_VERSION     1
+#define KANJI_INDEX_KANJI       5       // 漢字の単位数。
+#define KANJI_INDEX_RADICAL     5       // 部首の単位数。
+#define KANJI_INDEX_READING     3       // 読みの単位数。
+
+enum {
+    KI_KANJI,                   // 漢字。
+    KI_RADICALS,                // 部首。
+    KI_STROKE_STARTS,           // 画数→漢字の始まり。
+    KI_STROKE_KANJI,            // 画数→漢字の番号。
+    KI_RADICAL_STARTS,          // 部首→漢字の始まり。
+    KI_RADICAL_KANJI,           // 部首→漢字の番号。
+    KI_RADICAL_STROKE_STARTS,   // 画数→部首の始まり。
+    KI_READINGS,                // 読み。
+    KI_STRINGS,                 // 文字列。
+    KI_NUM_SECTIONS
+};
+
+#define KANJI_INDEX_HEADER      (10 + KI_NUM_SECTIONS * 2)  // ヘッダーの単位数。
+
+// kanji.datの行。
+struct KANJI_ENTRY {
+    WORD kanji_id;
+    WCHAR kanji_char;
+    WORD radical_id2;
+    WORD strokes;
+    std::wstring readings;
+    KANJI_ENTRY()
+    {
+        kanji_id = 0;
+        kanji_char = 0;
+        radical_id2 = 0;
+        strokes = 0;
+    }
+};
+
+// radical.datの行。
+struct RADICAL_ENTRY {
+    WORD radical_id;
+    WORD radical_id2;
+    WORD strokes;
+    std::wstring readings;
+    RADICAL_ENTRY()
+    {
+        radical_id = 0;
+        radical_id2 = 0;
+        strokes = 0;
+    }
+};
+
+// UTF-8のテキストファイルから、注釈（;）を除いた行を読み込む。
+inline void KanjiIndexReadLines(FILE *fp, std::vector<std::wstring>& lines)
+{
+    char buf[256];
+    wchar_t wbuf[256];
+    while (fgets(buf, 256, fp) != NULL) {
+        if (buf[0] == ';') continue;
+        ::MultiByteToWideChar(CP_UTF8, 0, buf, -1, wbuf, 256);
+        std::wstring str = wbuf;
+        size_t ich = str.find_last_not_of(L"\r\n");
+        str.resize(ich == str.npos ? 0 : ich + 1);
+        if (str.size())
+            lines.push_back(str);
+    }
+}
+
+// 行をタブで区切る。
+inline void KanjiIndexSplit(std::vector<std::wstring>& fields, const std::wstring& line)
+{
+    fields.clear();
+    size_t i = 0, j;
+    while ((j = line.find(L'\t', i)) != line.npos) {
+        fields.push_back(line.substr(i, j - i));
+        i = j + 1;
+    }
+    fields.push_back(line.substr(i));
+}
+
+// kanji.datの行を読む。
+inline bool KanjiIndexParseKanji(KANJI_ENTRY& entry, const std::wstring& line)
+{
+    std::vector<std::wstring> fields;
+    KanjiIndexSplit(fields, line);
+    if (fields.size() < 5 || fields[1].empty())
+        return false;
+    entry.kanji_id = WORD(wcstol(fields[0].c_str(), NULL, 10));
+    entry.kanji_char = fields[1][0];
+    entry.radical_id2 = WORD(wcstol(fields[2].c_str(), NULL, 10));
+    entry.strokes = WORD(wcstol(fields[3].c_str(), NULL, 10));
+    entry.readings = fields[4];
+    return true;
+}
+
+// radical.datの行を読む。
+inline bool KanjiIndexParseRadical(RADICAL_ENTRY& entry, const std::wstring& line)
+{
+    std::vector<std::wstring> fields;
+    KanjiIndexSplit(fields, line);
+    if (fields.size() < 5)
+        return false;
+    entry.radical_id = WORD(wcstol(fields[0].c_str(), NULL, 10));
+    entry.radical_id2 = WORD(wcstol(fields[1].c_str(), NULL, 10));
+    entry.strokes = WORD(wcstol(fields[3].c_str(), NULL, 10));
+    entry.readings = fields[4];
+    return true;
+}
+
+inline void KanjiIndexPutDWORD(std::vector<WORD>& units, size_t value)
+{
+    units.push_back(WORD(value & 0xFFFF));
+    units.push_back(WORD(value >> 16));
+}
+
+inline DWORD KanjiIndexGetDWORD(const WORD *pw)
+{
+    return pw[0] | ((DWORD)pw[1] << 16);
+}
+
+inline size_t KanjiIndexPutString(std::vector<WORD>& strings, const std::wstring& str)
+{
+    size_t ich = strings.size();
+    for (size_t i = 0; i < str.size(); ++i)
+        strings.push_back(WORD(str[i]));
+    strings.push_back(0);
+    return ich;
+}
+
+// 始まりの並び（CSR）にする。countsは番号ごとの数で、最後に番兵を足す。
+inline void KanjiIndexPutStarts(std::vector<WORD>& units, const std::vector<size_t>& counts)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        units.push_back(WORD(start));
+        start += counts[i];
+    }
+    units.push_back(WORD(start));
+}
+
+struct KanjiIndexStrokesLess {
+    const std::vector<KANJI_ENTRY> *kanji;
+    bool operator()(WORD i, WORD j) const {
+        return (*kanji)[i].strokes < (*kanji)[j].strokes;
+    }
+};
+
+inline bool KanjiIndexRadicalLess(const RADICAL_ENTRY& entry1, const RADICAL_ENTRY& entry2)
+{
+    return entry1.strokes < entry2.strokes;
+}
+
+// 漢字と部首から索引を作る。番号がWORDに収まらなければfalse。
+inline bool KanjiIndexBuild(std::vector<WORD>& units,
+                            const std::vector<KANJI_ENTRY>& kanji,
+                            std::vector<RADICAL_ENTRY> radicals)
+{
+    if (kanji.size() > 0xFFFF || radicals.size() > 0xFFFF)
+        return false;
+
+    size_t cStrokes = 0, cRadical2 = 0;
+    for (size_t i = 0; i < kanji.size(); ++i) {
+        cStrokes = (std::max)(cStrokes, size_t(kanji[i].strokes) + 1);
+        cRadical2 = (std::max)(cRadical2, size_t(kanji[i].radical_id2) + 1);
+    }
+    for (size_t i = 0; i < radicals.size(); ++i) {
+        cStrokes = (std::max)(cStrokes, size_t(radicals[i].strokes) + 1);
+        cRadical2 = (std::max)(cRadical2, size_t(radicals[i].radical_id2) + 1);
+    }
+    std::stable_sort(radicals.begin(), radicals.end(), KanjiIndexRadicalLess);
+
+    std::vector<WORD> sections[KI_NUM_SECTIONS];
+    std::vector<WORD>& strings = sections[KI_STRINGS];
+
+    // 漢字と、その読み。
+    std::vector<std::pair<std::wstring, WORD> > readings;
+    std::vector<size_t> stroke_counts(cStrokes), radical_counts(cRadical2);
+    for (size_t i = 0; i < kanji.size(); ++i) {
+        const KANJI_ENTRY& entry = kanji[i];
+        sections[KI_KANJI].push_back(WORD(entry.kanji_char));
+        sections[KI_KANJI].push_back(entry.radical_id2);
+        sections[KI_KANJI].push_back(entry.strokes);
+        KanjiIndexPutDWORD(sections[KI_KANJI], KanjiIndexPutString(strings, entry.readings));
+        ++stroke_counts[entry.strokes];
+        ++radical_counts[entry.radical_id2];
+
+        std::wstring reading;
+        for (size_t k = 0; k <= entry.readings.size(); ++k) {
+            WCHAR ch = (k < entry.readings.size() ? entry.readings[k] : L'、');
+            if (ch == L'-')
+                continue;
+            if (ch != L'、') {
+                reading += ch;
+                continue;
+            }
+            if (reading.size())
+                readings.push_back(std::make_pair(reading, WORD(i)));
+            reading.clear();
+        }
+    }
+
+    // 部首。
+    std::vector<size_t> radical_stroke_counts(cStrokes);
+    for (size_t i = 0; i < radicals.size(); ++i) {
+        const RADICAL_ENTRY& entry = radicals[i];
+        sections[KI_RADICALS].push_back(entry.radical_id);
+        sections[KI_RADICALS].push_back(entry.radical_id2);
+        sections[KI_RADICALS].push_back(entry.strokes);
+        KanjiIndexPutDWORD(sections[KI_RADICALS], KanjiIndexPutString(strings, entry.readings));
+        ++radical_stroke_counts[entry.strokes];
+    }
+
+    // 画数→漢字。画数ごとにkanji.datの順。
+    KanjiIndexPutStarts(sections[KI_STROKE_STARTS], stroke_counts);
+    sections[KI_STROKE_KANJI].resize(kanji.size());
+    {
+        std::vector<size_t> next(cStrokes);
+        for (size_t s = 0; s < cStrokes; ++s)
+            next[s] = sections[KI_STROKE_STARTS][s];
+        for (size_t i = 0; i < kanji.size(); ++i)
+            sections[KI_STROKE_KANJI][next[kanji[i].strokes]++] = WORD(i);
+    }
+
+    // 部首→漢字。部首ごとに画数の順にして、画数でも絞り込めるようにする。
+    KanjiIndexPutStarts(sections[KI_RADICAL_STARTS], radical_counts);
+    sections[KI_RADICAL_KANJI].resize(kanji.size());
+    {
+        KanjiIndexStrokesLess less;
+        less.kanji = &kanji;
+        std::vector<WORD> order(sections[KI_STROKE_KANJI]);
+        std::stable_sort(order.begin(), order.end(), less);
+        std::vector<size_t> next(cRadical2);
+        for (size_t r = 0; r < cRadical2; ++r)
+            next[r] = sections[KI_RADICAL_STARTS][r];
+        for (size_t i = 0; i < order.size(); ++i)
+            sections[KI_RADICAL_KANJI][next[kanji[order[i]].radical_id2]++] = order[i];
+    }
+
+    // 画数→部首。
+    KanjiIndexPutStarts(sections[KI_RADICAL_STROKE_STARTS], radical_stroke_counts);
+
+    // 読み。
+    std::sort(readings.begin(), readings.end());
+    for (size_t i = 0; i < readings.size(); ++i) {
+        KanjiIndexPutDWORD(sections[KI_READINGS], KanjiIndexPutString(strings, readings[i].first));
+        sections[KI_READINGS].push_back(readings[i].second);
+    }
+
+    // ヘッダー。
+    units.clear();
+    units.push_back(KANJI_INDEX_SIG0);
+    units.push_back(KANJI_INDEX_SIG1);
+    units.push_back(KANJI_INDEX_VERSION);
+    units.push_back(0);
+    units.push_back(WORD(kanji.size()));
+    units.push_back(WORD(radicals.size()));
+    units.push_back(WORD(cStrokes));
+    units.push_back(WORD(cRadical2));
+    KanjiIndexPutDWORD(units, readings.size());
+    size_t ib = KANJI_INDEX_HEADER;
+    for (INT i = 0; i < KI_NUM_SECTIONS; ++i) {
+        KanjiIndexPutDWORD(units, ib);
+        ib += sections[i].size();
+    }
+    for (INT i = 0; i < KI_NUM_SECTIONS; ++i)
+        units.insert(units.end(), sections[i].begin(), sections[i].end());
+    return true;
+}
+
+// 漢字の索引を読む。データは写像したファイルなどで、持ち主は別にいる。
+class KanjiIndex
+{
+public:
+    KanjiIndex() : m_data(NULL), m_cUnits(0) { }
+
+    // 索引のデータを使う。正しい索引でなければfalse。
+    bool Attach(const WORD *data, size_t cUnits)
+    {
+        m_data = NULL;
+        m_cUnits = 0;
+        if (cUnits < KANJI_INDEX_HEADER || data[0] != KANJI_INDEX_SIG0 ||
+            data[1] != KANJI_INDEX_SIG1 || data[2] != KANJI_INDEX_VERSION)
+        {
+            return false;
+        }
+        // 部分の大きさを確かめる。
+        size_t cKanji = data[4], cRadicals = data[5], cStrokes = data[6], cRadical2 = data[7];
+        size_t sizes[KI_NUM_SECTIONS] = {
+            cKanji * KANJI_INDEX_KANJI, cRadicals * KANJI_INDEX_RADICAL,
+            cStrokes + 1, cKanji, cRadical2 + 1, cKanji, cStrokes + 1,
+            KanjiIndexGetDWORD(data + 8) * KANJI_INDEX_READING, 0
+        };
+        for (INT i = 0; i < KI_NUM_SECTIONS; ++i) {
+            size_t ib = KanjiIndexGetDWORD(data + 10 + i * 2);
+            if (ib < KANJI_INDEX_HEADER || ib + sizes[i] > cUnits)
+                return false;
+        }
+        if (data[cUnits - 1] != 0) // 最後の文字列はNULで終わる。
+            return false;
+        m_data = data;
+        m_cUnits = cUnits;
+        return true;
+    }
+    bool IsAttached() const { return m_data != NULL; }
+
+    size_t GetKanjiCount() const { return m_data[4]; }
+    size_t GetRadicalCount() const { return m_data[5]; }
+    size_t GetStrokesCount() const { return m_data[6]; }   // 最大の画数 + 1。
+    size_t GetReadingCount() const { return KanjiIndexGetDWORD(m_data + 8); }
+
+    WCHAR GetKanjiChar(size_t iKanji) const { return WCHAR(Kanji(iKanji)[0]); }
+    WORD GetKanjiRadical2(size_t iKanji) const { return Kanji(iKanji)[1]; }
+    WORD GetKanjiStrokes(size_t iKanji) const { return Kanji(iKanji)[2]; }
+    const WCHAR *GetKanjiReadings(size_t iKanji) const { return String(Kanji(iKanji) + 3); }
+
+    // 部首は画数の順。
+    WORD GetRadicalID(size_t iRadical) const { return Radical(iRadical)[0]; }
+    WORD GetRadical2(size_t iRadical) const { return Radical(iRadical)[1]; }
+    WORD GetRadicalStrokes(size_t iRadical) const { return Radical(iRadical)[2]; }
+    const WCHAR *GetRadicalReadings(size_t iRadical) const { return String(Radical(iRadical) + 3); }
+
+    // 画数がstrokesの漢字の番号の並び。
+    const WORD *GetKanjiByStrokes(size_t strokes, size_t& count) const {
+        return Slice(KI_STROKE_STARTS, KI_STROKE_KANJI, GetStrokesCount(), strokes, count);
+    }
+    // 部首番号2がradical_id2の漢字の番号の並び（画数の順）。
+    const WORD *GetKanjiByRadical(size_t radical_id2, size_t& count) const {
+        return Slice(KI_RADICAL_STARTS, KI_RADICAL_KANJI, m_data[7], radical_id2, count);
+    }
+    // 部首番号2がradical_id2で、画数がstrokesの漢字の番号の並び。
+    const WORD *GetKanjiByRadicalAndStrokes(size_t radical_id2, size_t strokes, size_t& count) const {
+        const WORD *pw = GetKanjiByRadical(radical_id2, count);
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (GetKanjiStrokes(pw[mid]) < strokes) lo = mid + 1; else hi = mid;
+        }
+        size_t first = lo;
+        for (hi = count; lo < hi;) {
+            size_t mid = (lo + hi) / 2;
+            if (GetKanjiStrokes(pw[mid]) <= strokes) lo = mid + 1; else hi = mid;
+        }
+        count = lo - first;
+        return pw + first;
+    }
+    // 画数がstrokesの部首の番号の範囲[iFirst, iFirst + count)。
+    size_t GetRadicalsByStrokes(size_t strokes, size_t& count) const {
+        count = 0;
+        if (strokes >= GetStrokesCount())
+            return 0;
+        const WORD *starts = Section(KI_RADICAL_STROKE_STARTS);
+        count = starts[strokes + 1] - starts[strokes];
+        return starts[strokes];
+    }
+
+    // 読みがprefixで始まる読みの番号の範囲[iFirst, iFirst + count)。
+    size_t FindReadings(const WCHAR *prefix, size_t& count) const {
+        size_t cch = wcslen(prefix), lo = 0, hi = GetReadingCount();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (wcsncmp(GetReading(mid), prefix, cch) < 0) lo = mid + 1; else hi = mid;
+        }
+        size_t first = lo;
+        for (hi = GetReadingCount(); lo < hi;) {
+            size_t mid = (lo + hi) / 2;
+            if (wcsncmp(GetReading(mid), prefix, cch) <= 0) lo = mid + 1; else hi = mid;
+        }
+        count = lo - first;
+        return first;
+    }
+    const WCHAR *GetReading(size_t iReading) const {
+        return String(Section(KI_READINGS) + iReading * KANJI_INDEX_READING);
+    }
+    WORD GetReadingKanji(size_t iReading) const {
+        return Section(KI_READINGS)[iReading * KANJI_INDEX_READING + 2];
+    }
+
+protected:
+    const WORD *m_data;
+    size_t m_cUnits;
+
+    const WORD *Section(INT iSection) const {
+        return m_data + KanjiIndexGetDWORD(m_data + 10 + iSection * 2);
+    }
+    const WORD *Kanji(size_t iKanji) const {
+        return Section(KI_KANJI) + iKanji * KANJI_INDEX_KANJI;
+    }
+    const WORD *Radical(size_t iRadical) const {
+        return Section(KI_RADICALS) + iRadical * KANJI_INDEX_RADICAL;
+    }
+    const WCHAR *String(const WORD *pwPos) const {
+        return (const WCHAR *)Section(KI_STRINGS) + KanjiIndexGetDWORD(pwPos);
+    }
+    const WORD *Slice(INT iStarts, INT iItems, size_t cKeys, size_t key, size_t& count) const {
+        count = 0;
+        if (key >= cKeys)
+            return NULL;
+        const WORD *starts = Section(iStarts);
+        count = starts[key + 1] - starts[key];
+        return Section(iItems) + starts[key];
+    }
+};
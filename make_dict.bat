@@ -26,5 +26,6 @@ goto label5
 %DICT_COMPILE% res\basic.dat res\basic.dic
 %DICT_COMPILE% res\name.dat res\name.dic
 %DICT_COMPILE% res\testdata.dat res\testdata.dic
+%DICT_COMPILE% -k res\kanji.dat res\radical.dat res\kanji.idx
 
 exit /b 0
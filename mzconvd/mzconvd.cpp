@@ -0,0 +1,153 @@
+﻿// mzconvd.cpp --- mzimeja conversion server
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 辞書を一度だけ読み込み、IMEからの変換要求を通信路で受け付ける。
+// 使い方: mzconvd [-p 通信路の名前] [-w ワーカーの数] [-d 目録] [-s 特別な変換]
+
+#include "mzconv_server.h"
+#ifdef _WIN32
+    #include <shellapi.h>
+#else
+    #include <signal.h>
+#endif
+
+#ifdef _WIN32
+static HANDLE s_hQuit = NULL; // 終了を知らせるイベント。
+
+// Ctrl+Cなどで終了する。
+static BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
+{
+    mz_event_set(s_hQuit);
+    return TRUE;
+}
+#endif
+
+// 辞書を読み込む。IMEと同じ場所を探す。
+static BOOL LoadDicts(void)
+{
+    std::wstring basic;
+    if (FindLocalFile(basic, L"basic.dic") ||
+        FindLocalFile(basic, L"res\\basic.dic") ||
+        FindAppFile(basic, L"basic.dic") ||
+        FindAppFile(basic, L"res\\basic.dic") ||
+        Config_GetSz(L"BasicDictPathName", basic))
+    {
+        if (!g_basic_dict.Load(basic.c_str(), L"BasicDictObject"))
+            return FALSE;
+    } else {
+        return FALSE;
+    }
+
+    std::wstring name;
+    if (FindLocalFile(name, L"name.dic") ||
+        FindLocalFile(name, L"res\\name.dic") ||
+        FindAppFile(name, L"name.dic") ||
+        FindAppFile(name, L"res\\name.dic") ||
+        Config_GetSz(L"NameDictPathName", name))
+    {
+        g_name_dict.Load(name.c_str(), L"NameDictObject");
+    }
+
+    return TRUE;
+}
+
+extern "C"
+int wmain(int argc, wchar_t **wargv)
+{
+    std::wstring name = MZCONV_PIPE_NAME;
+    DWORD dwWorkers = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::wstring arg = wargv[i];
+        if (arg == L"-p" && i + 1 < argc) {
+            name = wargv[++i];
+        } else if (arg == L"-w" && i + 1 < argc) {
+            dwWorkers = (DWORD)wcstoul(wargv[++i], NULL, 10);
+        } else if (arg == L"-d" && i + 1 < argc) {
+            // 分野別の分割辞書の目録。何度でも指定できる。
+            if (!g_domain_dict.Load(wargv[++i])) {
+                fprintf(stderr, "ERROR: cannot load domain dictionary\n");
+                return 2;
+            }
+        } else if (arg == L"-s" && i + 1 < argc) {
+            // 特別な変換のデータファイル。
+            if (!g_special_convs.Load(wargv[++i])) {
+                fprintf(stderr, "ERROR: cannot load special conversions\n");
+                return 2;
+            }
+        } else {
+            fprintf(stderr, "Usage: mzconvd [-p name] [-w workers] [-d manifest] [-s special]...\n");
+            return 1;
+        }
+    }
+
+    mz_make_literal_maps();
+    if (!LoadDicts()) {
+        fprintf(stderr, "ERROR: cannot load dictionary\n");
+        return 2;
+    }
+
+#ifndef _WIN32
+    // シグナルはこのスレッドでsigwaitする。スレッドを作る前に止めておく。
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+#endif
+
+    MzConverter converter;
+    MzConvServer server(&converter);
+    if (!server.Start(name.c_str(), dwWorkers)) {
+        fprintf(stderr, "ERROR: cannot listen\n");
+        return 3;
+    }
+
+#ifdef _WIN32
+    s_hQuit = mz_event_create(TRUE);
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+    mz_event_wait(s_hQuit, INFINITE);
+#else
+    int sig;
+    sigwait(&sigs, &sig);
+#endif
+
+    server.Stop();
+    printf("requests: %ld, batches: %ld, coalesced: %ld\n",
+           (long)server.m_nRequests, (long)server.m_nBatches, (long)server.m_nCoalesced);
+
+    if (g_domain_dict.IsLoaded()) {
+        printf("shard loads: %ld, evictions: %ld\n",
+               (long)g_domain_dict.m_nLoads, (long)g_domain_dict.m_nEvictions);
+    }
+
+    g_basic_dict.Unload();
+    g_name_dict.Unload();
+    g_domain_dict.Unload();
+    return 0;
+} // wmain
+
+#ifdef _WIN32
+// 古いコンパイラのサポートのため。
+int main(void)
+{
+    int argc;
+    LPWSTR *argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    int ret = wmain(argc, argv);
+    LocalFree(argv);
+    return ret;
+}
+#else
+int main(int argc, char **argv)
+{
+    std::vector<std::wstring> args(argc);
+    std::vector<wchar_t *> wargv(argc + 1);
+    for (int i = 0; i < argc; ++i) {
+        std::vector<WCHAR> buf(strlen(argv[i]) + 1);
+        int cch = MultiByteToWideChar(CP_UTF8, 0, argv[i], -1, &buf[0], (int)buf.size());
+        args[i].assign(&buf[0], (cch > 0) ? cch - 1 : 0);
+        wargv[i] = &args[i][0];
+    }
+    return wmain(argc, &wargv[0]);
+}
+#endif
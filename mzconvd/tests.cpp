@@ -0,0 +1,1020 @@
+﻿// tests.cpp --- mzconvd のテスト。
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 使い方: mzconvd_tests basic.dic name.dic
+
+#include "mzconv_server.h"
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+static int s_nFailed = 0;
+
+#define CHECK(exp) do { \
+    if (!(exp)) { \
+        fprintf(stderr, "%s (%d): FAILED: %s\n", __FILE__, __LINE__, #exp); \
+        ++s_nFailed; \
+    } \
+} while (0)
+
+static MzConverter s_converter;
+static std::wstring s_name; // 通信路の名前。
+
+static const wchar_t *s_texts[] = {
+    L"わたしはにほんごをはなします。",
+    L"きょうはいいてんきですね。",
+    L"かきます。かいて。かかない。",
+    L"へんかんさーばー",
+    L"とうきょうとちよだく",
+};
+#define NUM_TEXTS (sizeof(s_texts) / sizeof(s_texts[0]))
+
+// 直接変換した結果と比べる。
+static BOOL IsSameAsLocal(WORD wType, const std::wstring& text, const MzConvResult& got)
+{
+    MzConvResult expected;
+    if (wType == MZCONV_SINGLE)
+        s_converter.ConvertSingleClause(text, expected);
+    else
+        s_converter.ConvertMultiClause(text, expected);
+    return got.get_str(true) == expected.get_str(true);
+}
+
+// 符号化と復号。
+static void TestProtocol(void)
+{
+    std::string buf;
+    MZCONV_HEADER header;
+    mzconv_put_header(buf, 0x12345678, MZCONV_MULTI, 6);
+    CHECK(buf.size() == MZCONV_HEADER_SIZE);
+    CHECK(mzconv_get_header((const BYTE *)buf.data(), header));
+    CHECK(header.dwId == 0x12345678 && header.wType == MZCONV_MULTI && header.cbBody == 6);
+
+    buf[0] = 'X';
+    CHECK(!mzconv_get_header((const BYTE *)buf.data(), header));
+
+    // サロゲートペアを含む文字列。
+    std::wstring text = L"𠮷野家", got;
+    buf.clear();
+    mzconv_put_text(buf, text);
+    CHECK(buf.size() == 4 * 2);
+    CHECK(mzconv_get_text(buf, got) && got == text);
+    CHECK(!mzconv_get_text(std::string("abc"), got));
+
+    MzConvResult result, result2;
+    s_converter.ConvertMultiClause(s_texts[0], result);
+    buf.clear();
+    mzconv_put_result(buf, result);
+    CHECK(mzconv_get_result(buf, result2));
+    CHECK(result.get_str(true) == result2.get_str(true));
+    buf.resize(buf.size() - 1);
+    CHECK(!mzconv_get_result(buf, result2));
+}
+
+// 予測変換。一文字ずつ伸ばしても、まとめて設定しても同じ候補になる。
+static void TestPredict(void)
+{
+    const std::wstring prefix = L"とうきょう";
+    MzPredictor predictor;
+    for (size_t i = 0; i < prefix.size(); ++i) {
+        CHECK(predictor.Push(prefix[i]));
+        MzConvResult got, expected;
+        CHECK(predictor.GetCandidates(got));
+        CHECK(s_converter.Predict(prefix.substr(0, i + 1), expected));
+        CHECK(got.get_str(true) == expected.get_str(true));
+
+        const MzConvClause& clause = got.clauses[0];
+        CHECK(clause.candidates.size() <= DICT_PREDICT_TOPK);
+        for (size_t j = 0; j < clause.candidates.size(); ++j) {
+            CHECK(clause.candidates[j].pre.compare(0, i + 1, prefix, 0, i + 1) == 0);
+            if (j > 0)
+                CHECK(clause.candidates[j - 1].cost <= clause.candidates[j].cost);
+        }
+    }
+
+    // 縮めると元に戻る。
+    MzConvResult before, after;
+    predictor.Pop();
+    predictor.GetCandidates(before);
+    predictor.Push(L'ゅ');
+    predictor.Pop();
+    predictor.GetCandidates(after);
+    CHECK(before.get_str(true) == after.get_str(true));
+
+    // 候補のない読み。
+    MzConvResult result;
+    CHECK(!predictor.SetPrefix(L"ゔゔゔゔ"));
+    CHECK(!predictor.GetCandidates(result));
+}
+
+// 再変換。表記から読みに戻し、各文節の最初の候補は元の表記になる。
+static void TestReconvert(void)
+{
+    std::wstring reading;
+    CHECK(s_converter.GetReading(L"東京都千代田区", reading));
+    CHECK(reading == L"とうきょうとちよだく");
+    CHECK(s_converter.GetReading(L"話します", reading));
+    CHECK(reading == L"はなします");
+    CHECK(s_converter.GetReading(L"コンピューター", reading));
+    CHECK(reading == L"こんぴゅーたー");
+
+    static const wchar_t *texts[] = {
+        L"漢字を書いた", L"今日はいい天気ですね", L"𰻞𰻞麺",
+    };
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i) {
+        MzConvResult result;
+        CHECK(s_converter.Reconvert(texts[i], result));
+        std::wstring str;
+        for (size_t iClause = 0; iClause < result.clauses.size(); ++iClause)
+            str += result.clauses[iClause].candidates[0].post;
+        CHECK(str == texts[i]);
+    }
+}
+
+// 読みの鍵の符号は文字列に戻せて、文字の順を保つ。
+static void TestKeyCode(void)
+{
+    static const WCHAR chars[] = {
+        0x0001, L'A', 0x3000, 0x3040, 0x3041, L'ゔ', L'ー', 0x30FF, 0x3100, L'漢',
+        0xD842, 0xDFB7, 0xFFFC, 0xFFFD, 0xFFFF,
+    };
+    std::string prev;
+    for (size_t i = 0; i < _countof(chars); ++i) {
+        std::string key;
+        CHECK(DictKeyEncodeChar(key, chars[i]));
+        CHECK(prev < key);
+        prev = key;
+
+        // 単位に入れると、NULや区切りにならない。
+        std::wstring units, pre;
+        for (size_t ib = 0; ib < key.size(); ib += 2) {
+            BYTE hi = (ib + 1 < key.size()) ? (BYTE)key[ib + 1] : 0;
+            units += (WCHAR)MAKEWORD((BYTE)key[ib], hi);
+        }
+        CHECK(units.find_first_of(std::wstring(1, FIELD_SEP) + RECORD_SEP) == units.npos);
+        CHECK(units.find(L'\0') == units.npos);
+        CHECK(DictKeyDecode(pre, units.c_str(), units.size()));
+        CHECK(pre == std::wstring(1, chars[i]));
+    }
+}
+
+// 読みの索引で得るレコードは、すべてのレコードを順に読んで読みで絞ったものと同じ。
+static void TestKeyIndex(void)
+{
+    WCHAR *dict_data = g_basic_dict.Lock();
+    CHECK(dict_data != NULL);
+    if (!dict_data)
+        return;
+    size_t ichKeys = FindKeyIndex(dict_data, g_basic_dict.GetLength());
+    CHECK(ichKeys != 0);
+
+    std::wstring sep(1, FIELD_SEP);
+    WStrings all;
+    for (size_t ich = 2; ichKeys && ich < ichKeys && dict_data[ich]; ) {
+        std::wstring record;
+        CHECK(GetDictRecord(record, dict_data, ichKeys, ich, TRUE));
+        all.push_back(record);
+        while (dict_data[ich] != RECORD_SEP)
+            ++ich;
+        ++ich;
+    }
+
+    for (size_t i = 0; ichKeys && i < NUM_TEXTS; ++i) {
+        Lattice lattice;
+        lattice.SetPre(s_texts[i]);
+        for (size_t index = 0; index < lattice.m_pre.size(); ++index) {
+            WStrings expected, got, fields;
+            for (size_t k = 0; k < all.size(); ++k) {
+                str_split(fields, all[k], sep);
+                if (lattice.m_pre.compare(index, fields[0].size(), fields[0]) == 0)
+                    expected.push_back(all[k]);
+            }
+            ScanKeyIndex(got, dict_data, ichKeys, lattice.m_key, lattice.m_key_pos[index]);
+            CHECK(got == expected);
+        }
+    }
+
+    g_basic_dict.Unlock(dict_data);
+}
+
+// 先読み変換。
+static void TestSpeculate(void)
+{
+    MzSpeculator spec(&s_converter);
+    HANDLE hNever = mz_event_create(TRUE);
+    int key1, key2;
+
+    // 変換が終わるまで待ってから受け取る。受け取れるのは一度だけ。
+    spec.m_dwDelay = 10;
+    spec.Schedule(&key1, s_texts[0]);
+    for (int i = 0; i < 500 && spec.m_nConverted == 0; ++i)
+        mz_event_wait(hNever, 10);
+    MzConvResult result;
+    CHECK(spec.Take(&key1, s_texts[0], result, INFINITE));
+    CHECK(IsSameAsLocal(MZCONV_MULTI, s_texts[0], result));
+    CHECK(!spec.Take(&key1, s_texts[0], result, INFINITE));
+
+    // 文字列が違えば使わない。
+    spec.Schedule(&key1, s_texts[1]);
+    for (int i = 0; i < 500 && spec.m_nConverted == 1; ++i)
+        mz_event_wait(hNever, 10);
+    CHECK(spec.m_nConverted == 2);
+    CHECK(!spec.Take(&key1, s_texts[2], result, INFINITE));
+
+    // 入力が続いている間は変換しない。予約し直すと古い予約は取り消す。
+    spec.m_dwDelay = 100000;
+    LONG nCancelled = spec.m_nCancelled;
+    spec.Schedule(&key2, s_texts[3]);
+    spec.Schedule(&key2, s_texts[4]);
+    CHECK(spec.m_nCancelled == nCancelled + 1);
+    spec.Cancel(&key2);
+    CHECK(spec.m_nCancelled == nCancelled + 2);
+    CHECK(!spec.Take(&key2, s_texts[4], result, 0));
+    CHECK(spec.m_nConverted == 2);
+    CHECK(spec.m_nHits == 1);
+
+    spec.Stop();
+    mz_event_close(hNever);
+}
+
+// 最初の文節の最初の候補。
+static std::wstring FirstCandidate(const std::wstring& text)
+{
+    MzConvResult result;
+    s_converter.ConvertMultiClause(text, result);
+    if (result.clauses.empty() || result.clauses[0].candidates.empty())
+        return std::wstring();
+    return result.clauses[0].candidates[0].post;
+}
+
+// 学習。
+static void TestLearning(void)
+{
+    WCHAR szDir[MAX_PATH];
+#ifdef _WIN32
+    GetTempPathW(_countof(szDir), szDir);
+    StringCchPrintfW(szDir + lstrlenW(szDir), 64, L"mzlearn-%lu-", GetCurrentProcessId());
+#else
+    StringCchPrintfW(szDir, MAX_PATH, L"/tmp/mzlearn-%lu-", (unsigned long)getpid());
+#endif
+    std::wstring snapshot_file = std::wstring(szDir) + L"learning.dat";
+    std::wstring log_file = std::wstring(szDir) + L"learning.log";
+
+    // 確定した候補が先頭になる。活用しても同じ。
+    CHECK(g_learning.Open(snapshot_file.c_str(), log_file.c_str()));
+    CHECK(FirstCandidate(L"かいた") == L"書いた");
+    g_learning.Learn(L"かいた", L"描いた", L"");
+    g_learning.Learn(L"きしゃ", L"記者", L"");
+    g_learning.Flush();
+    CHECK(g_learning.GetCount() == 2);
+    CHECK(FirstCandidate(L"かいて") == L"描いて");
+    CHECK(FirstCandidate(L"きしゃ") == L"記者");
+
+    // ほかのプロセスが書いたログも読む。
+    MzLearning other;
+    CHECK(other.Open(snapshot_file.c_str(), log_file.c_str()));
+    CHECK(other.GetCount() == 2);
+    g_learning.Learn(L"こうえん", L"講演", L"");
+    g_learning.Flush();
+    other.Learn(L"かんじ", L"感じ", L"");
+    other.Flush();
+    CHECK(other.GetCount() == 4);
+    other.Close();
+
+    // 閉じても覚えている。上限を超えたら古いものから忘れる。
+    g_learning.Close();
+    CHECK(FirstCandidate(L"きしゃ") != L"記者");
+    g_learning.m_dwMaxEntries = 3;
+    CHECK(g_learning.Open(snapshot_file.c_str(), log_file.c_str()));
+    CHECK(g_learning.GetCount() == 3);
+    CHECK(FirstCandidate(L"こうえん") == L"講演");
+    CHECK(FirstCandidate(L"かいた") == L"書いた");
+    g_learning.Close();
+    g_learning.m_dwMaxEntries = 10000;
+
+#ifdef _WIN32
+    DeleteFileW(snapshot_file.c_str());
+    DeleteFileW(log_file.c_str());
+#else
+    char szPath[MAX_PATH];
+    snprintf(szPath, sizeof(szPath), "/tmp/mzlearn-%lu-learning.dat", (unsigned long)getpid());
+    remove(szPath);
+    snprintf(szPath, sizeof(szPath), "/tmp/mzlearn-%lu-learning.log", (unsigned long)getpid());
+    remove(szPath);
+#endif
+}
+
+// UTF-16LEのファイルを書く。
+static BOOL WriteUtf16File(const std::wstring& file_name, const std::wstring& text)
+{
+    FILE *fp = _wfopen(file_name.c_str(), L"wb");
+    if (!fp)
+        return FALSE;
+    for (size_t i = 0; i < text.size(); ++i) {
+        BYTE ab[2] = { LOBYTE(text[i]), HIBYTE(text[i]) };
+        fwrite(ab, sizeof(ab), 1, fp);
+    }
+    fclose(fp);
+    return TRUE;
+}
+
+// ファイルを消す。
+static void RemoveFile(const std::wstring& file_name)
+{
+#ifdef _WIN32
+    DeleteFileW(file_name.c_str());
+#else
+    // パス名はUTF-8にする。大きさを先に求めるので切り詰めない。
+    int cb = WideCharToMultiByte(CP_UTF8, 0, file_name.c_str(), -1, NULL, 0, NULL, NULL);
+    if (cb <= 0)
+        return;
+    std::vector<char> path(cb);
+    if (WideCharToMultiByte(CP_UTF8, 0, file_name.c_str(), -1, &path[0], cb, NULL, NULL) == cb)
+        remove(&path[0]);
+#endif
+}
+
+// 分割辞書のレコード。
+static std::wstring ShardRecord(const std::wstring& pre, const std::wstring& post)
+{
+    std::wstring ret = pre;
+    ret += FIELD_SEP;
+    ret += post;
+    ret += FIELD_SEP;
+    ret += (WCHAR)MAKEWORD(HB_MEISHI, 0);
+    ret += FIELD_SEP;
+    ret += RECORD_SEP;
+    return ret;
+}
+
+// 分割辞書。分割は使うときに読み込み、予算を超えたら古いものから捨てる。
+static void TestShards(void)
+{
+    WCHAR szDir[MAX_PATH], szBase[64];
+#ifdef _WIN32
+    GetTempPathW(_countof(szDir), szDir);
+    StringCchPrintfW(szBase, _countof(szBase), L"mzshard-%lu", GetCurrentProcessId());
+#else
+    StringCchPrintfW(szDir, MAX_PATH, L"/tmp/");
+    StringCchPrintfW(szBase, 64, L"mzshard-%lu", (unsigned long)getpid());
+#endif
+    std::wstring dir = szDir, base = szBase;
+    std::wstring files[3] = {
+        base + L".shards", base + L".000.dic", base + L".001.dic"
+    };
+
+    std::wstring manifest;
+    manifest += (WCHAR)0xFEFF;
+    manifest += DICT_SHARD_SIGNATURE;
+    manifest += L"\t1\r\n";
+    manifest += files[1] + L"\tめも\r\n";
+    manifest += files[2] + L"\tぴ\r\n";
+    std::wstring shard0, shard1;
+    shard0 += (WCHAR)0xFEFF;
+    shard0 += RECORD_SEP;
+    shard0 += ShardRecord(L"めざもら", L"目座茂羅") + ShardRecord(L"もらざ", L"茂羅座");
+    shard0 += L'\0';
+    shard1 += (WCHAR)0xFEFF;
+    shard1 += RECORD_SEP;
+    shard1 += ShardRecord(L"ぴよたん", L"比与丹");
+    shard1 += L'\0';
+    CHECK(WriteUtf16File(dir + files[0], manifest));
+    CHECK(WriteUtf16File(dir + files[1], shard0));
+    CHECK(WriteUtf16File(dir + files[2], shard1));
+
+    // 目録を読んでも、分割はまだ読み込まない。
+    CHECK(FirstCandidate(L"めざもら") != L"目座茂羅");
+    CHECK(g_domain_dict.Load((dir + files[0]).c_str()));
+    CHECK(g_domain_dict.m_nLoads == 0);
+
+    CHECK(FirstCandidate(L"めざもら") == L"目座茂羅");
+    CHECK(g_domain_dict.m_nLoads == 1);
+    CHECK(FirstCandidate(L"もらざ") == L"茂羅座");
+    CHECK(g_domain_dict.m_nLoads == 1);
+
+    // 予算を一つの分割の大きさにすると、別の分割を読み込めば前の分割を捨てる。
+    DWORD cbBudget = g_domain_dict.m_cbBudget;
+    g_domain_dict.m_cbBudget = g_domain_dict.GetResidentSize();
+    MzConvResult result;
+    CHECK(s_converter.ConvertSingleClause(L"ぴよたん", result));
+    CHECK(result.get_str(true).find(L"比与丹") != std::wstring::npos);
+    CHECK(g_domain_dict.m_nLoads == 2);
+    CHECK(g_domain_dict.m_nEvictions == 1);
+    CHECK(FirstCandidate(L"めざもら") == L"目座茂羅");
+    CHECK(g_domain_dict.m_nLoads == 3);
+    CHECK(g_domain_dict.m_nEvictions == 2);
+    g_domain_dict.m_cbBudget = cbBudget;
+
+    g_domain_dict.Unload();
+    CHECK(FirstCandidate(L"めざもら") != L"目座茂羅");
+
+    for (size_t i = 0; i < _countof(files); ++i)
+        RemoveFile(dir + files[i]);
+}
+
+// 特別な変換を引き続けるスレッド。
+static volatile LONG s_nSpecialStop = 0;
+static volatile LONG s_nSpecialFailed = 0;
+static volatile LONG s_nSpecialDone = 0;
+static HANDLE s_hSpecialDone = NULL;
+#define NUM_FINDERS 4
+
+static DWORD WINAPI SpecialFindProc(LPVOID lpParam)
+{
+    MzSpecialConv entry;
+    for (INT i = 0; !s_nSpecialStop || i < 1000; ++i) {
+        if (!g_special_convs.Find(L"きょう", entry) || entry.text != L"今日" ||
+            !g_special_convs.Find(L"や", entry) || entry.kind != MZSC_SYMBOLS)
+        {
+            InterlockedIncrement(&s_nSpecialFailed);
+        }
+    }
+    if (InterlockedIncrement(&s_nSpecialDone) == NUM_FINDERS)
+        mz_event_set(s_hSpecialDone);
+    return 0;
+}
+
+// 特別な変換。
+static void TestSpecial(void)
+{
+    MzSpecialConv entry;
+    CHECK(g_special_convs.Find(L"きょう", entry) && entry.kind == MZSC_DAY);
+    CHECK(g_special_convs.Find(L"や", entry) && entry.kind == MZSC_SYMBOLS);
+    CHECK(g_special_convs.Find(L"かっこ", entry) && entry.kind == MZSC_WORDS);
+    CHECK(!g_special_convs.Find(L"きょうと", entry));
+    CHECK(!g_special_convs.Find(L"", entry));
+
+    MzConvResult result;
+    CHECK(s_converter.ConvertSingleClause(L"さんかく", result));
+    CHECK(result.get_str(true).find(L"▽") != std::wstring::npos);
+
+    WCHAR szFile[MAX_PATH];
+#ifdef _WIN32
+    WCHAR szDir[MAX_PATH];
+    GetTempPathW(_countof(szDir), szDir);
+    StringCchPrintfW(szFile, _countof(szFile), L"%smzspecial-%lu.txt", szDir, GetCurrentProcessId());
+#else
+    StringCchPrintfW(szFile, MAX_PATH, L"/tmp/mzspecial-%lu.txt", (unsigned long)getpid());
+#endif
+    std::wstring text;
+    text += (WCHAR)0xFEFF;
+    text += L"; 注釈\r\n";
+    text += L"めもらざ\twords\t目茂\t羅座\r\n";
+    text += L"しあさって\tday\t3\t明明後日\r\n";
+    text += L"や\tsymbols\t☆\r\n";
+    text += L"ぴよ\tunknown\t比与\r\n";
+    CHECK(WriteUtf16File(szFile, text));
+    size_t count = g_special_convs.GetCount();
+    CHECK(g_special_convs.Load(szFile));
+    CHECK(g_special_convs.GetCount() == count + 2);
+
+    CHECK(s_converter.ConvertSingleClause(L"めもらざ", result));
+    CHECK(result.get_str(true).find(L"羅座") != std::wstring::npos);
+    CHECK(s_converter.ConvertSingleClause(L"しあさって", result));
+    CHECK(result.get_str(true).find(L"明明後日") != std::wstring::npos);
+    CHECK(s_converter.ConvertSingleClause(L"や", result));
+    CHECK(result.get_str(true).find(L"☆") != std::wstring::npos);
+    CHECK(result.get_str(true).find(L"⇔") == std::wstring::npos);
+    CHECK(!g_special_convs.Find(L"ぴよ", entry));
+
+    // 組み込みの項目だけに戻す。
+    g_special_convs.Reset();
+    CHECK(g_special_convs.GetCount() == count);
+    CHECK(!g_special_convs.Find(L"めもらざ", entry));
+    CHECK(g_special_convs.Find(L"や", entry) && entry.text.find(L"⇔") != std::wstring::npos);
+
+    // 引いている途中で表を入れ替えても、引けなくなったり壊れたりしない。
+    s_hSpecialDone = mz_event_create(TRUE);
+    for (size_t i = 0; i < NUM_FINDERS; ++i)
+        CHECK(mz_create_thread(SpecialFindProc, NULL));
+    for (INT i = 0; i < 20; ++i) {
+        CHECK(g_special_convs.Load(szFile));
+        g_special_convs.Reset();
+    }
+    InterlockedExchange(&s_nSpecialStop, TRUE);
+    CHECK(mz_event_wait(s_hSpecialDone, 60 * 1000));
+    CHECK(s_nSpecialFailed == 0);
+    mz_event_close(s_hSpecialDone);
+    CHECK(g_special_convs.GetCount() == count);
+    RemoveFile(szFile);
+}
+
+// 最初の文節にその候補があるか？
+static BOOL HasCandidate(const MzConvResult& result, const std::wstring& post)
+{
+    if (result.clauses.empty())
+        return FALSE;
+    const candidates_t& cands = result.clauses[0].candidates;
+    for (size_t i = 0; i < cands.size(); ++i) {
+        if (cands[i].post == post)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// 数字の並び。ノードは一つだけで、ほかの表記は結果を作るときに足す。
+static void TestNumeric(void)
+{
+    MzConvResult result;
+    CHECK(s_converter.ConvertMultiClause(L"123", result));
+    CHECK(result.clauses.size() == 1);
+    const candidates_t& cands = result.clauses[0].candidates;
+    size_t count = 0;
+    for (size_t i = 0; i < cands.size(); ++i) {
+        if (cands[i].tags & MZ_TAG_SUUJI)
+            ++count;
+    }
+    CHECK(count == 1);
+    CHECK(HasCandidate(result, L"123"));
+    CHECK(HasCandidate(result, L"１２３"));
+    CHECK(HasCandidate(result, L"百二十三"));
+    CHECK(HasCandidate(result, L"百弐拾参"));
+    CHECK(HasCandidate(result, L"①②③"));
+    CHECK(cands.size() >= 2 && cands[0].post == L"123" && cands[1].post == L"１２３");
+
+    // 数字だけでなければ、漢数字にはしない。
+    CHECK(s_converter.ConvertMultiClause(L"12a", result));
+    CHECK(HasCandidate(result, L"12a"));
+    CHECK(!HasCandidate(result, L"十二a"));
+}
+
+// ビーム探索。最良の結果は変わらず、終了位置ごとのノード数は幅以下になる。
+static void TestBeam(void)
+{
+    const size_t beam_width = 8;
+    for (size_t i = 0; i < NUM_TEXTS; ++i) {
+        MzConvResult expected, got;
+        s_converter.ConvertWithBeam(s_texts[i], expected, 0, 0);
+        s_converter.ConvertWithBeam(s_texts[i], got, beam_width, 2000);
+        CHECK(got.get_str() == expected.get_str());
+
+        Lattice lattice;
+        CHECK(lattice.AddNodesForMulti(s_texts[i]));
+        lattice.AddExtraNodes();
+        lattice.PruneByBeam(beam_width, 2000);
+
+        const size_t length = lattice.m_pre.size();
+        std::vector<size_t> ends(length + 1);
+        for (size_t index = 0; index < length; ++index) {
+            const LatticeChunk& chunk = lattice.m_chunks[index];
+            for (size_t k = 0; k < chunk.size(); ++k) {
+                size_t end = index + chunk[k]->pre_len;
+                if (end <= length)
+                    ++ends[end];
+            }
+        }
+        for (size_t end = 0; end <= length; ++end)
+            CHECK(ends[end] <= beam_width);
+    }
+}
+
+// 文ごとの並列変換は、一つずつ変換した結果と同じになる。
+static void TestParallel(void)
+{
+    WStrings sentences;
+    std::wstring text; // 句点で終わる文をつなげたもの。
+    MzConvResult serial, whole, result;
+    for (size_t i = 0; i < NUM_TEXTS; ++i) {
+        sentences.push_back(s_texts[i]);
+        s_converter.ConvertSentence(sentences[i], result);
+        serial.clauses.insert(serial.clauses.end(), result.clauses.begin(), result.clauses.end());
+        if (sentences[i][sentences[i].size() - 1] == L'。') {
+            text += sentences[i];
+            whole.clauses.insert(whole.clauses.end(), result.clauses.begin(), result.clauses.end());
+        }
+    }
+
+    for (int k = 0; k < 4; ++k) {
+        MzConvResult parallel;
+        s_converter.ConvertSentencesInParallel(sentences, parallel);
+        CHECK(parallel.get_str(true) == serial.get_str(true));
+    }
+
+    // 句点では文節が切れるので、まとめて変換しても最良の結果は同じ。
+    s_converter.ConvertSentence(text, result);
+    CHECK(result.get_str() == whole.get_str());
+}
+
+// 活用の検査に使う。ノードを直接追加できるようにする。
+struct KatsuyouLattice : Lattice {
+    using Lattice::DoFields;
+};
+
+// 語幹の後の語尾と、その活用形の期待値。
+typedef std::map<std::wstring, std::vector<INT> > KatsuyouForms;
+
+static void AddForm(KatsuyouForms& forms, const std::wstring& tail, KatsuyouKei katsuyou)
+{
+    forms[tail].push_back(katsuyou);
+}
+
+// 「語幹＋語尾＋？」を変換し、語幹と語尾を合わせた長さの、同じ品詞のノードの活用形を得る。
+static std::vector<INT>
+GetKatsuyou(HinshiBunrui bunrui, Gyou gyou, const std::wstring& stem, const std::wstring& tail)
+{
+    KatsuyouLattice lattice;
+    lattice.SetPre(stem + tail + L"？");
+
+    WStrings fields(NUM_FIELDS);
+    fields[I_FIELD_PRE] = stem;
+    fields[I_FIELD_POST] = stem;
+    fields[I_FIELD_HINSHI].assign(1, MAKEWORD(bunrui, gyou));
+    lattice.DoFields(0, fields);
+
+    std::vector<INT> ret;
+    const LatticeChunk& chunk = lattice.m_chunks[0];
+    for (size_t i = 0; i < chunk.size(); ++i) {
+        if (chunk[i]->bunrui == bunrui && chunk[i]->pre_len == stem.size() + tail.size())
+            ret.push_back(chunk[i]->katsuyou);
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+static void CheckForms(HinshiBunrui bunrui, Gyou gyou, const std::wstring& stem, KatsuyouForms& forms)
+{
+    KatsuyouForms::iterator it, end = forms.end();
+    for (it = forms.begin(); it != end; ++it) {
+        std::sort(it->second.begin(), it->second.end());
+        std::vector<INT> got = GetKatsuyou(bunrui, gyou, stem, it->first);
+        if (got != it->second) {
+            char szTail[64];
+            WideCharToMultiByte(CP_UTF8, 0, it->first.c_str(), -1, szTail, sizeof(szTail), NULL, NULL);
+            fprintf(stderr, "katsuyou: bunrui %d, gyou %d, tail %s\n", bunrui, gyou, szTail);
+            CHECK(got == it->second);
+        }
+    }
+}
+
+// 五段動詞の行。あ行の未然形は「わ」。
+static const struct {
+    Gyou gyou;
+    const wchar_t *dan;     // ア段、イ段、ウ段、エ段、オ段。
+    wchar_t onbin;          // 連用形の音便。
+    wchar_t ta, te;         // 音便の後の「た」と「て」。
+} s_godan_rows[] = {
+    { GYOU_A,  L"わいうえお", L'っ', L'た', L'て' },
+    { GYOU_KA, L"かきくけこ", L'い', L'た', L'て' },
+    { GYOU_GA, L"がぎぐげご", L'い', L'だ', L'で' },
+    { GYOU_SA, L"さしすせそ", L'し', L'た', L'て' },
+    { GYOU_TA, L"たちつてと", L'っ', L'た', L'て' },
+    { GYOU_NA, L"なにぬねの", L'ん', L'だ', L'で' },
+    { GYOU_BA, L"ばびぶべぼ", L'ん', L'だ', L'で' },
+    { GYOU_MA, L"まみむめも", L'ん', L'だ', L'で' },
+    { GYOU_RA, L"らりるれろ", L'っ', L'た', L'て' },
+};
+
+// 活用規則の状態機械が、行ごとの五十音表から作った語尾のすべてに、
+// 以前の規則の連鎖と同じ活用形のノードを作る。
+static void TestKatsuyou(void)
+{
+    static const wchar_t *s_chau[] = { L"ちゃ", L"ちま", L"じゃ", L"じま" };
+    static const wchar_t *s_particles = L"よねなぞ";
+
+    for (size_t i = 0; i < _countof(s_godan_rows); ++i) {
+        const wchar_t *dan = s_godan_rows[i].dan;
+        const Gyou gyou = s_godan_rows[i].gyou;
+        const std::wstring q(1, s_godan_rows[i].onbin);
+        const std::wstring ta(1, s_godan_rows[i].ta), te(1, s_godan_rows[i].te);
+        KatsuyouForms forms;
+        AddForm(forms, std::wstring(1, dan[0]), MIZEN_KEI);
+        AddForm(forms, std::wstring(1, dan[0]) + L"せ", MIZEN_KEI);
+        if (gyou == GYOU_RA)
+            AddForm(forms, L"ん", MIZEN_KEI);
+        AddForm(forms, std::wstring(1, dan[1]), RENYOU_KEI);
+        AddForm(forms, q + te + L"も", RENYOU_KEI);
+        AddForm(forms, q + te, RENYOU_KEI);
+        AddForm(forms, q + ta + L"り", RENYOU_KEI);
+        AddForm(forms, q + ta, SHUUSHI_KEI);
+        AddForm(forms, q + ta, RENYOU_KEI);
+        for (size_t k = 0; k < _countof(s_chau); ++k) {
+            AddForm(forms, q + s_chau[k] + L"った", SHUUSHI_KEI);
+            AddForm(forms, q + s_chau[k] + L"う", SHUUSHI_KEI);
+            AddForm(forms, q + s_chau[k] + L"え", MEIREI_KEI);
+            AddForm(forms, q + s_chau[k] + L"い", MEIREI_KEI);
+        }
+        AddForm(forms, std::wstring(1, dan[2]), SHUUSHI_KEI);
+        AddForm(forms, std::wstring(1, dan[2]), RENTAI_KEI);
+        for (size_t k = 0; s_particles[k]; ++k)
+            AddForm(forms, std::wstring(1, dan[2]) + s_particles[k], SHUUSHI_KEI);
+        AddForm(forms, std::wstring(1, dan[3]), KATEI_KEI);
+        AddForm(forms, std::wstring(1, dan[3]), MEIREI_KEI);
+        AddForm(forms, std::wstring(1, dan[3]) + L"よ", MEIREI_KEI);
+        AddForm(forms, std::wstring(1, dan[3]) + L"や", MEIREI_KEI);
+        AddForm(forms, std::wstring(1, dan[4]) + L"う", MEIREI_KEI);
+        AddForm(forms, std::wstring(1, dan[4]) + L"うよ", MEIREI_KEI);
+        AddForm(forms, std::wstring(1, dan[4]) + L"うや", MEIREI_KEI);
+        AddForm(forms, std::wstring(1, dan[4]) + L"うな", MEIREI_KEI);
+        AddForm(forms, std::wstring(1, dan[4]) + L"うね", MEIREI_KEI);
+        CheckForms(HB_GODAN_DOUSHI, gyou, L"あ", forms);
+    }
+    {
+        // 「くださ(る)」→「ください」
+        KatsuyouForms forms;
+        AddForm(forms, L"い", MEIREI_KEI);
+        AddForm(forms, L"り", RENYOU_KEI);
+        CheckForms(HB_GODAN_DOUSHI, GYOU_RA, L"くださ", forms);
+    }
+    {
+        KatsuyouForms forms;
+        AddForm(forms, L"", MIZEN_KEI);
+        AddForm(forms, L"", RENYOU_KEI);
+        AddForm(forms, L"て", RENYOU_KEI);
+        AddForm(forms, L"ていた", SHUUSHI_KEI);
+        AddForm(forms, L"ていたよ", SHUUSHI_KEI);
+        AddForm(forms, L"ていたよぉ", SHUUSHI_KEI);
+        AddForm(forms, L"てた", SHUUSHI_KEI);
+        AddForm(forms, L"てたね", SHUUSHI_KEI);
+        AddForm(forms, L"ない", SHUUSHI_KEI);
+        AddForm(forms, L"る", SHUUSHI_KEI);
+        AddForm(forms, L"る", RENTAI_KEI);
+        for (size_t k = 0; s_particles[k]; ++k)
+            AddForm(forms, std::wstring(L"る") + s_particles[k], SHUUSHI_KEI);
+        AddForm(forms, L"れ", KATEI_KEI);
+        AddForm(forms, L"ろ", MEIREI_KEI);
+        AddForm(forms, L"ろよ", MEIREI_KEI);
+        AddForm(forms, L"ろや", MEIREI_KEI);
+        AddForm(forms, L"よ", MEIREI_KEI);
+        CheckForms(HB_ICHIDAN_DOUSHI, GYOU_A, L"よせ", forms);
+    }
+    {
+        KatsuyouForms forms;
+        AddForm(forms, L"くる", SHUUSHI_KEI);
+        AddForm(forms, L"くる", RENTAI_KEI);
+        for (size_t k = 0; s_particles[k]; ++k)
+            AddForm(forms, std::wstring(L"くる") + s_particles[k], SHUUSHI_KEI);
+        AddForm(forms, L"こい", MEIREI_KEI);
+        AddForm(forms, L"こいよ", MEIREI_KEI);
+        AddForm(forms, L"こいや", MEIREI_KEI);
+        AddForm(forms, L"くれ", KATEI_KEI);
+        AddForm(forms, L"こ", MIZEN_KEI);
+        AddForm(forms, L"こさせ", MIZEN_KEI);
+        AddForm(forms, L"き", RENYOU_KEI);
+        CheckForms(HB_KAHEN_DOUSHI, GYOU_A, L"かえって", forms);
+    }
+    for (int za = 0; za < 2; ++za) {
+        // サ変動詞は語尾ごとに辞書にあるので、語幹に語尾を含める。
+        static const wchar_t *s_endings[][2] = {
+            { L"さ", L"ざ" }, { L"し", L"じ" }, { L"せ", L"ぜ" }, { L"する", L"ずる" },
+            { L"すれ", L"ずれ" }, { L"しろ", L"じろ" }, { L"せよ", L"ぜよ" },
+            { L"せい", L"ぜい" }, { L"しよう", L"じよう" },
+        };
+        static const KatsuyouKei s_kei[][2] = {
+            { MIZEN_KEI, MIZEN_KEI }, { MIZEN_KEI, RENYOU_KEI }, { MIZEN_KEI, MIZEN_KEI },
+            { SHUUSHI_KEI, RENYOU_KEI }, { KATEI_KEI, KATEI_KEI }, { MEIREI_KEI, MEIREI_KEI },
+            { MEIREI_KEI, MEIREI_KEI }, { MEIREI_KEI, MEIREI_KEI }, { MEIREI_KEI, MEIREI_KEI },
+        };
+        const Gyou gyou = (za ? GYOU_ZA : GYOU_SA);
+        for (size_t k = 0; k < _countof(s_endings); ++k) {
+            KatsuyouForms forms;
+            AddForm(forms, L"", s_kei[k][0]);
+            if (s_kei[k][1] != s_kei[k][0])
+                AddForm(forms, L"", s_kei[k][1]);
+            if (k == 3) {
+                AddForm(forms, L"な", RENYOU_KEI);
+                AddForm(forms, L"よ", RENYOU_KEI);
+                AddForm(forms, L"なよ", RENYOU_KEI);
+            }
+            CheckForms(HB_SAHEN_DOUSHI, gyou, std::wstring(L"あまん") + s_endings[k][za], forms);
+        }
+    }
+    {
+        KatsuyouForms forms;
+        AddForm(forms, L"かろう", MIZEN_KEI);
+        AddForm(forms, L"かっ", RENYOU_KEI);
+        AddForm(forms, L"かった", SHUUSHI_KEI);
+        AddForm(forms, L"く", NONE_KEI);
+        AddForm(forms, L"くて", NONE_KEI);
+        AddForm(forms, L"う", NONE_KEI);
+        AddForm(forms, L"ゅう", NONE_KEI);
+        AddForm(forms, L"い", SHUUSHI_KEI);
+        AddForm(forms, L"い", RENTAI_KEI);
+        for (size_t k = 0; s_particles[k]; ++k)
+            AddForm(forms, std::wstring(L"い") + s_particles[k], SHUUSHI_KEI);
+        AddForm(forms, L"き", RENTAI_KEI);
+        AddForm(forms, L"けれ", KATEI_KEI);
+        AddForm(forms, L"ければ", KATEI_KEI);
+        CheckForms(HB_IKEIYOUSHI, GYOU_A, L"いた", forms);
+    }
+    {
+        KatsuyouForms forms;
+        AddForm(forms, L"だろう", MIZEN_KEI);
+        AddForm(forms, L"だっ", RENYOU_KEI);
+        AddForm(forms, L"だった", SHUUSHI_KEI);
+        AddForm(forms, L"で", RENYOU_KEI);
+        AddForm(forms, L"に", RENYOU_KEI);
+        AddForm(forms, L"だ", SHUUSHI_KEI);
+        for (size_t k = 0; s_particles[k]; ++k)
+            AddForm(forms, std::wstring(L"だ") + s_particles[k], SHUUSHI_KEI);
+        AddForm(forms, L"な", RENTAI_KEI);
+        AddForm(forms, L"なら", KATEI_KEI);
+        AddForm(forms, L"ならば", KATEI_KEI);
+        CheckForms(HB_NAKEIYOUSHI, GYOU_A, L"きょだい", forms);
+    }
+}
+
+// 一つずつ要求する。
+static void TestCall(void)
+{
+    MzConvClient client;
+    CHECK(client.Connect(s_name.c_str()));
+    CHECK(client.Ping());
+    for (size_t i = 0; i < NUM_TEXTS; ++i) {
+        MzConvResult result;
+        CHECK(client.ConvertMultiClause(s_texts[i], result));
+        CHECK(IsSameAsLocal(MZCONV_MULTI, s_texts[i], result));
+        CHECK(client.ConvertSingleClause(s_texts[i], result));
+        CHECK(IsSameAsLocal(MZCONV_SINGLE, s_texts[i], result));
+    }
+
+    // 数字の並びのほかの表記もサーバーから届く。
+    MzConvResult result;
+    CHECK(client.ConvertMultiClause(L"2025", result));
+    CHECK(HasCandidate(result, L"二千二十五"));
+    CHECK(HasCandidate(result, L"２０２５"));
+    CHECK(IsSameAsLocal(MZCONV_MULTI, L"2025", result));
+}
+
+// 応答を待たずに続けて送る。同じ要求が重なってもすべてに応答が来る。
+static void TestPipeline(void)
+{
+    MzConvClient client;
+    CHECK(client.Connect(s_name.c_str()));
+
+    const size_t count = NUM_TEXTS * 4;
+    std::map<DWORD, size_t> sent;
+    for (size_t i = 0; i < count; ++i) {
+        DWORD dwId;
+        CHECK(client.Send(MZCONV_MULTI, s_texts[i % NUM_TEXTS], &dwId));
+        sent[dwId] = i % NUM_TEXTS;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        DWORD dwId;
+        WORD wType;
+        MzConvResult result;
+        if (!client.Receive(&dwId, &wType, result)) {
+            CHECK(!"Receive failed");
+            break;
+        }
+        std::map<DWORD, size_t>::iterator it = sent.find(dwId);
+        CHECK(it != sent.end());
+        if (it == sent.end())
+            continue;
+        CHECK(wType == MZCONV_REPLY);
+        CHECK(IsSameAsLocal(MZCONV_MULTI, s_texts[it->second], result));
+        sent.erase(it);
+    }
+    CHECK(sent.empty());
+}
+
+// 複数のクライアントから同時に要求する。
+static volatile LONG s_nDone = 0;
+static volatile LONG s_nClientFailed = 0;
+static HANDLE s_hAllDone = NULL;
+#define NUM_CLIENTS 4
+
+static DWORD WINAPI ClientProc(LPVOID lpParam)
+{
+    size_t iStart = (size_t)lpParam;
+    MzConvClient client;
+    if (client.Connect(s_name.c_str())) {
+        for (size_t i = 0; i < NUM_TEXTS * 2; ++i) {
+            const wchar_t *text = s_texts[(iStart + i) % NUM_TEXTS];
+            MzConvResult result;
+            if (!client.ConvertMultiClause(text, result) ||
+                !IsSameAsLocal(MZCONV_MULTI, text, result))
+            {
+                InterlockedIncrement(&s_nClientFailed);
+            }
+        }
+    } else {
+        InterlockedIncrement(&s_nClientFailed);
+    }
+    if (InterlockedIncrement(&s_nDone) == NUM_CLIENTS)
+        mz_event_set(s_hAllDone);
+    return 0;
+}
+
+static void TestConcurrent(void)
+{
+    s_hAllDone = mz_event_create(TRUE);
+    for (size_t i = 0; i < NUM_CLIENTS; ++i)
+        CHECK(mz_create_thread(ClientProc, (LPVOID)i));
+    CHECK(mz_event_wait(s_hAllDone, 60 * 1000));
+    CHECK(s_nClientFailed == 0);
+    mz_event_close(s_hAllDone);
+}
+
+// 通信規約に従わない相手は切断される。サーバーは動き続ける。
+static void TestBadHeader(void)
+{
+    HANDLE hChannel = mz_channel_connect(s_name.c_str());
+    CHECK(hChannel != NULL);
+    if (hChannel) {
+        char junk[MZCONV_HEADER_SIZE];
+        memset(junk, 'X', sizeof(junk));
+        CHECK(mz_channel_write(hChannel, junk, sizeof(junk)));
+        BYTE b;
+        CHECK(!mz_channel_read(hChannel, &b, 1, 5000));
+        mz_channel_close(hChannel);
+    }
+
+    MzConvClient client;
+    CHECK(client.Connect(s_name.c_str()));
+    CHECK(client.Ping());
+}
+
+extern "C"
+int wmain(int argc, wchar_t **wargv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: mzconvd_tests basic.dic [name.dic]\n");
+        return 1;
+    }
+
+    mz_make_literal_maps();
+    if (!g_basic_dict.Load(wargv[1], L"BasicDictObject")) {
+        fprintf(stderr, "ERROR: cannot load dictionary\n");
+        return 1;
+    }
+    if (argc >= 3)
+        g_name_dict.Load(wargv[2], L"NameDictObject");
+
+    TestProtocol();
+    TestPredict();
+    TestReconvert();
+    TestKeyCode();
+    TestKeyIndex();
+    TestSpeculate();
+    TestLearning();
+    TestShards();
+    TestSpecial();
+    TestNumeric();
+    TestKatsuyou();
+    TestBeam();
+    TestParallel();
+
+    WCHAR szName[64];
+#ifdef _WIN32
+    StringCchPrintfW(szName, _countof(szName), L"mzconvd-test-%lu", GetCurrentProcessId());
+#else
+    StringCchPrintfW(szName, 64, L"mzconvd-test-%lu", (unsigned long)getpid());
+#endif
+    s_name = szName;
+
+    MzConvServer server(&s_converter);
+    CHECK(server.Start(s_name.c_str(), 2));
+
+    TestCall();
+    TestPipeline();
+    TestConcurrent();
+    TestBadHeader();
+
+    // 切断していないクライアントがいても止められる。
+    MzConvClient idle;
+    CHECK(idle.Connect(s_name.c_str()));
+    server.Stop();
+    MzConvResult result;
+    CHECK(!idle.ConvertMultiClause(s_texts[0], result));
+
+    printf("requests: %ld, batches: %ld, coalesced: %ld\n",
+           (long)server.m_nRequests, (long)server.m_nBatches, (long)server.m_nCoalesced);
+    CHECK(server.m_nBatches <= server.m_nRequests);
+
+    g_basic_dict.Unload();
+    g_name_dict.Unload();
+
+    if (s_nFailed) {
+        printf("%d check(s) failed\n", s_nFailed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+} // wmain
+
+#ifdef _WIN32
+#include <shellapi.h>
+
+// 古いコンパイラのサポートのため。
+int main(void)
+{
+    int argc;
+    LPWSTR *argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    int ret = wmain(argc, argv);
+    LocalFree(argv);
+    return ret;
+}
+#else
+int main(int argc, char **argv)
+{
+    std::vector<std::wstring> args(argc);
+    std::vector<wchar_t *> wargv(argc + 1);
+    for (int i = 0; i < argc; ++i) {
+        std::vector<WCHAR> buf(strlen(argv[i]) + 1);
+        int cch = MultiByteToWideChar(CP_UTF8, 0, argv[i], -1, &buf[0], (int)buf.size());
+        args[i].assign(&buf[0], (cch > 0) ? cch - 1 : 0);
+        wargv[i] = &args[i][0];
+    }
+    return wmain(argc, &wargv[0]);
+}
+#endif
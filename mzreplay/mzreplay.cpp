@@ -0,0 +1,498 @@
+﻿// mzreplay.cpp --- mzimeja keystroke replay
+//////////////////////////////////////////////////////////////////////////////
+// (Japanese, UTF-8)
+// 記録したキー入力を未確定文字列と候補情報に流し、キーごとにかかった時間と
+// メモリを確保した回数を測る。ウィンドウもIMMもいらないので、Windows以外のCIで動かす。
+// キーはDoProcessKeyの主な経路と同じように、入力コンテキスト（input.cpp）に渡す。
+// 入力コンテキストとIMCCはヒープに置き、メッセージは貯めるだけ（imm_posix.cpp）。
+// 先読み変換はしないので、変換キーは毎回その場で変換する。
+// 文字の追加と削除は、メモリを確保した回数が上限（s_max_allocs）を超えたら失敗にする。
+//
+// 使い方: mzreplay [-v] basic.dic name.dic session.keys ...
+//   -v  キーごとの測定値をCSVで出力する。
+//
+// キー入力のファイル（UTF-8）は一行に一つのキー。';'から後ろは注釈。
+//   41          仮想キー（16進）。
+//   41 S        修飾キー付き。S（Shift）、C（Ctrl）、A（Alt）、L（CapsLock）。
+//   = わたしは  次に確定する読み（ひらがな）。違っていたら失敗にする。
+
+#include "mzconv.h"
+#include "input.h"
+#include <algorithm>
+#include <new>
+
+//////////////////////////////////////////////////////////////////////////////
+// メモリの確保を数える。
+
+static volatile LONG s_nAllocs = 0;
+
+void *operator new(size_t size)
+{
+    InterlockedIncrement(&s_nAllocs);
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+    free(p);
+}
+
+// C++14からの大きさ付きのdelete。
+void operator delete(void *p, size_t) throw()
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) throw()
+{
+    free(p);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// キーの測定値。
+
+enum KEY_KIND {
+    KK_CHAR,        // 文字の追加。
+    KK_DELETE,      // 文字の削除。
+    KK_CONVERT,     // 変換。
+    KK_NEXT,        // 次の候補、候補の選択。
+    KK_MOVE,        // 文節の移動。
+    KK_COMMIT,      // 確定。
+    KK_CANCEL,      // 取り消し。
+    KK_PASS,        // 処理しないキー。
+    KK_MAX
+};
+
+static const char *s_kind_names[KK_MAX] = {
+    "char", "delete", "convert", "next", "move", "commit", "cancel", "pass"
+};
+
+// 一つのキーでメモリを確保してよい回数の上限。0なら測るだけ。
+// 文字の追加と削除は写しのバッファを使い回すので、文字列の長さにも辞書にも
+// よらず数十回で済む（以前は一キーあたり280回ほどだった）。
+static const DWORD s_max_allocs[KK_MAX] = {
+    64, 64, 0, 0, 0, 0, 0, 0
+};
+
+struct KeyRecord {
+    KEY_KIND kind;
+    DWORD dwMicroseconds;   // かかった時間。
+    DWORD dwAllocs;         // メモリを確保した回数。
+    DWORD dwReSizes;        // IMCCの大きさを変えた回数。
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// ReplayContext - 入力コンテキストにキーを振り分ける。
+
+class ReplayContext {
+public:
+    ReplayContext();
+    ~ReplayContext();
+
+    KEY_KIND ProcessKey(BYTE vk, BOOL bShift, BOOL bCtrl, BOOL bAlt, BOOL bCapsLock);
+    BOOL TakeCommitted(std::wstring& read_str, std::wstring& str);
+    BOOL CheckConsistency(std::string& error);
+    BOOL CheckCandInfo(std::string& error);
+
+protected:
+    HIMC m_hIMC;
+    InputContext *m_lpIMC;
+};
+
+ReplayContext::ReplayContext()
+{
+    m_hIMC = ImmCreateContext();
+    m_lpIMC = (InputContext *)ImmLockIMC(m_hIMC);
+    m_lpIMC->Initialize();
+    m_lpIMC->IsOpen() = TRUE;
+}
+
+ReplayContext::~ReplayContext()
+{
+    // ImeSelect(FALSE)と同じく、候補表の参照を手放す。
+    m_lpIMC->hCandInfo = CandInfo::ReCreate(m_lpIMC->hCandInfo, NULL);
+    ImmUnlockIMC(m_hIMC);
+    ImmDestroyContext(m_hIMC);
+}
+
+// キーを処理する。DoProcessKeyと同じように振り分ける。
+KEY_KIND ReplayContext::ProcessKey(BYTE vk, BOOL bShift, BOOL bCtrl, BOOL bAlt, BOOL bCapsLock)
+{
+    TheIME.m_msgs.clear();
+
+    if (vk == VK_SHIFT || vk == VK_CONTROL)
+        return KK_PASS;
+
+    BOOL bCompStr = m_lpIMC->HasCompStr();
+    switch (vk) {
+    case VK_SPACE: case VK_CONVERT:
+        if (!bCompStr || bCtrl || bAlt)
+            return KK_PASS;
+        if (m_lpIMC->HasCandInfo()) {
+            m_lpIMC->Convert(bShift);
+            return KK_NEXT;
+        }
+        m_lpIMC->Convert(bShift);
+        return KK_CONVERT;
+    case VK_ESCAPE:
+        if (!bCompStr)
+            return KK_PASS;
+        m_lpIMC->Escape();
+        return KK_CANCEL;
+    case VK_DELETE: case VK_BACK:
+        if (!bCompStr)
+            return KK_PASS;
+        m_lpIMC->DeleteChar(vk == VK_BACK);
+        return KK_DELETE;
+    case VK_RETURN:
+        if (!bCompStr)
+            return KK_PASS;
+        m_lpIMC->MakeResult();
+        return KK_COMMIT;
+    case VK_LEFT: case VK_RIGHT:
+        if (!bCompStr || bShift)
+            return KK_PASS; // 文節の伸縮はしない。
+        if (vk == VK_LEFT)
+            m_lpIMC->MoveLeft(FALSE);
+        else
+            m_lpIMC->MoveRight(FALSE);
+        return KK_MOVE;
+    default:
+        break;
+    }
+
+    if (bCtrl || bAlt)
+        return KK_PASS;
+
+    WCHAR chTranslated = 0;
+    if (!m_lpIMC->IsRomanMode())
+        chTranslated = mz_vkey_to_hiragana(vk, bShift);
+    WCHAR chTyped = mz_typing_key_to_char(vk, bShift, bCapsLock);
+    if (!chTranslated && !chTyped)
+        return KK_PASS;
+
+    if (m_lpIMC->HasCandInfo() && L'1' <= chTyped && chTyped <= L'9') {
+        m_lpIMC->SelectCand(chTyped - L'1');
+        return KK_NEXT;
+    }
+    m_lpIMC->AddChar(chTyped, chTranslated);
+    return KK_CHAR;
+}
+
+// 確定していれば、その読み（ひらがな）と文字列を物理データから取り出す。
+// 確定したかは、生成した WM_IME_COMPOSITION の GCS_RESULTSTR で見る。
+BOOL ReplayContext::TakeCommitted(std::wstring& read_str, std::wstring& str)
+{
+    BOOL bCommitted = FALSE;
+    for (size_t i = 0; i < TheIME.m_msgs.size(); ++i) {
+        const TRANSMSG& msg = TheIME.m_msgs[i];
+        if (msg.message == WM_IME_COMPOSITION && (msg.lParam & GCS_RESULTSTR))
+            bCommitted = TRUE;
+    }
+    TheIME.m_msgs.clear();
+    if (!bCommitted)
+        return FALSE;
+
+    CompStr *lpCompStr = m_lpIMC->LockCompStr();
+    if (!lpCompStr)
+        return FALSE;
+    read_str.assign(lpCompStr->GetResultReadStr(), lpCompStr->dwResultReadStrLen);
+    str.assign(lpCompStr->GetResultStr(), lpCompStr->dwResultStrLen);
+    m_lpIMC->UnlockCompStr();
+
+    read_str = mz_lcmap(read_str, LCMAP_FULLWIDTH | LCMAP_HIRAGANA);
+    return TRUE;
+}
+
+// 物理データが壊れていないか確かめる。
+BOOL ReplayContext::CheckConsistency(std::string& error)
+{
+    LogCompStr comp;
+    LogCandInfo cand;
+    m_lpIMC->GetLogObjects(comp, cand);
+
+    const DWORD cch = DWORD(comp.comp_str.size());
+    if (comp.comp_attr.size() != cch) {
+        error = "comp_attr and comp_str differ in length";
+        return FALSE;
+    }
+    if (comp.dwCursorPos > cch) {
+        error = "cursor is out of comp_str";
+        return FALSE;
+    }
+    if (cch == 0)
+        return TRUE;
+
+    if (comp.comp_clause.size() < 2 || comp.comp_clause[0] != 0 ||
+        comp.comp_clause[comp.comp_clause.size() - 1] != cch)
+    {
+        error = "comp_clause does not cover comp_str";
+        return FALSE;
+    }
+    for (size_t i = 1; i < comp.comp_clause.size(); ++i) {
+        if (comp.comp_clause[i - 1] >= comp.comp_clause[i]) {
+            error = "comp_clause is not increasing";
+            return FALSE;
+        }
+    }
+    if (comp.extra.hiragana_clauses.size() != comp.GetClauseCount()) {
+        error = "clause count of extra differs";
+        return FALSE;
+    }
+    if (comp.IsBeingConverted() && cand.GetClauseCount() != comp.GetClauseCount()) {
+        error = "clause count of candidates differs";
+        return FALSE;
+    }
+    return CheckCandInfo(error);
+}
+
+// 候補リストの物理データが、書いた範囲の候補だけを数えているか確かめる。
+// 書くのは前後のページまでなので、候補がいくつあっても3ページ分を超えない。
+BOOL ReplayContext::CheckCandInfo(std::string& error)
+{
+    CandInfo *lpCandInfo = m_lpIMC->LockCandInfo();
+    if (!lpCandInfo)
+        return TRUE;
+
+    BOOL ret = TRUE;
+    for (DWORD iList = 0; ret && iList < lpCandInfo->dwCount; ++iList) {
+        CandList *lpCandList = lpCandInfo->GetList(iList);
+        if (lpCandList->dwCount > 3 * lpCandList->dwPageSize) {
+            error = "candidate list materializes more than three pages";
+            ret = FALSE;
+        } else if (lpCandList->dwCount && lpCandList->dwSelection >= lpCandList->dwCount) {
+            error = "candidate selection is out of the list";
+            ret = FALSE;
+        }
+        for (DWORD iCand = 0; ret && iCand < lpCandList->dwCount; ++iCand) {
+            if (!*lpCandList->GetCandString(iCand)) {
+                error = "candidate list counts a candidate it does not hold";
+                ret = FALSE;
+            }
+        }
+    }
+    m_lpIMC->UnlockCandInfo();
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// 再生。
+
+static BOOL s_bVerbose = FALSE;
+
+static std::string ToUtf8(const std::wstring& str)
+{
+    if (str.empty())
+        return std::string();
+    int cb = WideCharToMultiByte(CP_UTF8, 0, str.c_str(), -1, NULL, 0, NULL, NULL);
+    std::vector<char> buf(cb > 0 ? cb : 1);
+    WideCharToMultiByte(CP_UTF8, 0, str.c_str(), -1, &buf[0], cb, NULL, NULL);
+    return &buf[0];
+}
+
+// 測定値の分位数。
+static DWORD Percentile(std::vector<DWORD>& values, INT percent)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t i = (values.size() - 1) * percent / 100;
+    return values[i];
+}
+
+static void PrintStats(const std::vector<KeyRecord>& records)
+{
+    for (INT kind = 0; kind < KK_MAX; ++kind) {
+        std::vector<DWORD> usecs, allocs;
+        DWORD dwReSizes = 0;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (records[i].kind != kind)
+                continue;
+            usecs.push_back(records[i].dwMicroseconds);
+            allocs.push_back(records[i].dwAllocs);
+            dwReSizes += records[i].dwReSizes;
+        }
+        if (usecs.empty() || kind == KK_PASS)
+            continue;
+        DWORD dwTotalAllocs = 0;
+        for (size_t i = 0; i < allocs.size(); ++i)
+            dwTotalAllocs += allocs[i];
+        printf("  %-8s %5u keys  p50 %6u us  p95 %6u us  max %6u us  "
+               "allocs/key %5.1f (p95 %u)  resizes %u\n",
+               s_kind_names[kind], (UINT)usecs.size(),
+               (UINT)Percentile(usecs, 50), (UINT)Percentile(usecs, 95),
+               (UINT)Percentile(usecs, 100),
+               (double)dwTotalAllocs / allocs.size(), (UINT)Percentile(allocs, 95),
+               (UINT)dwReSizes);
+    }
+}
+
+// キー入力のファイルを一つ再生する。失敗の数を返す。
+static INT ReplaySession(LPCWSTR file_name,
+                         std::vector<KeyRecord>& all_records)
+{
+    std::string name = ToUtf8(file_name);
+    FILE *fp = _wfopen(file_name, L"rb");
+    if (!fp) {
+        fprintf(stderr, "ERROR: cannot open %s\n", name.c_str());
+        return 1;
+    }
+
+    INT nFailed = 0;
+    ReplayContext context;
+    std::vector<KeyRecord> records;
+    std::list<std::wstring> expected;
+    char line[512];
+    for (INT lineno = 1; fgets(line, sizeof(line), fp); ++lineno) {
+        char *pch = strchr(line, ';');
+        if (pch)
+            *pch = 0;
+        StrTrimA(line, " \t\r\n");
+        if (!line[0])
+            continue;
+
+        if (line[0] == '=') {
+            const char *text = line + 1;
+            while (*text == ' ' || *text == '\t')
+                ++text;
+            WCHAR sz[256];
+            int cch = MultiByteToWideChar(CP_UTF8, 0, text, -1, sz, 256);
+            expected.push_back(std::wstring(sz, (cch > 0) ? cch - 1 : 0));
+            continue;
+        }
+
+        char *pchEnd;
+        BYTE vk = (BYTE)strtoul(line, &pchEnd, 16);
+        if (pchEnd == line) {
+            fprintf(stderr, "%s (%d): bad line\n", name.c_str(), lineno);
+            ++nFailed;
+            continue;
+        }
+        BOOL bShift = strchr(pchEnd, 'S') != NULL;
+        BOOL bCtrl = strchr(pchEnd, 'C') != NULL;
+        BOOL bAlt = strchr(pchEnd, 'A') != NULL;
+        BOOL bCapsLock = strchr(pchEnd, 'L') != NULL;
+
+        // キーを処理する間だけを測る。
+        LONG nReSizes = g_imcc_stats.nReSizes;
+        LONG nAllocs = s_nAllocs;
+        ULONGLONG t0 = mz_get_microseconds();
+        KeyRecord record;
+        record.kind = context.ProcessKey(vk, bShift, bCtrl, bAlt, bCapsLock);
+        record.dwMicroseconds = DWORD(mz_get_microseconds() - t0);
+        record.dwAllocs = DWORD(s_nAllocs - nAllocs);
+        record.dwReSizes = DWORD(g_imcc_stats.nReSizes - nReSizes);
+        records.push_back(record);
+
+        if (s_bVerbose) {
+            printf("%s,%d,%02X,%s,%u,%u,%u\n", name.c_str(), lineno, vk,
+                   s_kind_names[record.kind], (UINT)record.dwMicroseconds,
+                   (UINT)record.dwAllocs, (UINT)record.dwReSizes);
+        }
+
+        if (s_max_allocs[record.kind] && record.dwAllocs > s_max_allocs[record.kind]) {
+            fprintf(stderr, "%s (%d): %s key allocated %u times (max %u)\n",
+                    name.c_str(), lineno, s_kind_names[record.kind],
+                    (UINT)record.dwAllocs, (UINT)s_max_allocs[record.kind]);
+            ++nFailed;
+        }
+
+        std::string error;
+        if (!context.CheckConsistency(error)) {
+            fprintf(stderr, "%s (%d): %s\n", name.c_str(), lineno, error.c_str());
+            ++nFailed;
+        }
+
+        std::wstring read_str, str;
+        if (context.TakeCommitted(read_str, str) && !expected.empty()) {
+            if (read_str != expected.front()) {
+                fprintf(stderr, "%s (%d): committed '%s' (%s), expected '%s'\n",
+                        name.c_str(), lineno, ToUtf8(read_str).c_str(),
+                        ToUtf8(str).c_str(), ToUtf8(expected.front()).c_str());
+                ++nFailed;
+            }
+            expected.pop_front();
+        }
+    }
+    fclose(fp);
+
+    if (!expected.empty()) {
+        fprintf(stderr, "%s: %d expected commit(s) did not happen\n",
+                name.c_str(), (INT)expected.size());
+        nFailed += (INT)expected.size();
+    }
+
+    printf("%s: %d keys\n", name.c_str(), (INT)records.size());
+    PrintStats(records);
+    all_records.insert(all_records.end(), records.begin(), records.end());
+    return nFailed;
+} // ReplaySession
+
+extern "C"
+int wmain(int argc, wchar_t **wargv)
+{
+    int iarg = 1;
+    if (iarg < argc && lstrcmpW(wargv[iarg], L"-v") == 0) {
+        s_bVerbose = TRUE;
+        ++iarg;
+    }
+    if (argc - iarg < 3) {
+        fprintf(stderr, "Usage: mzreplay [-v] basic.dic name.dic session.keys ...\n");
+        return 1;
+    }
+
+    mz_make_literal_maps();
+    if (!g_basic_dict.Load(wargv[iarg], L"BasicDictObject")) {
+        fprintf(stderr, "ERROR: cannot load dictionary\n");
+        return 1;
+    }
+    g_name_dict.Load(wargv[iarg + 1], L"NameDictObject");
+
+    MzConverter converter;
+    TheIME.m_pConverter = &converter;
+    INT nFailed = 0;
+    std::vector<KeyRecord> records;
+    for (iarg += 2; iarg < argc; ++iarg)
+        nFailed += ReplaySession(wargv[iarg], records);
+
+    printf("total: %d keys\n", (INT)records.size());
+    PrintStats(records);
+    printf("imcc: %ld creates, %ld resizes, %ld moves\n", (long)g_imcc_stats.nCreates,
+           (long)g_imcc_stats.nReSizes, (long)g_imcc_stats.nMoves);
+
+    g_basic_dict.Unload();
+    g_name_dict.Unload();
+
+    if (nFailed) {
+        printf("%d check(s) failed\n", nFailed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+} // wmain
+
+int main(int argc, char **argv)
+{
+    std::vector<std::wstring> args(argc);
+    std::vector<wchar_t *> wargv(argc + 1);
+    for (int i = 0; i < argc; ++i) {
+        std::vector<WCHAR> buf(strlen(argv[i]) + 1);
+        int cch = MultiByteToWideChar(CP_UTF8, 0, argv[i], -1, &buf[0], (int)buf.size());
+        args[i].assign(&buf[0], (cch > 0) ? cch - 1 : 0);
+        wargv[i] = &args[i][0];
+    }
+    return wmain(argc, &wargv[0]);
+}
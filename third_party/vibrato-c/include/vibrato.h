@@ -17,11 +17,29 @@ typedef struct {
     size_t end;
 } VibratoToken;
 
+/* A reusable tokenization context. Use one per thread. */
+typedef struct VibratoWorker VibratoWorker;
+
+/* A token written into a caller-owned buffer. Offsets are in UTF-16 code units. */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint32_t feature_id;    /* interned per worker; see vibrato_worker_feature */
+    int32_t word_cost;
+} VibratoTokenSpan;
+
 VibratoTokenizer* vibrato_tokenizer_load(const char* dict_path);
+VibratoTokenizer* vibrato_tokenizer_load_from_memory(const uint8_t* data, size_t len);
 void vibrato_tokenizer_free(VibratoTokenizer* tokenizer);
 int vibrato_tokenize(VibratoTokenizer* tokenizer, const char* text, VibratoToken** tokens, size_t* num_tokens);
 void vibrato_tokens_free(VibratoToken* tokens, size_t num_tokens);
 
+VibratoWorker* vibrato_worker_new(const VibratoTokenizer* tokenizer);
+void vibrato_worker_free(VibratoWorker* worker);
+int vibrato_worker_tokenize_utf16(VibratoWorker* worker, const uint16_t* text, size_t len, size_t* num_tokens);
+size_t vibrato_worker_tokens(VibratoWorker* worker, VibratoTokenSpan* out, size_t capacity);
+const char* vibrato_worker_feature(const VibratoWorker* worker, uint32_t feature_id);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,7 +1,10 @@
+use std::collections::HashMap;
 use std::ffi::{CStr, CString};
 use std::fs::File;
+use std::io::BufReader;
 use std::os::raw::c_char;
 use std::ptr;
+use vibrato::tokenizer::worker::Worker;
 use vibrato::{Dictionary, Tokenizer};
 
 pub struct VibratoTokenizer {
@@ -16,6 +19,39 @@ pub struct VibratoToken {
     end: usize,
 }
 
+/// A token of the last sentence, written into a caller-owned buffer.
+/// Offsets are in UTF-16 code units of the input.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct VibratoTokenSpan {
+    start: u32,
+    end: u32,
+    feature_id: u32,
+    word_cost: i32,
+}
+
+/// A reusable tokenization context.
+/// All buffers are kept between calls, so tokenizing allocates nothing
+/// once they have grown to the size of the input.
+pub struct VibratoWorker {
+    worker: Worker<'static>,
+    text: String,
+    offsets: Vec<u32>,
+    feature_ids: HashMap<String, u32>,
+    features: Vec<CString>,
+}
+
+/// Returns the id of a feature string, adding it on first sight.
+fn intern_feature(ids: &mut HashMap<String, u32>, features: &mut Vec<CString>, feature: &str) -> u32 {
+    if let Some(&id) = ids.get(feature) {
+        return id;
+    }
+    let id = features.len() as u32;
+    features.push(CString::new(feature).unwrap_or_default());
+    ids.insert(feature.to_owned(), id);
+    id
+}
+
 #[no_mangle]
 pub extern "C" fn vibrato_tokenizer_load(dict_path: *const c_char) -> *mut VibratoTokenizer {
     if dict_path.is_null() {
@@ -35,8 +71,8 @@ pub extern "C" fn vibrato_tokenizer_load(dict_path: *const c_char) -> *mut Vibra
         Err(_) => return ptr::null_mut(),
     };
     
-    // Read the dictionary
-    let dict = match Dictionary::read(file) {
+    // Read the dictionary. The deserializer does many small reads, so buffer them.
+    let dict = match Dictionary::read(BufReader::new(file)) {
         Ok(d) => d,
         Err(_) => return ptr::null_mut(),
     };
@@ -46,6 +82,25 @@ pub extern "C" fn vibrato_tokenizer_load(dict_path: *const c_char) -> *mut Vibra
     Box::into_raw(Box::new(VibratoTokenizer { tokenizer }))
 }
 
+/// Loads a dictionary from memory, e.g. a read-only mapping of the dictionary file.
+/// The memory is only read during the call and can be released afterwards.
+#[no_mangle]
+pub extern "C" fn vibrato_tokenizer_load_from_memory(data: *const u8, len: usize) -> *mut VibratoTokenizer {
+    if data.is_null() || len == 0 {
+        return ptr::null_mut();
+    }
+
+    let bytes = unsafe { std::slice::from_raw_parts(data, len) };
+    let dict = match Dictionary::read(bytes) {
+        Ok(d) => d,
+        Err(_) => return ptr::null_mut(),
+    };
+
+    let tokenizer = Tokenizer::new(dict);
+
+    Box::into_raw(Box::new(VibratoTokenizer { tokenizer }))
+}
+
 #[no_mangle]
 pub extern "C" fn vibrato_tokenizer_free(tokenizer: *mut VibratoTokenizer) {
     if !tokenizer.is_null() {
@@ -126,3 +181,122 @@ pub extern "C" fn vibrato_tokens_free(tokens: *mut VibratoToken, num_tokens: usi
         drop(Box::from_raw(std::slice::from_raw_parts_mut(tokens, num_tokens)));
     }
 }
+
+/// Creates a worker. The tokenizer must outlive the worker.
+#[no_mangle]
+pub extern "C" fn vibrato_worker_new(tokenizer: *const VibratoTokenizer) -> *mut VibratoWorker {
+    if tokenizer.is_null() {
+        return ptr::null_mut();
+    }
+
+    // The worker borrows the tokenizer; the caller guarantees the lifetime.
+    let tokenizer: &'static Tokenizer = unsafe { &(*tokenizer).tokenizer };
+    Box::into_raw(Box::new(VibratoWorker {
+        worker: tokenizer.new_worker(),
+        text: String::new(),
+        offsets: Vec::new(),
+        feature_ids: HashMap::new(),
+        features: Vec::new(),
+    }))
+}
+
+#[no_mangle]
+pub extern "C" fn vibrato_worker_free(worker: *mut VibratoWorker) {
+    if !worker.is_null() {
+        unsafe {
+            drop(Box::from_raw(worker));
+        }
+    }
+}
+
+/// Tokenizes UTF-16 text. The tokens are kept in the worker until the next call.
+/// Unpaired surrogates are analyzed as U+FFFD but keep their one-unit width.
+#[no_mangle]
+pub extern "C" fn vibrato_worker_tokenize_utf16(
+    worker: *mut VibratoWorker,
+    text: *const u16,
+    len: usize,
+    num_tokens: *mut usize,
+) -> i32 {
+    if worker.is_null() || (text.is_null() && len != 0) || num_tokens.is_null() {
+        return -1;
+    }
+
+    let w = unsafe { &mut *worker };
+    let units: &[u16] = if len == 0 {
+        &[]
+    } else {
+        unsafe { std::slice::from_raw_parts(text, len) }
+    };
+
+    // Transcode into the reused buffer and record the UTF-16 offset of each char.
+    w.text.clear();
+    w.offsets.clear();
+    let mut pos = 0u32;
+    for r in char::decode_utf16(units.iter().copied()) {
+        let (ch, width) = match r {
+            Ok(ch) => (ch, ch.len_utf16() as u32),
+            Err(_) => (char::REPLACEMENT_CHARACTER, 1),
+        };
+        w.offsets.push(pos);
+        w.text.push(ch);
+        pos += width;
+    }
+    w.offsets.push(pos);
+
+    w.worker.reset_sentence(&w.text);
+    w.worker.tokenize();
+
+    unsafe {
+        *num_tokens = w.worker.num_tokens();
+    }
+    0
+}
+
+/// Copies up to `capacity` tokens of the last sentence into `out`.
+/// Returns the number of tokens; if it exceeds `capacity`, grow the buffer and call again.
+#[no_mangle]
+pub extern "C" fn vibrato_worker_tokens(
+    worker: *mut VibratoWorker,
+    out: *mut VibratoTokenSpan,
+    capacity: usize,
+) -> usize {
+    if worker.is_null() {
+        return 0;
+    }
+
+    let w = unsafe { &mut *worker };
+    let n = w.worker.num_tokens();
+    if out.is_null() {
+        return n;
+    }
+    let out = unsafe { std::slice::from_raw_parts_mut(out, capacity.min(n)) };
+    for (i, span) in out.iter_mut().enumerate() {
+        let token = w.worker.token(i);
+        let range = token.range_char();
+        *span = VibratoTokenSpan {
+            start: w.offsets[range.start],
+            end: w.offsets[range.end],
+            feature_id: intern_feature(&mut w.feature_ids, &mut w.features, token.feature()),
+            word_cost: token.word_cost() as i32,
+        };
+    }
+    n
+}
+
+/// Returns the feature string of an interned id, valid while the worker lives.
+#[no_mangle]
+pub extern "C" fn vibrato_worker_feature(
+    worker: *const VibratoWorker,
+    feature_id: u32,
+) -> *const c_char {
+    if worker.is_null() {
+        return ptr::null();
+    }
+
+    let w = unsafe { &*worker };
+    match w.features.get(feature_id as usize) {
+        Some(s) => s.as_ptr(),
+        None => ptr::null(),
+    }
+}